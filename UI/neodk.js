@@ -40,6 +40,41 @@ class NeoDK {
         stop: 'stop'
     }
 
+    /**
+     * Enum for the opcodes of pattern programs, see firmware/neodk/inc/pattern_vm.h
+     * @public
+     * @enum
+     * @readonly
+     */
+    static ProgramOp = {
+        End: 0, Set: 1, AddI: 2, Add: 3, Sub: 4, Mul: 5, Shr: 6, Min: 7, Max: 8,
+        Rand: 9, Seed: 10, Jmp: 11, Jnz: 12, Loop: 13, Emit: 14, Wait: 15
+    }
+
+    /**
+     * Enum for what an LFO modulates
+     * @public
+     * @enum
+     * @readonly
+     */
+    static ModulationTarget = {
+        pulseWidth: 0,
+        pace: 1,
+        amplitude: 2
+    }
+
+    /**
+     * Enum for LFO waveforms
+     * @public
+     * @enum
+     * @readonly
+     */
+    static Waveform = {
+        sine: 0,
+        triangle: 1,
+        randomWalk: 2
+    }
+
     // Public methods
 
     get Name() {
@@ -80,6 +115,246 @@ class NeoDK {
         this.#sendAttrReadRequest(this.#the_writer, NeoDK.#AttributeId.Voltages);
     }
 
+    /**
+     * Method to have the box stream its voltage and current measurements
+     * @public
+     * @param {number} rate_hz samples per second, up to 100; 0 stops the stream
+     */
+    setTelemetryRate(rate_hz) {
+        if (rate_hz > 0 && !this.#telemetry_subscribed) {
+            this.#sendAttrSubscribeRequest(this.#the_writer, NeoDK.#AttributeId.AdcStream);
+            this.#telemetry_subscribed = true;
+        }
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.TelemetryRateHz, new Uint8Array([NeoDK.#Encoding.UnsignedInt1, rate_hz]));
+    }
+
+    /**
+     * Method to have the box report peak current, charge and energy of every pulse
+     * @public
+     * @param {boolean} on whether to capture; the box only switches between bursts
+     */
+    setPulseCapture(on) {
+        if (on && !this.#pulse_metrics_subscribed) {
+            this.#sendAttrSubscribeRequest(this.#the_writer, NeoDK.#AttributeId.PulseMetrics);
+            this.#pulse_metrics_subscribed = true;
+        }
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.PulseCapture,
+            new Uint8Array([on ? NeoDK.#Encoding.BooleanTrue : NeoDK.#Encoding.BooleanFalse]));
+    }
+
+    /**
+     * Method to have the box log every pulse it emits
+     * @public
+     * @param {boolean} on whether to record; starting discards any previous recording
+     */
+    setPulseRecorder(on) {
+        if (on && !this.#pulse_records_subscribed) {
+            this.#sendAttrSubscribeRequest(this.#the_writer, NeoDK.#AttributeId.PulseRecords);
+            this.#pulse_records_subscribed = true;
+        }
+        if (on) this.#pulse_records = [];
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.PulseRecorder,
+            new Uint8Array([on ? NeoDK.#Encoding.BooleanTrue : NeoDK.#Encoding.BooleanFalse]));
+    }
+
+    /**
+     * Method to collect the pulses recorded so far, for firmware/tools/pulses2csv
+     * @public
+     * @returns {Uint8Array} the raw 12-byte pulse records, oldest first
+     */
+    takePulseRecording() {
+        const total = this.#pulse_records.reduce((sum, chunk) => sum + chunk.length, 0);
+        const recording = new Uint8Array(total);
+        let pos = 0;
+        for (const chunk of this.#pulse_records) {
+            recording.set(chunk, pos);
+            pos += chunk.length;
+        }
+        this.#pulse_records = [];
+        return recording;
+    }
+
+    /**
+     * Method to store a recording in the box, for playback without a host; only works while it is stopped
+     * @public
+     * @param {Uint8Array} ptd descriptors, each preceded by its size, as written by firmware/tools/ptcompile
+     * @returns {Promise<boolean>} whether the box stored all of it
+     */
+    async uploadRecording(ptd) {
+        const writer = this.#the_writer;
+        const Enc = NeoDK.#Encoding;
+        const Id = NeoDK.#AttributeId.Recordings;
+        if (await this.#writeAndAwaitStatus(writer, Id, new Uint8Array([Enc.BooleanTrue])) != NeoDK.#StatusCode.Success) return false;
+
+        // The box has few receive buffers and may have to erase flash, so send one chunk at a time.
+        for (let pos = 0; pos < ptd.length; ) {
+            let end = pos;
+            while (end < ptd.length && end + 1 + ptd[end] - pos <= NeoDK.#MaxRecordingChunk) end += 1 + ptd[end];
+            if (end == pos) return false;       // Not a descriptor stream.
+
+            const data = new Uint8Array(3 + end - pos);
+            data.set([Enc.Bytes_2Len, (end - pos) & 0xff, (end - pos) >> 8]);
+            data.set(ptd.subarray(pos, end), 3);
+            const sc = await this.#writeAndAwaitStatus(writer, Id, data);
+            if (sc != NeoDK.#StatusCode.Success) {
+                this.logger.log('Upload failed at byte ' + pos + ', status=' + sc);
+                return false;
+            }
+            pos = end;
+        }
+        return await this.#writeAndAwaitStatus(writer, Id, new Uint8Array([Enc.BooleanFalse])) == NeoDK.#StatusCode.Success;
+    }
+
+    /**
+     * Method to erase all recordings stored in the box; only works while it is stopped
+     * @public
+     */
+    eraseRecordings() {
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.Recordings, new Uint8Array([NeoDK.#Encoding.Null]));
+    }
+
+    refreshRecordings() {
+        this.#sendAttrReadRequest(this.#the_writer, NeoDK.#AttributeId.Recordings);
+    }
+
+    /**
+     * Method to play a stored recording
+     * @public
+     * @param {number} recording_nr the recording to play, or 255 to play all of them back to back
+     * @param {number} from_ms where to start, in ms from the start of the recording
+     */
+    playRecording(recording_nr, from_ms = 0) {
+        const data = new Uint8Array([NeoDK.#Encoding.Bytes_1Len, 5, recording_nr, 0, 0, 0, 0]);
+        new DataView(data.buffer).setUint32(3, from_ms, true);
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.Playback, data);
+    }
+
+    stopPlayback() {
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.Playback, new Uint8Array([NeoDK.#Encoding.BooleanFalse]));
+    }
+
+    /**
+     * Method to store a pattern in the box, next to the built-in ones; only works while it is stopped
+     * @public
+     * @param {string} name up to 23 bytes; an uploaded pattern of the same name gets replaced
+     * @param {Array<Array<number>>} elcons pairs of electrode sets (bit 0 is electrode A), for the two output phases
+     * @param {number} pace_us time between pulses, 5000..62500 µs
+     * @param {number} nr_of_steps pulses per transition from one pair to the next, at least 2
+     * @param {number} nr_of_reps times the pattern repeats
+     * @returns {Promise<boolean>} whether the box accepted it
+     */
+    async uploadPattern(name, elcons, pace_us, nr_of_steps, nr_of_reps) {
+        const enc_name = new TextEncoder().encode(name);
+        const len = 6 + enc_name.length + 2 * elcons.length;
+        const data = new Uint8Array(2 + len);
+        data.set([NeoDK.#Encoding.Bytes_1Len, len, pace_us & 0xff, pace_us >> 8, nr_of_reps & 0xff, nr_of_reps >> 8, nr_of_steps, enc_name.length]);
+        data.set(enc_name, 8);
+        data.set(elcons.flat(), 8 + enc_name.length);
+        const sc = await this.#writeAndAwaitStatus(this.#the_writer, NeoDK.#AttributeId.UserPatterns, data);
+        if (sc != NeoDK.#StatusCode.Success) return false;
+
+        this.#sendAttrReadRequest(this.#the_writer, NeoDK.#AttributeId.AllPatternNames);
+        return true;
+    }
+
+    removePattern(name) {
+        this.#writeString(name, NeoDK.#AttributeId.UserPatterns);
+    }
+
+    removeAllPatterns() {
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.UserPatterns, new Uint8Array([NeoDK.#Encoding.Null]));
+    }
+
+    /**
+     * Method to load a pattern program into the box; only works while it is stopped
+     * Programs are kept in RAM, so they must be loaded again after the box restarts
+     * @public
+     * @param {Uint8Array} code at most 255 bytes of NeoDK.ProgramOp instructions
+     * @returns {Promise<boolean>} whether the box accepted it
+     */
+    async uploadProgram(code) {
+        const data = new Uint8Array(2 + code.length);
+        data.set([NeoDK.#Encoding.Bytes_1Len, code.length]);
+        data.set(code, 2);
+        return await this.#writeAndAwaitStatus(this.#the_writer, NeoDK.#AttributeId.PatternProgram, data) == NeoDK.#StatusCode.Success;
+    }
+
+    runProgram() {
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.PatternProgram, new Uint8Array([NeoDK.#Encoding.BooleanTrue]));
+    }
+
+    stopProgram() {
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.PatternProgram, new Uint8Array([NeoDK.#Encoding.BooleanFalse]));
+    }
+
+    /**
+     * Method to modulate the built-in and uploaded patterns while they play
+     * @public
+     * @param {NeoDK.ModulationTarget} target
+     * @param {NeoDK.Waveform} waveform
+     * @param {number} depth_percent 0..100, where 0 turns modulation of the target off
+     * @param {number} rate_Hz 0..10, in steps of 0.01 Hz
+     */
+    setModulation(target, waveform, depth_percent, rate_Hz) {
+        const rate_cHz = Math.round(rate_Hz * 100);
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.Modulation,
+            new Uint8Array([NeoDK.#Encoding.Bytes_1Len, 5, target, waveform, depth_percent, rate_cHz & 0xff, rate_cHz >> 8]));
+    }
+
+    /**
+     * Method to jump to a point in the current pattern; when stopped, the pattern starts from there next time
+     * @public
+     * @param {number} position_ms from the start of the pattern
+     */
+    seekPattern(position_ms) {
+        const data = new Uint8Array(5);
+        data[0] = NeoDK.#Encoding.UnsignedInt4;
+        new DataView(data.buffer).setUint32(1, position_ms, true);
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.PatternProgress, data);
+    }
+
+    /**
+     * Method to set how a playing pattern switches to a newly selected one
+     * @public
+     * @param {number} crossfade_ms 0..20000; the intensity dips during the first half and recovers during the second
+     * @param {boolean} at_rep_boundary wait for the current repetition to end, rather than the current burst
+     */
+    setTransition(crossfade_ms, at_rep_boundary) {
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.Transition,
+            new Uint8Array([NeoDK.#Encoding.Bytes_1Len, 4, crossfade_ms & 0xff, crossfade_ms >> 8, at_rep_boundary ? 1 : 0, 0]));
+    }
+
+    /**
+     * Method to play up to two patterns at the same time, by interleaving their pulses; only works while stopped
+     * The patterns must not share electrodes, and must not short any electrode to itself
+     * All layers play at the voltage of the most intense one; the others get proportionally narrower pulses
+     * @public
+     * @param {Array<{name: string, intensity: number}>} layers pattern names, each with its intensity 0..100 %
+     * @returns {Promise<boolean>} whether the box accepted them
+     */
+    async playLayers(layers) {
+        const entries = layers.map(layer => {
+            const enc_name = new TextEncoder().encode(layer.name);
+            return [layer.intensity, enc_name.length, ...enc_name];
+        }).flat();
+        const data = new Uint8Array([NeoDK.#Encoding.Bytes_1Len, entries.length, ...entries]);
+        return await this.#writeAndAwaitStatus(this.#the_writer, NeoDK.#AttributeId.PatternLayers, data) == NeoDK.#StatusCode.Success;
+    }
+
+    stopLayers() {
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.PatternLayers, new Uint8Array([NeoDK.#Encoding.BooleanFalse]));
+    }
+
+    /**
+     * Method to set how long the triacs get to settle between switching electrodes and the next burst
+     * @public
+     * @param {number} settle_us the settle time in µs; the box keeps it within 10..500 µs
+     */
+    setTriacSettleTime(settle_us) {
+        this.#sendAttrWriteRequest(this.#the_writer, NeoDK.#AttributeId.TriacSettleMicros,
+            new Uint8Array([NeoDK.#Encoding.UnsignedInt2, settle_us & 0xff, settle_us >> 8]));
+    }
+
     /**
      * Method to get the port from browser
      * User will be prompted to select a port that box is connected to
@@ -115,6 +390,8 @@ class NeoDK {
             this._batteryVoltage = 0;
             this._capacitorVoltage = 0;
             this._primaryCurrent = 0;
+            this._samples = [];
+            this._pulseMetrics = [];
         }
 
         get BatteryVoltage() {
@@ -138,6 +415,22 @@ class NeoDK {
             this._primaryCurrent = value;
         }
 
+        // The latest batch of streamed measurements, oldest first.
+        get Samples() {
+            return this._samples;
+        }
+        set Samples(value) {
+            this._samples = value;
+        }
+
+        // The latest batch of captured pulses, oldest first.
+        get PulseMetrics() {
+            return this._pulseMetrics;
+        }
+        set PulseMetrics(value) {
+            this._pulseMetrics = value;
+        }
+
     }
 
     /**
@@ -149,6 +442,7 @@ class NeoDK {
             this._intensity = 0;
             this._currentPattern = '';
             this._availablePatterns = [];
+            this._progress = { elapsed_ms: 0, total_ms: 0 };
             this.power = new NeoDK.BoxPower();
         }
 
@@ -180,6 +474,14 @@ class NeoDK {
         set AvailablePatterns(value) {
             this._availablePatterns = value;
         }
+
+        // How far the current pattern has got, and how long it takes in all.
+        get Progress() {
+            return this._progress;
+        }
+        set Progress(value) {
+            this._progress = value;
+        }
     }
 
     // protocol constants
@@ -228,12 +530,28 @@ class NeoDK {
      * @readonly
      */
     static #AttributeId = {
+        AttributeList: 1,
         Voltages: 3,
         AllPatternNames: 5,
         CurrentPatternName: 6,
         IntensityPercent: 7,
         PlayPauseStop: 8,
-        BoxName: 9
+        BoxName: 9,
+        TelemetryRateHz: 12,
+        AdcStream: 13,
+        PulseCapture: 14,
+        PulseMetrics: 15,
+        PulseRecorder: 16,
+        PulseRecords: 17,
+        Recordings: 18,
+        Playback: 19,
+        UserPatterns: 20,
+        PatternProgram: 21,
+        Modulation: 22,
+        PatternProgress: 23,
+        Transition: 24,
+        PatternLayers: 25,
+        TriacSettleMicros: 26
     };
 
     /**
@@ -244,9 +562,17 @@ class NeoDK {
      */
     static #Encoding = {
         UnsignedInt1: 4,
+        UnsignedInt2: 5,
+        UnsignedInt4: 6,
+        BooleanFalse: 8,
+        BooleanTrue: 9,
         UTF8_1Len: 12,
         Bytes_1Len: 16,
+        Bytes_2Len: 17,
+        Null: 20,
+        Struct: 21,
         Array: 22,
+        List: 23,
         EndOfContainer: 24
     }
 
@@ -257,6 +583,7 @@ class NeoDK {
      * @readonly
      */
     static #OPCode = {
+        StatusResponse: 1,
         ReadRequest: 2,
         SubscribeRequest: 3,
         ReportData: 5,
@@ -266,6 +593,20 @@ class NeoDK {
 
 
 
+    /**
+     * NeoDK Protocol: Status codes (the ones we act on)
+     * @private
+     * @enum
+     * @readonly
+     */
+    static #StatusCode = {
+        Success: 0,
+        Failure: 1
+    };
+
+    // Largest descriptor stream per write, to fit in one packet.
+    static #MaxRecordingChunk = 480;
+
     /**
      * NeoDK Protocol: Play states
      * @private
@@ -286,6 +627,11 @@ class NeoDK {
     #the_writer = null;
     #tx_seq_nr = 0;
     #transaction_id = 1959;
+    #telemetry_subscribed = false;
+    #pulse_metrics_subscribed = false;
+    #pulse_records_subscribed = false;
+    #pulse_records = [];
+    #status_waiters = new Map();
 
     // private methods
 
@@ -374,10 +720,43 @@ class NeoDK {
     }
 
 
+    // Resolves with the status code of the response, or null if none comes.
+    #writeAndAwaitStatus(writer, attribute_id, data) {
+        const trans_id = this.#transaction_id++ & 0xffff;
+        const status = new Promise((resolve) => {
+            const timer = setTimeout(() => {
+                this.#status_waiters.delete(trans_id);
+                resolve(null);
+            }, 2000);
+            this.#status_waiters.set(trans_id, (sc) => {
+                clearTimeout(timer);
+                resolve(sc);
+            });
+        });
+        this.#sendFrame(writer, this.#makeRequestPacketFrame(trans_id, NeoDK.#OPCode.WriteRequest, attribute_id, data));
+        return status;
+    }
+
+
     #sendAttrSubscribeRequest(writer, attribute_id) {
         this.#sendFrame(writer, this.#makeRequestPacketFrame(this.#transaction_id++, NeoDK.#OPCode.SubscribeRequest, attribute_id, null));
     }
 
+
+    // The device answers a request for a list of attributes with a single report.
+    #encodeAttributeList(attribute_ids) {
+        const data = [NeoDK.#Encoding.List];
+        for (const id of attribute_ids) data.push(NeoDK.#Encoding.UnsignedInt2, id & 0xff, (id >> 8) & 0xff);
+        data.push(NeoDK.#Encoding.EndOfContainer);
+        return Uint8Array.from(data);
+    }
+
+
+    #sendAttrListRequest(writer, request_type, attribute_ids) {
+        const data = this.#encodeAttributeList(attribute_ids);
+        this.#sendFrame(writer, this.#makeRequestPacketFrame(this.#transaction_id++, request_type, NeoDK.#AttributeId.AttributeList, data));
+    }
+
     #handleIncomingDebugPacket(chunk) {
         if (typeof (this.logger.debug) == 'function') {
             this.logger.debug(new TextDecoder().decode(chunk));
@@ -402,16 +781,73 @@ class NeoDK {
     }
 
 
-    #handleReportedData(aa) {
-        const attribute_id = aa[4] | (aa[5] << 8);
-        let offset = NeoDK.#StructureSize.AttributeAction;
-        const data_length = aa.length - offset;
+    // The number of octets taken by the element at pos, including any nested elements.
+    #elementLength(data, pos) {
+        const enc = data[pos];
+        if (enc <= 7) return 1 + (1 << (enc & 3));          // Signed and unsigned integers.
+        if (enc <= 9) return 1;                             // Booleans.
+        if (enc <= 11) return enc == 10 ? 5 : 9;           // Floats.
+        if (enc <= 19) {                                    // Strings and byte arrays.
+            const nr_of_len_octets = 1 << ((enc - 12) & 3);
+            let len = 0;
+            for (let i = nr_of_len_octets; i > 0; i--) len = len * 256 + data[pos + i];
+            return 1 + nr_of_len_octets + len;
+        }
+        if (enc >= NeoDK.#Encoding.Struct && enc <= NeoDK.#Encoding.List) {
+            let end = pos + 1;
+            while (end < data.length && data[end] != NeoDK.#Encoding.EndOfContainer) end += this.#elementLength(data, end);
+            return end + 1 - pos;
+        }
+        return 1;                                           // Null, end of container.
+    }
+
+
+    // A time stamp in ms, followed by samples of a time offset, Vbat, Vcap and Iprim, all little endian.
+    #unpackTelemetry(report) {
+        const view = new DataView(report.buffer, report.byteOffset, report.byteLength);
+        const time_ms = view.getUint32(0, true);
+        const samples = [];
+        for (let pos = 4; pos + 8 <= report.length; pos += 8) {
+            samples.push({
+                time_ms: time_ms + view.getUint16(pos, true),
+                BatteryVoltage: view.getUint16(pos + 2, true) / 1000,
+                CapacitorVoltage: view.getUint16(pos + 4, true) / 1000,
+                PrimaryCurrent: view.getUint16(pos + 6, true) / 1000
+            });
+        }
+        if (samples.length == 0) return;
+
+        const latest = samples[samples.length - 1];
+        this.state.power.BatteryVoltage = latest.BatteryVoltage;
+        this.state.power.CapacitorVoltage = latest.CapacitorVoltage;
+        this.state.power.PrimaryCurrent = latest.PrimaryCurrent;
+        this.state.power.Samples = samples;
+    }
+
+
+    // Per pulse: charge in nC, energy in nJ, peak current in mA and the pulse's number in its burst, all little endian.
+    #unpackPulseMetrics(report) {
+        const view = new DataView(report.buffer, report.byteOffset, report.byteLength);
+        const pulses = [];
+        for (let pos = 0; pos + 12 <= report.length; pos += 12) {
+            pulses.push({
+                Charge_uC: view.getUint32(pos, true) / 1000,
+                Energy_mJ: view.getUint32(pos + 4, true) / 1000000,
+                PeakCurrent: view.getUint16(pos + 8, true) / 1000,
+                SeqNr: view.getUint16(pos + 10, true)
+            });
+        }
+        this.state.power.PulseMetrics = pulses;
+    }
+
+
+    #handleAttributeValue(attribute_id, data) {
         switch (attribute_id) {
             case NeoDK.#AttributeId.Voltages:
-                if (data_length >= 8 && aa[offset] == NeoDK.#Encoding.Bytes_1Len) {
-                    const Vbat_mV = aa[offset + 2] | ((aa[offset + 3]) << 8);
-                    const Vcap_mV = aa[offset + 4] | ((aa[offset + 5]) << 8);
-                    const Ipri_mA = aa[offset + 6] | ((aa[offset + 7]) << 8);
+                if (data.length >= 8 && data[0] == NeoDK.#Encoding.Bytes_1Len) {
+                    const Vbat_mV = data[2] | ((data[3]) << 8);
+                    const Vcap_mV = data[4] | ((data[5]) << 8);
+                    const Ipri_mA = data[6] | ((data[7]) << 8);
                     this.state.power.BatteryVoltage = Vbat_mV / 1000;
                     this.state.power.CapacitorVoltage = Vcap_mV / 1000;
                     this.state.power.PrimaryCurrent = Ipri_mA / 1000;
@@ -419,53 +855,163 @@ class NeoDK {
                 }
                 break;
             case NeoDK.#AttributeId.AllPatternNames:
-                if (data_length >= 2 && aa[offset] == NeoDK.#Encoding.Array) {
+                if (data.length >= 2 && data[0] == NeoDK.#Encoding.Array) {
                     this.logger.log('Available patterns:');
-                    offset += this.#unpackPatternNames(aa.slice(offset + 1));
+                    this.#unpackPatternNames(data.slice(1));
                 }
                 break;
             case NeoDK.#AttributeId.CurrentPatternName:
-                if (aa[offset] == NeoDK.#Encoding.UTF8_1Len) {
-                    const name = new TextDecoder().decode(aa.slice(offset + 2));
+                if (data[0] == NeoDK.#Encoding.UTF8_1Len) {
+                    const name = new TextDecoder().decode(data.slice(2));
                     this.state.CurrentPattern = name;
                     this.logger.log('Current pattern is ' + name);
                 }
                 break;
             case NeoDK.#AttributeId.IntensityPercent:
-                if (aa[offset] == NeoDK.#Encoding.UnsignedInt1) {
-                    const intensity_perc = aa[offset + 1];
+                if (data[0] == NeoDK.#Encoding.UnsignedInt1) {
+                    const intensity_perc = data[1];
                     this.state.Intensity = intensity_perc;
                     this.logger.log('Intensity is ' + intensity_perc + '%');
                 }
                 break;
             case NeoDK.#AttributeId.PlayPauseStop:
-                if (aa[offset] == NeoDK.#Encoding.UnsignedInt1) {
-                    const play_state = aa[offset + 1];
+                if (data[0] == NeoDK.#Encoding.UnsignedInt1) {
+                    const play_state = data[1];
                     if (play_state >= 4) play_state = 0;
                     this.state.PlayState = NeoDK.#playStates[play_state];
                     this.logger.log('NeoDK is ' + NeoDK.#playStates[play_state]);
                 }
                 break;
             case NeoDK.#AttributeId.BoxName:
-                if (aa[offset] == NeoDK.#Encoding.UTF8_1Len) {
-                    const name = new TextDecoder().decode(aa.slice(offset + 2));
+                if (data[0] == NeoDK.#Encoding.UTF8_1Len) {
+                    const name = new TextDecoder().decode(data.slice(2));
                     this._name = name;
                     this.logger.log('Box name is ' + name);
                 }
                 break;
+            case NeoDK.#AttributeId.TelemetryRateHz:
+                if (data[0] == NeoDK.#Encoding.UnsignedInt1) {
+                    this.logger.log('Telemetry rate is ' + data[1] + ' Hz');
+                }
+                break;
+            case NeoDK.#AttributeId.AdcStream:
+                if (data.length >= 3 && data[0] == NeoDK.#Encoding.Bytes_2Len) {
+                    this.#unpackTelemetry(data.slice(3, 3 + (data[1] | (data[2] << 8))));
+                }
+                break;
+            case NeoDK.#AttributeId.PulseCapture:
+                this.logger.log('Pulse capture is ' + (data[0] == NeoDK.#Encoding.BooleanTrue ? 'on' : 'off'));
+                break;
+            case NeoDK.#AttributeId.PulseMetrics:
+                if (data.length >= 2 && data[0] == NeoDK.#Encoding.Bytes_1Len) {
+                    this.#unpackPulseMetrics(data.slice(2, 2 + data[1]));
+                }
+                break;
+            case NeoDK.#AttributeId.PulseRecorder:
+                this.logger.log('Pulse recorder is ' + (data[0] == NeoDK.#Encoding.BooleanTrue ? 'on' : 'off'));
+                break;
+            case NeoDK.#AttributeId.PulseRecords:
+                if (data.length >= 2 && data[0] == NeoDK.#Encoding.Bytes_1Len) {
+                    this.#pulse_records.push(data.slice(2, 2 + data[1]));
+                }
+                break;
+            case NeoDK.#AttributeId.Recordings:
+                if (data.length >= 8 && data[0] == NeoDK.#Encoding.Bytes_1Len) {
+                    const nr_of_recordings = data[2] | (data[3] << 8);
+                    const free_blocks = data[4] | (data[5] << 8);
+                    const block_size = data[6] | (data[7] << 8);
+                    this.logger.log(nr_of_recordings + ' recordings stored, ' + (free_blocks * block_size) + ' bytes free');
+                }
+                break;
+            case NeoDK.#AttributeId.UserPatterns:
+                if (data.length >= 6 && data[0] == NeoDK.#Encoding.Bytes_1Len) {
+                    this.logger.log(data[2] + ' of ' + data[3] + ' user patterns stored, ' + (data[4] | (data[5] << 8)) + ' bytes free');
+                }
+                break;
+            case NeoDK.#AttributeId.PatternProgram:
+                if (data.length >= 3 && data[0] == NeoDK.#Encoding.UnsignedInt2) {
+                    this.logger.log('Pattern program of ' + (data[1] | (data[2] << 8)) + ' bytes loaded');
+                }
+                break;
+            case NeoDK.#AttributeId.PatternProgress:
+                if (data.length >= 10 && data[0] == NeoDK.#Encoding.Bytes_1Len) {
+                    const dv = new DataView(data.buffer, data.byteOffset + 2, 8);
+                    this.state.Progress = { elapsed_ms: dv.getUint32(0, true), total_ms: dv.getUint32(4, true) };
+                }
+                break;
+            case NeoDK.#AttributeId.PatternLayers:
+                if (data.length >= 2 && data[0] == NeoDK.#Encoding.UnsignedInt1) {
+                    this.logger.log(data[1] + ' pattern layers playing');
+                }
+                break;
+            case NeoDK.#AttributeId.TriacSettleMicros:
+                if (data.length >= 3 && data[0] == NeoDK.#Encoding.UnsignedInt2) {
+                    this.logger.log('Triac settle time is ' + (data[1] | (data[2] << 8)) + ' µs');
+                }
+                break;
+            case NeoDK.#AttributeId.Transition:
+                if (data.length >= 6 && data[0] == NeoDK.#Encoding.Bytes_1Len) {
+                    this.logger.log('Pattern switches at the next ' + (data[4] ? 'rep' : 'burst') + ', crossfade ' + (data[2] | (data[3] << 8)) + ' ms');
+                }
+                break;
+            case NeoDK.#AttributeId.Modulation:
+                for (let pos = 2; pos + 4 <= data.length && data[0] == NeoDK.#Encoding.Bytes_1Len; pos += 4) {
+                    const rate_cHz = data[pos + 2] | (data[pos + 3] << 8);
+                    this.logger.log('LFO ' + (pos - 2) / 4 + ': waveform=' + data[pos] + ', depth=' + data[pos + 1] + '%, rate=' + rate_cHz / 100 + ' Hz');
+                }
+                break;
+            case NeoDK.#AttributeId.Playback:
+                if (data[0] == NeoDK.#Encoding.UnsignedInt1) {
+                    this.logger.log('Playing recording ' + data[1]);
+                } else {
+                    this.logger.log('No recording playing');
+                }
+                break;
             default:
                 this.logger.log('Unexpected attribute id: ' + attribute_id);
         }
     }
 
 
+
+
+    // A list of attribute id and value pairs.
+    #handleReportedList(data) {
+        if (data.length < 2 || data[0] != NeoDK.#Encoding.List) return;
+
+        let pos = 1;
+        while (pos + 3 < data.length && data[pos] == NeoDK.#Encoding.UnsignedInt2) {
+            const attribute_id = data[pos + 1] | (data[pos + 2] << 8);
+            pos += 3;
+            const len = this.#elementLength(data, pos);
+            this.#handleAttributeValue(attribute_id, data.slice(pos, pos + len));
+            pos += len;
+        }
+    }
+
+
+    #handleReportedData(aa) {
+        const attribute_id = aa[4] | (aa[5] << 8);
+        const data = aa.slice(NeoDK.#StructureSize.AttributeAction);
+        if (attribute_id == NeoDK.#AttributeId.AttributeList) {
+            this.#handleReportedList(data);
+        } else {
+            this.#handleAttributeValue(attribute_id, data);
+        }
+    }
+
+
     #handleIncomingDatagram(datagram) {
         const offset = NeoDK.#StructureSize.PacketHeader;
         const opcode = datagram[offset + 2];
+        const tr_id = datagram[offset] | (datagram[offset + 1] << 8);
         if (opcode == NeoDK.#OPCode.ReportData) {
             this.#handleReportedData(datagram.slice(offset))
+        } else if (opcode == NeoDK.#OPCode.StatusResponse && this.#status_waiters.has(tr_id)) {
+            const sc = datagram[offset + NeoDK.#StructureSize.AttributeAction + 1];
+            this.#status_waiters.get(tr_id)(sc);
+            this.#status_waiters.delete(tr_id);
         } else {
-            const tr_id = datagram[offset] | (datagram[offset + 1] << 8);
             this.logger.log('Transaction ID=' + tr_id + ', opcode=' + opcode);
         }
     }
@@ -549,13 +1095,12 @@ class NeoDK {
 
             this.#readIncomingData(port.readable.getReader());
 
-            // We have one readable attribute and three we can subscribe to.
-            this.#sendAttrReadRequest(this.#the_writer, NeoDK.#AttributeId.AllPatternNames);
-            this.#sendAttrReadRequest(this.#the_writer, NeoDK.#AttributeId.Voltages);
-            this.#sendAttrReadRequest(this.#the_writer, NeoDK.#AttributeId.BoxName);
-            this.#sendAttrSubscribeRequest(this.#the_writer, NeoDK.#AttributeId.CurrentPatternName);
-            this.#sendAttrSubscribeRequest(this.#the_writer, NeoDK.#AttributeId.IntensityPercent);
-            this.#sendAttrSubscribeRequest(this.#the_writer, NeoDK.#AttributeId.PlayPauseStop);
+            // We have three readable attributes and four we can subscribe to.
+            this.#sendAttrListRequest(this.#the_writer, NeoDK.#OPCode.ReadRequest,
+                [NeoDK.#AttributeId.AllPatternNames, NeoDK.#AttributeId.Voltages, NeoDK.#AttributeId.BoxName]);
+            this.#sendAttrListRequest(this.#the_writer, NeoDK.#OPCode.SubscribeRequest,
+                [NeoDK.#AttributeId.CurrentPatternName, NeoDK.#AttributeId.IntensityPercent, NeoDK.#AttributeId.PlayPauseStop,
+                 NeoDK.#AttributeId.PatternProgress]);
         });
         return true;
     }
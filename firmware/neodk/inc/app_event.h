@@ -8,7 +8,7 @@
  *
  *  Created on: 22 May 2021
  *      Author: Mark
- *   Copyright  2021..2025 Neostim™
+ *   Copyright  2021..2026 Neostim™
  */
 
 #ifndef INC_APP_EVENT_H_
@@ -26,6 +26,9 @@ enum {
     ET_SELECT_NEXT_PATTERN, ET_SELECT_PATTERN_BY_NAME, ET_SET_INTENSITY,
     ET_QUEUE_PULSE_TRAIN, ET_START_STREAM, ET_STOP_STREAM,
     ET_BAD_BURST, ET_BURST_STARTED, ET_BURST_COMPLETED, ET_BURST_EXPIRED,
+    ET_PERIPHERAL_READY, ET_SUBSCRIPTION_TIMER, ET_TELEMETRY_TIMER, ET_PULSE_METRICS,
+    ET_START_PLAYBACK, ET_START_PROGRAM, ET_SET_MODULATION, ET_SEEK_PATTERN, ET_SET_TRANSITION,
+    ET_START_LAYERS,
 };
 
 #endif
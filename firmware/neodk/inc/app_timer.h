@@ -0,0 +1,43 @@
+/*
+ * app_timer.h -- Software timers for active objects, on a single hardware compare.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_APP_TIMER_H_
+#define INC_APP_TIMER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "eventqueue.h"
+
+typedef struct _AppTimer AppTimer;
+
+// Embed one of these in the owning object. Treat the members as private.
+struct _AppTimer {
+    AppTimer *next, *prev;
+    EventQueue *event_queue;
+    uint32_t expiry_ms;
+    uint32_t period_ms;                         // 0 for a one-shot timer.
+    uint8_t  event_type;
+    uint8_t  slot;                              // Where in the wheel, if armed.
+};
+
+// Class method.
+void AppTimer_startService(void);
+
+// Instance methods. On expiry, the event's data is the address of the AppTimer.
+// Cancelling does not retract an expiry event that was already posted.
+void AppTimer_init(AppTimer *, EventQueue *, uint8_t event_type);
+void AppTimer_arm(AppTimer *, uint32_t delay_ms, uint32_t period_ms);
+void AppTimer_cancel(AppTimer *);
+bool AppTimer_isArmed(AppTimer const *);
+
+#endif
@@ -7,30 +7,49 @@
  *
  *  Created on: 15 Oct 2024
  *      Author: mark
- *   Copyright  2024, 2025 Neostim™
+ *   Copyright  2024..2026 Neostim™
  */
 
 #ifndef INC_ATTRIBUTES_H_
 #define INC_ATTRIBUTES_H_
 
 #include "matter.h"
+#include "eventqueue.h"
+#include "app_timer.h"
 
 typedef enum {
-    AI_FIRMWARE_VERSION = 2, AI_VOLTAGES, AI_CLOCK_MICROS,
+    AI_ATTRIBUTE_LIST = 1,                      // The data is a list of attribute ids.
+    AI_FIRMWARE_VERSION, AI_VOLTAGES, AI_CLOCK_MICROS,
     AI_ALL_PATTERN_NAMES, AI_CURRENT_PATTERN_NAME, AI_INTENSITY_PERCENT, AI_PLAY_PAUSE_STOP,
-    AI_BOX_NAME, AI_PT_DESCRIPTOR_QUEUE, AI_HEARTBEAT_INTERVAL_SECS
+    AI_BOX_NAME, AI_PT_DESCRIPTOR_QUEUE, AI_HEARTBEAT_INTERVAL_SECS,
+    AI_TELEMETRY_RATE_HZ, AI_ADC_STREAM, AI_PULSE_CAPTURE, AI_PULSE_METRICS,
+    AI_PULSE_RECORDER, AI_PULSE_RECORDS, AI_RECORDINGS, AI_PLAYBACK, AI_USER_PATTERNS,
+    AI_PATTERN_PROGRAM, AI_MODULATION, AI_PATTERN_PROGRESS, AI_TRANSITION,
+    AI_PATTERN_LAYERS, AI_TRIAC_SETTLE_MICROS,
+    AI_NR_OF_ATTRIBUTES                         // Keep this one last.
 } AttributeId;
 
 typedef void (*AttrNotifier)(void *target, AttributeId, TransactionId, ElementEncoding, uint8_t const *data, uint16_t size);
 
 #define NO_TRANS_ID     (TransactionId)0U
+#define NO_SUB_ID       (SubscriptionId)0U
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// The subscription timers post their expiry events to the given queue, whose owner
+// must pass them on to Attribute_handleTimerEvent().
+void Attribute_startService(EventQueue *, uint8_t timer_event_type);
+void Attribute_handleTimerEvent(AppTimer *);
+
 SubscriptionId Attribute_awaitRead(AttributeId, TransactionId, AttrNotifier, void *target);
 SubscriptionId Attribute_subscribe(AttributeId, TransactionId, AttrNotifier, void *target);
+// Report at most once per min interval, and at least once per max interval (0 means never).
+SubscriptionId Attribute_subscribeWithIntervals(AttributeId, TransactionId, uint32_t min_interval_ms, uint32_t max_interval_ms,
+                                                AttrNotifier, void *target);
+void Attribute_unsubscribe(SubscriptionId);
+bool Attribute_isSubscribed(AttributeId);
 void Attribute_changed(AttributeId, TransactionId, ElementEncoding, uint8_t const *data, uint16_t size);
 
 #ifdef __cplusplus
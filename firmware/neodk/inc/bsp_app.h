@@ -21,13 +21,64 @@ typedef struct {
     uint16_t Vbat_mV, Vcap_mV, Iprim_mA;
 } AdcValues;
 
+// What a captured pulse boils down to. All fields are little endian on the wire.
+typedef struct {
+    uint32_t charge_nC;
+    uint32_t energy_nJ;
+    uint16_t peak_mA;
+    uint16_t pulse_seqnr;                       // Within its burst.
+} PulseMetrics;
+
+// An emitted pulse, as recorded by the pulse ISR. All fields are little endian on the wire.
+typedef struct {
+    uint32_t start_µs;                          // Sequencer clock time.
+    uint16_t seqnr;                             // Of all pulses since recording started.
+    uint16_t width_¼µs;
+    uint16_t Vcap_mV;                           // Sampled during the pulse.
+    uint8_t  phase;
+    uint8_t  elcon;                             // The electrode configuration.
+} PulseRecord;
+
+// Interrupt priority levels, from high to low.
+typedef enum {
+    IRQL_PULSE, IRQL_ADC_DMA, IRQL_COMMS, IRQL_BUTTON
+} IrqLevel;
+
+typedef uint32_t IrqMask;
+
+typedef enum {
+    CS_LOW_POWER,                               // 16 MHz, straight off HSI16.
+    CS_FULL_SPEED                               // 64 MHz, from the PLL.
+} ClockSpeed;
+
+// Statically allocated objects, carved from the RAM arena and accounted for per module.
+#define ARENA(module)   __attribute__((section(".bss.arena." #module)))
+
+// Code on the pulse path runs from SRAM, without flash wait states. The startup code copies it there.
+// Flash and SRAM are too far apart for a BL, hence the long_call.
+#define RAMFUNC         __attribute__((section(".ramfunc"), noinline, long_call))
+
+// Peripherals that finish their bring-up in the background, reported by ET_PERIPHERAL_READY.
+enum { PR_LSE = 0x01, PR_DAC = 0x02, PR_ADC = 0x04 };
+
+// Flash areas outside the firmware image, for the application's data.
+typedef enum { FA_RECORDINGS, FA_PATTERNS } FlashArea;
+
 
 void BSP_init(void);                            // Get the hardware ready for action.
 void BSP_registerPulseDelegate(EventQueue *);
+void BSP_registerReadinessDelegate(EventQueue *);
 void BSP_toggleTheLED(void);
+void BSP_selectClockSpeed(ClockSpeed);
 uint32_t BSP_millisecondsToTicks(uint16_t ms);
 uint64_t BSP_ticksToMicroseconds(uint64_t ticks);
 uint64_t BSP_microsecondsSinceBoot(void);
+void BSP_scheduleAppTimer(uint64_t deadline_µs);    // Only when registered without a tick.
+void BSP_sealHeap(void);                        // From here on, malloc() fails.
+
+// Critical sections that keep interrupts above the given level enabled.
+IrqMask BSP_maskInterrupts(IrqLevel);           // Masks all interrupts at or below the level.
+void BSP_restoreInterrupts(IrqMask);
 
 // To install some handlers.
 void BSP_registerIdleHandler(Selector *);
@@ -37,14 +88,31 @@ void BSP_registerButtonHandler(Selector *);
 uint16_t BSP_setPrimaryVoltagePercent(uint8_t perc);
 void BSP_primaryVoltageEnable(bool must_be_on);
 void BSP_setElectrodeConfiguration(uint8_t const [2]);
+uint16_t BSP_setTriacSettleTime(uint16_t settle_µs);   // Returns the time it was clamped to.
+uint16_t BSP_triacSettleTime(void);
+bool BSP_enablePulseCapture(EventQueue *);      // Posts ET_PULSE_METRICS batches to it; NULL stops capturing.
+void BSP_recordPulses(bool);
+uint16_t BSP_takePulseRecords(PulseRecord [], uint16_t max_nr_of_records);
+uint16_t BSP_nrOfPulseRecordsDropped(void);
 void BSP_startSequencerClock(uint32_t time_µs);
-void BSP_stopSequencerClock(void);
+uint32_t BSP_stopSequencerClock(void);      // Returns the clock time it stopped at.
 void BSP_resumeSequencerClock(void);
 bool BSP_scheduleBurst(Burst const *);
 bool BSP_startBurst(Burst const *);
 
+void BSP_getAdcValues(AdcValues *);            // The latest samples, converted.
+void BSP_sampleADC(void);                       // Fresh samples, if no burst is running to trigger them.
+
+// Flash storage. Erasing and writing stall all code that runs from flash.
+uint8_t const *BSP_flashArea(FlashArea, uint32_t *size);
+uint16_t BSP_flashPageSize(void);
+bool BSP_eraseFlashPage(uint8_t const *page);
+bool BSP_writeFlash(uint8_t const *dst, void const *src, uint16_t nb);    // Whole, aligned double words only.
+
 // Debugging stuff.
 void BSP_triggerADC(void);
+void BSP_logPulseIrqLatency(void);
+void BSP_logPowerStatistics(void);
 
 // Firmware update.
 uint32_t const *BSP_serialNumber(void);
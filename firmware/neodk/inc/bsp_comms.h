@@ -20,5 +20,6 @@ void BSP_enableUsbInterrupt(void);
 void BSP_initComms(void);
 DeviceId BSP_openSerialPort(char const *name);
 int BSP_closeSerialPort(int fd);
+bool BSP_commsMayStop(void);                    // True if no transmission is in progress.
 
 #endif
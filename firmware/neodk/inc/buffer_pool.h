@@ -0,0 +1,36 @@
+/*
+ * buffer_pool.h -- Reference counted receive buffers, so events can carry a handle instead of a copy.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_BUFFER_POOL_H_
+#define INC_BUFFER_POOL_H_
+
+#include <stdint.h>
+
+#define NO_BUFFER       0xff
+
+// The event data of ET_INCOMING_PACKET and ET_QUEUE_PULSE_TRAIN.
+// Whoever takes the event from its queue owns one reference, and must release it.
+typedef struct {
+    uint8_t const *data;                        // Points into the buffer.
+    uint16_t size;
+    uint8_t  buffer_nr;
+} BufferRef;
+
+// Class methods. Safe to call from the serial port ISR.
+void BufferPool_init(void);
+uint8_t BufferPool_acquire(void);               // Returns NO_BUFFER if none is free.
+uint8_t *BufferPool_data(uint8_t buffer_nr);
+void BufferPool_retain(uint8_t buffer_nr);
+void BufferPool_release(uint8_t buffer_nr);
+void BufferPool_logStatistics(void);
+
+#endif
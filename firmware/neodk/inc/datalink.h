@@ -7,7 +7,7 @@
  *
  *  Created on: 24 Feb 2024
  *      Author: mark
- *   Copyright  2024, 2025 Neostim™
+ *   Copyright  2024..2026 Neostim™
  */
 
 #ifndef INC_DATALINK_H_
@@ -18,6 +18,8 @@
 
 #include "eventqueue.h"
 
+#define MAX_PAYLOAD_SIZE    512
+
 typedef struct _DataLink DataLink;              // Opaque type.
 
 // Class method.
@@ -26,6 +28,10 @@ DataLink *DataLink_new();
 // Instance methods.
 bool DataLink_open(DataLink *, EventQueue *);
 void DataLink_awaitSync(DataLink *);
+// Encode a datagram in place: reserve room for it, fill it in, then commit (or abandon) it.
+uint8_t *DataLink_reservePacket(DataLink *, uint16_t max_packet_size);
+bool DataLink_commitPacket(DataLink *, uint8_t *packet, uint16_t packet_size);
+void DataLink_abandonPacket(DataLink *, uint8_t *packet);
 bool DataLink_sendDebugPacket(DataLink *, uint8_t const *, uint16_t);
 bool DataLink_sendDatagram(DataLink *, uint8_t const *, uint16_t);
 void DataLink_close(DataLink *);
@@ -0,0 +1,25 @@
+/*
+ * frame_pool.h -- Slab allocator for the frames DataLink holds until they are acknowledged.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_FRAME_POOL_H_
+#define INC_FRAME_POOL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Class methods. Allocating and freeing take constant time.
+void FramePool_init(void);
+uint8_t *FramePool_alloc(uint16_t nb);          // NULL if no block of at least nb bytes is free.
+void FramePool_free(uint8_t *);
+void FramePool_logStatistics(void);
+
+#endif
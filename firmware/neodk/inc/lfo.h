@@ -0,0 +1,53 @@
+/*
+ * lfo.h -- Low frequency oscillators, for modulating patterns.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_LFO_H_
+#define INC_LFO_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LFO_MAX_RATE_cHz        1000            // 10 Hz.
+
+// What the LFOs of a pattern modulate.
+enum { MT_PULSE_WIDTH, MT_PACE, MT_AMPLITUDE, MT_NR_OF_TARGETS };
+
+typedef enum { LW_SINE, LW_TRIANGLE, LW_RANDOM_WALK, LW_NR_OF_WAVEFORMS } LfoWaveform;
+
+// As they go over the wire. All fields are little endian.
+typedef struct {
+    uint8_t  waveform;
+    uint8_t  depth_percent;                     // 0 turns the LFO off.
+    uint16_t rate_cHz;                          // [0.01 Hz].
+} LfoSettings;
+
+// Treat the members as private.
+typedef struct {
+    LfoSettings settings;
+    uint32_t phase;                             // One cycle is 2^32.
+    uint32_t phase_step;                        // Per µs.
+    uint32_t quarter_cycle_µs;
+    uint32_t prng_state;
+    int16_t  walk;
+} Lfo;
+
+// Class method.
+bool Lfo_isValid(LfoSettings const *);
+
+// Instance methods.
+void Lfo_configure(Lfo *, LfoSettings const *);
+void Lfo_restart(Lfo *);
+bool Lfo_isActive(Lfo const *);
+int16_t Lfo_advance(Lfo *, uint32_t elapsed_µs);    // The modulation [-32767..32767] now, before moving on.
+uint16_t Lfo_modulate(uint16_t value, int16_t modulation, uint16_t min, uint16_t max);
+
+#endif
@@ -7,7 +7,7 @@
  *
  *  Created on: 6 Mar 2024
  *      Author: mark
- *   Copyright  2024, 2025 Neostim™
+ *   Copyright  2024..2026 Neostim™
  */
 
 #ifndef INC_PATTERN_ITER_H_
@@ -15,6 +15,7 @@
 
 #include "bsp_app.h"
 #include "patterns.h"
+#include "lfo.h"
 
 typedef struct {
     PatternDescr const *pattern_descr;
@@ -24,13 +25,28 @@ typedef struct {
     uint8_t step_nr;
     uint16_t nr_of_reps;
     uint8_t segment_nr;
+    uint8_t intensity_percent;
+    uint8_t voltage_percent;                    // As last set by the amplitude LFO.
+    uint8_t burst_voltage_percent;              // For next_burst, or NO_VOLTAGE_CHANGE.
+    Lfo lfos[MT_NR_OF_TARGETS];
+    Burst next_burst;                           // Computed ahead of time, if has_next_burst.
+    bool has_next_burst;
 } PatternIterator;
 
 
 bool PatternIterator_init(PatternIterator *, PatternDescr const *);
 void PatternIterator_setPulseWidth(PatternIterator *, uint8_t width_µs);
 void PatternIterator_setIntensity(PatternIterator *, uint8_t intensity);
-bool PatternIterator_scheduleNextBurst(PatternIterator *);
+void PatternIterator_setModulation(PatternIterator *, uint8_t target, LfoSettings const *);
+void PatternIterator_getModulation(PatternIterator const *, LfoSettings settings[MT_NR_OF_TARGETS]);
+void PatternIterator_restoreIntensity(PatternIterator *);    // Undoes the amplitude LFO.
+void PatternIterator_getProgress(PatternIterator const *, uint32_t progress_ms[2]);  // Elapsed and total.
+bool PatternIterator_seek(PatternIterator *, uint32_t position_ms);     // To the burst containing the position.
+bool PatternIterator_prepareBurst(PatternIterator *);   // Computes the next burst now, to start it later.
+bool PatternIterator_scheduleNextBurst(PatternIterator *, uint32_t start_µs);   // On the sequencer clock.
+uint32_t PatternIterator_burstStarted(PatternIterator *);   // Moves past the scheduled burst, returns its duration.
+bool PatternIterator_takeBurst(PatternIterator *, Burst *, uint8_t *intensity_percent);    // For others to start.
+bool PatternIterator_atRepStart(PatternIterator const *);
 char const *PatternIterator_name(PatternIterator const *);
 bool PatternIterator_done(PatternIterator *);
 
@@ -0,0 +1,67 @@
+/*
+ * pattern_mux.h -- Plays several patterns at once, on separate electrodes, by interleaving their pulses.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_PATTERN_MUX_H_
+#define INC_PATTERN_MUX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pattern_iter.h"
+#include "ptd_queue.h"
+
+#ifndef MUX_MAX_LAYERS
+#define MUX_MAX_LAYERS          2               // Four electrodes make two disjoint pairs.
+#endif
+
+typedef enum { ME_NONE, ME_NO_LAYERS, ME_TOO_MANY, ME_BAD_INTENSITY, ME_SHORT, ME_OVERLAP } MuxErrType;
+
+typedef struct {
+    PatternDescr const *pd;
+    uint8_t intensity_percent;
+} LayerSpec;
+
+// Treat the members as private.
+typedef struct {
+    PatternIterator pi;
+    Burst burst;                                // The rest of it, still to be played.
+    uint32_t next_µs;                           // When the layer's next pulse is due.
+    bool is_done;
+} MuxLayer;
+
+// Treat the members as private.
+typedef struct {
+    MuxLayer layers[MUX_MAX_LAYERS];
+    uint32_t pending[PT_DESCRIPTOR_MAX_SIZE / 4];   // The next descriptor, waiting for room in the queue.
+    uint32_t busy_until_µs;                     // The end of the last pulse queued.
+    uint32_t last_start_µs;
+    uint8_t last_electrodes;
+    uint8_t amplitude;                          // Common to all layers.
+    uint8_t nr_of_layers;
+    uint8_t seq_nr;
+    bool has_pending;
+    bool is_active;                             // From start to stop.
+    bool has_more;                              // To queue.
+} PatternMux;
+
+// Class method.
+bool PatternMux_check(LayerSpec const specs[], uint8_t nr_of_layers, MuxErrType *);
+
+// Instance methods.
+void PatternMux_init(PatternMux *);
+// Layers play at the voltage of the most intense one; the others get narrower pulses, down to the minimum width.
+bool PatternMux_start(PatternMux *, LayerSpec const specs[], uint8_t nr_of_layers);
+uint16_t PatternMux_fill(PatternMux *, PtdQueue *);     // Returns the number of descriptors queued.
+uint8_t PatternMux_nrOfLayers(PatternMux const *);      // 0 if not active.
+void PatternMux_stop(PatternMux *);
+
+#endif
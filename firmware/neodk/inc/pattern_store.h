@@ -0,0 +1,49 @@
+/*
+ * pattern_store.h -- Patterns uploaded at run time, kept in flash.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_PATTERN_STORE_H_
+#define INC_PATTERN_STORE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "patterns.h"
+
+#ifndef MAX_USER_PATTERNS
+#define MAX_USER_PATTERNS       16
+#endif
+
+#define PATTERN_NAME_MAX_LEN    23
+#define PATTERN_MAX_ELCONS      64
+
+typedef enum { PSE_NONE, PSE_TOO_MANY, PSE_STORE_FULL, PSE_WRITE_FAILED } PatStoreErrType;
+
+// The value of AI_USER_PATTERNS, when read. All fields are little endian.
+typedef struct {
+    uint8_t  nr_of_patterns;
+    uint8_t  max_nr_of_patterns;
+    uint16_t nr_of_bytes_free;                  // Before the store has to compact itself.
+} PatternStoreInfo;
+
+// Class methods.
+void PatternStore_startService(void);           // Finds the patterns in flash.
+void PatternStore_getInfo(PatternStoreInfo *);
+uint16_t PatternStore_generation(void);         // Changes whenever the set of patterns changes.
+PatternDescr const *PatternStore_get(uint8_t slot_nr);     // NULL if the slot is free.
+uint8_t PatternStore_slotNr(PatternDescr const *);          // MAX_USER_PATTERNS if not from the store.
+
+// A stored pattern replaces the one of the same name. The data gets copied, so it may be transient.
+bool PatternStore_put(PatternDescr const *, uint8_t name_len, PatStoreErrType *);
+bool PatternStore_remove(char const *name, uint16_t len);
+void PatternStore_eraseAll(void);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * pattern_vm.h -- Runs pattern programs, small bytecode programs that generate bursts.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_PATTERN_VM_H_
+#define INC_PATTERN_VM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ptd_queue.h"
+
+#define PATTERN_PROGRAM_MAX_SIZE    255
+#define PVM_NR_OF_VARS              16
+
+/**
+ * The instruction set. Operands r and s are variable numbers, all variables are signed 32-bit.
+ * Jumps are relative to the next instruction. A program must end with END or JMP.
+ */
+enum {
+    OP_END,                                     // Stops the program.
+    OP_SET,                                     // r imm16: vr = imm16 (unsigned, little endian).
+    OP_ADDI,                                    // r imm8: vr += imm8 (signed).
+    OP_ADD,                                     // r s: vr += vs.
+    OP_SUB,                                     // r s: vr -= vs.
+    OP_MUL,                                     // r s: vr *= vs.
+    OP_SHR,                                     // r n: vr >>= n, with n < 32.
+    OP_MIN,                                     // r s: vr = min(vr, vs).
+    OP_MAX,                                     // r s: vr = max(vr, vs).
+    OP_RAND,                                    // r s: vr = a pseudo-random number in [0, vs), for vs up to 65535.
+    OP_SEED,                                    // r: makes the random numbers repeatable.
+    OP_JMP,                                     // rel8: always.
+    OP_JNZ,                                     // r rel8: if vr != 0.
+    OP_LOOP,                                    // r rel8: if --vr > 0.
+    OP_EMIT,                                    // r: a burst on electrode sets vr bits 3..0 and 7..4, see below.
+    OP_WAIT,                                    // r: vr ms of silence.
+    OP_NR_OF_OPCODES
+};
+
+// The variables EMIT takes the rest of the burst from. The values get clipped to what the hardware can do.
+enum { PV_PULSES = 12, PV_PACE_µs, PV_WIDTH_µs };
+
+// Treat the members as private.
+typedef struct {
+    int32_t  vars[PVM_NR_OF_VARS];
+    uint32_t pending[PT_DESCRIPTOR_MAX_SIZE / 4];   // The next descriptor, waiting for room in the queue.
+    uint32_t time_µs;                           // Where the next burst goes, in stream time.
+    uint32_t prng_state;
+    uint16_t pc;
+    uint8_t  seq_nr;
+    bool     has_pending;
+    bool     is_active;                         // From start to stop.
+    bool     has_more;                          // To queue.
+} PatternVm;
+
+// Class methods. There is one program, shared by all instances.
+bool PatternVm_load(uint8_t const *code, uint16_t nb, uint16_t *bad_pc);   // Verifies the program first.
+uint16_t PatternVm_programSize(void);           // 0 if there is none.
+
+// Instance methods.
+void PatternVm_init(PatternVm *);
+bool PatternVm_start(PatternVm *);
+uint16_t PatternVm_fill(PatternVm *, PtdQueue *);  // Returns the number of descriptors queued.
+bool PatternVm_isActive(PatternVm const *);
+void PatternVm_stop(PatternVm *);
+
+#endif
@@ -7,14 +7,17 @@
  *
  *  Created on: 11 Jan 2025
  *      Author: mark
- *   Copyright  2025 Neostim™
+ *   Copyright  2025, 2026 Neostim™
  */
 
 #ifndef INC_PATTERNS_H_
 #define INC_PATTERNS_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define NR_OF_BUILT_IN_PATTERNS     5           // The size of the table in patterns.c.
+
 typedef struct _PatternDescr PatternDescr;
 
 struct _PatternDescr {
@@ -27,10 +30,15 @@ struct _PatternDescr {
 };
 
 
+// The built-in patterns come first, followed by the ones in the pattern store.
 uint16_t Patterns_getCount();
 char const *Patterns_name(PatternDescr const *);
 void Patterns_getNames(char const *[], uint8_t cnt);
 void Patterns_checkAll();
+bool Patterns_isValid(PatternDescr const *, uint16_t name_len);    // For uploaded ones.
+bool Patterns_isBuiltIn(PatternDescr const *);
+bool Patterns_isShortFree(PatternDescr const *);
+uint8_t Patterns_electrodes(PatternDescr const *);  // All the electrodes the pattern uses.
 PatternDescr const *Patterns_findByName(char const *, uint16_t len);
 PatternDescr const *Patterns_getNext(PatternDescr const *);
 
@@ -0,0 +1,51 @@
+/*
+ * playback.h -- Feeds recordings from the store into a pulse train descriptor queue.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_PLAYBACK_H_
+#define INC_PLAYBACK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ptd_queue.h"
+#include "rec_store.h"
+
+#define PLAYBACK_ALL    0xff                    // Plays all recordings, back to back.
+
+// The data of ET_START_PLAYBACK.
+typedef struct {
+    uint32_t from_ms;                           // Into the (first) recording.
+    uint8_t  recording_nr;
+} PlaybackRequest;
+
+// Treat the members as private.
+typedef struct {
+    RecCursor cursor;
+    uint32_t pending[PT_DESCRIPTOR_MAX_SIZE / 4];   // The next descriptor, waiting for room in the queue.
+    uint8_t  pending_size;
+    uint8_t  recording_nr;
+    uint8_t  last_recording_nr;
+    uint8_t  seq_nr;
+    uint32_t time_offset_µs;                    // From recording time to stream time.
+    uint32_t end_µs;                            // Of the latest burst, in stream time.
+    bool     is_active;                         // From start to stop.
+    bool     has_more;                          // To queue.
+} Playback;
+
+void Playback_init(Playback *);
+bool Playback_start(Playback *, uint8_t recording_nr, uint32_t from_µs);
+uint16_t Playback_fill(Playback *, PtdQueue *);    // Returns the number of descriptors queued.
+bool Playback_isActive(Playback const *);
+uint8_t Playback_recordingNr(Playback const *);
+void Playback_stop(Playback *);
+
+#endif
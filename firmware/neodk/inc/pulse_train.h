@@ -7,7 +7,7 @@
  *
  *  Created on: 29 Dec 2019
  *      Author: mark
- *   Copyright  2019..2025 Neostim™
+ *   Copyright  2019..2026 Neostim™
  */
 
 #ifndef INC_PULSE_TRAIN_H_
@@ -15,6 +15,8 @@
 
 #include "burst.h"
 
+#define PT_DESCRIPTOR_MAX_SIZE  16              // See PulseTrainDescr.md.
+
 typedef struct _PulseTrain PulseTrain;          // Opaque type.
 
 #ifdef __cplusplus
@@ -28,6 +30,9 @@ uint16_t PulseTrain_size(void);
 PulseTrain *PulseTrain_init(PulseTrain *, uint8_t seq_nr, uint32_t timestamp, Burst const *burst);
 bool     PulseTrain_isValid(PulseTrain const *, uint16_t sz);
 uint32_t PulseTrain_timestamp(PulseTrain const *);
+void     PulseTrain_setTimestamp(PulseTrain *, uint32_t timestamp);
+void     PulseTrain_setSequenceNumber(PulseTrain *, uint8_t seq_nr);
+void     PulseTrain_setAmplitude(PulseTrain *, uint8_t amplitude);
 void     PulseTrain_clearDeltas(PulseTrain *);
 void     PulseTrain_setDeltas(PulseTrain *, int8_t delta_width_¼µs, int8_t delta_pace_µs);
 uint16_t PulseTrain_amplitude(PulseTrain const *);
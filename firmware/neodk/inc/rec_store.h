@@ -0,0 +1,64 @@
+/*
+ * rec_store.h -- Pulse train recordings, compressed into blocks of flash.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_REC_STORE_H_
+#define INC_REC_STORE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pulse_train.h"
+
+#define REC_NR_OF_REFERENCES    4               // Interleaved channels the codec keeps apart.
+
+typedef enum { RE_NONE, RE_NOT_RECORDING, RE_BAD_DESCRIPTOR, RE_STORE_FULL, RE_WRITE_FAILED } RecErrType;
+
+// The value of AI_RECORDINGS. All fields are little endian.
+typedef struct {
+    uint16_t nr_of_recordings;
+    uint16_t nr_of_free_blocks;
+    uint16_t block_size;
+} RecStoreInfo;
+
+// Descriptors get coded against the previous one of the same channel. Treat the members as private.
+typedef struct {
+    uint8_t  refs[REC_NR_OF_REFERENCES][PT_DESCRIPTOR_MAX_SIZE];
+    uint8_t  ref_sizes[REC_NR_OF_REFERENCES];
+    uint8_t  next_ref;                          // To replace, when a new channel shows up.
+    uint32_t time_µs;                           // Start time of the previous descriptor.
+} RecCodec;
+
+// A read position in a recording. Treat the members as private.
+typedef struct {
+    RecCodec codec;
+    uint8_t const *block;
+    uint16_t offset;                            // Into the block's coded data.
+    uint16_t nr_left;                           // Descriptors still to be read from the block.
+} RecCursor;
+
+// Class methods.
+void RecStore_startService(void);               // Finds the recordings in flash.
+void RecStore_getInfo(RecStoreInfo *);
+uint8_t RecStore_nrOfRecordings(void);
+
+// Writing a recording, from a stream of descriptors that are each preceded by their size.
+// Erasing a block takes tens of milliseconds, so hosts should await each append's response.
+bool RecStore_beginRecording(void);             // Abandons a recording that has not been ended.
+bool RecStore_append(uint8_t const *stream, uint16_t nb, RecErrType *);   // Failing abandons the recording.
+bool RecStore_endRecording(void);
+void RecStore_eraseAll(void);
+
+// Reading. A descriptor comes out in full, with its sequence number set to 0.
+bool RecStore_seek(RecCursor *, uint8_t recording_nr, uint32_t from_µs);
+uint8_t RecStore_read(RecCursor *, uint8_t descr[PT_DESCRIPTOR_MAX_SIZE]);    // Its size, or 0 at the end.
+
+#endif
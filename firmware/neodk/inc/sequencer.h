@@ -7,7 +7,7 @@
  *
  *  Created on: 27 Feb 2024
  *      Author: mark
- *   Copyright  2024, 2025 Neostim™
+ *   Copyright  2024..2026 Neostim™
  */
 
 #ifndef INC_SEQUENCER_H_
@@ -15,10 +15,23 @@
 
 #include <stdint.h>
 
+#include "lfo.h"
+
 typedef struct _Sequencer Sequencer;            // Opaque type.
 
 typedef enum { PS_UNKNOWN, PS_IDLE, PS_PAUSED, PS_PLAYING } PlayState;
 
+#define MAX_CROSSFADE_ms        20000
+
+typedef enum { TB_NEXT_BURST, TB_NEXT_REP, TB_NR_OF_BOUNDARIES } TransitionBoundary;
+
+// How a playing pattern switches to the next one. As it goes over the wire, little endian.
+typedef struct {
+    uint16_t crossfade_ms;                      // Fade out, switch, fade in. 0 to switch at once.
+    uint8_t  boundary;                          // A TransitionBoundary.
+    uint8_t  reserved;
+} TransitionSettings;
+
 // Class method.
 Sequencer *Sequencer_new(void);
 
@@ -30,10 +43,19 @@ bool Sequencer_handleEvent(Sequencer *);
 uint16_t Sequencer_getNrOfPatterns(Sequencer const *);
 void Sequencer_getPatternNames(Sequencer const *, char const *[], uint8_t);
 uint8_t Sequencer_getIntensityPercentage(Sequencer const *);
+char const *Sequencer_getPatternName(Sequencer const *);
+PlayState Sequencer_getPlayState(Sequencer const *);
+bool Sequencer_getPlayback(Sequencer const *, uint8_t *recording_nr);  // False if no recording is playing.
+void Sequencer_getModulation(Sequencer const *, LfoSettings [MT_NR_OF_TARGETS]);
+uint8_t Sequencer_getNrOfLayers(Sequencer const *);     // 0 if no layers are playing.
+void Sequencer_getProgress(Sequencer const *, uint32_t [2]);    // Of the pattern, elapsed and total [ms].
+void Sequencer_getTransition(Sequencer const *, TransitionSettings *);
+void Sequencer_getPtQueueBytesFree(Sequencer const *, uint16_t [2]);
 
 void Sequencer_notifyIntensity(Sequencer const *);
 void Sequencer_notifyPattern(Sequencer const *);
 void Sequencer_notifyPlayState(Sequencer const *);
+void Sequencer_notifyProgress(Sequencer *);
 void Sequencer_notifyPtQueue(Sequencer const *, uint16_t trans_id);
 
 void Sequencer_stop(Sequencer *);
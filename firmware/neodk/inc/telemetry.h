@@ -0,0 +1,39 @@
+/*
+ * telemetry.h -- Streams of ADC measurements, pulse metrics and pulse records, for subscribers.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#ifndef INC_TELEMETRY_H_
+#define INC_TELEMETRY_H_
+
+#include <stdint.h>
+
+#include "eventqueue.h"
+#include "app_timer.h"
+#include "bsp_app.h"
+
+#ifndef TELEMETRY_MAX_RATE_Hz
+#define TELEMETRY_MAX_RATE_Hz   100
+#endif
+
+// The sample timer posts its expiry events to the given queue, and so does the pulse capture
+// with its ET_PULSE_METRICS. The queue's owner must pass them on to the handlers below.
+void Telemetry_startService(EventQueue *, uint8_t timer_event_type);
+void Telemetry_stopService(void);
+void Telemetry_handleTimerEvent(AppTimer *);
+void Telemetry_handlePulseMetrics(PulseMetrics const *, uint16_t size);
+uint8_t Telemetry_setRate(uint8_t rate_Hz);     // 0 stops the stream. Returns the rate in effect.
+uint8_t Telemetry_getRate(void);
+bool Telemetry_capturePulses(bool);             // False if the mode cannot change now; try again between bursts.
+bool Telemetry_isCapturingPulses(void);
+void Telemetry_recordPulses(bool);
+bool Telemetry_isRecordingPulses(void);
+
+#endif
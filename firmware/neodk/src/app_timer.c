@@ -0,0 +1,249 @@
+/*
+ * app_timer.c -- Hierarchical timer wheel, driven by the BSP's tickless app timer.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include <stddef.h>
+
+#include "bsp_dbg.h"
+#include "bsp_mao.h"
+#include "bsp_app.h"
+
+// This module implements:
+#include "app_timer.h"
+
+/*
+ * Four levels of 32 slots, of 1 ms, 32 ms, 1.024 s and 32.768 s, cover about 17 minutes.
+ * Timers further out get parked in the last level-3 slot, and re-inserted from there.
+ * Slots are doubly linked lists, so arming and cancelling take constant time.
+ * The wheel only advances to ticks where a slot needs handling, as told by the occupancy masks.
+ */
+#define NR_OF_LEVELS        4
+#define BITS_PER_LEVEL      5
+#define SLOTS_PER_LEVEL     (1 << BITS_PER_LEVEL)
+#define MAX_INDEX_DIFF      (SLOTS_PER_LEVEL - 1)
+#define NOT_ARMED           0xff
+
+typedef struct {
+    AppTimer *slots[NR_OF_LEVELS][SLOTS_PER_LEVEL];
+    uint32_t occupied[NR_OF_LEVELS];            // Bit n is set if slot n is not empty.
+    uint32_t now_ms;                            // Ticks up to and including this one have been handled.
+    uint16_t nr_armed;
+} TimerWheel;
+
+
+static TimerWheel wheel ARENA(app_timer);
+
+
+static uint32_t millisecondsSinceBoot()
+{
+    return (uint32_t)(BSP_microsecondsSinceBoot() / 1000);
+}
+
+/**
+ * How many slots of the given level lie between now and the expiry time. Safe across wrap-around.
+ */
+static uint32_t indexDiff(uint32_t expiry_ms, uint32_t now_ms, uint8_t level)
+{
+    uint8_t const shift = BITS_PER_LEVEL * level;
+    return ((expiry_ms - now_ms) + (now_ms & ((1UL << shift) - 1))) >> shift;
+}
+
+
+static void insert(TimerWheel *w, AppTimer *t)
+{
+    uint8_t level = 0;
+    while (level < NR_OF_LEVELS - 1 && indexDiff(t->expiry_ms, w->now_ms, level) > MAX_INDEX_DIFF) {
+        level++;
+    }
+    uint8_t const shift = BITS_PER_LEVEL * level;
+    uint32_t index = t->expiry_ms >> shift;
+    if (indexDiff(t->expiry_ms, w->now_ms, level) > MAX_INDEX_DIFF) {
+        index = (w->now_ms >> shift) + MAX_INDEX_DIFF;  // Too far out; park it.
+    }
+    uint8_t const slot = index % SLOTS_PER_LEVEL;
+    AppTimer **head = &w->slots[level][slot];
+    t->prev = NULL;
+    if ((t->next = *head) != NULL) (*head)->prev = t;
+    *head = t;
+    w->occupied[level] |= 1UL << slot;
+    t->slot = level * SLOTS_PER_LEVEL + slot;
+}
+
+
+static void unlink(TimerWheel *w, AppTimer *t)
+{
+    uint8_t const level = t->slot / SLOTS_PER_LEVEL;
+    uint8_t const slot  = t->slot % SLOTS_PER_LEVEL;
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else if ((w->slots[level][slot] = t->next) == NULL) {
+        w->occupied[level] &= ~(1UL << slot);
+    }
+    if (t->next != NULL) t->next->prev = t->prev;
+    t->slot = NOT_ARMED;
+}
+
+/**
+ * The number of slots after the current one, until the first occupied one.
+ */
+static uint8_t slotsToNextOccupied(uint32_t occupied, uint32_t current_slot)
+{
+    uint8_t const rot = (current_slot + 1) % SLOTS_PER_LEVEL;
+    uint32_t const rotated = rot == 0 ? occupied : (occupied >> rot) | (occupied << (32 - rot));
+    return __builtin_ctz(rotated) + 1;
+}
+
+/**
+ * The first tick after now at which a slot must be expired or cascaded. False if there is none.
+ */
+static bool nextTickToHandle(TimerWheel const *w, uint32_t *tick)
+{
+    bool found = false;
+    for (uint8_t level = 0; level < NR_OF_LEVELS; level++) {
+        if (w->occupied[level] == 0) continue;
+        uint8_t const shift = BITS_PER_LEVEL * level;
+        uint32_t const now_index = w->now_ms >> shift;
+        uint32_t const t = (now_index + slotsToNextOccupied(w->occupied[level], now_index % SLOTS_PER_LEVEL)) << shift;
+        if (! found || (int32_t)(t - *tick) < 0) *tick = t;
+        found = true;
+    }
+    return found;
+}
+
+
+static void cascade(TimerWheel *w, uint32_t tick)
+{
+    for (uint8_t level = NR_OF_LEVELS - 1; level != 0; level--) {
+        uint8_t const shift = BITS_PER_LEVEL * level;
+        if ((tick & ((1UL << shift) - 1)) != 0) continue;
+        uint8_t const slot = (tick >> shift) % SLOTS_PER_LEVEL;
+        AppTimer *t = w->slots[level][slot];
+        w->slots[level][slot] = NULL;
+        w->occupied[level] &= ~(1UL << slot);
+        while (t != NULL) {
+            AppTimer *next = t->next;
+            insert(w, t);                       // Into a lower level, unless it was parked.
+            t = next;
+        }
+    }
+}
+
+
+static void expire(TimerWheel *w, uint32_t tick)
+{
+    uint8_t const slot = tick % SLOTS_PER_LEVEL;
+    AppTimer *t = w->slots[0][slot];
+    w->slots[0][slot] = NULL;
+    w->occupied[0] &= ~(1UL << slot);
+    while (t != NULL) {
+        AppTimer *next = t->next;
+        EventQueue_postEvent(t->event_queue, t->event_type, (uint8_t const *)&t, sizeof t);
+        if (t->period_ms != 0) {
+            t->expiry_ms += t->period_ms;
+            insert(w, t);
+        } else {
+            t->slot = NOT_ARMED;
+            w->nr_armed--;
+        }
+        t = next;
+    }
+}
+
+
+static void advance(TimerWheel *w, uint32_t now_ms)
+{
+    uint32_t tick;
+    while (nextTickToHandle(w, &tick) && (int32_t)(tick - now_ms) <= 0) {
+        w->now_ms = tick;
+        cascade(w, tick);
+        expire(w, tick);
+    }
+    // Nothing needs handling in between, so we can skip ahead.
+    if ((int32_t)(now_ms - w->now_ms) > 0) w->now_ms = now_ms;
+}
+
+
+static void scheduleHardwareTimer(TimerWheel const *w)
+{
+    uint32_t tick;
+    if (! nextTickToHandle(w, &tick)) return;
+
+    uint64_t const now_µs = BSP_microsecondsSinceBoot();
+    uint64_t const now_ms = now_µs / 1000;
+    int32_t const ms_to_go = (int32_t)(tick - (uint32_t)now_ms);
+    BSP_scheduleAppTimer(ms_to_go <= 0 ? now_µs : (now_ms + ms_to_go) * 1000);
+}
+
+
+static void onHardwareTimer(TimerWheel *w, uint64_t now_µs)
+{
+    advance(w, (uint32_t)(now_µs / 1000));
+    scheduleHardwareTimer(w);
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+void AppTimer_startService()
+{
+    wheel.now_ms = millisecondsSinceBoot();
+    // Tickless: the hardware timer only fires when the wheel needs attention.
+    BSP_registerAppTimerHandler((void (*)(void *, uint64_t))&onHardwareTimer, &wheel, 0);
+}
+
+
+void AppTimer_init(AppTimer *me, EventQueue *eq, uint8_t event_type)
+{
+    me->next = me->prev = NULL;
+    me->event_queue = eq;
+    me->expiry_ms = 0;
+    me->period_ms = 0;
+    me->event_type = event_type;
+    me->slot = NOT_ARMED;
+}
+
+
+void AppTimer_arm(AppTimer *me, uint32_t delay_ms, uint32_t period_ms)
+{
+    uint32_t const now_ms = millisecondsSinceBoot();
+    // The app timer interrupt is the only other user of the wheel.
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    if (me->slot != NOT_ARMED) {
+        unlink(&wheel, me);
+        wheel.nr_armed--;
+    }
+    if (wheel.nr_armed == 0) wheel.now_ms = now_ms;   // Do not make the wheel catch up for nothing.
+    me->expiry_ms = now_ms + delay_ms;
+    if ((int32_t)(me->expiry_ms - wheel.now_ms) <= 0) me->expiry_ms = wheel.now_ms + 1;
+    me->period_ms = period_ms;
+    insert(&wheel, me);
+    wheel.nr_armed++;
+    scheduleHardwareTimer(&wheel);
+    BSP_restoreInterrupts(im);
+}
+
+
+void AppTimer_cancel(AppTimer *me)
+{
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    if (me->slot != NOT_ARMED) {                // It may have expired in the meantime.
+        unlink(&wheel, me);
+        wheel.nr_armed--;
+    }
+    BSP_restoreInterrupts(im);
+}
+
+
+bool AppTimer_isArmed(AppTimer const *me)
+{
+    return me->slot != NOT_ARMED;
+}
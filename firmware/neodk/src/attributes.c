@@ -7,81 +7,256 @@
  *
  *  Created on: 15 Oct 2024
  *      Author: mark
- *   Copyright  2024, 2025 Neostim™
+ *   Copyright  2024..2026 Neostim™
  */
 
+#include <stddef.h>
+#include <string.h>
+
 #include "bsp_dbg.h"
 #include "convenience.h"
+#include "bsp_app.h"
 
 // This module implements:
 #include "attributes.h"
 
+#ifndef NR_OF_SUBSCRIPTIONS
+#define NR_OF_SUBSCRIPTIONS     16
+#endif
+
+// Values up to this size get cached, so reports can be coalesced.
+#ifndef ATTR_CACHE_SIZE
+#define ATTR_CACHE_SIZE         24
+#endif
+
+#define NO_SUB                  0xff
+#define SUB_ID_OFFSET           256
+
+enum { SF_IN_USE = 0x01, SF_ONE_SHOT = 0x02, SF_DIRTY = 0x04 };
 
 typedef struct {
-    AttributeId ai;                             // Key.
-    uint16_t times_left;
+    AppTimer timer;                             // For the min and max intervals.
     AttrNotifier notify;
     void *target;
+    uint32_t min_interval_ms;
+    uint32_t max_interval_ms;
+    uint32_t last_report_ms;
+    TransactionId trans_id;
+    AttributeId ai;
+    uint8_t next;                               // Next subscription to the same attribute.
+    uint8_t flags;
 } Subscription;
 
+typedef struct {
+    uint8_t first_sub;                          // Head of this attribute's list of subscriptions.
+    uint8_t enc;                                // Of the cached value.
+    uint8_t size;                               // Of the cached value, 0 if nothing cached.
+    uint8_t value[ATTR_CACHE_SIZE];
+} AttributeState;
+
+typedef struct {
+    Subscription subs[NR_OF_SUBSCRIPTIONS];
+    AttributeState attrs[AI_NR_OF_ATTRIBUTES];  // Indexed by attribute id.
+    EventQueue *timer_queue;
+    uint8_t timer_event_type;
+} SubscriptionEngine;
 
-static Subscription subscriptions[10];
-static uint8_t nr_of_subs = 0;
 
+static SubscriptionEngine engine ARENA(attributes);
 
-static Subscription *findSubForId(AttributeId ai)
+
+static uint32_t millisecondsSinceBoot()
 {
-    for (uint8_t i = 0; i < nr_of_subs; i++) {
-        Subscription *sub = &subscriptions[i];
-        if (ai == sub->ai) return sub;
-    }
+    return (uint32_t)(BSP_microsecondsSinceBoot() / 1000);
+}
+
+
+static uint8_t indexOf(SubscriptionEngine const *me, Subscription const *sub)
+{
+    return sub - me->subs;
+}
+
 
+// Only finds persistent subscriptions; each pending read has an entry of its own.
+static Subscription *findSub(SubscriptionEngine *me, AttributeId ai, AttrNotifier notify, void *target)
+{
+    for (uint8_t si = me->attrs[ai].first_sub; si != NO_SUB; si = me->subs[si].next) {
+        Subscription *sub = &me->subs[si];
+        if (sub->notify == notify && sub->target == target && ! (sub->flags & SF_ONE_SHOT)) return sub;
+    }
     return NULL;
 }
 
 
-static SubscriptionId setSubForId(AttributeId ai, AttrNotifier notify, void *target, uint16_t times)
+static Subscription *allocSub(SubscriptionEngine *me, AttributeId ai)
 {
-    Subscription *sub = findSubForId(ai);
-    if (sub == NULL) {                          // Not present, add it if there is room.
-        if (nr_of_subs == M_DIM(subscriptions)) return 0;
-        sub = &subscriptions[nr_of_subs++];
+    for (uint8_t si = 0; si < NR_OF_SUBSCRIPTIONS; si++) {
+        Subscription *sub = &me->subs[si];
+        if (sub->flags & SF_IN_USE) continue;
+        sub->flags = SF_IN_USE;
         sub->ai = ai;
+        sub->next = me->attrs[ai].first_sub;    // Prepend.
+        me->attrs[ai].first_sub = si;
+        return sub;
     }
+    return NULL;
+}
+
+
+static void freeSub(SubscriptionEngine *me, Subscription *sub)
+{
+    uint8_t *link = &me->attrs[sub->ai].first_sub;
+    while (*link != indexOf(me, sub)) link = &me->subs[*link].next;
+    *link = sub->next;
+    AppTimer_cancel(&sub->timer);
+    sub->flags = 0;
+}
+
+
+static SubscriptionId setSub(SubscriptionEngine *me, AttributeId ai, TransactionId trans_id, uint8_t flags,
+                             uint32_t min_interval_ms, uint32_t max_interval_ms, AttrNotifier notify, void *target)
+{
+    if (ai >= AI_NR_OF_ATTRIBUTES) return NO_SUB_ID;
+
+    // A subscriber renewing its subscription replaces the old one. A read never replaces anything.
+    Subscription *sub = (flags & SF_ONE_SHOT) ? NULL : findSub(me, ai, notify, target);
+    if (sub == NULL && (sub = allocSub(me, ai)) == NULL) return NO_SUB_ID;
+
+    sub->flags = SF_IN_USE | flags;
     sub->notify = notify;
     sub->target = target;
-    sub->times_left = times;
-    return 256 + (sub - subscriptions);
+    sub->trans_id = trans_id;
+    sub->min_interval_ms = min_interval_ms;
+    sub->max_interval_ms = max_interval_ms;
+    sub->last_report_ms = millisecondsSinceBoot() - min_interval_ms;
+    AppTimer_cancel(&sub->timer);
+    if (max_interval_ms != 0) AppTimer_arm(&sub->timer, max_interval_ms, 0);
+    return SUB_ID_OFFSET + indexOf(me, sub);
+}
+
+
+static void report(SubscriptionEngine *me, Subscription *sub, TransactionId trans_id, ElementEncoding enc, uint8_t const *data, uint16_t size)
+{
+    sub->flags &= ~SF_DIRTY;
+    sub->last_report_ms = millisecondsSinceBoot();
+    // Reports for a subscription carry the transaction id of the subscribe request.
+    sub->notify(sub->target, sub->ai, trans_id == NO_TRANS_ID ? sub->trans_id : trans_id, enc, data, size);
+    if (sub->flags & SF_ONE_SHOT) {
+        freeSub(me, sub);
+    } else if (sub->max_interval_ms != 0) {
+        AppTimer_arm(&sub->timer, sub->max_interval_ms, 0);
+    } else {
+        AppTimer_cancel(&sub->timer);
+    }
+}
+
+
+static void reportCachedValue(SubscriptionEngine *me, Subscription *sub)
+{
+    AttributeState const *as = &me->attrs[sub->ai];
+    if (as->size != 0) report(me, sub, NO_TRANS_ID, as->enc, as->value, as->size);
+}
+
+
+static void cacheValue(AttributeState *as, ElementEncoding enc, uint8_t const *data, uint16_t size)
+{
+    if (size > sizeof as->value) {
+        as->size = 0;                           // Too big to cache, so it cannot be coalesced.
+        return;
+    }
+    as->enc = enc;
+    as->size = size;
+    memcpy(as->value, data, size);
 }
 
 /*
  * Below are the functions implementing this module's interface.
  */
 
+void Attribute_startService(EventQueue *eq, uint8_t timer_event_type)
+{
+    engine.timer_queue = eq;
+    engine.timer_event_type = timer_event_type;
+    for (uint8_t ai = 0; ai < AI_NR_OF_ATTRIBUTES; ai++) {
+        engine.attrs[ai].first_sub = NO_SUB;
+        engine.attrs[ai].size = 0;
+    }
+    for (uint8_t si = 0; si < NR_OF_SUBSCRIPTIONS; si++) {
+        Subscription *sub = &engine.subs[si];
+        sub->flags = 0;
+        AppTimer_init(&sub->timer, eq, timer_event_type);
+    }
+}
+
+
+void Attribute_handleTimerEvent(AppTimer *timer)
+{
+    Subscription *sub = (Subscription *)((uint8_t *)timer - offsetof(Subscription, timer));
+    // Ignore events from timers that got cancelled or re-armed after they expired.
+    if (! (sub->flags & SF_IN_USE) || AppTimer_isArmed(timer)) return;
+
+    // Either the min interval has passed with a change pending, or the max interval with none.
+    reportCachedValue(&engine, sub);
+    if (! AppTimer_isArmed(timer) && sub->max_interval_ms != 0) {
+        AppTimer_arm(timer, sub->max_interval_ms, 0);
+    }
+}
+
+
 SubscriptionId Attribute_awaitRead(AttributeId ai, TransactionId trans_id, AttrNotifier notify, void *target)
 {
     // BSP_logf("%s for id=%hu\n", __func__, ai);
-    return setSubForId(ai, notify, target, 1);
+    return setSub(&engine, ai, trans_id, SF_ONE_SHOT, 0, 0, notify, target);
 }
 
 
 SubscriptionId Attribute_subscribe(AttributeId ai, TransactionId trans_id, AttrNotifier notify, void *target)
 {
     // BSP_logf("%s for id=%hu\n", __func__, ai);
-    return setSubForId(ai, notify, target, 0);
+    return setSub(&engine, ai, trans_id, 0, 0, 0, notify, target);
+}
+
+
+SubscriptionId Attribute_subscribeWithIntervals(AttributeId ai, TransactionId trans_id, uint32_t min_interval_ms, uint32_t max_interval_ms,
+                                                AttrNotifier notify, void *target)
+{
+    if (max_interval_ms != 0 && max_interval_ms < min_interval_ms) max_interval_ms = min_interval_ms;
+    return setSub(&engine, ai, trans_id, 0, min_interval_ms, max_interval_ms, notify, target);
+}
+
+
+void Attribute_unsubscribe(SubscriptionId sub_id)
+{
+    uint16_t const si = sub_id - SUB_ID_OFFSET;
+    if (si < NR_OF_SUBSCRIPTIONS && (engine.subs[si].flags & SF_IN_USE)) {
+        freeSub(&engine, &engine.subs[si]);
+    }
+}
+
+
+bool Attribute_isSubscribed(AttributeId ai)
+{
+    return ai < AI_NR_OF_ATTRIBUTES && engine.attrs[ai].first_sub != NO_SUB;
 }
 
 
 void Attribute_changed(AttributeId ai, TransactionId trans_id, ElementEncoding enc, uint8_t const *data, uint16_t size)
 {
-    Subscription *sub = findSubForId(ai);
-    if (sub == NULL) return;
+    if (ai >= AI_NR_OF_ATTRIBUTES) return;
 
-    sub->notify(sub->target, ai, trans_id, enc, data, size);
-    if (sub->times_left == 1) {                 // Subscription expired?
-        // BSP_logf("Cancelling subscription for id=%hu\n", sub->ai);
-        *sub = subscriptions[--nr_of_subs];     // Cancel it.
-    } else if (sub->times_left) {
-        sub->times_left -= 1;
+    AttributeState *as = &engine.attrs[ai];
+    cacheValue(as, enc, data, size);
+    uint32_t const now_ms = millisecondsSinceBoot();
+    uint8_t si = as->first_sub;
+    while (si != NO_SUB) {
+        Subscription *sub = &engine.subs[si];
+        si = sub->next;                         // The report may free this subscription.
+        // Answers to reads, values we cannot cache and subscribers that have waited long enough get it now.
+        if (trans_id != NO_TRANS_ID || as->size == 0 || now_ms - sub->last_report_ms >= sub->min_interval_ms) {
+            report(&engine, sub, trans_id, enc, data, size);
+        } else if (! (sub->flags & SF_DIRTY)) {
+            sub->flags |= SF_DIRTY;             // Coalesce: report the latest value when the min interval is up.
+            AppTimer_arm(&sub->timer, sub->last_report_ms + sub->min_interval_ms - now_ms, 0);
+        }
     }
 }
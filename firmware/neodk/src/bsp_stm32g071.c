@@ -10,12 +10,15 @@
  *   Copyright  2023..2026 Neostim™
  */
 
+#include <errno.h>
 #include <limits.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "stm32g0xx_hal_rcc.h"
 #include "stm32g0xx_hal_pwr.h"
 #include "stm32g0xx_ll_system.h"
+#include "stm32g0xx_ll_rcc.h"
 #include "stm32g0xx_ll_gpio.h"
 #include "stm32g0xx_ll_exti.h"
 #include "stm32g0xx_ll_tim.h"
@@ -25,6 +28,7 @@
 
 #include "bsp_dbg.h"
 #include "app_event.h"
+#include "bsp_comms.h"
 
 // This module implements:
 #include "bsp_mao.h"
@@ -61,13 +65,79 @@
 
 #define ALL_TRIACS_OFF          0x00
 
+// The triac enable signals are active low, so a switch that must conduct gets its pin reset.
+#define TRIAC_BSRR_BITS(pin, on)    ((on) ? (pin) << 16 : (pin))
+#define SWITCH_BSRR_WORD(pattern)   (TRIAC_BSRR_BITS(TRIAC_1_PIN, (pattern) & 1) \
+                                    | TRIAC_BSRR_BITS(TRIAC_2_PIN, (pattern) & 2) \
+                                    | TRIAC_BSRR_BITS(TRIAC_3_PIN, (pattern) & 4) \
+                                    | TRIAC_BSRR_BITS(TRIAC_4_PIN, (pattern) & 8))
+
+// Set to 1 to have DMA, rather than the sequencer clock ISR, write the switch word.
+// Not yet confirmed on hardware: the G0 maps GPIOB on the IOPORT bus, which DMA may not reach.
+#ifndef TRIAC_SWITCH_BY_DMA
+#define TRIAC_SWITCH_BY_DMA     0
+#endif
+
+#define DEFAULT_TRIAC_SETTLE_TIME_µs    40
+#define MIN_TRIAC_SETTLE_TIME_µs        10
+#define MAX_TRIAC_SETTLE_TIME_µs       500      // Well below PATTERN_START_TIME_µs.
+#define BURST_SCHEDULING_MARGIN_µs      20
+#define ADC_TRIGGER_DELAY_µs            10
+#define PULSE_TIMER_CCR_OFF             0xFFFF  // Beyond ARR, so the output stays inactive.
+#define DAC_SETTLE_TIME_µs              15      // Wake-up plus settling time of the buffered output.
+#define ADC_ENABLE_AFTER_CALIB_µs       1       // Way more than LL_ADC_DELAY_CALIB_ENABLE_ADC_CYCLES.
+#define NR_OF_ADC_RANKS                 3       // Iprim, Vcap, Vbat.
+#define CAPTURE_MIN_SPACING_µs          8       // One sequence of all ranks, at 16 MHz.
+#define PULSE_METRICS_PER_EVENT         8
+
+// Must be a power of 2.
+#ifndef PULSE_RECORDER_SIZE
+#define PULSE_RECORDER_SIZE             64
+#endif
+
+// The number of times the ADC samples each pulse, in capture mode.
+#ifndef CAPTURE_SAMPLES_PER_PULSE
+#define CAPTURE_SAMPLES_PER_PULSE       8
+#endif
+
+// Set to 1 to measure how long pulse timer interrupts wait before being serviced.
+#ifndef MEASURE_PULSE_IRQ_LATENCY
+#define MEASURE_PULSE_IRQ_LATENCY       0
+#endif
+
+// Set to 0 to only ever use SLEEP mode when idle, for comparison.
+#ifndef USE_STOP_MODE
+#define USE_STOP_MODE                   1
+#endif
+
+// Set to 1 to have BSP_maskInterrupts() disable all interrupts, for comparison.
+#ifndef USE_GLOBAL_CRITICAL_SECTIONS
+#define USE_GLOBAL_CRITICAL_SECTIONS    0
+#endif
+
 // #define ADC_TIMER_FREQ_Hz        100000UL
 #define SEQUENCER_CLOCK_FREQ_Hz 1000000UL
-#define PULSE_TIMER_FREQ_Hz     1000000UL
+#define BRING_UP_TIMER_FREQ_Hz  1000000UL
+#define PACE_TIMER_FREQ_Hz      1000000UL
 #define APP_TIMER_FREQ_Hz       2000000UL
 #define TICKS_PER_MICROSECOND   (APP_TIMER_FREQ_Hz / 1000000UL)
+#define LSE_FREQ_Hz             32768UL
+
+// Without a tick, the app timer compare still fires at least this often, as the counter is only 16 bits.
+#define MAX_APP_TIMER_STEP_TICKS    (16000 * TICKS_PER_MICROSECOND)
+#define MIN_APP_TIMER_STEP_TICKS    (5 * TICKS_PER_MICROSECOND)
+#define NO_APP_TIMER_DEADLINE       UINT64_MAX
+#define MAX_STOP_LSE_TICKS          60000       // About 1.83 s, well within the 16-bit low-power timer.
+#define MIN_STOP_LSE_TICKS          33          // About 1 ms; not worth stopping for less.
+#define STOP_WAKE_UP_LSE_TICKS      2           // Wake up early enough to restore the clocks.
 
 
+// The steps of the background bring-up of the DAC and ADC, in order.
+typedef enum {
+    BU_DAC_SETTLING, BU_ADC_CONFIGURING, BU_ADC_REGULATOR, BU_ADC_CALIBRATING,
+    BU_ADC_CAL_SETTLING, BU_ADC_ENABLING, BU_DONE
+} BringUpStep;
+
 typedef struct {
     // The following members get set only once.
     void (*app_timer_handler)(void *, uint64_t);
@@ -75,22 +145,56 @@ typedef struct {
     uint32_t clock_ticks_per_app_timer_tick;
     Selector button_sel;
     EventQueue *delegate;
+    EventQueue *readiness_delegate;
+    EventQueue *volatile capture_delegate;      // Gets the pulse metrics, when capturing.
     // The following members may get updated regularly.
+    uint8_t volatile bring_up_step;
+    uint8_t volatile ready_flags;               // Peripherals that finished their bring-up.
+    uint8_t volatile Vcap_wanted;
+    uint8_t volatile clock_speed;               // The requested ClockSpeed.
+    uint32_t ticks_per_µs;                      // Core clock cycles per µs, so the pulse path need not divide.
     uint8_t critical_section_level;
-    uint16_t volatile adc_1_samples[3];         // Must match the number of ADC1 ranks.
+    uint32_t irq_lines_from_level[4];           // Per level, the interrupt lines at or below it.
+    uint32_t volatile app_timer_wraps;
+    uint64_t timebase_offset_ticks;             // Time spent in STOP mode, when the app timer does not run.
+    uint64_t volatile app_deadline_ticks;       // When tickless.
+    uint32_t lse_remainder;                     // Fraction of an app timer tick, in 1/256ths.
+    uint32_t nr_of_stops;
+    uint64_t stopped_ticks;
+    uint16_t volatile max_pulse_irq_latency;    // [timer clock cycles].
+    uint32_t volatile nr_of_latency_samples;
+    uint16_t volatile adc_1_samples[NR_OF_ADC_RANKS];
+    // In capture mode, the DMA fills one half with a pulse's samples while the CPU reduces the other.
+    uint16_t volatile capture_samples[2][CAPTURE_SAMPLES_PER_PULSE][NR_OF_ADC_RANKS];
+    uint32_t volatile capture_spacing_ns;
+    uint16_t volatile captured_seqnr;           // Pulses captured in the current burst.
+    uint8_t  nr_of_metrics;
+    PulseMetrics metrics[PULSE_METRICS_PER_EVENT];
+    // Single producer (the pulse ISR), single consumer (the main loop), so no locking needed.
+    PulseRecord pulse_records[PULSE_RECORDER_SIZE];
+    uint16_t volatile rec_head;                 // Only written by the pulse ISR.
+    uint16_t volatile rec_tail;                 // Only written by the consumer.
+    uint16_t volatile rec_dropped;
+    uint16_t rec_seqnr;                         // Counts dropped pulses too, so gaps show.
+    PulseRecord rec_burst;                      // What all pulses of the current burst have in common.
+    bool volatile recording;
     uint16_t V_prim_mV;
     uint16_t volatile pulse_seqnr;
+    uint16_t volatile nr_of_pulses;
     Burst volatile next_burst;
     // Deltas next_deltas;
-    uint8_t volatile elcon_available;
+    uint32_t volatile switch_word;              // Source of the switch matrix DMA transfer.
+    uint32_t volatile busy_until_µs;            // End of the current burst, in sequencer clock time.
+    uint16_t triac_settle_µs;
+    uint8_t volatile switch_armed;
 } BSP;
 
 // The interrupt request priorities, from high to low.
 enum {  // STM32G0xx MCUs have 4 interrupt priority levels.
-    IRQ_PRIO_PULSE, IRQ_PRIO_SEQ_CLOCK = IRQ_PRIO_PULSE,
-    IRQ_PRIO_ADC_DMA, IRQ_PRIO_SYSTICK = IRQ_PRIO_ADC_DMA,
-    IRQ_PRIO_USART, IRQ_PRIO_APP_TIMER = IRQ_PRIO_USART,
-    IRQ_PRIO_ADC1, IRQ_PRIO_EXTI = IRQ_PRIO_ADC1
+    IRQ_PRIO_PULSE   = IRQL_PULSE,   IRQ_PRIO_SEQ_CLOCK = IRQ_PRIO_PULSE,
+    IRQ_PRIO_ADC_DMA = IRQL_ADC_DMA, IRQ_PRIO_SYSTICK = IRQ_PRIO_ADC_DMA,
+    IRQ_PRIO_USART   = IRQL_COMMS,   IRQ_PRIO_APP_TIMER = IRQ_PRIO_USART,
+    IRQ_PRIO_ADC1    = IRQL_BUTTON,  IRQ_PRIO_EXTI = IRQ_PRIO_ADC1
 };
 
 // Ensure the following three consts refer to the same timer.
@@ -98,6 +202,13 @@ static TIM_TypeDef *const pulse_timer = TIM1;   // Advanced 16-bit timer.
 static IRQn_Type const pulse_timer_upd_irq = TIM1_BRK_UP_TRG_COM_IRQn;
 static IRQn_Type const pulse_timer_cc_irq  = TIM1_CC_IRQn;
 
+// Ensure the following two consts refer to the same timer, which must be the pulse timer's ITR2.
+static TIM_TypeDef *const pace_timer  = TIM3;   // General purpose 16-bit timer.
+static IRQn_Type const pace_timer_irq = TIM3_IRQn;
+
+// Its ITR1 must be the pace timer's TRGO.
+static TIM_TypeDef *const capture_timer = TIM15;    // General purpose 16-bit timer, with repetition counter.
+
 // Ensure the following two consts refer to the same timer.
 static TIM_TypeDef *const seq_clock  = TIM2;    // General purpose 32-bit timer.
 static IRQn_Type const seq_clock_irq = TIM2_IRQn;
@@ -106,7 +217,27 @@ static IRQn_Type const seq_clock_irq = TIM2_IRQn;
 static TIM_TypeDef *const app_timer  = TIM17;   // General purpose 16-bit timer.
 static IRQn_Type const app_timer_irq = TIM17_IRQn;
 
-static BSP bsp = {0};
+// Ensure the following two consts refer to the same timer.
+static LPTIM_TypeDef *const wake_up_timer = LPTIM1; // Low-power 16-bit timer, clocked by the LSE.
+static IRQn_Type const wake_up_timer_irq  = TIM6_DAC_LPTIM1_IRQn;
+
+// Ensure the following two consts refer to the same timer.
+static TIM_TypeDef *const bring_up_timer  = TIM16;  // General purpose 16-bit timer.
+static IRQn_Type const bring_up_timer_irq = TIM16_IRQn;
+
+// BSRR words for all 16 switch matrix settings, so no ISR needs to compute them.
+static uint32_t const switch_words[16] = {
+    SWITCH_BSRR_WORD(0x0), SWITCH_BSRR_WORD(0x1), SWITCH_BSRR_WORD(0x2), SWITCH_BSRR_WORD(0x3),
+    SWITCH_BSRR_WORD(0x4), SWITCH_BSRR_WORD(0x5), SWITCH_BSRR_WORD(0x6), SWITCH_BSRR_WORD(0x7),
+    SWITCH_BSRR_WORD(0x8), SWITCH_BSRR_WORD(0x9), SWITCH_BSRR_WORD(0xa), SWITCH_BSRR_WORD(0xb),
+    SWITCH_BSRR_WORD(0xc), SWITCH_BSRR_WORD(0xd), SWITCH_BSRR_WORD(0xe), SWITCH_BSRR_WORD(0xf),
+};
+
+static BSP bsp = {
+    .clock_speed = CS_FULL_SPEED,               // As set up by SystemClock_Config().
+    .triac_settle_µs = DEFAULT_TRIAC_SETTLE_TIME_µs,
+    .app_deadline_ticks = NO_APP_TIMER_DEADLINE,
+};
 
 // Using a couple of functions from STM's infamous HAL.
 extern HAL_StatusTypeDef HAL_InitTick(uint32_t);
@@ -119,7 +250,9 @@ static void SystemClock_Config(void)
     PWR->CR1 |= PWR_CR1_DBP;
     while ((PWR->CR1 & PWR_CR1_DBP) == RESET) { /* Wait for write protection to be removed. */ }
     RCC->BDCR = RCC_BDCR_LSEON | RCC_BDCR_LSEDRV_0 | RCC_BDCR_RTCEN;
-    while ((RCC->BDCR & RCC_BDCR_LSERDY) == RESET) { /* Wait for LSE to stabilise. */ }
+    // A cold crystal can take seconds to stabilise, so do not wait for it here.
+    RCC->CICR = RCC_CICR_LSERDYC;
+    RCC->CIER |= RCC_CIER_LSERDYIE;
     // TODO Calibrate HSI using LSE and TIM16?
 
     RCC_OscInitTypeDef RCC_OscInitStruct = {
@@ -151,6 +284,10 @@ static void SystemClock_Config(void)
 
 static void enableInterruptWithPrio(IRQn_Type intr, int prio)
 {
+    // Keep track of the lines at each priority level, for selective masking.
+    for (int level = 0; level <= prio; level++) {
+        bsp.irq_lines_from_level[level] |= 1UL << intr;
+    }
     NVIC_ClearPendingIRQ(intr);
     NVIC_SetPriority(intr, prio);
     NVIC_EnableIRQ(intr);
@@ -233,39 +370,132 @@ static void initEXTI()
 static void initAppTimer()
 {
     app_timer->PSC = SystemCoreClock / APP_TIMER_FREQ_Hz - 1;
-    app_timer->CCR1 = BSP_millisecondsToTicks(100);
-    app_timer->DIER |= TIM_DIER_CC1IE;          // Interrupt on match with compare register.
-    app_timer->CR1 = TIM_CR1_CEN;               // Enable the counter.
+    app_timer->CR1 = TIM_CR1_URS;               // Only counter wraps set the update flag.
+    app_timer->EGR = TIM_EGR_UG;                // Load the prescaler.
+    app_timer->DIER |= TIM_DIER_UIE;            // Interrupt on wrap, to extend the time base.
+    app_timer->CR1 |= TIM_CR1_CEN;              // Enable the counter.
     enableInterruptWithPrio(app_timer_irq, IRQ_PRIO_APP_TIMER);
 }
 
 
+static void startAppTimerTicks(uint32_t clock_ticks_per_app_timer_tick)
+{
+    app_timer->CCR1 = app_timer->CNT + clock_ticks_per_app_timer_tick;
+    app_timer->SR = ~TIM_SR_CC1IF;
+    app_timer->DIER |= TIM_DIER_CC1IE;          // Interrupt on match with compare register.
+}
+
+
+static void initWakeUpTimer()
+{
+    RCC->APBENR1 |= RCC_APBENR1_LPTIM1EN;
+    LL_RCC_SetLPTIMClockSource(LL_RCC_LPTIM1_CLKSOURCE_LSE);
+    wake_up_timer->CFGR = 0;                    // Internal clock, no prescaler.
+    wake_up_timer->IER = LPTIM_IER_CMPMIE;      // Can only be written while disabled.
+    enableInterruptWithPrio(wake_up_timer_irq, IRQ_PRIO_APP_TIMER);
+}
+
+
+static void initBringUpTimer()
+{
+    bring_up_timer->PSC = SystemCoreClock / BRING_UP_TIMER_FREQ_Hz - 1;
+    bring_up_timer->CR1 = TIM_CR1_OPM | TIM_CR1_URS;
+    bring_up_timer->EGR = TIM_EGR_UG;           // Load the prescaler.
+    bring_up_timer->DIER = TIM_DIER_UIE;
+    enableInterruptWithPrio(bring_up_timer_irq, IRQ_PRIO_ADC1);
+}
+
+
+static void startBringUpTimer(uint16_t delay_µs)
+{
+    bring_up_timer->ARR = delay_µs;
+    bring_up_timer->CNT = 0;
+    bring_up_timer->CR1 |= TIM_CR1_CEN;
+}
+
+
 static void initSequencerClock()
 {
     seq_clock->PSC = SystemCoreClock / SEQUENCER_CLOCK_FREQ_Hz - 1;
+    seq_clock->CR1 = TIM_CR1_URS;
+    seq_clock->EGR = TIM_EGR_UG;                // Load the prescaler.
     seq_clock->CCMR1 |= TIM_CCMR1_OC1M_0;
     seq_clock->DIER |= TIM_DIER_CC1IE;          // Interrupt on match with compare register.
     enableInterruptWithPrio(seq_clock_irq, IRQ_PRIO_SEQ_CLOCK);
 }
 
 
+#if TRIAC_SWITCH_BY_DMA
+static void initDMAforSwitches(uint32_t volatile *switch_word)
+{
+    // Channel 2 copies the precomputed BSRR word to the triac port on each CC2 match of the sequencer clock.
+    LL_DMA_SetPeriphRequest(DMA1, LL_DMA_CHANNEL_2, LL_DMAMUX_REQ_TIM2_CH2);
+    LL_DMA_ConfigTransfer(DMA1, LL_DMA_CHANNEL_2, LL_DMA_DIRECTION_MEMORY_TO_PERIPH | LL_DMA_MODE_CIRCULAR
+                              | LL_DMA_PERIPH_NOINCREMENT | LL_DMA_MEMORY_NOINCREMENT
+                              | LL_DMA_PDATAALIGN_WORD | LL_DMA_MDATAALIGN_WORD
+                              | LL_DMA_PRIORITY_VERYHIGH);
+    LL_DMA_ConfigAddresses(DMA1, LL_DMA_CHANNEL_2, (uint32_t)switch_word,
+                            (uint32_t)&TRIAC_GPIO_PORT->BSRR, LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+    LL_DMA_SetDataLength(DMA1, LL_DMA_CHANNEL_2, 1);
+    LL_DMA_EnableChannel(DMA1, LL_DMA_CHANNEL_2);
+}
+#endif
+
+
+/**
+ * The pulse timer runs at the full timer clock and produces exactly one pulse per trigger,
+ * so pulse widths get sub-¼ µs resolution regardless of the pace.
+ */
 static void initPulseTimer()
 {
-    pulse_timer->PSC = SystemCoreClock / PULSE_TIMER_FREQ_Hz - 1;
-    // PWM mode 1 for channels 1 and 2, enable preload.
-    pulse_timer->CCMR1 = TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1PE
-                       | TIM_CCMR1_OC2M_2 | TIM_CCMR1_OC2M_1 | TIM_CCMR1_OC2PE;
+    pulse_timer->PSC = 0;
+    // PWM mode 2 for channels 1 and 2: the output is active from CCRx up to and including ARR.
+    pulse_timer->CCMR1 = TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1M_0
+                       | TIM_CCMR1_OC2M_2 | TIM_CCMR1_OC2M_1 | TIM_CCMR1_OC2M_0;
     // PWM mode 2 for channel 4, which is used to trigger the ADC.
-    pulse_timer->CCMR2 = TIM_CCMR2_OC4M_2 | TIM_CCMR2_OC4M_1 | TIM_CCMR2_OC4M_0 | TIM_CCMR2_OC4PE;
+    pulse_timer->CCMR2 = TIM_CCMR2_OC4M_2 | TIM_CCMR2_OC4M_1 | TIM_CCMR2_OC4M_0;
+    pulse_timer->CCR1 = PULSE_TIMER_CCR_OFF;
+    pulse_timer->CCR2 = PULSE_TIMER_CCR_OFF;
+    pulse_timer->CCR4 = PULSE_TIMER_CCR_OFF;
     // Enable the outputs.
     pulse_timer->CCER = TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC4E;
-    pulse_timer->CR1  = TIM_CR1_ARPE | TIM_CR1_URS;
-    pulse_timer->DIER = TIM_DIER_UIE;           // Enable update interrupt.
+    pulse_timer->SMCR = TIM_SMCR_TS_1;          // Trigger input is ITR2, the pace timer's TRGO.
+    pulse_timer->CR1  = TIM_CR1_OPM | TIM_CR1_URS;
+    pulse_timer->DIER = TIM_DIER_UIE;           // Interrupt at the end of each pulse.
     pulse_timer->BDTR = TIM_BDTR_MOE;
     enableInterruptWithPrio(pulse_timer_upd_irq, IRQ_PRIO_PULSE);
     enableInterruptWithPrio(pulse_timer_cc_irq,  IRQ_PRIO_PULSE);
 }
 
+/**
+ * In capture mode, the capture timer triggers the ADC several times per pulse. Like the pulse timer,
+ * it gets started by the pace timer, and it stops by itself once its repetition counter runs out.
+ */
+static void initCaptureTimer()
+{
+    capture_timer->PSC = 0;
+    // PWM mode 2 for channel 1: OC1REF rises halfway each period, so the samples are centred in their slots.
+    capture_timer->CCMR1 = TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1M_0;
+    capture_timer->CR2  = TIM_CR2_MMS_2;        // OC1REF is TRGO, which triggers the ADC.
+    capture_timer->RCR  = CAPTURE_SAMPLES_PER_PULSE - 1;
+    capture_timer->SMCR = TIM_SMCR_TS_0;        // Trigger input is ITR1, the pace timer's TRGO.
+    capture_timer->CR1  = TIM_CR1_OPM | TIM_CR1_URS;
+    capture_timer->EGR  = TIM_EGR_UG;           // Load the repetition counter.
+}
+
+/**
+ * The pace timer ticks at 1 MHz, so any pace up to MAX_PULSE_PACE_µs fits its 16-bit ARR.
+ * Each of its update events triggers one pulse.
+ */
+static void initPaceTimer()
+{
+    pace_timer->PSC = SystemCoreClock / PACE_TIMER_FREQ_Hz - 1;
+    pace_timer->CR2 = TIM_CR2_MMS_1;            // Update event is TRGO.
+    pace_timer->CR1 = TIM_CR1_URS;
+    pace_timer->EGR = TIM_EGR_UG;               // Load the prescaler.
+    enableInterruptWithPrio(pace_timer_irq, IRQ_PRIO_PULSE);
+}
+
 
 static void initDAC()
 {
@@ -277,13 +507,14 @@ static void initDAC()
         .OutputMode = LL_DAC_OUTPUT_MODE_NORMAL
     };
     LL_DAC_Init(DAC1, LL_DAC_CHANNEL_2, &DAC_InitStruct);
-    // TODO Wait for the DAC to settle?
-    LL_DAC_Enable(DAC1, LL_DAC_CHANNEL_2);
+    LL_DAC_Enable(DAC1, LL_DAC_CHANNEL_2);      // The bring-up timer lets it settle.
     // LL_DAC_EnableTrigger(DAC1, LL_DAC_CHANNEL_2);
 }
 
-
-static void initADC1()
+/**
+ * The ADC bring-up steps are driven by the ADC and bring-up timer interrupts.
+ */
+static void startADC1Configuration()
 {
     LL_ADC_InitTypeDef gis = {
         // .Clock = LL_ADC_CLOCK_SYNC_PCLK_DIV4,
@@ -292,10 +523,15 @@ static void initADC1()
         .LowPowerMode  = LL_ADC_LP_MODE_NONE,
     };
     LL_ADC_Init(ADC1, &gis);
+    ADC1->ISR = ADC_ISR_CCRDY;
+    ADC1->IER = ADC_IER_CCRDYIE | ADC_IER_EOCALIE | ADC_IER_ADRDYIE | ADC_IER_OVRIE;
+    enableInterruptWithPrio(ADC1_COMP_IRQn, IRQ_PRIO_ADC1);
     LL_ADC_REG_SetSequencerConfigurable(ADC1, LL_ADC_REG_SEQ_CONFIGURABLE);
-    while (LL_ADC_IsActiveFlag_CCRDY(ADC1) == 0) { /* Wait. */ }
-    LL_ADC_ClearFlag_CCRDY(ADC1);
+}
+
 
+static void configureADC1()
+{
     LL_ADC_SetSamplingTimeCommonChannels(ADC1, LL_ADC_SAMPLINGTIME_COMMON_1, LL_ADC_SAMPLINGTIME_7CYCLES_5);
     LL_ADC_SetSamplingTimeCommonChannels(ADC1, LL_ADC_SAMPLINGTIME_COMMON_2, LL_ADC_SAMPLINGTIME_39CYCLES_5);
 
@@ -309,20 +545,8 @@ static void initADC1()
     LL_ADC_REG_SetSequencerRanks(ADC1, LL_ADC_REG_RANK_3, LL_ADC_CHANNEL_6);
     LL_ADC_SetChannelSamplingTime(ADC1, LL_ADC_CHANNEL_6, LL_ADC_SAMPLINGTIME_COMMON_2);
 
-    LL_ADC_EnableInternalRegulator(ADC1);
-    uint32_t volatile wli = LL_ADC_DELAY_INTERNAL_REGUL_STAB_US * (SystemCoreClock / 1000000);
-    while (wli != 0) wli--;
-
-    LL_ADC_StartCalibration(ADC1);
-    while (LL_ADC_IsCalibrationOnGoing(ADC1)) { /* Wait. */ }
-    ADC1->ISR = ADC_ISR_EOCAL;
-    wli = LL_ADC_DELAY_CALIB_ENABLE_ADC_CYCLES * 16;
-    while (wli != 0) wli--;
-
     // ADC->CCR |= ADC_CCR_VREFEN | ADC_CCR_TSEN;
     ADC1->CFGR2 |= ADC_CFGR2_LFTRIG;
-    ADC1->IER = ADC_IER_ADRDYIE | ADC_IER_OVRIE;
-    enableInterruptWithPrio(ADC1_COMP_IRQn, IRQ_PRIO_ADC1);
 
     LL_ADC_REG_InitTypeDef ris = {
         .SequencerLength  = LL_ADC_REG_SEQ_SCAN_ENABLE_3RANKS,
@@ -359,6 +583,104 @@ static void initDMAforADC1(uint16_t volatile samples[], size_t nr_of_samples)
 }
 
 
+/**
+ * Only to be called while no conversions are being triggered.
+ */
+static void selectAdcTrigger(BSP *me, bool capture)
+{
+    LL_ADC_REG_StopConversion(ADC1);
+    while (LL_ADC_REG_IsConversionOngoing(ADC1)) {}
+    LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_1);
+    if (capture) {
+        LL_DMA_SetMemoryAddress(DMA1, LL_DMA_CHANNEL_1, (uint32_t)me->capture_samples);
+        LL_DMA_SetDataLength(DMA1, LL_DMA_CHANNEL_1, sizeof me->capture_samples / sizeof(uint16_t));
+        LL_DMA_EnableIT_HT(DMA1, LL_DMA_CHANNEL_1);
+        LL_ADC_REG_SetTriggerSource(ADC1, LL_ADC_REG_TRIG_EXT_TIM15_TRGO);
+    } else {
+        LL_DMA_SetMemoryAddress(DMA1, LL_DMA_CHANNEL_1, (uint32_t)me->adc_1_samples);
+        LL_DMA_SetDataLength(DMA1, LL_DMA_CHANNEL_1, M_DIM(me->adc_1_samples));
+        LL_DMA_DisableIT_HT(DMA1, LL_DMA_CHANNEL_1);
+        LL_ADC_REG_SetTriggerSource(ADC1, LL_ADC_REG_TRIG_EXT_TIM1_CH4);
+    }
+    DMA1->IFCR = DMA_IFCR_CGIF1;                // Clear all channel 1 interrupt flags.
+    LL_DMA_EnableChannel(DMA1, LL_DMA_CHANNEL_1);
+    LL_ADC_REG_StartConversion(ADC1);
+}
+
+/**
+ * Convert all ranks once, right now, then hand the ADC back to the pulse timer.
+ * Only to be called while no conversions are being triggered. Takes a few microseconds.
+ */
+static void convertOnce(void)
+{
+    LL_ADC_REG_StopConversion(ADC1);
+    while (LL_ADC_REG_IsConversionOngoing(ADC1)) {}
+    LL_ADC_REG_SetTriggerSource(ADC1, LL_ADC_REG_TRIG_SOFTWARE);
+    ADC1->ISR = ADC_ISR_EOS;                    // Clear.
+    LL_ADC_REG_StartConversion(ADC1);
+    while (! (ADC1->ISR & ADC_ISR_EOS)) {}      // The DMA moves each result as it comes in.
+    ADC1->ISR = ADC_ISR_EOS;
+    LL_ADC_REG_SetTriggerSource(ADC1, LL_ADC_REG_TRIG_EXT_TIM1_CH4);
+    LL_ADC_REG_StartConversion(ADC1);
+}
+
+/**
+ * Spread the samples evenly across the pulse, but make sure they are all in before the next pulse starts.
+ * If they cannot be, capture nothing: a partial set would make the DMA halves lose step with the pulses.
+ */
+RAMFUNC static void armCaptureTimer(BSP *me, uint32_t width_ticks, uint16_t pace_µs)
+{
+    // The divisions below call libgcc in flash, but only when capturing.
+    uint32_t const ticks_per_µs = me->ticks_per_µs;
+    uint32_t const min_spacing = CAPTURE_MIN_SPACING_µs * ticks_per_µs;
+    uint32_t const max_spacing = (pace_µs * ticks_per_µs) / (CAPTURE_SAMPLES_PER_PULSE + 1);
+    uint32_t spacing = width_ticks / CAPTURE_SAMPLES_PER_PULSE;
+    if (spacing < min_spacing) spacing = min_spacing;
+    if (spacing > 0x10000) spacing = 0x10000;
+    capture_timer->CR1 &= ~TIM_CR1_CEN;
+    capture_timer->SMCR &= ~TIM_SMCR_SMS;
+    if (spacing > max_spacing) return;
+
+    capture_timer->CNT  = 0;
+    capture_timer->ARR  = spacing - 1;
+    capture_timer->CCR1 = spacing / 2;
+    capture_timer->SMCR |= TIM_SMCR_SMS_2 | TIM_SMCR_SMS_1;   // Trigger mode: each pace period starts a capture.
+    me->capture_spacing_ns = spacing * 1000 / ticks_per_µs;
+    me->captured_seqnr = 0;
+}
+
+/**
+ * Boil a pulse's worth of samples down to its peak current, charge and energy. As this runs
+ * in the DMA interrupt for every pulse, it only sums raw samples, and scales the sums once.
+ */
+static void reducePulse(BSP *me, uint16_t volatile const samples[][NR_OF_ADC_RANKS])
+{
+    uint32_t peak = 0, sum_I = 0, sum_VI = 0;
+    for (uint8_t i = 0; i < CAPTURE_SAMPLES_PER_PULSE; i++) {
+        uint32_t const I = samples[i][0], V = samples[i][1];
+        if (I > peak) peak = I;
+        sum_I  += I;
+        sum_VI += I * V;
+    }
+    // The DMA no longer writes adc_1_samples, so keep the voltage readings current from here.
+    for (uint8_t r = 0; r < NR_OF_ADC_RANKS; r++) {
+        me->adc_1_samples[r] = samples[CAPTURE_SAMPLES_PER_PULSE - 1][r];
+    }
+    if (me->capture_delegate == NULL) return;
+
+    // Same scaling as in BSP_getAdcValues(). mA times µs is nC, and µW times ns is fJ.
+    PulseMetrics *pm = &me->metrics[me->nr_of_metrics++];
+    pm->pulse_seqnr = me->captured_seqnr++;
+    pm->peak_mA   = (peak * 2063UL) / 1024;
+    pm->charge_nC = (uint32_t)(((((uint64_t)sum_I * 2063UL) >> 10) * me->capture_spacing_ns) / 1000);
+    pm->energy_nJ = (uint32_t)(((((uint64_t)sum_VI * 2063UL * 52813UL) >> 24) * me->capture_spacing_ns) / 1000000);
+    if (me->nr_of_metrics == M_DIM(me->metrics) || me->captured_seqnr == me->nr_of_pulses) {
+        EventQueue_postEvent(me->capture_delegate, ET_PULSE_METRICS, (uint8_t const *)me->metrics, me->nr_of_metrics * sizeof(PulseMetrics));
+        me->nr_of_metrics = 0;
+    }
+}
+
+
 static void setPinVal(GPIO_TypeDef *GPIOx, uint16_t gpio_pin, uint8_t pin_state)
 {
     if (pin_state != 0) {
@@ -373,38 +695,217 @@ static void setSwitches(uint16_t pattern)
 {
     // Turn on the LED if at least one triac will be activated.
     setPinVal(LED_GPIO_PORT, LED_1_PIN, pattern);
-
-    // The triac enable signals are active low.
-    TRIAC_GPIO_PORT->BSRR
-        = (pattern & 1 ? TRIAC_1_PIN << 16 : TRIAC_1_PIN)
-        | (pattern & 2 ? TRIAC_2_PIN << 16 : TRIAC_2_PIN)
-        | (pattern & 4 ? TRIAC_3_PIN << 16 : TRIAC_3_PIN)
-        | (pattern & 8 ? TRIAC_4_PIN << 16 : TRIAC_4_PIN);
+    TRIAC_GPIO_PORT->BSRR = switch_words[pattern & 0xf];
 }
 
 
 static void disableOutputStage()
 {
+    pace_timer->CR1 &= ~TIM_CR1_CEN;
     pulse_timer->CCER &= ~(TIM_CCER_CC1E | TIM_CCER_CC2E);
     LL_GPIO_ResetOutputPin(BUCK_GPIO_PORT, BUCK_ENABLE_PIN);
     LL_GPIO_SetOutputPin(TRIAC_GPIO_PORT, ALL_TRIAC_PINS);
 }
 
 
+/**
+ * Lock-free, so it may be called at any interrupt priority, including from the pulse ISRs.
+ * Only the app timer ISR counts wraps; readers retry if it did so while they were reading.
+ */
 static uint64_t ticksSinceBoot()
 {
-    static uint16_t ticks_since_boot[] = { 0, 0, 0, 0 };
+    uint32_t wraps;
+    uint16_t ticks;
+    bool wrap_pending;
+    do {
+        wraps = bsp.app_timer_wraps;
+        ticks = app_timer->CNT;
+        wrap_pending = (app_timer->SR & TIM_SR_UIF) != 0;
+    } while (wraps != bsp.app_timer_wraps);
+    // A wrap the ISR has not counted yet, because the caller runs at a higher priority or with interrupts masked.
+    if (wrap_pending && ticks < 0x8000) wraps += 1;
+    // The offset only changes with all interrupts disabled.
+    return (((uint64_t)wraps << 16) | ticks) + bsp.timebase_offset_ticks;
+}
+
+
+static bool isTickless(BSP const *me)
+{
+    return me->clock_ticks_per_app_timer_tick == 0;
+}
+
+/**
+ * Without a tick, have the app timer interrupt at the deadline, or on the way there.
+ */
+static void armAppTimerCompare(BSP *me)
+{
+    if (me->app_deadline_ticks == NO_APP_TIMER_DEADLINE) {
+        app_timer->DIER &= ~TIM_DIER_CC1IE;
+        return;
+    }
+
+    int64_t const ticks_to_go = (int64_t)(me->app_deadline_ticks - ticksSinceBoot());
+    uint32_t step = MAX_APP_TIMER_STEP_TICKS;
+    if (ticks_to_go < MIN_APP_TIMER_STEP_TICKS) {
+        step = MIN_APP_TIMER_STEP_TICKS;
+    } else if (ticks_to_go < MAX_APP_TIMER_STEP_TICKS) {
+        step = (uint32_t)ticks_to_go;
+    }
+    app_timer->CCR1 = app_timer->CNT + step;
+    app_timer->SR = ~TIM_SR_CC1IF;
+    app_timer->DIER |= TIM_DIER_CC1IE;
+}
+
+
+static void onAppTimerCompare(BSP *me)
+{
+    if (! isTickless(me)) {
+        me->app_timer_handler(me->app_timer_target, BSP_microsecondsSinceBoot());
+        app_timer->CCR1 += me->clock_ticks_per_app_timer_tick;
+        return;
+    }
+
+    if ((int64_t)(ticksSinceBoot() - me->app_deadline_ticks) >= 0) {
+        me->app_deadline_ticks = NO_APP_TIMER_DEADLINE;
+        me->app_timer_handler(me->app_timer_target, BSP_microsecondsSinceBoot());
+    }
+    armAppTimerCompare(me);
+}
+
+/**
+ * STOP mode halts all high-speed clocks, so only allow it when nothing is in
+ * progress that needs them. Returns the number of LSE ticks we may stop for.
+ */
+static uint32_t stopModeAllowance(BSP const *me)
+{
+    if (! USE_STOP_MODE || ! isTickless(me) || me->app_timer_handler == NULL) return 0;
+    if ((me->ready_flags & PR_LSE) == 0 || me->bring_up_step != BU_DONE) return 0;
+    if ((seq_clock->CR1 & TIM_CR1_CEN) || (pace_timer->CR1 & TIM_CR1_CEN)) return 0;
+    if (me->pulse_seqnr != me->nr_of_pulses || ! BSP_commsMayStop()) return 0;
+    // STOP mode turns off the PLL, so only stop while running off HSI16, which we also wake up on.
+    if (me->clock_speed != CS_LOW_POWER || LL_RCC_PLL_IsReady()) return 0;
+
+    if (me->app_deadline_ticks == NO_APP_TIMER_DEADLINE) return MAX_STOP_LSE_TICKS;
+    int64_t const ticks_to_go = (int64_t)(me->app_deadline_ticks - ticksSinceBoot());
+    if (ticks_to_go <= 0) return 0;
+    uint64_t const lse_ticks = ((uint64_t)ticks_to_go * LSE_FREQ_Hz) / APP_TIMER_FREQ_Hz;
+    if (lse_ticks < MIN_STOP_LSE_TICKS + STOP_WAKE_UP_LSE_TICKS) return 0;
+    if (lse_ticks > MAX_STOP_LSE_TICKS) return MAX_STOP_LSE_TICKS;
+    return (uint32_t)lse_ticks - STOP_WAKE_UP_LSE_TICKS;
+}
+
+
+static void startWakeUpTimer(uint16_t lse_ticks)
+{
+    wake_up_timer->CR = 0;                      // Also resets the counter.
+    wake_up_timer->CR = LPTIM_CR_ENABLE;
+    wake_up_timer->ICR = LPTIM_ICR_CMPMCF | LPTIM_ICR_ARRMCF | LPTIM_ICR_CMPOKCF | LPTIM_ICR_ARROKCF;
+    wake_up_timer->ARR = 0xFFFF;
+    while ((wake_up_timer->ISR & LPTIM_ISR_ARROK) == 0) { /* Wait for the LSE domain. */ }
+    wake_up_timer->CMP = lse_ticks;
+    while ((wake_up_timer->ISR & LPTIM_ISR_CMPOK) == 0) { /* Wait for the LSE domain. */ }
+    wake_up_timer->ICR = LPTIM_ICR_CMPOKCF | LPTIM_ICR_ARROKCF;
+    wake_up_timer->CR |= LPTIM_CR_CNTSTRT;
+}
+
+
+static uint16_t stopWakeUpTimer()
+{
+    // The counter runs asynchronously, so read it until two consecutive values agree.
+    uint16_t lse_ticks;
+    do {
+        lse_ticks = wake_up_timer->CNT;
+    } while (lse_ticks != wake_up_timer->CNT);
+    wake_up_timer->CR = 0;
+    return lse_ticks;
+}
+
 
-    BSP_criticalSectionEnter();                 // Protect our static var.
-    uint16_t last_ticks = ticks_since_boot[0];  // Assuming little-Endian.
-    if ((ticks_since_boot[0] = app_timer->CNT) < last_ticks) {
-        // The 16-bit timer wrapped; increment the second 16-bit word.
-        if (++ticks_since_boot[1] == 0) {       // We have a 32-bit wrap too.
-            *(uint32_t *)&ticks_since_boot[2] += 1;
+static bool isRunningOnPLL()
+{
+    return LL_RCC_GetSysClkSource() == LL_RCC_SYS_CLKSOURCE_STATUS_PLL;
+}
+
+
+static bool isBurstInProgress(BSP const *me)
+{
+    return (pace_timer->CR1 & TIM_CR1_CEN) || (pulse_timer->CR1 & TIM_CR1_CEN) || me->pulse_seqnr != me->nr_of_pulses;
+}
+
+/**
+ * Re-derive a timer's prescaler from the new core clock, keeping its count.
+ * At most one timer tick gets lost, as the prescaler counter restarts.
+ */
+static void rescaleTimer(TIM_TypeDef *tim, uint32_t timer_freq_Hz)
+{
+    uint32_t const cnt = tim->CNT;
+    tim->PSC = SystemCoreClock / timer_freq_Hz - 1;
+    tim->CR1 |= TIM_CR1_URS;                    // The forced update must not look like a wrap.
+    tim->EGR = TIM_EGR_UG;                      // Load the new prescaler right away.
+    tim->CNT = cnt;
+}
+
+/**
+ * Must be called with interrupts disabled. The pulse timer needs no rescaling,
+ * as BSP_startBurst() derives its settings from ticks_per_µs for each burst.
+ * The UART and the ADC run off HSI16, regardless of the core clock.
+ */
+static void switchSystemClock(uint32_t sysclk_source, uint32_t flash_latency)
+{
+    if (flash_latency > LL_FLASH_GetLatency()) {
+        LL_FLASH_SetLatency(flash_latency);     // Slow down flash before speeding up.
+        while (LL_FLASH_GetLatency() != flash_latency) { /* Wait. */ }
+    }
+    LL_RCC_SetSysClkSource(sysclk_source);
+    while (LL_RCC_GetSysClkSource() != (sysclk_source << RCC_CFGR_SWS_Pos)) { /* Wait. */ }
+    if (flash_latency < LL_FLASH_GetLatency()) {
+        LL_FLASH_SetLatency(flash_latency);
+    }
+    SystemCoreClockUpdate();
+    bsp.ticks_per_µs = SystemCoreClock / 1000000UL;
+    rescaleTimer(app_timer, APP_TIMER_FREQ_Hz);
+    rescaleTimer(seq_clock, SEQUENCER_CLOCK_FREQ_Hz);
+    rescaleTimer(pace_timer, PACE_TIMER_FREQ_Hz);
+    rescaleTimer(bring_up_timer, BRING_UP_TIMER_FREQ_Hz);
+    HAL_InitTick(IRQ_PRIO_SYSTICK);
+}
+
+/**
+ * Must be called with interrupts disabled. Makes the core clock match the requested speed,
+ * if that can be done now. Never in the middle of a burst, nor at low speed while streaming.
+ */
+static void applyClockSpeed(BSP *me)
+{
+    if (isBurstInProgress(me)) return;
+
+    if (me->clock_speed == CS_FULL_SPEED) {
+        if (! isRunningOnPLL() && LL_RCC_PLL_IsReady()) {
+            switchSystemClock(LL_RCC_SYS_CLKSOURCE_PLL, LL_FLASH_LATENCY_2);
         }
+    } else if (isRunningOnPLL() && (seq_clock->CR1 & TIM_CR1_CEN) == 0) {
+        switchSystemClock(LL_RCC_SYS_CLKSOURCE_HSI, LL_FLASH_LATENCY_0);
+        LL_RCC_PLL_Disable();
     }
-    BSP_criticalSectionExit();
-    return *(uint64_t *)ticks_since_boot;
+}
+
+/**
+ * Must be called with interrupts disabled. The app timer does not run in STOP mode, so it is
+ * halted for the duration and the time base gets advanced by what the low-power timer measured.
+ */
+static void enterStopMode(BSP *me, uint16_t lse_ticks)
+{
+    app_timer->CR1 &= ~TIM_CR1_CEN;
+    startWakeUpTimer(lse_ticks);
+    HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+    // 1 LSE tick is 15625/256 app timer ticks at 2 MHz. Carry the fraction, so no time gets lost.
+    uint32_t const scaled = stopWakeUpTimer() * (APP_TIMER_FREQ_Hz / 128UL) + me->lse_remainder;
+    app_timer->CR1 |= TIM_CR1_CEN;
+    uint32_t const slept_ticks = scaled / (LSE_FREQ_Hz / 128UL);
+    me->lse_remainder = scaled % (LSE_FREQ_Hz / 128UL);
+    me->timebase_offset_ticks += slept_ticks;
+    me->stopped_ticks += slept_ticks;
+    me->nr_of_stops += 1;
+    armAppTimerCompare(me);
 }
 
 /**
@@ -414,7 +915,7 @@ static uint64_t ticksSinceBoot()
 #define VPRIM_MIN_mV     1202   //  1202 for Tokmas buck chip, 1064 for SGM 61410.
 #define VPRIM_MAX_mV    10195   // 10195 for Tokmas, 10057 for SGM.
 
-static uint16_t Vcap_mV_ToDacVal(uint16_t Vcap_mV)
+RAMFUNC static uint16_t Vcap_mV_ToDacVal(uint16_t Vcap_mV)
 {
     if (Vcap_mV < VPRIM_MIN_mV) Vcap_mV = VPRIM_MIN_mV;
     else if (Vcap_mV > VPRIM_MAX_mV) Vcap_mV = VPRIM_MAX_mV;
@@ -422,7 +923,69 @@ static uint16_t Vcap_mV_ToDacVal(uint16_t Vcap_mV)
 }
 
 
-static void setPrimaryVoltage_mV(uint16_t mV)
+static void switchPrimaryVoltage(bool must_be_on)
+{
+    if ((BUCK_GPIO_PORT->ODR & BUCK_ENABLE_PIN) == 0) {
+        if (must_be_on) {
+            BSP_logf("Turning Vcap ON\n");
+            LL_GPIO_SetOutputPin(BUCK_GPIO_PORT, BUCK_ENABLE_PIN);
+        }
+    } else {
+        if (! must_be_on) {
+            BSP_logf("Turning Vcap OFF\n");
+            LL_GPIO_ResetOutputPin(BUCK_GPIO_PORT, BUCK_ENABLE_PIN);
+        }
+    }
+}
+
+
+static void signalReady(BSP *me, uint8_t peripherals)
+{
+    me->ready_flags |= peripherals;
+    if (me->readiness_delegate != NULL) {
+        EventQueue_postEvent(me->readiness_delegate, ET_PERIPHERAL_READY, &peripherals, sizeof peripherals);
+    }
+}
+
+/**
+ * Called from the interrupts that end each bring-up step. They all have the same priority.
+ */
+static void advanceBringUp(BSP *me)
+{
+    switch (me->bring_up_step)
+    {
+        case BU_DAC_SETTLING:
+            signalReady(me, PR_DAC);
+            switchPrimaryVoltage(me->Vcap_wanted);
+            startADC1Configuration();           // CCRDY ends this step.
+            break;
+        case BU_ADC_CONFIGURING:
+            configureADC1();
+            LL_ADC_EnableInternalRegulator(ADC1);
+            startBringUpTimer(LL_ADC_DELAY_INTERNAL_REGUL_STAB_US);
+            break;
+        case BU_ADC_REGULATOR:
+            LL_ADC_StartCalibration(ADC1);      // EOCAL ends this step.
+            break;
+        case BU_ADC_CALIBRATING:
+            startBringUpTimer(ADC_ENABLE_AFTER_CALIB_µs);
+            break;
+        case BU_ADC_CAL_SETTLING:
+            LL_ADC_Enable(ADC1);                // ADRDY ends this step.
+            break;
+        case BU_ADC_ENABLING:
+            LL_ADC_REG_StartConversion(ADC1);
+            signalReady(me, PR_ADC);
+            break;
+        default:
+            BSP_logf("%s: step %hhu?\n", __func__, me->bring_up_step);
+            return;
+    }
+    me->bring_up_step += 1;
+}
+
+
+RAMFUNC static void setPrimaryVoltage_mV(uint16_t mV)
 {
     bsp.V_prim_mV = mV;
     // TODO Ensure a rising step on the buck regulator's feedback pin does not exceed 80 mV.
@@ -430,18 +993,51 @@ static void setPrimaryVoltage_mV(uint16_t mV)
 }
 
 
-static void setConfigAndClock(BSP *me)
+RAMFUNC static void armSwitchTransfer(BSP *me)
+{
+#if TRIAC_SWITCH_BY_DMA
+    seq_clock->DIER |= TIM_DIER_CC2DE;
+#else
+    seq_clock->SR &= ~TIM_SR_CC2IF;
+    seq_clock->DIER |= TIM_DIER_CC2IE;
+#endif
+    me->switch_armed = true;
+}
+
+
+RAMFUNC static void disarmSwitchTransfer(BSP *me)
+{
+    seq_clock->DIER &= ~(TIM_DIER_CC2DE | TIM_DIER_CC2IE);
+    me->switch_armed = false;
+}
+
+/**
+ * Schedule the switch matrix update the settle time ahead of the burst,
+ * but not before the burst that is currently running has ended.
+ */
+RAMFUNC static void setConfigAndClock(BSP *me)
 {
-    if (me->pulse_seqnr == pulse_timer->RCR + 1) {
-        BSP_setElectrodeConfiguration((uint8_t const *)me->next_burst.elcon);
-    } else {                                    // Pulse train is not finished yet.
-        me->elcon_available = true;
+    uint32_t const start_µs = me->next_burst.start_time_µs;
+    uint32_t switch_µs = start_µs - me->triac_settle_µs;
+    if ((int32_t)(me->busy_until_µs - switch_µs) > 0) {
+        switch_µs = me->busy_until_µs;
     }
-    seq_clock->CCR1 = me->next_burst.start_time_µs;
+    me->switch_word = switch_words[(me->next_burst.elcon[0] | me->next_burst.elcon[1]) & 0xf];
+    seq_clock->CCR2 = switch_µs;
+    armSwitchTransfer(me);
+    if ((int32_t)(seq_clock->CNT - switch_µs) >= 0) {
+        // Switch time has passed already, and the previous burst is done: switch right away.
+        TRIAC_GPIO_PORT->BSRR = me->switch_word;
+    }
+    seq_clock->CCR1 = start_µs;
 }
 
 
-static bool kickOffBurst(BSP *me)
+/**
+ * Runs in the CC1 interrupt, from SRAM, as do the Burst functions it calls. BSP_logf() and
+ * maolib's EventQueue_postEvent() are in flash, but only get called when no burst is started.
+ */
+RAMFUNC static bool kickOffBurst(BSP *me)
 {
     Burst *burst = (Burst *)&me->next_burst;
     if (Burst_isValid(burst)) {
@@ -449,8 +1045,14 @@ static bool kickOffBurst(BSP *me)
             // Scale amplitude 0..255 to 0..10200 mV (for now).
             setPrimaryVoltage_mV(burst->amplitude * 40);
         }
-        if ((pulse_timer->CR1 & TIM_CR1_CEN) == 0) {
-            return BSP_startBurst(Burst_adjust(burst, 20));
+        if (me->pulse_seqnr == me->nr_of_pulses) {
+            // The switches were set by the time the burst was scheduled for.
+            disarmSwitchTransfer(me);
+            Burst_adjust(burst, 20);
+            // The next switch may happen as soon as the last pulse of this burst has ended.
+            me->busy_until_µs = burst->start_time_µs + (burst->nr_of_pulses - 1) * burst->pace_µs + Burst_pulseWidth_µs(burst);
+            LL_GPIO_SetOutputPin(LED_GPIO_PORT, LED_1_PIN);
+            return BSP_startBurst(burst);
         }
         BSP_logf("Pulse timer busy at t=%u µs\n", seq_clock->CNT);
     }
@@ -459,13 +1061,38 @@ static bool kickOffBurst(BSP *me)
 }
 
 
-static void onePulseDone(BSP *me)
+RAMFUNC static void recordPulse(BSP *me)
 {
-    if (me->pulse_seqnr++ == pulse_timer->RCR) {
-        if (me->elcon_available) {
-            BSP_setElectrodeConfiguration((uint8_t const *)me->next_burst.elcon);
-            me->elcon_available = false;
-        } else {
+    uint16_t const head = me->rec_head;
+    uint16_t const seqnr = me->rec_seqnr++;
+    if ((uint16_t)(head - me->rec_tail) == PULSE_RECORDER_SIZE) {
+        me->rec_dropped += 1;                   // Full; the consumer is lagging.
+        return;
+    }
+    PulseRecord *pr = &me->pulse_records[head % PULSE_RECORDER_SIZE];
+    // The pulse has just ended, and this ISR runs at top priority.
+    pr->start_µs   = seq_clock->CNT - (me->rec_burst.width_¼µs + 2) / 4;
+    pr->seqnr      = seqnr;
+    pr->width_¼µs  = me->rec_burst.width_¼µs;
+    pr->Vcap_mV    = ((uint32_t)me->adc_1_samples[1] * 52813UL) / 16384;
+    pr->phase      = me->rec_burst.phase;
+    pr->elcon      = me->rec_burst.elcon;
+    __DMB();                                    // The record must be complete before it is published.
+    me->rec_head = head + 1;
+}
+
+
+RAMFUNC static void onePulseDone(BSP *me)
+{
+    if (me->recording) recordPulse(me);
+    if (++me->pulse_seqnr == me->nr_of_pulses) {
+        pulse_timer->SMCR &= ~TIM_SMCR_SMS;     // Ignore further triggers.
+        capture_timer->SMCR &= ~TIM_SMCR_SMS;
+        // Let the pace timer stop, and the burst expire, at the end of this pace period.
+        pace_timer->SR &= ~TIM_SR_UIF;
+        pace_timer->DIER |= TIM_DIER_UIE;
+        pace_timer->CR1 |= TIM_CR1_OPM;
+        if (! me->switch_armed) {               // No next burst to switch to.
             LL_GPIO_ResetOutputPin(TRIAC_GPIO_PORT, ALL_TRIAC_PINS);
         }
         EventQueue_postEvent(bsp.delegate, ET_BURST_COMPLETED, NULL, 0);
@@ -497,48 +1124,85 @@ void SysTick_Handler(void)
 
 void RCC_IRQHandler(void)
 {
-    // TODO Catch LSE ready interrupt?
-    spuriousIRQ(&bsp);
+    if (RCC->CIFR & RCC_CIFR_LSERDYF) {
+        RCC->CICR = RCC_CICR_LSERDYC;           // Clear.
+        RCC->CIER &= ~RCC_CIER_LSERDYIE;
+        signalReady(&bsp, PR_LSE);
+    } else if (RCC->CIFR & RCC_CIFR_PLLRDYF) {  // Pre-warming done.
+        RCC->CICR = RCC_CICR_PLLRDYC;           // Clear.
+        RCC->CIER &= ~RCC_CIER_PLLRDYIE;
+        BSP_criticalSectionEnter();
+        applyClockSpeed(&bsp);                  // Unless a burst is running; then we switch when idle.
+        BSP_criticalSectionExit();
+    } else {
+        spuriousIRQ(&bsp);
+    }
 }
 
 
-void TIM1_BRK_UP_TRG_COM_IRQHandler(void)
+void TIM16_IRQHandler(void)
 {
-    if (pulse_timer->SR & TIM_SR_UIF) {         // An update event.
-        pulse_timer->CR1 &= ~TIM_CR1_CEN;       // Stop the counter.
-        pulse_timer->DIER &= ~(TIM_DIER_CC1IE | TIM_DIER_CC2IE | TIM_DIER_CC4IE);
-        pulse_timer->SR &= ~(TIM_SR_UIF | TIM_SR_CC1IF | TIM_SR_CC2IF);
-        LL_GPIO_ResetOutputPin(LED_GPIO_PORT, LED_1_PIN);
-        // BSP_logf("%s at %u µs\n", __func__, seq_clock->CNT);
-        EventQueue_postEvent(bsp.delegate, ET_BURST_EXPIRED, NULL, 0);
+    if (bring_up_timer->SR & TIM_SR_UIF) {      // A bring-up delay has passed.
+        bring_up_timer->SR = ~TIM_SR_UIF;
+        if (bsp.bring_up_step == BU_DAC_SETTLING || bsp.bring_up_step == BU_ADC_REGULATOR
+         || bsp.bring_up_step == BU_ADC_CAL_SETTLING) {
+            advanceBringUp(&bsp);
+        }
     } else {
-        BSP_logf("PT SR=0x%x\n", __func__, pulse_timer->SR);
-        // spuriousIRQ(&bsp);
+        spuriousIRQ(&bsp);
     }
 }
 
 
-void TIM1_CC_IRQHandler(void)
+RAMFUNC void TIM1_BRK_UP_TRG_COM_IRQHandler(void)
 {
-    if ((pulse_timer->DIER & TIM_DIER_CC1IE) && (pulse_timer->SR & TIM_SR_CC1IF)) {
-        pulse_timer->SR &= ~TIM_SR_CC1IF;
-        onePulseDone(&bsp);
-    }
-    if ((pulse_timer->DIER & TIM_DIER_CC2IE) && (pulse_timer->SR & TIM_SR_CC2IF)) {
-        pulse_timer->SR &= ~TIM_SR_CC2IF;
+    if (pulse_timer->SR & TIM_SR_UIF) {         // End of a pulse; one-pulse mode stopped the counter.
+        pulse_timer->SR &= ~TIM_SR_UIF;
         onePulseDone(&bsp);
+    } else {
+        BSP_logf("PT SR=0x%x\n", pulse_timer->SR);
+        // spuriousIRQ(&bsp);
     }
-    pulse_timer->SR &= ~(TIM_SR_CC6IF | TIM_SR_CC5IF | TIM_SR_CC4IF | TIM_SR_CC3IF);
-    if (pulse_timer->SR & ~(TIM_SR_CC2IF | TIM_SR_CC1IF | TIM_SR_UIF)) {
+}
+
+
+RAMFUNC void TIM1_CC_IRQHandler(void)
+{
+    uint16_t const ticks = pulse_timer->CNT;    // First thing, as it counts timer clock cycles since the trigger.
+    if (pulse_timer->SR & (TIM_SR_CC2IF | TIM_SR_CC1IF)) {
+        pulse_timer->SR = ~(TIM_SR_CC2IF | TIM_SR_CC1IF);
+        // The compare event happened at tick 1. A stopped counter means we missed the whole pulse.
+        uint16_t const latency = ticks != 0 ? ticks - 1 : pulse_timer->ARR;
+        if (latency > bsp.max_pulse_irq_latency) bsp.max_pulse_irq_latency = latency;
+        bsp.nr_of_latency_samples += 1;
+    } else {
+        pulse_timer->SR = ~(TIM_SR_CC6IF | TIM_SR_CC5IF | TIM_SR_CC4IF | TIM_SR_CC3IF);
         BSP_logf("PT SR=0x%x\n", pulse_timer->SR);
         spuriousIRQ(&bsp);
     }
 }
 
 
-void TIM2_IRQHandler(void)
+RAMFUNC void TIM3_IRQHandler(void)
+{
+    if (pace_timer->SR & TIM_SR_UIF) {          // The last pace period of the burst is over.
+        pace_timer->SR &= ~TIM_SR_UIF;
+        pace_timer->DIER &= ~TIM_DIER_UIE;
+        LL_GPIO_ResetOutputPin(LED_GPIO_PORT, LED_1_PIN);
+        // BSP_logf("%s at %u µs\n", __func__, seq_clock->CNT);
+        EventQueue_postEvent(bsp.delegate, ET_BURST_EXPIRED, NULL, 0);
+    } else {
+        spuriousIRQ(&bsp);
+    }
+}
+
+
+RAMFUNC void TIM2_IRQHandler(void)
 {
-    if (seq_clock->SR & TIM_SR_CC1IF) {
+    if ((seq_clock->DIER & TIM_DIER_CC2IE) && (seq_clock->SR & TIM_SR_CC2IF)) {
+        seq_clock->SR &= ~TIM_SR_CC2IF;         // Clear the interrupt.
+        TRIAC_GPIO_PORT->BSRR = bsp.switch_word;
+    } else if (seq_clock->SR & TIM_SR_CC1IF) {
         seq_clock->SR &= ~TIM_SR_CC1IF;         // Clear the interrupt.
         // BSP_logf("TIM2 at %u µs\n", seq_clock->CNT);
         kickOffBurst(&bsp);
@@ -550,11 +1214,15 @@ void TIM2_IRQHandler(void)
 
 void TIM17_IRQHandler(void)
 {
-    if (app_timer->SR & TIM_SR_CC1IF) {         // Capture/compare 1.
-        app_timer->SR &= ~TIM_SR_CC1IF;         // Clear the interrupt.
-        bsp.app_timer_handler(bsp.app_timer_target, BSP_microsecondsSinceBoot());
-        app_timer->CCR1 += bsp.clock_ticks_per_app_timer_tick;
-    } else {
+    uint32_t const sr = app_timer->SR;
+    if (sr & TIM_SR_UIF) {                      // The 16-bit counter wrapped.
+        app_timer->SR = ~TIM_SR_UIF;            // Clear only this flag.
+        bsp.app_timer_wraps += 1;
+    }
+    if ((sr & TIM_SR_CC1IF) && (app_timer->DIER & TIM_DIER_CC1IE)) {
+        app_timer->SR = ~TIM_SR_CC1IF;          // Clear the interrupt.
+        onAppTimerCompare(&bsp);
+    } else if ((sr & TIM_SR_UIF) == 0) {
         spuriousIRQ(&bsp);
     }
 }
@@ -576,8 +1244,12 @@ void EXTI4_15_IRQHandler(void)
 
 void TIM6_DAC_LPTIM1_IRQHandler(void)
 {
-    // TODO Check for DAC interrupt.
-    spuriousIRQ(&bsp);
+    if (wake_up_timer->ISR & LPTIM_ISR_CMPM) {  // Woke us up from STOP mode.
+        wake_up_timer->ICR = LPTIM_ICR_CMPMCF;
+    } else {
+        // TODO Check for DAC interrupt.
+        spuriousIRQ(&bsp);
+    }
 }
 
 
@@ -588,10 +1260,13 @@ void ADC1_COMP_IRQHandler(void)
         BSP_logf("ADC overrun\n");
     } else if (ADC1->ISR & ADC_ISR_ADRDY) {
         ADC1->ISR = ADC_ISR_ADRDY;              // Clear.
-        BSP_logf("ADC ready\n");
-    } else if (ADC1->ISR & ADC_ISR_CCRDY) {
+        if (bsp.bring_up_step == BU_ADC_ENABLING) advanceBringUp(&bsp);
+    } else if (ADC1->ISR & ADC_ISR_EOCAL) {
+        ADC1->ISR = ADC_ISR_EOCAL;              // Clear.
+        if (bsp.bring_up_step == BU_ADC_CALIBRATING) advanceBringUp(&bsp);
+    } else if (ADC1->ISR & ADC_ISR_CCRDY) {     // Also after the channel selection gets written.
         ADC1->ISR = ADC_ISR_CCRDY;              // Clear.
-        BSP_logf("ADC channel config ready\n");
+        if (bsp.bring_up_step == BU_ADC_CONFIGURING) advanceBringUp(&bsp);
     } else if (ADC1->ISR & ADC_ISR_EOC) {       // Debugging only.
         ADC1->ISR = ADC_ISR_EOC;                // Clear.
         BSP_logf("ADC EOC\n");
@@ -607,10 +1282,15 @@ void ADC1_COMP_IRQHandler(void)
 
 void DMA1_Channel1_IRQHandler(void)
 {
-    if (DMA1->ISR & DMA_ISR_TCIF1) {
+    // The half transfer flag also gets set outside capture mode, but then its interrupt is not enabled.
+    if ((DMA1->ISR & DMA_ISR_HTIF1) && (DMA1_Channel1->CCR & DMA_CCR_HTIE)) {
+        DMA1->IFCR = DMA_IFCR_CHTIF1;           // The first half holds a complete pulse.
+        reducePulse(&bsp, bsp.capture_samples[0]);
+    } else if (DMA1->ISR & DMA_ISR_TCIF1) {
         DMA1->IFCR = DMA_IFCR_CTCIF1;           // Clear transfer complete flag.
-        // BSP_logf("DMA1_1\n");
-        // EventQueue_postEvent(bsp.delegate, ET_ADC_DATA_AVAILABLE, (uint8_t const *)bsp.adc_1_samples, sizeof bsp.adc_1_samples);
+        if (DMA1_Channel1->CCR & DMA_CCR_HTIE) {
+            reducePulse(&bsp, bsp.capture_samples[1]);
+        }
     } else if (DMA1->ISR & DMA_ISR_TEIF1) {
         DMA1->IFCR = DMA_IFCR_CTEIF1;           // Clear transfer error flag.
         BSP_logf("%s, TEIF1\n", __func__);
@@ -630,6 +1310,69 @@ void assert_failed(char const *filename, uint32_t line_nr)
     BSP_assertionFailed(filename, line_nr, "STM LL");
 }
 
+/*
+ * Support for newlib's malloc(), which only gets used during initialisation.
+ */
+
+extern uint8_t end, _eheap;                     // Defined by the linker script.
+static uint8_t *heap_top = &end;
+static bool heap_sealed = false;
+
+
+void *_sbrk(ptrdiff_t incr)
+{
+    M_ASSERT(! heap_sealed);                    // No allocations after init.
+    if (heap_sealed || heap_top + incr > &_eheap) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    uint8_t *prev_top = heap_top;
+    heap_top += incr;
+    return prev_top;
+}
+
+/*
+ * Programming the flash areas that hold the application's data.
+ * While flash is busy, code running from flash stalls. The pulse path runs from SRAM, so it keeps going.
+ */
+
+#ifndef FLASH_PAGE_SIZE
+#define FLASH_PAGE_SIZE         0x800U
+#endif
+
+#define FLASH_ERROR_FLAGS       (FLASH_SR_OPERR | FLASH_SR_PROGERR | FLASH_SR_WRPERR | FLASH_SR_PGAERR \
+                               | FLASH_SR_SIZERR | FLASH_SR_PGSERR | FLASH_SR_MISERR | FLASH_SR_FASTERR)
+
+extern uint8_t const _srecordings[], _erecordings[];   // Defined by the linker script.
+extern uint8_t const _spatterns[], _epatterns[];
+
+
+static bool isInDataArea(uint8_t const *addr, uint32_t nb)
+{
+    return (addr >= _srecordings && addr + nb <= _erecordings)
+        || (addr >= _spatterns && addr + nb <= _epatterns);
+}
+
+
+static void unlockFlash()
+{
+    while (FLASH->SR & (FLASH_SR_BSY1 | FLASH_SR_CFGBSY)) { /* Wait. */ }
+    if (FLASH->CR & FLASH_CR_LOCK) {
+        FLASH->KEYR = 0x45670123UL;
+        FLASH->KEYR = 0xCDEF89ABUL;
+    }
+    FLASH->SR = FLASH_ERROR_FLAGS | FLASH_SR_EOP;   // Clear leftovers.
+}
+
+
+static bool awaitFlash()
+{
+    while (FLASH->SR & FLASH_SR_BSY1) { /* Wait. */ }
+    uint32_t const errors = FLASH->SR & FLASH_ERROR_FLAGS;
+    FLASH->SR = errors | FLASH_SR_EOP;
+    return errors == 0;
+}
+
 /*
  * Below are the functions implementing this module's interface.
  */
@@ -641,20 +1384,25 @@ void BSP_init()
 
     LL_RCC_SetADCClockSource(LL_RCC_ADC_CLKSOURCE_HSI);
     RCC->APBENR1 = RCC_APBENR1_TIM2EN | RCC_APBENR1_TIM3EN | RCC_APBENR1_PWREN | RCC_APBENR1_DAC1EN;
-    RCC->APBENR2 = RCC_APBENR2_TIM1EN | RCC_APBENR2_TIM16EN | RCC_APBENR2_TIM17EN | RCC_APBENR2_ADCEN | RCC_APBENR2_SYSCFGEN;
+    RCC->APBENR2 = RCC_APBENR2_TIM1EN | RCC_APBENR2_TIM15EN | RCC_APBENR2_TIM16EN | RCC_APBENR2_TIM17EN | RCC_APBENR2_ADCEN | RCC_APBENR2_SYSCFGEN;
     RCC->AHBENR |= RCC_AHBENR_DMA1EN;
     // Enable instruction cache and prefetch buffer.
     FLASH->ACR |= FLASH_ACR_ICEN | FLASH_ACR_PRFTEN;
 
     HAL_InitTick(IRQ_PRIO_SYSTICK);
     SystemClock_Config();
+    bsp.ticks_per_µs = SystemCoreClock / 1000000UL;
+    initAppTimer();                             // Our time base starts here.
+    enableInterruptWithPrio(RCC_IRQn, IRQ_PRIO_EXTI);
     BSP_logf("DevId=0x%x, SystemCoreClock=%u, flash size=%hu KB\n",
             LL_DBGMCU_GetDeviceID(), SystemCoreClock, *(const uint16_t *)FLASHSIZE_BASE);
+    // Finish the LSE, DAC and ADC in the background, so the link can come up right away.
+    initBringUpTimer();
+    initWakeUpTimer();
     initDAC();
     initDMAforADC1(bsp.adc_1_samples, M_DIM(bsp.adc_1_samples));
-    initADC1();
-    LL_ADC_Enable(ADC1);
-    LL_ADC_REG_StartConversion(ADC1);
+    bsp.bring_up_step = BU_DAC_SETTLING;
+    startBringUpTimer(DAC_SETTLE_TIME_µs);
 }
 
 
@@ -691,6 +1439,32 @@ void BSP_criticalSectionExit()
 }
 
 
+IrqMask BSP_maskInterrupts(IrqLevel level)
+{
+#if USE_GLOBAL_CRITICAL_SECTIONS
+    BSP_criticalSectionEnter();
+    return level;
+#else
+    // Only disable the lines that are enabled now, so nested sections restore correctly.
+    IrqMask const mask = NVIC->ISER[0] & bsp.irq_lines_from_level[level];
+    NVIC->ICER[0] = mask;
+    __DSB();
+    __ISB();
+    return mask;
+#endif
+}
+
+
+void BSP_restoreInterrupts(IrqMask mask)
+{
+#if USE_GLOBAL_CRITICAL_SECTIONS
+    BSP_criticalSectionExit();
+#else
+    NVIC->ISER[0] = mask;
+#endif
+}
+
+
 uint32_t BSP_millisecondsToTicks(uint16_t ms)
 {
     uint32_t const ticks_per_millisecond = APP_TIMER_FREQ_Hz / 1000UL;
@@ -715,7 +1489,31 @@ void BSP_registerAppTimerHandler(void (*handler)(void *, uint64_t), void *target
     bsp.app_timer_handler = handler;
     bsp.app_timer_target  = target;
     bsp.clock_ticks_per_app_timer_tick = microseconds_per_app_timer_tick * TICKS_PER_MICROSECOND;
-    initAppTimer();
+    if (isTickless(&bsp)) {
+        BSP_criticalSectionEnter();
+        armAppTimerCompare(&bsp);
+        BSP_criticalSectionExit();
+    } else {
+        startAppTimerTicks(bsp.clock_ticks_per_app_timer_tick);
+    }
+}
+
+
+void BSP_scheduleAppTimer(uint64_t deadline_µs)
+{
+    if (! isTickless(&bsp)) return;             // The handler gets called every tick anyway.
+
+    BSP_criticalSectionEnter();
+    bsp.app_deadline_ticks = deadline_µs * TICKS_PER_MICROSECOND;
+    if (bsp.app_timer_handler != NULL) armAppTimerCompare(&bsp);
+    BSP_criticalSectionExit();
+}
+
+
+void BSP_sealHeap()
+{
+    heap_sealed = true;
+    BSP_logf("Heap: %u of %u bytes used during init\n", (unsigned)(heap_top - &end), (unsigned)(&_eheap - &end));
 }
 
 
@@ -723,7 +1521,132 @@ void BSP_registerPulseDelegate(EventQueue *dq)
 {
     bsp.delegate = dq;
     initPulseTimer();
+    initCaptureTimer();
+    initPaceTimer();
     initSequencerClock();
+#if TRIAC_SWITCH_BY_DMA
+    initDMAforSwitches(&bsp.switch_word);
+#endif
+}
+
+
+bool BSP_enablePulseCapture(EventQueue *dq)
+{
+    // Switch modes between bursts only, so every DMA half holds exactly one pulse.
+    if (! (bsp.ready_flags & PR_ADC) || bsp.pulse_seqnr != bsp.nr_of_pulses) return false;
+
+    IrqMask const im = BSP_maskInterrupts(IRQL_ADC_DMA);
+    if ((dq != NULL) != (bsp.capture_delegate != NULL)) {
+        selectAdcTrigger(&bsp, dq != NULL);
+    }
+    bsp.nr_of_metrics = 0;
+    bsp.capture_delegate = dq;
+    BSP_restoreInterrupts(im);
+    return true;
+}
+
+
+void BSP_recordPulses(bool on)
+{
+    if (on && ! bsp.recording) {
+        bsp.rec_tail = bsp.rec_head;            // Start afresh. Safe, as the ISR is not recording.
+        bsp.rec_dropped = 0;
+        bsp.rec_seqnr = 0;
+    }
+    bsp.recording = on;
+}
+
+
+uint16_t BSP_takePulseRecords(PulseRecord dst[], uint16_t max_nr_of_records)
+{
+    uint16_t const tail = bsp.rec_tail;
+    uint16_t nr_of_records = bsp.rec_head - tail;
+    if (nr_of_records > max_nr_of_records) nr_of_records = max_nr_of_records;
+    __DMB();                                    // Read the records only after the head.
+    for (uint16_t i = 0; i < nr_of_records; i++) {
+        dst[i] = bsp.pulse_records[(uint16_t)(tail + i) % PULSE_RECORDER_SIZE];
+    }
+    __DMB();                                    // Done reading before the slots get handed back.
+    bsp.rec_tail = tail + nr_of_records;
+    return nr_of_records;
+}
+
+
+uint16_t BSP_nrOfPulseRecordsDropped(void)
+{
+    return bsp.rec_dropped;
+}
+
+
+uint8_t const *BSP_flashArea(FlashArea fa, uint32_t *size)
+{
+    switch (fa)
+    {
+        case FA_RECORDINGS:
+            *size = _erecordings - _srecordings;
+            return _srecordings;
+        case FA_PATTERNS:
+            *size = _epatterns - _spatterns;
+            return _spatterns;
+    }
+    *size = 0;
+    return NULL;
+}
+
+
+uint16_t BSP_flashPageSize()
+{
+    return FLASH_PAGE_SIZE;
+}
+
+
+bool BSP_eraseFlashPage(uint8_t const *page)
+{
+    if (((uintptr_t)page & (FLASH_PAGE_SIZE - 1)) != 0 || ! isInDataArea(page, FLASH_PAGE_SIZE)) return false;
+
+    unlockFlash();
+    uint32_t const page_nr = ((uintptr_t)page - FLASH_BASE) / FLASH_PAGE_SIZE;
+    FLASH->CR = (FLASH->CR & ~FLASH_CR_PNB) | (page_nr << FLASH_CR_PNB_Pos) | FLASH_CR_PER;
+    FLASH->CR |= FLASH_CR_STRT;                 // Takes about 22 ms.
+    bool const ok = awaitFlash();
+    FLASH->CR &= ~FLASH_CR_PER;
+    FLASH->CR |= FLASH_CR_LOCK;
+    return ok;
+}
+
+
+bool BSP_writeFlash(uint8_t const *dst, void const *src, uint16_t nb)
+{
+    // The flash gets programmed one double word at a time.
+    if (((uintptr_t)dst & 7) != 0 || (nb & 7) != 0 || ! isInDataArea(dst, nb)) return false;
+
+    bool ok = true;
+    unlockFlash();
+    FLASH->CR |= FLASH_CR_PG;
+    for (uint16_t i = 0; ok && i < nb; i += 8) {
+        uint32_t words[2];
+        memcpy(words, (uint8_t const *)src + i, sizeof words);
+        uint32_t volatile *dw = (uint32_t volatile *)(uintptr_t)(dst + i);
+        dw[0] = words[0];
+        __ISB();
+        dw[1] = words[1];                       // Starts the programming.
+        ok = awaitFlash();
+    }
+    FLASH->CR &= ~FLASH_CR_PG;
+    FLASH->CR |= FLASH_CR_LOCK;
+    return ok;
+}
+
+
+void BSP_registerReadinessDelegate(EventQueue *dq)
+{
+    BSP_criticalSectionEnter();
+    bsp.readiness_delegate = dq;
+    uint8_t const already_ready = bsp.ready_flags;
+    BSP_criticalSectionExit();
+    if (already_ready != 0) {
+        EventQueue_postEvent(dq, ET_PERIPHERAL_READY, &already_ready, sizeof already_ready);
+    }
 }
 
 
@@ -748,16 +1671,10 @@ void BSP_toggleTheLED()
 
 void BSP_primaryVoltageEnable(bool must_be_on)
 {
-    if ((BUCK_GPIO_PORT->ODR & BUCK_ENABLE_PIN) == 0) {
-        if (must_be_on) {
-            BSP_logf("Turning Vcap ON\n");
-            LL_GPIO_SetOutputPin(BUCK_GPIO_PORT, BUCK_ENABLE_PIN);
-        }
-    } else {
-        if (! must_be_on) {
-            BSP_logf("Turning Vcap OFF\n");
-            LL_GPIO_ResetOutputPin(BUCK_GPIO_PORT, BUCK_ENABLE_PIN);
-        }
+    bsp.Vcap_wanted = must_be_on;
+    // Until the DAC has settled, the bring-up takes care of this.
+    if (bsp.ready_flags & PR_DAC) {
+        switchPrimaryVoltage(must_be_on);
     }
 }
 
@@ -775,28 +1692,74 @@ uint16_t BSP_setPrimaryVoltagePercent(uint8_t perc)
 }
 
 
+uint16_t BSP_setTriacSettleTime(uint16_t settle_µs)
+{
+    if (settle_µs < MIN_TRIAC_SETTLE_TIME_µs) settle_µs = MIN_TRIAC_SETTLE_TIME_µs;
+    else if (settle_µs > MAX_TRIAC_SETTLE_TIME_µs) settle_µs = MAX_TRIAC_SETTLE_TIME_µs;
+    bsp.triac_settle_µs = settle_µs;
+    return settle_µs;
+}
+
+
+uint16_t BSP_triacSettleTime(void)
+{
+    return bsp.triac_settle_µs;
+}
+
+
+void BSP_selectClockSpeed(ClockSpeed cs)
+{
+    BSP_criticalSectionEnter();
+    bsp.clock_speed = cs;
+    if (cs == CS_FULL_SPEED && ! LL_RCC_PLL_IsReady()) {
+        // Let the PLL lock in the background; the RCC interrupt completes the switch.
+        RCC->CICR = RCC_CICR_PLLRDYC;
+        RCC->CIER |= RCC_CIER_PLLRDYIE;
+        LL_RCC_PLL_Enable();
+    } else {
+        applyClockSpeed(&bsp);
+    }
+    BSP_criticalSectionExit();
+}
+
+
+/**
+ * Runs at whatever core clock speed was selected. If the PLL is still locking, the RCC interrupt
+ * switches over between bursts, and the sequencer clock keeps its count.
+ */
 void BSP_startSequencerClock(uint32_t time_µs)
 {
-    BSP_logf("%s(%d)\n", __func__, time_µs);
-    seq_clock->CCR1 = time_µs - 1;
-    seq_clock->CNT = time_µs;
+    BSP_logf("%s(%d)%s\n", __func__, time_µs, isRunningOnPLL() ? "" : " at 16 MHz");
+    // Start early enough to set the switches and schedule the first burst at time_µs.
+    uint32_t const clock_µs = time_µs - bsp.triac_settle_µs - 2 * BURST_SCHEDULING_MARGIN_µs;
+    disarmSwitchTransfer(&bsp);
+    seq_clock->CCR1 = clock_µs - 1;
+    seq_clock->CNT = clock_µs;
+    bsp.busy_until_µs = clock_µs;
     seq_clock->CR1 |= TIM_CR1_CEN;              // Enable the counter.
 }
 
 
-void BSP_stopSequencerClock()
+uint32_t BSP_stopSequencerClock()
 {
-    BSP_logf("%s at %u µs\n", __func__, seq_clock->CNT);
     seq_clock->CR1 &= ~TIM_CR1_CEN;             // Disable the counter.
     setSwitches(ALL_TRIACS_OFF);
+    BSP_logf("%s at %u µs\n", __func__, seq_clock->CNT);
+    return seq_clock->CNT;
 }
 
 
+/**
+ * The switches get set again as scheduled, so a burst that was still running at the pause
+ * keeps its electrodes until it has ended.
+ */
 void BSP_resumeSequencerClock()
 {
     BSP_logf("%s at %u µs\n", __func__, seq_clock->CNT);
-    BSP_setElectrodeConfiguration((uint8_t const *)bsp.next_burst.elcon);
+    BSP_criticalSectionEnter();
+    setConfigAndClock(&bsp);
     seq_clock->CR1 |= TIM_CR1_CEN;              // Enable the counter.
+    BSP_criticalSectionExit();
 }
 
 
@@ -805,7 +1768,7 @@ bool BSP_scheduleBurst(Burst const *burst)
     // Accept the burst only if there is enough time ('do less sooner').
     // Minimum margin yet to be determined; trying 20 µs.
     BSP_criticalSectionEnter();
-    if ((int32_t)seq_clock->CNT < (int32_t)burst->start_time_µs - 20) {
+    if ((int32_t)seq_clock->CNT < (int32_t)burst->start_time_µs - BURST_SCHEDULING_MARGIN_µs) {
         bsp.next_burst = *burst;                // Copy.
         setConfigAndClock(&bsp);
         BSP_criticalSectionExit();
@@ -819,45 +1782,95 @@ bool BSP_scheduleBurst(Burst const *burst)
 }
 
 
-bool BSP_startBurst(Burst const *burst)
+void BSP_logPowerStatistics(void)
 {
-    pulse_timer->ARR = burst->pace_µs - 1;
-    pulse_timer->RCR = burst->nr_of_pulses - 1;
-    bsp.pulse_seqnr = 0;
+    BSP_criticalSectionEnter();
+    uint32_t const stopped_ms = (uint32_t)(bsp.stopped_ticks / (APP_TIMER_FREQ_Hz / 1000UL));
+    uint32_t const nr_of_stops = bsp.nr_of_stops;
+    BSP_criticalSectionExit();
+    uint32_t const uptime_ms = (uint32_t)(BSP_microsecondsSinceBoot() / 1000);
+    BSP_logf("STOP mode %u times, %u of %u ms (%u%%)%s\n", nr_of_stops, stopped_ms, uptime_ms,
+            uptime_ms == 0 ? 0 : (uint32_t)((uint64_t)stopped_ms * 100 / uptime_ms),
+            USE_STOP_MODE ? "" : ", disabled");
+}
+
+
+void BSP_logPulseIrqLatency(void)
+{
+    uint32_t const cycles_per_µs = SystemCoreClock / 1000000UL;
+    uint16_t const max_cycles = bsp.max_pulse_irq_latency;
+    BSP_logf("Pulse IRQ latency over %u pulses: max %hu cycles (%u.%02u µs)%s\n",
+            bsp.nr_of_latency_samples, max_cycles, max_cycles / cycles_per_µs,
+            (max_cycles % cycles_per_µs) * 100 / cycles_per_µs,
+            USE_GLOBAL_CRITICAL_SECTIONS ? ", global critical sections" : "");
+    bsp.max_pulse_irq_latency = 0;
+    bsp.nr_of_latency_samples = 0;
+}
+
+
+RAMFUNC bool BSP_startBurst(Burst const *burst)
+{
+    uint8_t const phase = Burst_phase(burst);
+    if (phase > 1) return false;                // We only have one output stage.
+
+    // The pulse timer counts at the core clock, so widths are rendered at native ¼ µs resolution (or better).
+    uint32_t const ticks_per_µs = bsp.ticks_per_µs;
+    uint32_t const width_ticks = (burst->pulse_width_¼µs * ticks_per_µs + 2) / 4;
+    uint32_t const adc_trigger_ticks = 1 + ADC_TRIGGER_DELAY_µs * ticks_per_µs;
+    pace_timer->CR1 &= ~(TIM_CR1_CEN | TIM_CR1_OPM);
+    pace_timer->DIER &= ~TIM_DIER_UIE;
+    pulse_timer->CR1 &= ~TIM_CR1_CEN;
     pulse_timer->CNT = 0;
-    pulse_timer->SR &= ~(TIM_SR_CC1IF | TIM_SR_CC2IF);
-    uint8_t phase = Burst_phase(burst);
-    uint8_t pulse_width_µs = Burst_pulseWidth_µs(burst);
-    if (phase == 0) {
-        pulse_timer->CCR1 = pulse_width_µs;
-        pulse_timer->DIER |= TIM_DIER_CC1IE;
-    } else if (phase == 1) {
-        pulse_timer->CCR2 = pulse_width_µs;
-        pulse_timer->DIER |= TIM_DIER_CC2IE;
-    } else return false;                        // We only have one output stage.
-
-    if (pulse_width_µs > 10) pulse_timer->CCR4 = 10;
+    pulse_timer->ARR = width_ticks;
+    pulse_timer->CCR1 = phase == 0 ? 1 : PULSE_TIMER_CCR_OFF;
+    pulse_timer->CCR2 = phase == 1 ? 1 : PULSE_TIMER_CCR_OFF;
+    pulse_timer->CCR4 = adc_trigger_ticks < width_ticks ? adc_trigger_ticks : PULSE_TIMER_CCR_OFF;
+    if (bsp.capture_delegate != NULL) armCaptureTimer(&bsp, width_ticks, burst->pace_µs);
+    bsp.rec_burst.width_¼µs = burst->pulse_width_¼µs;
+    bsp.rec_burst.phase = phase;
+    bsp.rec_burst.elcon = burst->elcon[phase];
+    pulse_timer->SMCR |= TIM_SMCR_SMS_2 | TIM_SMCR_SMS_1;   // Trigger mode: each pace period starts a pulse.
+#if MEASURE_PULSE_IRQ_LATENCY
+    pulse_timer->SR = ~(TIM_SR_CC2IF | TIM_SR_CC1IF);
+    pulse_timer->DIER = (pulse_timer->DIER & ~(TIM_DIER_CC2IE | TIM_DIER_CC1IE)) | (phase == 0 ? TIM_DIER_CC1IE : TIM_DIER_CC2IE);
+#endif
+    pace_timer->ARR = burst->pace_µs - 1;
+    pace_timer->CNT = 0;
+    bsp.nr_of_pulses = burst->nr_of_pulses;
+    bsp.pulse_seqnr = 0;
+    pace_timer->CR1 |= TIM_CR1_CEN;
+    pulse_timer->CR1 |= TIM_CR1_CEN;            // The first pulse starts right away.
+    if (capture_timer->SMCR & TIM_SMCR_SMS) capture_timer->CR1 |= TIM_CR1_CEN;
+    // Posting runs from flash, so only once the pulses are under way.
     EventQueue_postEvent(bsp.delegate, ET_BURST_STARTED, (uint8_t const *)&seq_clock->CNT, sizeof seq_clock->CNT);
-    pulse_timer->EGR |= TIM_EGR_UG;             // Force update of the shadow registers.
-    // Keep at least one instruction between the shadow register update and clearing the CCRs.
-    bsp.elcon_available = false;
-    pulse_timer->CCR1 = 0;
-    pulse_timer->CCR2 = 0;
-    pulse_timer->CCR4 = 0;
-    pulse_timer->CR1 |= TIM_CR1_CEN;            // Enable the counter.
     return true;
 }
 
 
+void BSP_getAdcValues(AdcValues *av)
+{
+    uint16_t const *v = (uint16_t const *)bsp.adc_1_samples;
+    av->Vbat_mV = ((uint32_t)v[2] * 52813UL) / 16384;
+    av->Vcap_mV = ((uint32_t)v[1] * 52813UL) / 16384;
+    av->Iprim_mA = ((uint32_t)v[0] * 2063UL) /  1024;
+}
+
+
+void BSP_sampleADC(void)
+{
+    // During bursts the pulses trigger the conversions, and while capturing they go elsewhere.
+    if (! (bsp.ready_flags & PR_ADC) || bsp.capture_delegate != NULL || isBurstInProgress(&bsp)) return;
+
+    convertOnce();
+}
+
+
 void BSP_triggerADC(void)
 {
     BSP_logf("%s\n", __func__);
-    uint16_t const *v = (uint16_t const *)bsp.adc_1_samples;
-    AdcValues const av = {
-        .Vbat_mV = ((uint32_t)v[2] * 52813UL) / 16384,
-        .Vcap_mV = ((uint32_t)v[1] * 52813UL) / 16384,
-        .Iprim_mA = ((uint32_t)v[0] * 2063UL) /  1024,
-    };
+    BSP_sampleADC();
+    AdcValues av;
+    BSP_getAdcValues(&av);
     EventQueue_postEvent(bsp.delegate, ET_ADC_DATA_AVAILABLE, (uint8_t const *)&av, sizeof av);
 }
 
@@ -870,7 +1883,13 @@ void BSP_close()
 
 void BSP_sleepMCU()
 {
-    HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+    applyClockSpeed(&bsp);                      // Catch up on a switch that had to wait for a burst to end.
+    uint32_t const lse_ticks = stopModeAllowance(&bsp);
+    if (lse_ticks != 0) {
+        enterStopMode(&bsp, (uint16_t)lse_ticks);
+    } else {
+        HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+    }
 }
 
 
@@ -7,7 +7,7 @@
  *
  *  Created on: 5 Apr 2025
  *      Author: mark
- *   Copyright  2025 Neostim™
+ *   Copyright  2025..2026 Neostim™
  */
 
 #include "stm32g071xx.h"
@@ -54,7 +54,8 @@ static void initUsartGpio(void)
 static void initUSART2(uint32_t serial_speed_bps)
 {
     USART2->BRR = (uint16_t)((HSI_VALUE + serial_speed_bps / 2) / serial_speed_bps);
-    USART2->CR1 |= USART_CR1_UE | USART_CR1_FIFOEN;
+    // Running off HSI16, the receiver can wake the MCU from STOP mode.
+    USART2->CR1 |= USART_CR1_UE | USART_CR1_FIFOEN | USART_CR1_UESM;
 }
 
 
@@ -173,6 +174,12 @@ void BSP_doChannelAction(DeviceId device_id, ChannelAction action)
 }
 
 
+bool BSP_commsMayStop(void)
+{
+    return (USART2->CR1 & USART_CR1_TXEIE_TXFNFIE) == 0 && (USART2->ISR & USART_ISR_TC) != 0;
+}
+
+
 int BSP_closeSerialPort(int device_id)
 {
     M_ASSERT(device_id == com.nr_of_serial_devices - 1);
@@ -0,0 +1,118 @@
+/*
+ * buffer_pool.c -- Reference counted receive buffers, so events can carry a handle instead of a copy.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include <stddef.h>
+
+#include "bsp_dbg.h"
+#include "bsp_app.h"
+#include "net_frame.h"
+#include "datalink.h"
+
+// This module implements:
+#include "buffer_pool.h"
+
+// One buffer to receive into, the others on their way through the active objects.
+#ifndef NR_OF_RX_BUFFERS
+#define NR_OF_RX_BUFFERS    3
+#endif
+
+#define RX_BUFFER_SIZE      (FRAME_HEADER_SIZE + MAX_PAYLOAD_SIZE)
+
+typedef struct {
+    uint8_t  storage[NR_OF_RX_BUFFERS][RX_BUFFER_SIZE];
+    uint8_t  ref_count[NR_OF_RX_BUFFERS];
+    uint8_t  max_in_use;
+    uint16_t nr_of_failures;
+} BufferPool;
+
+
+static BufferPool pool ARENA(buffer_pool);
+
+
+static uint8_t nrInUse(BufferPool const *me)
+{
+    uint8_t nr_in_use = 0;
+    for (uint8_t i = 0; i < NR_OF_RX_BUFFERS; i++) {
+        if (me->ref_count[i] != 0) nr_in_use++;
+    }
+    return nr_in_use;
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+void BufferPool_init()
+{
+    for (uint8_t i = 0; i < NR_OF_RX_BUFFERS; i++) pool.ref_count[i] = 0;
+    pool.max_in_use = 0;
+    pool.nr_of_failures = 0;
+}
+
+
+uint8_t BufferPool_acquire()
+{
+    uint8_t buffer_nr = NO_BUFFER;
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    for (uint8_t i = 0; i < NR_OF_RX_BUFFERS; i++) {
+        if (pool.ref_count[i] == 0) {
+            pool.ref_count[i] = 1;
+            buffer_nr = i;
+            break;
+        }
+    }
+    if (buffer_nr == NO_BUFFER) {
+        pool.nr_of_failures++;
+    } else {
+        uint8_t const nr_in_use = nrInUse(&pool);
+        if (nr_in_use > pool.max_in_use) pool.max_in_use = nr_in_use;
+    }
+    BSP_restoreInterrupts(im);
+    return buffer_nr;
+}
+
+
+uint8_t *BufferPool_data(uint8_t buffer_nr)
+{
+    M_ASSERT(buffer_nr < NR_OF_RX_BUFFERS);
+    return pool.storage[buffer_nr];
+}
+
+
+void BufferPool_retain(uint8_t buffer_nr)
+{
+    M_ASSERT(buffer_nr < NR_OF_RX_BUFFERS);
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    M_ASSERT(pool.ref_count[buffer_nr] != 0);   // Only the owner of a reference may hand out more.
+    pool.ref_count[buffer_nr]++;
+    BSP_restoreInterrupts(im);
+}
+
+
+void BufferPool_release(uint8_t buffer_nr)
+{
+    M_ASSERT(buffer_nr < NR_OF_RX_BUFFERS);
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    M_ASSERT(pool.ref_count[buffer_nr] != 0);
+    pool.ref_count[buffer_nr]--;
+    BSP_restoreInterrupts(im);
+}
+
+
+void BufferPool_logStatistics()
+{
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    uint8_t const nr_in_use = nrInUse(&pool);
+    BSP_restoreInterrupts(im);
+    BSP_logf("Rx buffers: %hu of %hu in use, max %hu, %hu times none free\n",
+            nr_in_use, NR_OF_RX_BUFFERS, pool.max_in_use, pool.nr_of_failures);
+}
@@ -7,11 +7,12 @@
  *
  *  Created on: 9 Jan 2025
  *      Author: mark
- *   Copyright  2025 Neostim™
+ *   Copyright  2025..2026 Neostim™
  */
 
 #include <string.h>
 #include "bsp_dbg.h"
+#include "bsp_app.h"
 
 // This module implements:
 #include "burst.h"
@@ -23,7 +24,10 @@ void Burst_clear(Burst *me)
 }
 
 
-bool Burst_isValid(Burst const *me)
+/*
+ * The pulse interrupts call the RAMFUNC functions, so those run from SRAM too.
+ */
+RAMFUNC bool Burst_isValid(Burst const *me)
 {
     // Pulse repetition rate must be in range [16..200] Hz.
     // if (me->pace_µs < MIN_PULSE_PACE_µs) return false;
@@ -34,13 +38,13 @@ bool Burst_isValid(Burst const *me)
 }
 
 
-uint8_t Burst_phase(Burst const *me)
+RAMFUNC uint8_t Burst_phase(Burst const *me)
 {
     return me->phase & 0x7;
 }
 
 
-uint8_t Burst_pulseWidth_µs(Burst const *me)
+RAMFUNC uint8_t Burst_pulseWidth_µs(Burst const *me)
 {
     return (me->pulse_width_¼µs + 2) / 4;
 }
@@ -53,7 +57,7 @@ uint32_t Burst_duration_µs(Burst const *me)
 }
 
 
-Burst *Burst_adjust(Burst *me, uint16_t margin_µs)
+RAMFUNC Burst *Burst_adjust(Burst *me, uint16_t margin_µs)
 {
     // Prevent timing troubles with the last (or only) pulse of the burst.
     if (me->nr_of_pulses == 1) {
@@ -20,10 +20,23 @@
 #include "attributes.h"
 #include "app_event.h"
 #include "patterns.h"
+#include "pattern_store.h"
+#include "app_timer.h"
+#include "buffer_pool.h"
+#include "telemetry.h"
+#include "rec_store.h"
+#include "playback.h"
+#include "pattern_vm.h"
+#include "pattern_mux.h"
+#include "debug_cli.h"
 
 // This module implements:
 #include "controller.h"
 
+#ifndef CONTROLLER_EVENT_STORAGE_SIZE
+#define CONTROLLER_EVENT_STORAGE_SIZE   400
+#endif
+
 typedef struct {
     uint8_t  flags;                             // Version, etc.
     uint8_t  reserved;                          // Hop count, etc.
@@ -40,15 +53,21 @@ typedef struct {
     uint8_t  data[0];
 } AttributeAction;
 
+#define RESPONSE_HEADERS_SIZE   (sizeof(PacketHeader) + sizeof(AttributeAction))
+#define LIST_ENTRY_HEADER_SIZE  3               // The attribute id, as an unsigned int of 2 octets.
+#define MAX_IDS_PER_LIST        AI_NR_OF_ATTRIBUTES
+
 typedef void *(*StateFunc)(Controller *, AOEvent const *);
 
 struct _Controller {
     EventQueue event_queue;                     // This MUST be the first member.
-    uint8_t    event_storage[400];
+    uint8_t    event_storage[CONTROLLER_EVENT_STORAGE_SIZE];
     StateFunc  state;
     Sequencer *sequencer;
     DataLink  *datalink;
-    uint32_t   heartbeat_interval_µs;
+    BufferRef const *packet;                    // The one being handled.
+    AppTimer   heartbeat_timer;
+    uint16_t   heartbeat_interval_secs;
     char       box_name[24];
 };
 
@@ -74,43 +93,61 @@ static void initAttributeAction(AttributeAction *aa, uint16_t transaction_id, ui
 }
 
 
+/**
+ * Reserve room for a response in the DataLink's next frame, and fill in the headers.
+ */
+static uint8_t *reserveResponse(Controller *me, uint16_t trans_id, uint8_t opcode, uint16_t attribute_id, uint16_t data_size)
+{
+    uint8_t *packet = DataLink_reservePacket(me->datalink, RESPONSE_HEADERS_SIZE + data_size);
+    if (packet != NULL) {
+        initResponsePacket((PacketHeader *)packet);
+        initAttributeAction((AttributeAction *)(packet + sizeof(PacketHeader)), trans_id, opcode, attribute_id);
+    }
+    return packet;
+}
+
+
+// Of the request being handled. Packets shorter than the headers never get this far.
+static uint16_t requestDataSize(Controller const *me)
+{
+    return me->packet->size - RESPONSE_HEADERS_SIZE;
+}
+
+
 static void readPatternNames(Controller *me, AttributeAction const *aa)
 {
     uint8_t nr_of_patterns = Patterns_getCount();
-    char const *pattern_names[nr_of_patterns];  // Reserve enough space.
+    char const *pattern_names[NR_OF_BUILT_IN_PATTERNS + MAX_USER_PATTERNS];
     Patterns_getNames(pattern_names, nr_of_patterns);
-    uint16_t nbtw = sizeof(PacketHeader) + sizeof(AttributeAction);
-    uint16_t packet_size = nbtw + Matter_encodedStringArrayLength(pattern_names, nr_of_patterns);
-    // TODO Ensure packet_size does not exceed max frame payload size.
-    uint8_t packet[packet_size];
-    initResponsePacket((PacketHeader *)packet);
-    initAttributeAction((AttributeAction *)(packet + sizeof(PacketHeader)), aa->transaction_id, OC_REPORT_DATA, aa->attribute_id);
-    nbtw += Matter_encodeStringArray(packet + nbtw, pattern_names, nr_of_patterns);
-    DataLink_sendDatagram(me->datalink, packet, nbtw);
+    uint16_t data_size = Matter_encodedStringArrayLength(pattern_names, nr_of_patterns);
+    uint8_t *packet = reserveResponse(me, aa->transaction_id, OC_REPORT_DATA, aa->attribute_id, data_size);
+    if (packet == NULL) return;
+
+    data_size = Matter_encodeStringArray(packet + RESPONSE_HEADERS_SIZE, pattern_names, nr_of_patterns);
+    DataLink_commitPacket(me->datalink, packet, RESPONSE_HEADERS_SIZE + data_size);
 }
 
 
 static void attributeChanged(Controller *me, AttributeId ai, uint16_t trans_id, ElementEncoding enc, uint8_t const *data, uint16_t data_size)
 {
     // BSP_logf("Controller_%s(%hu) size=%hu\n", __func__, ai, data_size);
-    uint16_t nbtw = sizeof(PacketHeader) + sizeof(AttributeAction);
-    uint8_t packet[nbtw + Matter_encodedDataLength(enc, data_size)];
-    initResponsePacket((PacketHeader *)packet);
-    initAttributeAction((AttributeAction *)(packet + sizeof(PacketHeader)), trans_id, OC_REPORT_DATA, ai);
-    nbtw += Matter_encode(packet + nbtw, enc, data, data_size);
-    DataLink_sendDatagram(me->datalink, packet, nbtw);
+    uint8_t *packet = reserveResponse(me, trans_id, OC_REPORT_DATA, ai, Matter_encodedDataLength(enc, data_size));
+    if (packet == NULL) return;
+
+    uint16_t nbtw = RESPONSE_HEADERS_SIZE + Matter_encode(packet + RESPONSE_HEADERS_SIZE, enc, data, data_size);
+    DataLink_commitPacket(me->datalink, packet, nbtw);
 }
 
 
 static void sendStatusResponse(Controller *me, AttributeAction const *aa, StatusCode sc)
 {
     if (sc != SC_SUCCESS) BSP_logf("%s %hu for attr id=%hu\n", __func__, sc, aa->attribute_id);
-    uint16_t nbtw = sizeof(PacketHeader) + sizeof(AttributeAction);
-    uint8_t packet[nbtw + Matter_encodedDataLength(EE_UNSIGNED_INT, 1)];
-    initResponsePacket((PacketHeader *)packet);
-    initAttributeAction((AttributeAction *)(packet + sizeof(PacketHeader)), aa->transaction_id, OC_STATUS_RESPONSE, aa->attribute_id);
-    nbtw += Matter_encode(packet + nbtw, EE_UNSIGNED_INT, &sc, 1);
-    DataLink_sendDatagram(me->datalink, packet, nbtw);
+    uint8_t *packet = reserveResponse(me, aa->transaction_id, OC_STATUS_RESPONSE, aa->attribute_id,
+                                      Matter_encodedDataLength(EE_UNSIGNED_INT, 1));
+    if (packet == NULL) return;
+
+    uint16_t nbtw = RESPONSE_HEADERS_SIZE + Matter_encode(packet + RESPONSE_HEADERS_SIZE, EE_UNSIGNED_INT, &sc, 1);
+    DataLink_commitPacket(me->datalink, packet, nbtw);
 }
 
 
@@ -120,10 +157,238 @@ static void logTransaction(AttributeAction const *aa, char const *action_str)
 }
 
 
-static void handleReadRequest(Controller *me, AttributeAction const *aa)
+static uint16_t decodeUnsigned(uint8_t const *src, uint16_t nb, uint32_t *value)
+{
+    uint8_t nr_of_octets;
+    switch (nb == 0 ? EE_NULL : src[0])
+    {
+        case EE_UNSIGNED_INT_1: nr_of_octets = 1; break;
+        case EE_UNSIGNED_INT_2: nr_of_octets = 2; break;
+        case EE_UNSIGNED_INT_4: nr_of_octets = 4; break;
+        default: return 0;
+    }
+    if (nb < 1 + nr_of_octets) return 0;
+
+    *value = 0;
+    for (uint8_t i = nr_of_octets; i != 0; i--) {
+        *value = (*value << 8) | src[i];        // Little endian.
+    }
+    return 1 + nr_of_octets;
+}
+
+
+/**
+ * Decode a list of unsigned attribute ids. Returns the number of octets used, or 0 if the list is malformed.
+ */
+static uint16_t decodeAttributeList(uint8_t const *src, uint16_t nb, uint16_t ids[], uint8_t *nr_of_ids)
+{
+    if (nb < 2 || src[0] != EE_LIST) return 0;
+
+    uint16_t pos = 1;
+    *nr_of_ids = 0;
+    while (pos < nb && src[pos] != EE_END_OF_CONTAINER) {
+        uint32_t id;
+        uint16_t const nbr = decodeUnsigned(src + pos, nb - pos, &id);
+        if (nbr == 0 || *nr_of_ids == MAX_IDS_PER_LIST) return 0;
+
+        ids[(*nr_of_ids)++] = (uint16_t)id;
+        pos += nbr;
+    }
+    return pos < nb ? pos + 1 : 0;
+}
+
+
+static uint16_t encodeValue(uint8_t *dst, ElementEncoding enc, void const *data, uint16_t size)
+{
+    return dst == NULL ? Matter_encodedDataLength(enc, size) : Matter_encode(dst, enc, (uint8_t const *)data, size);
+}
+
+/**
+ * Encode the current value of an attribute, or only compute its encoded length if dst is NULL.
+ * Returns 0 for attributes that cannot be read on the spot.
+ */
+static uint16_t encodeAttribute(Controller const *me, uint16_t ai, uint8_t *dst)
+{
+    switch (ai)
+    {
+        case AI_FIRMWARE_VERSION: {
+            char const *fw_version = BSP_firmwareVersion();
+            return encodeValue(dst, EE_UTF8_1LEN, fw_version, strlen(fw_version));
+        }
+        case AI_VOLTAGES: {
+            AdcValues av;
+            BSP_getAdcValues(&av);
+            return encodeValue(dst, EE_BYTES_1LEN, &av, sizeof av);
+        }
+        case AI_CLOCK_MICROS: {
+            uint64_t const clock_micros = BSP_microsecondsSinceBoot();
+            return encodeValue(dst, EE_UNSIGNED_INT, &clock_micros, sizeof clock_micros);
+        }
+        case AI_ALL_PATTERN_NAMES: {
+            uint8_t nr_of_patterns = Patterns_getCount();
+            char const *pattern_names[NR_OF_BUILT_IN_PATTERNS + MAX_USER_PATTERNS];
+            Patterns_getNames(pattern_names, nr_of_patterns);
+            return dst == NULL ? Matter_encodedStringArrayLength(pattern_names, nr_of_patterns)
+                               : Matter_encodeStringArray(dst, pattern_names, nr_of_patterns);
+        }
+        case AI_CURRENT_PATTERN_NAME: {
+            char const *name = Sequencer_getPatternName(me->sequencer);
+            return encodeValue(dst, EE_UTF8_1LEN, name, strlen(name));
+        }
+        case AI_INTENSITY_PERCENT: {
+            uint8_t const intensity_percent = Sequencer_getIntensityPercentage(me->sequencer);
+            return encodeValue(dst, EE_UNSIGNED_INT_1, &intensity_percent, sizeof intensity_percent);
+        }
+        case AI_PLAY_PAUSE_STOP: {
+            uint8_t const play_state = Sequencer_getPlayState(me->sequencer);
+            return encodeValue(dst, EE_UNSIGNED_INT_1, &play_state, sizeof play_state);
+        }
+        case AI_BOX_NAME:
+            return encodeValue(dst, EE_UTF8_1LEN, me->box_name, strlen(me->box_name));
+        case AI_PT_DESCRIPTOR_QUEUE: {
+            uint16_t nqbf[2];
+            Sequencer_getPtQueueBytesFree(me->sequencer, nqbf);
+            return encodeValue(dst, EE_BYTES_1LEN, nqbf, sizeof nqbf);
+        }
+        case AI_HEARTBEAT_INTERVAL_SECS:
+            return encodeValue(dst, EE_UNSIGNED_INT_2, &me->heartbeat_interval_secs, sizeof me->heartbeat_interval_secs);
+        case AI_TELEMETRY_RATE_HZ: {
+            uint8_t const rate_Hz = Telemetry_getRate();
+            return encodeValue(dst, EE_UNSIGNED_INT_1, &rate_Hz, sizeof rate_Hz);
+        }
+        case AI_PULSE_CAPTURE:
+            if (dst != NULL) *dst = Telemetry_isCapturingPulses() ? EE_BOOLEAN_TRUE : EE_BOOLEAN_FALSE;
+            return 1;
+        case AI_PULSE_RECORDER:
+            if (dst != NULL) *dst = Telemetry_isRecordingPulses() ? EE_BOOLEAN_TRUE : EE_BOOLEAN_FALSE;
+            return 1;
+        case AI_RECORDINGS: {
+            RecStoreInfo info;
+            RecStore_getInfo(&info);
+            return encodeValue(dst, EE_BYTES_1LEN, &info, sizeof info);
+        }
+        case AI_USER_PATTERNS: {
+            PatternStoreInfo info;
+            PatternStore_getInfo(&info);
+            return encodeValue(dst, EE_BYTES_1LEN, &info, sizeof info);
+        }
+        case AI_TRANSITION: {
+            TransitionSettings ts;
+            Sequencer_getTransition(me->sequencer, &ts);
+            return encodeValue(dst, EE_BYTES_1LEN, &ts, sizeof ts);
+        }
+        case AI_PATTERN_PROGRESS: {
+            uint32_t progress_ms[2];
+            Sequencer_getProgress(me->sequencer, progress_ms);
+            return encodeValue(dst, EE_BYTES_1LEN, progress_ms, sizeof progress_ms);
+        }
+        case AI_MODULATION: {
+            LfoSettings settings[MT_NR_OF_TARGETS];
+            Sequencer_getModulation(me->sequencer, settings);
+            return encodeValue(dst, EE_BYTES_1LEN, settings, sizeof settings);
+        }
+        case AI_PATTERN_PROGRAM: {
+            uint16_t const program_size = PatternVm_programSize();
+            return encodeValue(dst, EE_UNSIGNED_INT_2, &program_size, sizeof program_size);
+        }
+        case AI_PATTERN_LAYERS: {
+            uint8_t const nr_of_layers = Sequencer_getNrOfLayers(me->sequencer);
+            return encodeValue(dst, EE_UNSIGNED_INT_1, &nr_of_layers, sizeof nr_of_layers);
+        }
+        case AI_TRIAC_SETTLE_MICROS: {
+            uint16_t const settle_µs = BSP_triacSettleTime();
+            return encodeValue(dst, EE_UNSIGNED_INT_2, &settle_µs, sizeof settle_µs);
+        }
+        case AI_PLAYBACK: {
+            uint8_t recording_nr;
+            if (Sequencer_getPlayback(me->sequencer, &recording_nr)) {
+                return encodeValue(dst, EE_UNSIGNED_INT_1, &recording_nr, sizeof recording_nr);
+            }
+            if (dst != NULL) *dst = EE_BOOLEAN_FALSE;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void reportAttribute(Controller *me, AttributeAction const *aa)
+{
+    uint16_t const data_size = encodeAttribute(me, aa->attribute_id, NULL);
+    uint8_t *packet = reserveResponse(me, aa->transaction_id, OC_REPORT_DATA, aa->attribute_id, data_size);
+    if (packet == NULL) return;
+
+    encodeAttribute(me, aa->attribute_id, packet + RESPONSE_HEADERS_SIZE);
+    DataLink_commitPacket(me->datalink, packet, RESPONSE_HEADERS_SIZE + data_size);
+}
+
+
+static bool checkAttributeList(Controller *me, AttributeAction const *aa, uint16_t const ids[], uint8_t nr_of_ids)
+{
+    for (uint8_t i = 0; i < nr_of_ids; i++) {
+        if (encodeAttribute(me, ids[i], NULL) == 0) {
+            BSP_logf("%s: unsupported attribute id=%hu\n", __func__, ids[i]);
+            sendStatusResponse(me, aa, SC_UNSUPPORTED_ATTRIBUTE);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Report the listed attributes in as few packets as possible. Each packet carries
+ * a list of (attribute id, value) pairs, and is a complete report by itself.
+ */
+static void reportAttributeList(Controller *me, uint16_t trans_id, uint16_t const ids[], uint8_t nr_of_ids)
+{
+    uint8_t first = 0;
+    while (first < nr_of_ids) {
+        uint16_t data_size = 2;                 // The list's start and end markers.
+        uint8_t end = first;
+        do {
+            uint16_t const nb = LIST_ENTRY_HEADER_SIZE + encodeAttribute(me, ids[end], NULL);
+            if (end != first && RESPONSE_HEADERS_SIZE + data_size + nb > MAX_PAYLOAD_SIZE) break;
+            data_size += nb;
+        } while (++end < nr_of_ids);
+
+        uint8_t *packet = reserveResponse(me, trans_id, OC_REPORT_DATA, AI_ATTRIBUTE_LIST, data_size);
+        if (packet == NULL) return;
+
+        uint8_t *dst = packet + RESPONSE_HEADERS_SIZE;
+        *dst++ = EE_LIST;
+        for (uint8_t i = first; i < end; i++) {
+            dst += Matter_encode(dst, EE_UNSIGNED_INT_2, (uint8_t const *)&ids[i], sizeof ids[i]);
+            dst += encodeAttribute(me, ids[i], dst);
+        }
+        *dst++ = EE_END_OF_CONTAINER;
+        DataLink_commitPacket(me->datalink, packet, dst - packet);
+        first = end;
+    }
+}
+
+
+static void readAttributeList(Controller *me, AttributeAction const *aa)
+{
+    uint16_t ids[MAX_IDS_PER_LIST];
+    uint8_t nr_of_ids;
+    if (decodeAttributeList(aa->data, requestDataSize(me), ids, &nr_of_ids) == 0) {
+        sendStatusResponse(me, aa, SC_INVALID_COMMAND);
+    } else if (checkAttributeList(me, aa, ids, nr_of_ids)) {
+        reportAttributeList(me, aa->transaction_id, ids, nr_of_ids);
+    }
+}
+
+
+/**
+ * Returns false if the attribute cannot be read, after telling the client so.
+ */
+static bool handleReadRequest(Controller *me, AttributeAction const *aa)
 {
     switch (aa->attribute_id)
     {
+        case AI_ATTRIBUTE_LIST:
+            readAttributeList(me, aa);
+            break;
         case AI_FIRMWARE_VERSION: {
             char const *fw_version = BSP_firmwareVersion();
             attributeChanged(me, aa->attribute_id, aa->transaction_id, EE_UTF8_1LEN, (uint8_t const *)fw_version, strlen(fw_version));
@@ -156,11 +421,32 @@ static void handleReadRequest(Controller *me, AttributeAction const *aa)
         case AI_PT_DESCRIPTOR_QUEUE:
             Sequencer_notifyPtQueue(me->sequencer, aa->transaction_id);
             break;
+        case AI_TELEMETRY_RATE_HZ:
+        case AI_PULSE_CAPTURE:
+        case AI_PULSE_RECORDER:
+        case AI_RECORDINGS:
+        case AI_PLAYBACK:
+        case AI_USER_PATTERNS:
+        case AI_PATTERN_PROGRAM:
+        case AI_MODULATION:
+        case AI_PATTERN_PROGRESS:
+        case AI_TRANSITION:
+        case AI_PATTERN_LAYERS:
+        case AI_TRIAC_SETTLE_MICROS:
+            reportAttribute(me, aa);
+            break;
+        case AI_ADC_STREAM:
+        case AI_PULSE_METRICS:
+        case AI_PULSE_RECORDS:
+            // The samples only go out in reports to subscribers.
+            sendStatusResponse(me, aa, aa->opcode == OC_SUBSCRIBE_REQUEST ? SC_SUCCESS : SC_UNSUPPORTED_READ);
+            break;
         default:
             BSP_logf("%s: unknown attribute id=%hu\n", __func__, aa->attribute_id);
             sendStatusResponse(me, aa, SC_UNSUPPORTED_ATTRIBUTE);
-            return;
+            return false;
     }
+    return true;
 }
 
 
@@ -173,6 +459,35 @@ static EventType eventTypeForCommand(uint8_t const *cs, uint16_t len)
 }
 
 
+static void scheduleHeartbeat(Controller *me)
+{
+    if (me->heartbeat_interval_secs == 0) {
+        AppTimer_cancel(&me->heartbeat_timer);
+    } else {
+        uint32_t const interval_ms = me->heartbeat_interval_secs * 1000UL;
+        AppTimer_arm(&me->heartbeat_timer, interval_ms, interval_ms);
+    }
+}
+
+
+static void printTime()
+{
+    uint32_t seconds_since_boot = (uint32_t)(BSP_microsecondsSinceBoot() / 1000000UL);
+    CLI_logf("Time %02u:%02u:%02u\n", seconds_since_boot / 3600, (seconds_since_boot / 60) % 60, seconds_since_boot % 60);
+}
+
+
+static void queuePulseTrain(Controller *me, uint8_t const *pt, uint8_t nb)
+{
+    // Pass on a reference to the packet buffer instead of a copy.
+    BufferRef const br = { .data = pt, .size = nb, .buffer_nr = me->packet->buffer_nr };
+    BufferPool_retain(br.buffer_nr);
+    if (! EventQueue_postEvent((EventQueue *)me->sequencer, ET_QUEUE_PULSE_TRAIN, (uint8_t const *)&br, sizeof br)) {
+        BufferPool_release(br.buffer_nr);
+    }
+}
+
+
 static void updateBoxName(Controller *me, uint8_t const *name, uint16_t len)
 {
     size_t nb = (len < sizeof me->box_name ? len : sizeof me->box_name - 1);
@@ -183,6 +498,237 @@ static void updateBoxName(Controller *me, uint8_t const *name, uint16_t len)
 }
 
 
+/**
+ * TRUE begins a recording, descriptor streams of type bytes append to it, and FALSE ends it.
+ * NULL erases all recordings. Only while nothing plays, as erasing and programming the flash
+ * stall all code that runs from it, including the parts of the pulse path that do.
+ */
+static StatusCode updateRecordings(Controller *me, AttributeAction const *aa)
+{
+    if (Sequencer_getPlayState(me->sequencer) != PS_IDLE) return SC_BUSY;
+
+    uint16_t const nb = requestDataSize(me);
+    RecErrType err;
+    switch (aa->data[0])
+    {
+        case EE_BOOLEAN_TRUE:
+            return RecStore_beginRecording() ? SC_SUCCESS : SC_RESOURCE_EXHAUSTED;
+        case EE_BYTES_1LEN:
+            if (nb < 2 + aa->data[1]) return SC_CONSTRAINT_ERROR;
+            if (RecStore_append(aa->data + 2, aa->data[1], &err)) return SC_SUCCESS;
+            break;
+        case EE_BYTES_2LEN: {
+            uint16_t const len = aa->data[1] | (aa->data[2] << 8);
+            if (nb < 3 + len) return SC_CONSTRAINT_ERROR;
+            if (RecStore_append(aa->data + 3, len, &err)) return SC_SUCCESS;
+            break;
+        }
+        case EE_BOOLEAN_FALSE:
+            return RecStore_endRecording() ? SC_SUCCESS : SC_FAILURE;
+        case EE_NULL:
+            RecStore_eraseAll();
+            return SC_SUCCESS;
+        default:
+            return SC_INVALID_DATA_TYPE;
+    }
+    BSP_logf("Recording abandoned, err=%u\n", err);
+    return err == RE_STORE_FULL ? SC_RESOURCE_EXHAUSTED : err == RE_WRITE_FAILED ? SC_FAILURE : SC_CONSTRAINT_ERROR;
+}
+
+/**
+ * A recording number plays that recording from its start, or all of them if it is PLAYBACK_ALL.
+ * Bytes {recording number, start time in ms as a 4-octet LE integer} play from somewhere in between.
+ */
+static StatusCode startPlayback(Controller *me, AttributeAction const *aa)
+{
+    PlaybackRequest pr = { .from_ms = 0 };
+    if (aa->data[0] == EE_UNSIGNED_INT_1) {
+        if (requestDataSize(me) < 2) return SC_INVALID_COMMAND;
+        pr.recording_nr = aa->data[1];
+    } else if (aa->data[0] == EE_BYTES_1LEN && aa->data[1] == 5 && requestDataSize(me) >= 7) {
+        pr.recording_nr = aa->data[2];
+        memcpy(&pr.from_ms, aa->data + 3, sizeof pr.from_ms);
+    } else if (aa->data[0] == EE_BOOLEAN_FALSE) {
+        EventQueue_postEvent((EventQueue *)me->sequencer, ET_STOP_STREAM, NULL, 0);
+        return SC_SUCCESS;
+    } else {
+        return SC_INVALID_DATA_TYPE;
+    }
+    if (pr.recording_nr != PLAYBACK_ALL && pr.recording_nr >= RecStore_nrOfRecordings()) return SC_NOT_FOUND;
+
+    EventQueue_postEvent((EventQueue *)me->sequencer, ET_START_PLAYBACK, (uint8_t const *)&pr, sizeof pr);
+    return SC_SUCCESS;
+}
+
+
+/**
+ * Bytes {pace in µs, number of repetitions (both 2-octet LE integers), number of steps, name length, name, elcons}
+ * store a pattern, a string removes the pattern of that name and NULL removes all uploaded patterns.
+ */
+static StatusCode updateUserPatterns(Controller *me, AttributeAction const *aa)
+{
+    // The sequencer may be using any of them.
+    if (Sequencer_getPlayState(me->sequencer) != PS_IDLE) return SC_BUSY;
+
+    uint16_t const nb = requestDataSize(me);
+    char const *selected_name = Sequencer_getPatternName(me->sequencer);
+    PatternDescr const *selected = Patterns_findByName(selected_name, strlen(selected_name));
+    switch (aa->data[0])
+    {
+        case EE_BYTES_1LEN: {
+            uint8_t const *src = aa->data + 2;
+            uint8_t const len = aa->data[1];
+            if (nb < 2 + len || len < 6 || len < 6 + src[5]) return SC_CONSTRAINT_ERROR;
+            if ((len - 6 - src[5]) % 2 != 0) return SC_CONSTRAINT_ERROR;   // Half an elcon pair.
+
+            PatternDescr const pd = {
+                .pace_µs = src[0] | (src[1] << 8), .nr_of_reps = src[2] | (src[3] << 8), .nr_of_steps = src[4],
+                .name = (char const *)src + 6,
+                .pattern = (uint8_t const (*)[2])(src + 6 + src[5]), .nr_of_elcons = (len - 6 - src[5]) / 2,
+            };
+            if (! Patterns_isValid(&pd, src[5])) return SC_CONSTRAINT_ERROR;
+
+            PatStoreErrType err;
+            if (PatternStore_put(&pd, src[5], &err)) return SC_SUCCESS;
+            return err == PSE_WRITE_FAILED ? SC_FAILURE : SC_RESOURCE_EXHAUSTED;
+        }
+        case EE_UTF8_1LEN: {
+            if (nb < 2 || nb < 2 + aa->data[1]) return SC_INVALID_COMMAND;
+
+            char const *name = (char const *)aa->data + 2;
+            PatternDescr const *pd = Patterns_findByName(name, aa->data[1]);
+            if (pd == NULL || Patterns_isBuiltIn(pd)) return SC_NOT_FOUND;
+            if (pd == selected) return SC_BUSY;
+            return PatternStore_remove(name, aa->data[1]) ? SC_SUCCESS : SC_FAILURE;
+        }
+        case EE_NULL:
+            if (! Patterns_isBuiltIn(selected)) return SC_BUSY;
+            PatternStore_eraseAll();
+            return SC_SUCCESS;
+    }
+    return SC_INVALID_DATA_TYPE;
+}
+
+
+/**
+ * Bytes load a pattern program, TRUE runs it and FALSE stops it.
+ * Programs live in RAM, so they must be loaded again after a reset.
+ */
+static StatusCode updatePatternProgram(Controller *me, AttributeAction const *aa)
+{
+    uint16_t const nb = requestDataSize(me);
+    switch (aa->data[0])
+    {
+        case EE_BYTES_1LEN: {
+            // A running program would change under the sequencer's feet.
+            if (Sequencer_getPlayState(me->sequencer) != PS_IDLE) return SC_BUSY;
+            if (nb < 2 + aa->data[1]) return SC_CONSTRAINT_ERROR;
+
+            uint16_t bad_pc;
+            if (PatternVm_load(aa->data + 2, aa->data[1], &bad_pc)) return SC_SUCCESS;
+            BSP_logf("Bad pattern program at pc=%hu\n", bad_pc);
+            return SC_CONSTRAINT_ERROR;
+        }
+        case EE_BOOLEAN_TRUE:
+            if (PatternVm_programSize() == 0) return SC_NOT_FOUND;
+            EventQueue_postEvent((EventQueue *)me->sequencer, ET_START_PROGRAM, NULL, 0);
+            return SC_SUCCESS;
+        case EE_BOOLEAN_FALSE:
+            EventQueue_postEvent((EventQueue *)me->sequencer, ET_STOP_STREAM, NULL, 0);
+            return SC_SUCCESS;
+    }
+    return SC_INVALID_DATA_TYPE;
+}
+
+
+/**
+ * Bytes {target, waveform, depth in %, rate in cHz as a 2-octet LE integer} set up the LFO for one target.
+ */
+static StatusCode setModulation(Controller *me, AttributeAction const *aa)
+{
+    if (aa->data[0] != EE_BYTES_1LEN) return SC_INVALID_DATA_TYPE;
+    uint16_t const nb = requestDataSize(me);
+    if (aa->data[1] != 1 + sizeof(LfoSettings) || nb < 2 + aa->data[1]) return SC_CONSTRAINT_ERROR;
+
+    LfoSettings ls;
+    memcpy(&ls, aa->data + 3, sizeof ls);
+    if (aa->data[2] >= MT_NR_OF_TARGETS || ! Lfo_isValid(&ls)) return SC_CONSTRAINT_ERROR;
+
+    EventQueue_postEvent((EventQueue *)me->sequencer, ET_SET_MODULATION, aa->data + 2, aa->data[1]);
+    return SC_SUCCESS;
+}
+
+
+/**
+ * Bytes {crossfade in ms as a 2-octet LE integer, boundary, 0} set how a playing pattern switches to the next one.
+ */
+static StatusCode setTransition(Controller *me, AttributeAction const *aa)
+{
+    if (aa->data[0] != EE_BYTES_1LEN) return SC_INVALID_DATA_TYPE;
+
+    uint16_t const nb = requestDataSize(me);
+    if (aa->data[1] != sizeof(TransitionSettings) || nb < 2 + aa->data[1]) return SC_CONSTRAINT_ERROR;
+
+    TransitionSettings ts;
+    memcpy(&ts, aa->data + 2, sizeof ts);
+    if (ts.boundary >= TB_NR_OF_BOUNDARIES || ts.crossfade_ms > MAX_CROSSFADE_ms) return SC_CONSTRAINT_ERROR;
+
+    EventQueue_postEvent((EventQueue *)me->sequencer, ET_SET_TRANSITION, (uint8_t const *)&ts, sizeof ts);
+    return SC_SUCCESS;
+}
+
+
+/**
+ * Bytes hold one {intensity in %, name length, name} entry per layer. The layers play at the same time,
+ * so their patterns must not share electrodes, and share the voltage of the most intense one. FALSE stops them.
+ */
+static StatusCode playLayers(Controller *me, AttributeAction const *aa)
+{
+    if (aa->data[0] == EE_BOOLEAN_FALSE) {
+        EventQueue_postEvent((EventQueue *)me->sequencer, ET_STOP_STREAM, NULL, 0);
+        return SC_SUCCESS;
+    }
+    if (aa->data[0] != EE_BYTES_1LEN) return SC_INVALID_DATA_TYPE;
+    if (Sequencer_getPlayState(me->sequencer) != PS_IDLE) return SC_BUSY;
+
+    uint16_t const nb = requestDataSize(me);
+    uint8_t const len = aa->data[1];
+    if (nb < 2 + len) return SC_CONSTRAINT_ERROR;
+
+    LayerSpec specs[MUX_MAX_LAYERS];
+    uint8_t nr_of_layers = 0;
+    uint8_t const *src = aa->data + 2;
+    for (uint8_t offset = 0; offset < len; offset += 2 + src[offset + 1]) {
+        if (nr_of_layers == MUX_MAX_LAYERS || len - offset < 2 || len - offset < 2 + src[offset + 1]) {
+            return SC_CONSTRAINT_ERROR;
+        }
+        specs[nr_of_layers].intensity_percent = src[offset];
+        specs[nr_of_layers].pd = Patterns_findByName((char const *)src + offset + 2, src[offset + 1]);
+        if (specs[nr_of_layers++].pd == NULL) return SC_NOT_FOUND;
+    }
+
+    MuxErrType err;
+    if (! PatternMux_check(specs, nr_of_layers, &err)) {
+        BSP_logf("Layers rejected, err=%d\n", err);
+        return SC_CONSTRAINT_ERROR;
+    }
+    EventQueue_postEvent((EventQueue *)me->sequencer, ET_START_LAYERS, (uint8_t const *)specs, nr_of_layers * sizeof(LayerSpec));
+    return SC_SUCCESS;
+}
+
+
+// Between setting the switches and starting a burst. The BSP clamps it to what it can do.
+static StatusCode setTriacSettleTime(Controller *me, AttributeAction const *aa)
+{
+    if (aa->data[0] != EE_UNSIGNED_INT_2) return SC_INVALID_DATA_TYPE;
+    if (requestDataSize(me) < 3) return SC_INVALID_COMMAND;
+
+    uint16_t const settle_µs = BSP_setTriacSettleTime(aa->data[1] | (aa->data[2] << 8));
+    BSP_logf("Triac settle time is %hu µs\n", settle_µs);
+    return SC_SUCCESS;
+}
+
+
 static void handleWriteRequest(Controller *me, AttributeAction const *aa)
 {
     switch (aa->attribute_id)
@@ -209,7 +755,7 @@ static void handleWriteRequest(Controller *me, AttributeAction const *aa)
             break;
         case AI_PT_DESCRIPTOR_QUEUE:
             if (aa->data[0] == EE_BYTES_1LEN) {
-                EventQueue_postEvent((EventQueue *)me->sequencer, ET_QUEUE_PULSE_TRAIN, aa->data + 2, aa->data[1]);
+                queuePulseTrain(me, aa->data + 2, aa->data[1]);
             }
             break;
         case AI_HEARTBEAT_INTERVAL_SECS:
@@ -217,8 +763,63 @@ static void handleWriteRequest(Controller *me, AttributeAction const *aa)
                 uint16_t interval_secs = aa->data[1] | (aa->data[2] << 8);
                 if (interval_secs > 3600) interval_secs = 3600;
                 BSP_logf("Setting heartbeat interval to %hu seconds\n", interval_secs);
-                me->heartbeat_interval_µs = interval_secs * 1000000UL;
+                me->heartbeat_interval_secs = interval_secs;
+                scheduleHeartbeat(me);
+            }
+            break;
+        case AI_TELEMETRY_RATE_HZ:
+            if (aa->data[0] == EE_UNSIGNED_INT_1) {
+                Telemetry_setRate(aa->data[1]);
+            }
+            break;
+        case AI_PULSE_CAPTURE:
+            if (aa->data[0] == EE_BOOLEAN_FALSE || aa->data[0] == EE_BOOLEAN_TRUE) {
+                if (! Telemetry_capturePulses(aa->data[0] == EE_BOOLEAN_TRUE)) {
+                    sendStatusResponse(me, aa, SC_BUSY);
+                    return;
+                }
+            }
+            break;
+        case AI_PULSE_RECORDER:
+            if (aa->data[0] == EE_BOOLEAN_FALSE || aa->data[0] == EE_BOOLEAN_TRUE) {
+                Telemetry_recordPulses(aa->data[0] == EE_BOOLEAN_TRUE);
+            }
+            break;
+        case AI_RECORDINGS:
+            sendStatusResponse(me, aa, updateRecordings(me, aa));
+            return;
+        case AI_PLAYBACK:
+            sendStatusResponse(me, aa, startPlayback(me, aa));
+            return;
+        case AI_USER_PATTERNS:
+            sendStatusResponse(me, aa, updateUserPatterns(me, aa));
+            return;
+        case AI_PATTERN_PROGRAM:
+            sendStatusResponse(me, aa, updatePatternProgram(me, aa));
+            return;
+        case AI_MODULATION:
+            sendStatusResponse(me, aa, setModulation(me, aa));
+            return;
+        case AI_TRANSITION:
+            sendStatusResponse(me, aa, setTransition(me, aa));
+            return;
+        case AI_PATTERN_LAYERS:
+            sendStatusResponse(me, aa, playLayers(me, aa));
+            return;
+        case AI_TRIAC_SETTLE_MICROS:
+            sendStatusResponse(me, aa, setTriacSettleTime(me, aa));
+            return;
+        case AI_PATTERN_PROGRESS:
+            // Seek, in the pattern that is playing or the next one to start.
+            if (aa->data[0] != EE_UNSIGNED_INT_4) {
+                sendStatusResponse(me, aa, SC_INVALID_DATA_TYPE);
+                return;
             }
+            if (requestDataSize(me) < 1 + sizeof(uint32_t)) {
+                sendStatusResponse(me, aa, SC_INVALID_COMMAND);
+                return;
+            }
+            EventQueue_postEvent((EventQueue *)me->sequencer, ET_SEEK_PATTERN, aa->data + 1, sizeof(uint32_t));
             break;
         default:
             BSP_logf("%s: unknown attribute id=%hu\n", __func__, aa->attribute_id);
@@ -254,6 +855,67 @@ static void handleInvokeRequest(Controller *me, AttributeAction const *aa)
 }
 
 
+/**
+ * Optionally, the min and max reporting intervals in ms, as unsigned integers.
+ */
+static void decodeIntervals(uint8_t const *data, uint16_t nb, uint32_t intervals_ms[2])
+{
+    for (uint8_t i = 0; i < 2; i++) {
+        uint16_t const nbr = decodeUnsigned(data, nb, &intervals_ms[i]);
+        data += nbr;
+        nb -= nbr;
+    }
+}
+
+
+static void subscribeToAttributeList(Controller *me, AttributeAction const *aa)
+{
+    uint16_t ids[MAX_IDS_PER_LIST];
+    uint8_t nr_of_ids;
+    uint16_t const nb = requestDataSize(me);
+    uint16_t const nbr = decodeAttributeList(aa->data, nb, ids, &nr_of_ids);
+    if (nbr == 0) {
+        sendStatusResponse(me, aa, SC_INVALID_COMMAND);
+        return;
+    }
+    if (! checkAttributeList(me, aa, ids, nr_of_ids)) return;
+
+    uint32_t intervals_ms[2] = {0, 0};
+    decodeIntervals(aa->data + nbr, nb - nbr, intervals_ms);
+    SubscriptionId sub_ids[MAX_IDS_PER_LIST];
+    for (uint8_t i = 0; i < nr_of_ids; i++) {
+        sub_ids[i] = Attribute_subscribeWithIntervals(ids[i], aa->transaction_id, intervals_ms[0], intervals_ms[1],
+                                                      (AttrNotifier)&attributeChanged, me);
+        if (sub_ids[i] == NO_SUB_ID) {          // All or nothing.
+            while (i != 0) Attribute_unsubscribe(sub_ids[--i]);
+            sendStatusResponse(me, aa, SC_RESOURCE_EXHAUSTED);
+            return;
+        }
+    }
+    reportAttributeList(me, aa->transaction_id, ids, nr_of_ids);
+}
+
+
+static void handleSubscribeRequest(Controller *me, AttributeAction const *aa)
+{
+    if (aa->attribute_id == AI_ATTRIBUTE_LIST) {
+        subscribeToAttributeList(me, aa);
+        return;
+    }
+
+    uint32_t intervals_ms[2] = {0, 0};
+    decodeIntervals(aa->data, requestDataSize(me), intervals_ms);
+    SubscriptionId const sub_id = Attribute_subscribeWithIntervals(aa->attribute_id, aa->transaction_id,
+                                         intervals_ms[0], intervals_ms[1], (AttrNotifier)&attributeChanged, me);
+    if (sub_id == NO_SUB_ID) {
+        sendStatusResponse(me, aa, SC_RESOURCE_EXHAUSTED);
+        return;
+    }
+    // The initial read tells whether the attribute exists. If not, free the slot again.
+    if (! handleReadRequest(me, aa)) Attribute_unsubscribe(sub_id);
+}
+
+
 static void handleRequest(Controller *me, AttributeAction const *aa)
 {
     switch (aa->opcode)
@@ -264,15 +926,22 @@ static void handleRequest(Controller *me, AttributeAction const *aa)
             break;
         case OC_WRITE_REQUEST:
             // logTransaction(aa, "write");
+            if (requestDataSize(me) == 0) {
+                sendStatusResponse(me, aa, SC_INVALID_DATA_TYPE);
+                break;
+            }
             handleWriteRequest(me, aa);
             break;
         case OC_SUBSCRIBE_REQUEST:
             logTransaction(aa, "subscribe to");
-            Attribute_subscribe(aa->attribute_id, aa->transaction_id, (AttrNotifier)&attributeChanged, me);
-            handleReadRequest(me, aa);
+            handleSubscribeRequest(me, aa);
             break;
         case OC_INVOKE_REQUEST:
             logTransaction(aa, "invoke");
+            if (requestDataSize(me) == 0) {
+                sendStatusResponse(me, aa, SC_INVALID_COMMAND);
+                break;
+            }
             handleInvokeRequest(me, aa);
             break;
         default:
@@ -282,6 +951,20 @@ static void handleRequest(Controller *me, AttributeAction const *aa)
 }
 
 
+static void handleIncomingPacket(Controller *me, BufferRef const *br)
+{
+    if (br->size < RESPONSE_HEADERS_SIZE) {
+        BSP_logf("%s: runt packet of %hu bytes\n", __func__, br->size);
+    } else {
+        me->packet = br;
+        // Ignore the packet header for now.
+        handleRequest(me, (AttributeAction const *)(br->data + sizeof(PacketHeader)));
+        me->packet = NULL;
+    }
+    BufferPool_release(br->buffer_nr);
+}
+
+
 static void *stateNop(Controller *me, AOEvent const *evt)
 {
     BSP_logf("Controller_%s unexpected event: %u\n", __func__, AOEvent_type(evt));
@@ -303,8 +986,19 @@ static void *stateReady(Controller *me, AOEvent const *evt)
             DataLink_sendDebugPacket(me->datalink, welcome_msg, sizeof welcome_msg);
             break;
         case ET_INCOMING_PACKET:
-            // Ignore the packet header for now.
-            handleRequest(me, (AttributeAction const *)(AOEvent_data(evt) + sizeof(PacketHeader)));
+            handleIncomingPacket(me, (BufferRef const *)AOEvent_data(evt));
+            break;
+        case ET_APP_HEARTBEAT:
+            printTime();
+            break;
+        case ET_SUBSCRIPTION_TIMER:
+            Attribute_handleTimerEvent(*(AppTimer * const *)AOEvent_data(evt));
+            break;
+        case ET_TELEMETRY_TIMER:
+            Telemetry_handleTimerEvent(*(AppTimer * const *)AOEvent_data(evt));
+            break;
+        case ET_PULSE_METRICS:
+            Telemetry_handlePulseMetrics((PulseMetrics const *)AOEvent_data(evt), AOEvent_dataSize(evt));
             break;
         default:
             BSP_logf("Controller_%s unexpected event: %u\n", __func__, AOEvent_type(evt));
@@ -333,7 +1027,8 @@ static void dispatchEvent(Controller *me, AOEvent const *evt)
 
 Controller *Controller_new()
 {
-    Controller *me = (Controller *)malloc(sizeof(Controller));
+    static Controller controller ARENA(controller);    // There is only one.
+    Controller *me = &controller;
     EventQueue_init(&me->event_queue, me->event_storage, sizeof me->event_storage);
     me->state = &stateNop;
     return me;
@@ -345,7 +1040,11 @@ void Controller_init(Controller *me, Sequencer *sequencer, DataLink *datalink)
     snprintf(me->box_name, sizeof me->box_name, "Neostim %s", BSP_deviceTypeName());
     me->sequencer = sequencer;
     me->datalink  = datalink;
-    me->heartbeat_interval_µs = 15000000;
+    me->packet    = NULL;
+    Attribute_startService(&me->event_queue, ET_SUBSCRIPTION_TIMER);
+    Telemetry_startService(&me->event_queue, ET_TELEMETRY_TIMER);
+    AppTimer_init(&me->heartbeat_timer, &me->event_queue, ET_APP_HEARTBEAT);
+    me->heartbeat_interval_secs = 15;
 }
 
 
@@ -355,6 +1054,7 @@ void Controller_start(Controller *me)
     me->state(me, AOEvent_newEntryEvent());
     DataLink_open(me->datalink, &me->event_queue);
     DataLink_awaitSync(me->datalink);
+    scheduleHeartbeat(me);
     BSP_logf("Welcome to the %s!\n%s", me->box_name, welcome_msg);
 }
 
@@ -365,14 +1065,10 @@ bool Controller_handleEvent(Controller *me)
 }
 
 
-bool Controller_heartbeatElapsed(Controller const *me, uint32_t delta_µs)
-{
-    return me->heartbeat_interval_µs != 0 && delta_µs >= me->heartbeat_interval_µs;
-}
-
-
 void Controller_stop(Controller *me)
 {
+    AppTimer_cancel(&me->heartbeat_timer);
+    Telemetry_stopService();
     me->state(me, AOEvent_newExitEvent());
     me->state = stateNop;
     BSP_logf("End of session\n");
@@ -382,5 +1078,5 @@ void Controller_stop(Controller *me)
 
 void Controller_delete(Controller *me)
 {
-    free(me);
+    me->state = &stateNop;
 }
@@ -11,35 +11,46 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "bsp_dbg.h"
 #include "bsp_mao.h"
 #include "bsp_comms.h"
+#include "bsp_app.h"
 #include "app_event.h"
 #include "net_frame.h"
+#include "frame_pool.h"
+#include "buffer_pool.h"
 #include "debug_cli.h"                          // Temporary.
 
 // This module implements:
 #include "datalink.h"
 
-#define MAX_PAYLOAD_SIZE    512
+// Frames waiting for the serial port: at most one per sequence number, plus some ACKs.
+#ifndef TX_QUEUE_LENGTH
+#define TX_QUEUE_LENGTH     12
+#endif
 
 typedef struct {
-    uint8_t  frame[FRAME_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+    uint8_t *frame;                             // From the frame pool, until acknowledged.
     uint32_t frame_timestamp_µs;
 } TxFrameInfo;
 
 struct _DataLink {
     EventQueue *delegate_queue;
     TxFrameInfo tx_frame_info[NR_OF_FRAME_SEQ_NRS];
-    CircBuffer output_buffer;
-    uint8_t tx_buf_store[600];
-    uint8_t rx_frame_buffer[FRAME_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+    uint8_t *tx_queue[TX_QUEUE_LENGTH];         // Frames from the frame pool, sent straight from there.
+    uint16_t tx_frame_size;                     // Of the frame at the tail.
+    uint16_t tx_nb;                             // Bytes of that frame sent so far.
+    uint8_t tx_head, tx_tail, tx_count;
+    uint8_t *rx_frame_buffer;                   // From the buffer pool.
+    uint8_t rx_buffer_nr;
     uint8_t rx_nb;
     DeviceId channel_fd;
     uint16_t rx_payload_size;
     uint8_t tx_seq_nr;
     uint8_t synced;
+    uint8_t acked_once;
 };
 
 
@@ -48,6 +59,9 @@ static void init(DataLink *me)
     me->rx_nb = 0;
     me->synced = false;
     me->tx_seq_nr = 0;
+    me->acked_once = false;
+    me->tx_head = me->tx_tail = me->tx_count = 0;
+    me->tx_nb = 0;
 }
 
 
@@ -90,28 +104,81 @@ static FrameType assembleIncomingFrame(DataLink *me, uint8_t ch)
 }
 
 
-static uint32_t writeFrame(DataLink *me, uint8_t const *frame, uint32_t nb)
+static uint16_t frameSize(uint8_t const *frame)
 {
-    BSP_criticalSectionEnter();
-    uint32_t nbw = CircBuffer_write(&me->output_buffer, frame, nb);
-    if (nbw != 0) BSP_doChannelAction(me->channel_fd, CA_TX_CB_ENABLE);
-    BSP_criticalSectionExit();
-    return nbw;
+    return FRAME_HEADER_SIZE + PhysFrame_payloadSize((PhysFrame const *)frame);
+}
+
+
+static bool isQueuedForTx(DataLink const *me, uint8_t const *frame)
+{
+    for (uint8_t i = 0, qi = me->tx_tail; i < me->tx_count; i++, qi = (qi + 1) % TX_QUEUE_LENGTH) {
+        if (me->tx_queue[qi] == frame) return true;
+    }
+    return false;
+}
+
+
+static bool isHeldForRetransmit(DataLink const *me, uint8_t const *frame)
+{
+    for (uint8_t i = 0; i < NR_OF_FRAME_SEQ_NRS; i++) {
+        if (me->tx_frame_info[i].frame == frame) return true;
+    }
+    return false;
+}
+
+
+static bool enqueueFrame(DataLink *me, uint8_t *frame)
+{
+    // Only the serial port and app timer ISRs touch the tx queue; keep the pulse ISRs live.
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    bool const ok = me->tx_count < TX_QUEUE_LENGTH;
+    if (ok) {
+        if (me->tx_count++ == 0) me->tx_frame_size = frameSize(frame);
+        me->tx_queue[me->tx_head] = frame;
+        me->tx_head = (me->tx_head + 1) % TX_QUEUE_LENGTH;
+        BSP_doChannelAction(me->channel_fd, CA_TX_CB_ENABLE);
+    }
+    BSP_restoreInterrupts(im);
+    return ok;
 }
 
 
 static void respondWithAckFrame(DataLink *me, uint8_t ack_nr, NetworkServiceType nst)
 {
-    uint8_t ack_frame[FRAME_HEADER_SIZE];
     // TODO Check whether we have an outbound frame queued that
     // we can piggyback on instead of sending a separate ACK frame.
+    uint8_t *ack_frame = FramePool_alloc(FRAME_HEADER_SIZE);
+    if (ack_frame == NULL) return;              // The peer will retransmit.
+
     PhysFrame_initHeaderWithAck((PhysFrame *)ack_frame, FT_ACK, 0, ack_nr, nst);
     // BSP_logf("%s(%hhu) to controller\n", __func__, ack_nr);
-    writeFrame(me, ack_frame, sizeof ack_frame);
+    if (! enqueueFrame(me, ack_frame)) FramePool_free(ack_frame);
+    if (! me->acked_once) {                     // How long before we respond to the controller?
+        BSP_logf("First ACK at %u ms after boot\n", (uint32_t)(BSP_microsecondsSinceBoot() / 1000));
+        me->acked_once = true;
+    }
 }
 
 
-static void handleIncomingDataFrame(DataLink *me, PhysFrame const *frame)
+static bool deliverPacket(DataLink *me, uint8_t const *payload, uint16_t payload_size)
+{
+    // Hand the current rx buffer to the delegate, and receive the next frame into a fresh one.
+    uint8_t const next_buffer_nr = BufferPool_acquire();
+    if (next_buffer_nr == NO_BUFFER) return false;
+
+    BufferRef const br = { .data = payload, .size = payload_size, .buffer_nr = me->rx_buffer_nr };
+    if (! EventQueue_postEvent(me->delegate_queue, ET_INCOMING_PACKET, (uint8_t const *)&br, sizeof br)) {
+        BufferPool_release(next_buffer_nr);
+        return false;
+    }
+    me->rx_buffer_nr = next_buffer_nr;
+    me->rx_frame_buffer = BufferPool_data(next_buffer_nr);
+    return true;
+}
+
+
+static bool handleIncomingDataFrame(DataLink *me, PhysFrame const *frame)
 {
     NetworkServiceType nst = PhysFrame_serviceType(frame);
     uint8_t const *payload = PhysFrame_payload(frame);
@@ -119,10 +186,10 @@ static void handleIncomingDataFrame(DataLink *me, PhysFrame const *frame)
     if (nst == NST_DEBUG) {
         // BSP_logf("Got debug frame, seq_nr=%hhu, command length=%hu\n", PhysFrame_seqNr(frame), payload_size);
         CLI_handleRemoteInput(payload, payload_size);
-    } else {
-        // BSP_logf("Got packet frame, seq_nr=%hhu, packet size=%hu\n", PhysFrame_seqNr(frame), payload_size);
-        EventQueue_postEvent(me->delegate_queue, ET_INCOMING_PACKET, payload, payload_size);
+        return true;
     }
+    // BSP_logf("Got packet frame, seq_nr=%hhu, packet size=%hu\n", PhysFrame_seqNr(frame), payload_size);
+    return deliverPacket(me, payload, payload_size);
 }
 
 
@@ -138,6 +205,48 @@ static uint32_t getFrameAckDelay(DataLink *me, uint8_t ack_nr)
 }
 
 
+static void releaseFrame(DataLink *me, uint8_t seq_nr)
+{
+    // Called from the serial port ISR as well.
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    uint8_t *frame = me->tx_frame_info[seq_nr].frame;
+    me->tx_frame_info[seq_nr].frame = NULL;
+    // If it is still waiting to be sent, the tx callback frees it afterwards.
+    if (frame != NULL && ! isQueuedForTx(me, frame)) FramePool_free(frame);
+    BSP_restoreInterrupts(im);
+}
+
+
+static uint8_t *allocFrame(DataLink *me, uint16_t nb)
+{
+    uint8_t *frame_store;
+    // If the pool has run dry, give up on the oldest unacknowledged frames first.
+    uint8_t seq_nr = me->tx_seq_nr;
+    while ((frame_store = FramePool_alloc(nb)) == NULL) {
+        seq_nr = (seq_nr + 1) & 0x7;
+        if (seq_nr == me->tx_seq_nr) return NULL;
+        releaseFrame(me, seq_nr);
+    }
+    return frame_store;
+}
+
+
+static void discardAllFrames(DataLink *me)
+{
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    for (uint8_t seq_nr = 0; seq_nr < NR_OF_FRAME_SEQ_NRS; seq_nr++) {
+        releaseFrame(me, seq_nr);
+    }
+    while (me->tx_count != 0) {
+        FramePool_free(me->tx_queue[me->tx_tail]);
+        me->tx_tail = (me->tx_tail + 1) % TX_QUEUE_LENGTH;
+        me->tx_count--;
+    }
+    me->tx_nb = 0;
+    BSP_restoreInterrupts(im);
+}
+
+
 static void handleIncomingFrame(DataLink *me, PhysFrame const *frame)
 {
     if (! PhysFrame_isIntact(frame)) {
@@ -153,6 +262,7 @@ static void handleIncomingFrame(DataLink *me, PhysFrame const *frame)
         __attribute__((unused))                 // Temporary.
         uint32_t ack_delay = getFrameAckDelay(me, ack_nr);
         // BSP_logf("Got ACK for frame %hhu after %u µs\n", ack_nr, ack_delay);
+        releaseFrame(me, ack_nr);
         // TODO Slide the window.
         return;
     }
@@ -168,8 +278,8 @@ static void handleIncomingFrame(DataLink *me, PhysFrame const *frame)
 
     uint16_t payload_size = PhysFrame_payloadSize(frame);
     if (frame_type == FT_DATA) {
-        handleIncomingDataFrame(me, frame);
-        respondWithAckFrame(me, rx_seq_nr, nst);
+        // If the application cannot take it now, withhold the ACK to make the peer retransmit.
+        if (handleIncomingDataFrame(me, frame)) respondWithAckFrame(me, rx_seq_nr, nst);
     } else {
         BSP_logf("Got %s frame, seq_nr=%hhu, payload_size=%hu\n",
                     PhysFrame_frameTypeName(frame_type), rx_seq_nr, payload_size);
@@ -204,12 +314,20 @@ static void rxErrorCallback(DataLink *me, uint32_t rx_error)
 
 static void txCallback(DataLink *me, uint8_t *dst)
 {
-    // Disable this callback before sending the last byte from the buffer.
-    if (CircBuffer_availableData(&me->output_buffer) == 1) {
+    M_ASSERT(me->tx_count != 0);
+    uint8_t *frame = me->tx_queue[me->tx_tail];
+    *dst = frame[me->tx_nb++];
+    if (me->tx_nb < me->tx_frame_size) return;
+
+    // Last byte of this frame. Unless the peer may want it again, its block can go.
+    me->tx_nb = 0;
+    me->tx_tail = (me->tx_tail + 1) % TX_QUEUE_LENGTH;
+    if (! isHeldForRetransmit(me, frame)) FramePool_free(frame);
+    if (--me->tx_count == 0) {
         BSP_doChannelAction(me->channel_fd, CA_TX_CB_DISABLE);
+    } else {
+        me->tx_frame_size = frameSize(me->tx_queue[me->tx_tail]);
     }
-    uint32_t nbr = CircBuffer_read(&me->output_buffer, dst, 1);
-    M_ASSERT(nbr == 1);
 }
 
 
@@ -233,17 +351,96 @@ static void setupChannel(DataLink *me)
 }
 
 
-static bool sendPacket(DataLink *me, NetworkServiceType nst, uint8_t const *packet, uint16_t nb)
+static uint8_t crc8(uint8_t crc, uint8_t const *data, uint16_t nb)
 {
-    uint8_t *frame_store = me->tx_frame_info[me->tx_seq_nr].frame;
-    PhysFrame_init((PhysFrame *)frame_store, FT_DATA, me->tx_seq_nr, nst, packet, nb);
-    if (writeFrame(me, frame_store, FRAME_HEADER_SIZE + nb) == FRAME_HEADER_SIZE + nb) {
+    while (nb-- != 0) {
+        crc ^= *data++;
+        for (uint8_t k = 0; k < 8; k++) crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+
+static uint16_t crc16(uint16_t crc, uint8_t const *data, uint16_t nb)
+{
+    while (nb-- != 0) {
+        crc ^= *data++ << 8;
+        for (uint8_t k = 0; k < 8; k++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// Multiplies two polynomials modulo the CRC-16 polynomial.
+static uint16_t crc16MulMod(uint16_t a, uint16_t b)
+{
+    uint16_t product = 0;
+    for (uint16_t bit = 0x8000; bit != 0; bit >>= 1) {
+        product = (product & 0x8000) ? (product << 1) ^ 0x1021 : product << 1;
+        if (b & bit) product ^= a;
+    }
+    return product;
+}
+
+// What running nb zero bytes through the CRC-16 multiplies its register by: x^(8 * nb).
+static uint16_t crc16ZeroBytesFactor(uint16_t nb)
+{
+    uint16_t factor = 1, power = 0x0100;
+    for (; nb != 0; nb >>= 1) {
+        if (nb & 1) factor = crc16MulMod(factor, power);
+        power = crc16MulMod(power, power);
+    }
+    return factor;
+}
+
+/**
+ * Does what PhysFrame_init() does, for a payload that is in place already, whose CRC is known.
+ * The header layout is the one the UI builds in #initFrame() and #crcFrame().
+ * The CRC-16 is linear, so the payload's share of it does not depend on the header.
+ */
+static void initDataFrameHeader(uint8_t *frame, uint8_t seq_nr, NetworkServiceType nst, uint16_t nb,
+                                uint16_t payload_crc, uint16_t zero_bytes_factor)
+{
+    frame[0] = (nst << 4) | (FT_DATA << 1);
+    frame[1] = seq_nr << 3;
+    frame[2] = nb >> 8;
+    frame[3] = nb & 0xff;
+    frame[4] = 0;
+    frame[5] = crc8(0, frame, 5);
+    uint16_t const crc = crc16MulMod(crc16(0xffff, frame, 6), zero_bytes_factor) ^ payload_crc;
+    frame[6] = crc >> 8;
+    frame[7] = crc & 0xff;
+}
+
+
+static bool commitFrame(DataLink *me, NetworkServiceType nst, uint8_t *frame, uint16_t nb)
+{
+    // The header holds the sequence number, so only the payload's CRC can be computed up front.
+    uint16_t const payload_crc = crc16(0, frame + FRAME_HEADER_SIZE, nb);
+    uint16_t const zero_bytes_factor = crc16ZeroBytesFactor(nb);
+    // Packets get sent from the serial port ISR too, so claim the sequence number atomically.
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    releaseFrame(me, me->tx_seq_nr);            // Reusing the sequence number.
+    initDataFrameHeader(frame, me->tx_seq_nr, nst, nb, payload_crc, zero_bytes_factor);
+    bool const ok = enqueueFrame(me, frame);
+    if (ok) {
+        me->tx_frame_info[me->tx_seq_nr].frame = frame;
         setFrameQueuedTimestamp(me);
         me->tx_seq_nr = (me->tx_seq_nr + 1) & 0x7;
-        return true;
+    } else {
+        FramePool_free(frame);                  // TODO Schedule for retry.
     }
-    // TODO Schedule for retry.
-    return false;
+    BSP_restoreInterrupts(im);
+    return ok;
+}
+
+
+static bool sendPacket(DataLink *me, NetworkServiceType nst, uint8_t const *packet, uint16_t nb)
+{
+    uint8_t *payload = DataLink_reservePacket(me, nb);
+    if (payload == NULL) return false;
+
+    memcpy(payload, packet, nb);
+    return commitFrame(me, nst, payload - FRAME_HEADER_SIZE, nb);
 }
 
 /*
@@ -252,8 +449,13 @@ static bool sendPacket(DataLink *me, NetworkServiceType nst, uint8_t const *pack
 
 DataLink *DataLink_new()
 {
-    DataLink *me = (DataLink *)malloc(sizeof(DataLink));
-    CircBuffer_init(&me->output_buffer, me->tx_buf_store, sizeof me->tx_buf_store);
+    static DataLink datalink ARENA(datalink);   // There is only one.
+    DataLink *me = &datalink;
+    FramePool_init();
+    BufferPool_init();
+    me->rx_buffer_nr = BufferPool_acquire();
+    me->rx_frame_buffer = BufferPool_data(me->rx_buffer_nr);
+    for (uint8_t i = 0; i < NR_OF_FRAME_SEQ_NRS; i++) me->tx_frame_info[i].frame = NULL;
     me->channel_fd = -1;
     return me;
 }
@@ -279,6 +481,29 @@ void DataLink_awaitSync(DataLink *me)
 }
 
 
+uint8_t *DataLink_reservePacket(DataLink *me, uint16_t max_packet_size)
+{
+    if (max_packet_size > MAX_PAYLOAD_SIZE) {
+        BSP_logf("Packet of %hu bytes is too big\n", max_packet_size);
+        return NULL;
+    }
+    uint8_t *frame = allocFrame(me, FRAME_HEADER_SIZE + max_packet_size);
+    return frame == NULL ? NULL : frame + FRAME_HEADER_SIZE;
+}
+
+
+bool DataLink_commitPacket(DataLink *me, uint8_t *packet, uint16_t packet_size)
+{
+    return commitFrame(me, NST_DATAGRAM, packet - FRAME_HEADER_SIZE, packet_size);
+}
+
+
+void DataLink_abandonPacket(DataLink *me, uint8_t *packet)
+{
+    FramePool_free(packet - FRAME_HEADER_SIZE);
+}
+
+
 bool DataLink_sendDebugPacket(DataLink *me, uint8_t const *packet, uint16_t nb)
 {
     return sendPacket(me, NST_DEBUG, packet, nb);
@@ -295,11 +520,12 @@ void DataLink_close(DataLink *me)
 {
     BSP_doChannelAction(me->channel_fd, CA_CLOSE);
     me->channel_fd = -1;
+    discardAllFrames(me);
 }
 
 
 void DataLink_delete(DataLink *me)
 {
     M_ASSERT(me->channel_fd < 0);               // Ascertain the channel is closed.
-    free(me);
+    BufferPool_release(me->rx_buffer_nr);
 }
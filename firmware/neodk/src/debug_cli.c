@@ -7,7 +7,7 @@
  *
  *  Created on: 26 Mar 2024
  *      Author: mark
- *   Copyright  2024, 2025 Neostim™
+ *   Copyright  2024..2026 Neostim™
  */
 
 #include <stdio.h>
@@ -16,6 +16,8 @@
 #include "bsp_mao.h"
 #include "bsp_app.h"
 #include "app_event.h"
+#include "frame_pool.h"
+#include "buffer_pool.h"
 
 // This module implements:
 #include "debug_cli.h"
@@ -66,7 +68,7 @@ static void interpretCommand(CmndInterp *me, char ch)
     switch (ch)
     {
         case '?':
-            CLI_logf("Commands: /? /a /b /d /l /n /q /s /u /v /w /0 /1../9\n");
+            CLI_logf("Commands: /? /a /b /d /i /l /m /n /p /q /s /u /v /w /0 /1../9\n");
             break;
         case '0':
             BSP_primaryVoltageEnable(false);
@@ -86,9 +88,19 @@ static void interpretCommand(CmndInterp *me, char ch)
         case 'd':                               // Intensity down.
             changeIntensity(me, -2);
             break;
+        case 'i':                               // Interrupt latency.
+            BSP_logPulseIrqLatency();
+            break;
+        case 'p':                               // Power saving.
+            BSP_logPowerStatistics();
+            break;
         case 'l':
             BSP_toggleTheLED();
             break;
+        case 'm':                               // Memory.
+            FramePool_logStatistics();
+            BufferPool_logStatistics();
+            break;
         case 'n':
             EventQueue_postEvent((EventQueue *)me->sequencer, ET_SELECT_NEXT_PATTERN, NULL, 0);
             break;
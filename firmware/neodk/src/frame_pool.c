@@ -0,0 +1,154 @@
+/*
+ * frame_pool.c -- Slab allocator for the frames DataLink holds until they are acknowledged.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include <stddef.h>
+
+#include "bsp_dbg.h"
+#include "bsp_app.h"
+#include "net_frame.h"
+#include "datalink.h"
+
+// This module implements:
+#include "frame_pool.h"
+
+/*
+ * Most frames are small: attribute reports, status responses and pulse train descriptors.
+ * Three size classes, each a fixed number of equal blocks on a free list, cover them.
+ */
+#ifndef NR_OF_SMALL_FRAMES
+#define NR_OF_SMALL_FRAMES          8
+#endif
+
+#ifndef NR_OF_MEDIUM_FRAMES
+#define NR_OF_MEDIUM_FRAMES         4
+#endif
+
+#ifndef NR_OF_LARGE_FRAMES
+#define NR_OF_LARGE_FRAMES          2
+#endif
+
+#define SMALL_FRAME_SIZE            32
+#define MEDIUM_FRAME_SIZE           96
+#define LARGE_FRAME_SIZE            ((FRAME_HEADER_SIZE + MAX_PAYLOAD_SIZE + 3) & ~3)
+
+typedef struct _FreeBlock FreeBlock;
+struct _FreeBlock {
+    FreeBlock *next;
+};
+
+typedef struct {
+    uint8_t  *storage;
+    FreeBlock *free_list;
+    uint16_t  block_size;
+    uint8_t   nr_of_blocks;
+    uint8_t   nr_in_use;
+    uint8_t   max_in_use;
+} SizeClass;
+
+typedef struct {
+    SizeClass classes[3];
+    uint16_t  nr_of_failures;
+} FramePool;
+
+
+static uint8_t small_frames[NR_OF_SMALL_FRAMES][SMALL_FRAME_SIZE] ARENA(frame_pool) __attribute__((aligned(4)));
+static uint8_t medium_frames[NR_OF_MEDIUM_FRAMES][MEDIUM_FRAME_SIZE] ARENA(frame_pool) __attribute__((aligned(4)));
+static uint8_t large_frames[NR_OF_LARGE_FRAMES][LARGE_FRAME_SIZE] ARENA(frame_pool) __attribute__((aligned(4)));
+
+static FramePool pool ARENA(frame_pool);
+
+
+static void initSizeClass(SizeClass *sc, uint8_t *storage, uint16_t block_size, uint8_t nr_of_blocks)
+{
+    sc->storage = storage;
+    sc->block_size = block_size;
+    sc->nr_of_blocks = nr_of_blocks;
+    sc->nr_in_use = sc->max_in_use = 0;
+    sc->free_list = NULL;
+    for (uint8_t i = nr_of_blocks; i != 0; i--) {
+        FreeBlock *fb = (FreeBlock *)(storage + (i - 1) * block_size);
+        fb->next = sc->free_list;
+        sc->free_list = fb;
+    }
+}
+
+
+static SizeClass *classOfBlock(FramePool *me, uint8_t const *block)
+{
+    for (uint8_t i = 0; i < M_DIM(me->classes); i++) {
+        SizeClass *sc = &me->classes[i];
+        if (block >= sc->storage && block < sc->storage + sc->nr_of_blocks * sc->block_size) return sc;
+    }
+    return NULL;
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+void FramePool_init()
+{
+    initSizeClass(&pool.classes[0], small_frames[0], SMALL_FRAME_SIZE, NR_OF_SMALL_FRAMES);
+    initSizeClass(&pool.classes[1], medium_frames[0], MEDIUM_FRAME_SIZE, NR_OF_MEDIUM_FRAMES);
+    initSizeClass(&pool.classes[2], large_frames[0], LARGE_FRAME_SIZE, NR_OF_LARGE_FRAMES);
+    pool.nr_of_failures = 0;
+}
+
+
+uint8_t *FramePool_alloc(uint16_t nb)
+{
+    FreeBlock *fb = NULL;
+    // Frames get freed from the serial port ISR, on receipt of an ACK.
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    // Fall back on a bigger block if the best fitting class has run dry.
+    for (uint8_t i = 0; i < M_DIM(pool.classes); i++) {
+        SizeClass *sc = &pool.classes[i];
+        if (nb > sc->block_size || sc->free_list == NULL) continue;
+        fb = sc->free_list;
+        sc->free_list = fb->next;
+        if (++sc->nr_in_use > sc->max_in_use) sc->max_in_use = sc->nr_in_use;
+        break;
+    }
+    if (fb == NULL) pool.nr_of_failures++;
+    BSP_restoreInterrupts(im);
+    return (uint8_t *)fb;
+}
+
+
+void FramePool_free(uint8_t *block)
+{
+    if (block == NULL) return;
+
+    SizeClass *sc = classOfBlock(&pool, block);
+    M_ASSERT(sc != NULL && (block - sc->storage) % sc->block_size == 0);
+    FreeBlock *fb = (FreeBlock *)block;
+    IrqMask const im = BSP_maskInterrupts(IRQL_COMMS);
+    fb->next = sc->free_list;
+    sc->free_list = fb;
+    sc->nr_in_use--;
+    BSP_restoreInterrupts(im);
+}
+
+
+void FramePool_logStatistics()
+{
+    uint32_t pool_size = 0;
+    for (uint8_t i = 0; i < M_DIM(pool.classes); i++) {
+        SizeClass const *sc = &pool.classes[i];
+        BSP_logf("Frame pool %3hu B: %hu of %hu in use, max %hu\n",
+                sc->block_size, sc->nr_in_use, sc->nr_of_blocks, sc->max_in_use);
+        pool_size += sc->nr_of_blocks * sc->block_size;
+    }
+    uint32_t const fixed_size = NR_OF_FRAME_SEQ_NRS * (FRAME_HEADER_SIZE + MAX_PAYLOAD_SIZE);
+    BSP_logf("Frame pool: %u bytes, %u less than fixed frame slots, %hu failures\n",
+            pool_size, fixed_size - pool_size, pool.nr_of_failures);
+}
@@ -0,0 +1,140 @@
+/*
+ * lfo.c -- Fixed point oscillators that step once per burst.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include "bsp_app.h"
+
+// This module implements:
+#include "lfo.h"
+
+// The first quarter of a sine wave, scaled to 32767.
+static int16_t const quarter_sine[65] = {
+        0,   804,  1608,  2410,  3212,  4011,  4808,  5602,
+     6393,  7179,  7962,  8739,  9512, 10278, 11039, 11793,
+    12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+    23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+    27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+    32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+    32767,
+};
+
+
+static int16_t sineAt(uint8_t index)
+{
+    uint8_t const i = index & 63;
+    switch (index >> 6)
+    {
+        case 0: return quarter_sine[i];
+        case 1: return quarter_sine[64 - i];
+        case 2: return -quarter_sine[i];
+    }
+    return -quarter_sine[64 - i];
+}
+
+
+static int16_t sine(uint32_t phase)
+{
+    uint8_t const index = phase >> 24;
+    int32_t const s0 = sineAt(index);
+    int32_t const s1 = sineAt(index + 1);
+    return s0 + (((s1 - s0) * (int32_t)((phase >> 16) & 0xff)) >> 8);
+}
+
+
+static int16_t triangle(uint32_t phase)
+{
+    uint16_t const p = (phase >> 16) + 0x4000;  // Start at 0, going up, like the sine.
+    return 2 * (p < 0x8000 ? p : 0xffff - p) - 32767;
+}
+
+
+static int16_t nextRandom(Lfo *me)
+{
+    uint32_t x = me->prng_state;                // Xorshift32.
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    me->prng_state = x;
+    return (int16_t)(x >> 16);
+}
+
+
+static void walk(Lfo *me, uint32_t elapsed_µs, uint32_t phase_delta)
+{
+    // A quarter cycle allows a step across the whole range.
+    int32_t const scale = elapsed_µs >= me->quarter_cycle_µs ? 32767 : (int32_t)(phase_delta >> 15);
+    int32_t w = me->walk + ((nextRandom(me) * (scale > 32767 ? 32767 : scale)) >> 15);
+    me->walk = w > 32767 ? 32767 : w < -32767 ? -32767 : w;
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+bool Lfo_isValid(LfoSettings const *ls)
+{
+    return ls->waveform < LW_NR_OF_WAVEFORMS && ls->depth_percent <= 100 && ls->rate_cHz <= LFO_MAX_RATE_cHz;
+}
+
+
+void Lfo_configure(Lfo *me, LfoSettings const *ls)
+{
+    me->settings = *ls;
+    // 2^32 / 10^8 per cHz per µs, rounded.
+    me->phase_step = ((uint32_t)ls->rate_cHz * 85899UL + 1000) / 2000;
+    me->quarter_cycle_µs = ls->rate_cHz == 0 ? UINT32_MAX : 25000000UL / ls->rate_cHz;
+    me->prng_state = (uint32_t)BSP_microsecondsSinceBoot() | 1;
+    Lfo_restart(me);
+}
+
+
+void Lfo_restart(Lfo *me)
+{
+    me->phase = 0;
+    me->walk = 0;
+}
+
+
+bool Lfo_isActive(Lfo const *me)
+{
+    return me->settings.depth_percent != 0;
+}
+
+
+int16_t Lfo_advance(Lfo *me, uint32_t elapsed_µs)
+{
+    int32_t wave;
+    switch (me->settings.waveform)
+    {
+        case LW_SINE:
+            wave = sine(me->phase);
+            break;
+        case LW_TRIANGLE:
+            wave = triangle(me->phase);
+            break;
+        default:
+            wave = me->walk;
+    }
+    uint32_t const phase_delta = me->phase_step * elapsed_µs;   // Wraps around, like the phase.
+    if (me->settings.waveform == LW_RANDOM_WALK) walk(me, elapsed_µs, phase_delta);
+    me->phase += phase_delta;
+    return wave * me->settings.depth_percent / 100;
+}
+
+
+uint16_t Lfo_modulate(uint16_t value, int16_t modulation, uint16_t min, uint16_t max)
+{
+    // Clamp before narrowing: a pace of 62500 µs modulated by +25% does not fit in 16 bits.
+    int32_t const result = value + (((int32_t)value * modulation) >> 15);
+    return result < min ? min : result > max ? max : (uint16_t)result;
+}
@@ -16,20 +16,21 @@
 #include "bsp_mao.h"
 #include "bsp_app.h"
 #include "app_event.h"
+#include "app_timer.h"
 #include "controller.h"
+#include "rec_store.h"
+#include "pattern_store.h"
 #include "debug_cli.h"
 
-
-#ifndef MICROSECONDS_PER_APP_TIMER_TICK
-#define MICROSECONDS_PER_APP_TIMER_TICK 1000    // For 1 kHz tick.
+#ifndef BOSS_EVENT_STORAGE_SIZE
+#define BOSS_EVENT_STORAGE_SIZE     100
 #endif
 
 typedef struct {
     EventQueue event_queue;                     // This MUST be the first member.
-    uint8_t event_storage[100];
+    uint8_t event_storage[BOSS_EVENT_STORAGE_SIZE];
     Controller *controller;
     Sequencer *sequencer;
-    uint64_t prev_micros;
     uint8_t keep_running;
 } Boss;
 
@@ -39,7 +40,6 @@ static void Boss_init(Boss *me)
     EventQueue_init(&me->event_queue, me->event_storage, sizeof me->event_storage);
     me->controller = Controller_new();
     me->sequencer = Sequencer_new();
-    me->prev_micros = 0ULL;
     me->keep_running = true;
 }
 
@@ -58,10 +58,10 @@ static void handlePosixSignal(Boss *me, int sig)
 }
 
 
-static void printTime(uint64_t app_timer_micros)
+static void logReadiness(uint8_t peripherals)
 {
-    uint32_t seconds_since_boot = (uint32_t)(app_timer_micros / 1000000UL);
-    CLI_logf("Time %02u:%02u:%02u\n", seconds_since_boot / 3600, (seconds_since_boot / 60) % 60, seconds_since_boot % 60);
+    BSP_logf("Ready at %u ms:%s%s%s\n", (uint32_t)(BSP_microsecondsSinceBoot() / 1000),
+            peripherals & PR_LSE ? " LSE" : "", peripherals & PR_DAC ? " DAC" : "", peripherals & PR_ADC ? " ADC" : "");
 }
 
 
@@ -70,8 +70,8 @@ static void dispatchEvent(Boss *me, AOEvent const *evt)
     uint8_t evt_type = AOEvent_type(evt);
     switch (evt_type)
     {
-        case ET_APP_HEARTBEAT:
-            printTime(*(uint64_t const *)AOEvent_data(evt));
+        case ET_PERIPHERAL_READY:
+            logReadiness(*AOEvent_data(evt));
             break;
         case ET_POSIX_SIGNAL:
             handlePosixSignal(me, *(int const *)AOEvent_data(evt));
@@ -99,15 +99,6 @@ static void onButtonToggle(Boss *me, uint32_t pushed)
 }
 
 
-static void onAppTimerTick(Boss *me, uint64_t app_timer_micros)
-{
-    if (Controller_heartbeatElapsed(me->controller, app_timer_micros - me->prev_micros)) {
-        EventQueue_postEvent(&me->event_queue, ET_APP_HEARTBEAT, (uint8_t const *)&app_timer_micros, sizeof app_timer_micros);
-        me->prev_micros = app_timer_micros;
-    }
-}
-
-
 static bool Boss_handleEvent(Boss *me)
 {
     return EventQueue_handleNextEvent(&me->event_queue, (EvtFunc)&dispatchEvent, me);
@@ -128,12 +119,13 @@ static void setupAndRunApplication(Boss *me)
     Sequencer_init(me->sequencer);
     Controller_init(me->controller, me->sequencer, datalink);
     CLI_init(&me->event_queue, me->sequencer, datalink);
+    Controller_start(me->controller);           // Open the link first, to answer the controller's SYNC soon.
     Sequencer_start(me->sequencer);
 
     Selector button_selector;
     BSP_registerButtonHandler(Selector_init(&button_selector, (Action)&onButtonToggle, me));
+    BSP_sealHeap();                             // Everything has been allocated by now.
 
-    Controller_start(me->controller);
     while (me->keep_running) {
         // Service the worker objects in order of decreasing priority.
         if (Sequencer_handleEvent(me->sequencer)) continue;
@@ -153,9 +145,12 @@ int main()
     BSP_logf("Initialising %s...\n", BSP_firmwareVersion());
     BSP_init();                                 // Get the hardware ready.
 
-    Boss boss;                                  // The supervisor object.
+    static Boss boss ARENA(boss);               // The supervisor object.
     Boss_init(&boss);
-    BSP_registerAppTimerHandler((void (*)(void *, uint64_t))&onAppTimerTick, &boss, MICROSECONDS_PER_APP_TIMER_TICK);
+    BSP_registerReadinessDelegate(&boss.event_queue);
+    AppTimer_startService();                    // Software timers for the active objects.
+    RecStore_startService();                    // Find the recordings in flash.
+    PatternStore_startService();                // And the uploaded patterns.
     setupAndRunApplication(&boss);
     Boss_finish(&boss);
 
@@ -7,7 +7,7 @@
  *
  *  Created on: 6 Mar 2024
  *      Author: mark
- *   Copyright  2024, 2025 Neostim™
+ *   Copyright  2024..2026 Neostim™
  */
 
 #include "bsp_dbg.h"
@@ -15,6 +15,8 @@
 // This module implements:
 #include "pattern_iter.h"
 
+#define NO_VOLTAGE_CHANGE   0xff
+
 
 static void nextElconIfLastStep(PatternIterator *me)
 {
@@ -46,6 +48,30 @@ static uint8_t const *getNextPattern(PatternIterator *me, uint16_t *nr_of_pulses
 }
 
 
+/**
+ * Each LFO moves on by the unmodulated length of the burst, so the work per burst is constant.
+ * Intensity becomes primary voltage, which gets set when the burst starts.
+ */
+static void modulate(PatternIterator *me, Burst *burst)
+{
+    uint32_t const elapsed_µs = (uint32_t)burst->nr_of_pulses * burst->pace_µs;
+    Lfo *lfo = &me->lfos[MT_PULSE_WIDTH];
+    if (Lfo_isActive(lfo)) {
+        burst->pulse_width_¼µs = Lfo_modulate(burst->pulse_width_¼µs, Lfo_advance(lfo, elapsed_µs),
+                                              MIN_PULSE_WIDTH_¼µs, MAX_PULSE_WIDTH_¼µs);
+    }
+    lfo = &me->lfos[MT_PACE];
+    if (Lfo_isActive(lfo)) {
+        burst->pace_µs = Lfo_modulate(burst->pace_µs, Lfo_advance(lfo, elapsed_µs), MIN_PULSE_PACE_µs, MAX_PULSE_PACE_µs);
+    }
+    lfo = &me->lfos[MT_AMPLITUDE];
+    me->burst_voltage_percent = NO_VOLTAGE_CHANGE;
+    if (Lfo_isActive(lfo)) {
+        me->burst_voltage_percent = Lfo_modulate(me->intensity_percent, Lfo_advance(lfo, elapsed_µs), 0, 100);
+    }
+}
+
+
 static bool getNextBurst(PatternIterator *me, Burst *burst)
 {
     if (PatternIterator_done(me)) return false;
@@ -55,10 +81,28 @@ static bool getNextBurst(PatternIterator *me, Burst *burst)
     burst->elcon[1] = elcon[1];
     burst->pulse_width_¼µs = me->pulse_width_micros * 4;
     burst->pace_µs = me->pattern_descr->pace_µs;
+    modulate(me, burst);
     return true;
 }
 
 
+/*
+ * Every transition from one elcon to the next takes nr_of_steps - 1 steps, of nr_of_steps pulses each.
+ * Times are nominal, that is at the pattern's pace, whatever the pace LFO does.
+ */
+static uint32_t pulsesPerTransition(PatternDescr const *pd)
+{
+    return (uint32_t)pd->nr_of_steps * (pd->nr_of_steps - 1);
+}
+
+
+static uint32_t toMilliseconds(PatternDescr const *pd, uint64_t nr_of_pulses)
+{
+    uint64_t const ms = nr_of_pulses * pd->pace_µs / 1000;
+    return ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms;
+}
+
+
 static uint8_t getPhase(uint8_t const elcon[2])
 {
     M_ASSERT((elcon[0] & elcon[1]) == 0);       // Prevent shorts.
@@ -66,12 +110,20 @@ static uint8_t getPhase(uint8_t const elcon[2])
 }
 
 
-static bool startBurst(Burst const *burst)
+static uint8_t amplitudeForPercentage(uint8_t perc)
 {
-    if (Burst_isValid(burst)) {
-        BSP_setElectrodeConfiguration(burst->elcon);
-        return BSP_startBurst(burst);
-    }
+    // The voltage BSP_setPrimaryVoltagePercent() sets, in units of 40 mV. 0 would mean 'no change'.
+    uint8_t const amplitude = (perc * 85U + 20) / 40;
+    return amplitude == 0 ? 1 : amplitude;
+}
+
+/**
+ * The BSP switches the electrodes the triac settle time ahead of the burst,
+ * and sets the burst's amplitude as the burst starts.
+ */
+static bool scheduleBurst(Burst const *burst)
+{
+    if (Burst_isValid(burst)) return BSP_scheduleBurst(burst);
 
     BSP_logf("Invalid burst\n   ");
     Burst_print(burst);
@@ -90,6 +142,8 @@ bool PatternIterator_init(PatternIterator *me, PatternDescr const *pd)
     me->elcon_nr = 0;
     me->step_nr = 0;
     me->segment_nr = 0;                         // 0 or 1.
+    for (uint8_t i = 0; i < MT_NR_OF_TARGETS; i++) Lfo_restart(&me->lfos[i]);
+    me->has_next_burst = false;
     return pd->nr_of_steps != 0;
 }
 
@@ -101,20 +155,130 @@ void PatternIterator_setPulseWidth(PatternIterator *me, uint8_t width_µs)
 }
 
 
-bool PatternIterator_scheduleNextBurst(PatternIterator *me)
+void PatternIterator_setIntensity(PatternIterator *me, uint8_t intensity)
+{
+    me->intensity_percent = intensity;
+    me->voltage_percent = intensity;            // The caller sets the voltage.
+}
+
+
+void PatternIterator_setModulation(PatternIterator *me, uint8_t target, LfoSettings const *ls)
+{
+    BSP_logf("LFO %hhu: waveform=%hhu, depth=%hhu%%, rate=%hu cHz\n", target, ls->waveform, ls->depth_percent, ls->rate_cHz);
+    Lfo_configure(&me->lfos[target], ls);
+    if (target == MT_AMPLITUDE) PatternIterator_restoreIntensity(me);
+}
+
+
+void PatternIterator_getModulation(PatternIterator const *me, LfoSettings settings[MT_NR_OF_TARGETS])
+{
+    for (uint8_t i = 0; i < MT_NR_OF_TARGETS; i++) settings[i] = me->lfos[i].settings;
+}
+
+
+void PatternIterator_restoreIntensity(PatternIterator *me)
+{
+    if (me->voltage_percent != me->intensity_percent) {
+        BSP_setPrimaryVoltagePercent(me->intensity_percent);
+        me->voltage_percent = me->intensity_percent;
+    }
+}
+
+
+void PatternIterator_getProgress(PatternIterator const *me, uint32_t progress_ms[2])
+{
+    PatternDescr const *pd = me->pattern_descr;
+    progress_ms[0] = progress_ms[1] = 0;
+    if (pd->nr_of_steps < 2) return;            // Not a pattern, e.g. a stream.
+
+    // The pulses before the next burst.
+    uint32_t const pulses_per_rep = pd->nr_of_elcons * pulsesPerTransition(pd);
+    uint32_t pulses_in_rep = me->elcon_nr * pulsesPerTransition(pd) + me->step_nr * pd->nr_of_steps;
+    if (me->segment_nr != 0) pulses_in_rep += pd->nr_of_steps - 1 - me->step_nr;
+    uint64_t const elapsed = (uint64_t)(pd->nr_of_reps - me->nr_of_reps) * pulses_per_rep + pulses_in_rep;
+    progress_ms[0] = toMilliseconds(pd, elapsed);
+    progress_ms[1] = toMilliseconds(pd, (uint64_t)pd->nr_of_reps * pulses_per_rep);
+}
+
+
+bool PatternIterator_seek(PatternIterator *me, uint32_t position_ms)
 {
-    Burst burst;
-    if (getNextBurst(me, &burst)) {
-        if (burst.pulse_width_¼µs > MAX_PULSE_WIDTH_¼µs) {
-            burst.pulse_width_¼µs = MAX_PULSE_WIDTH_¼µs;
+    PatternDescr const *pd = me->pattern_descr;
+    if (pd->nr_of_steps < 2) return false;
+
+    uint32_t const pulses_per_rep = pd->nr_of_elcons * pulsesPerTransition(pd);
+    uint64_t const pulse_nr = (uint64_t)position_ms * 1000 / pd->pace_µs;
+    if (pulse_nr >= (uint64_t)pd->nr_of_reps * pulses_per_rep) return false;
+
+    uint32_t const rep_nr = pulse_nr / pulses_per_rep;
+    uint32_t pulse_in = pulse_nr % pulses_per_rep;
+    me->elcon_nr = pulse_in / pulsesPerTransition(pd);
+    pulse_in %= pulsesPerTransition(pd);
+    me->step_nr = pulse_in / pd->nr_of_steps;
+    pulse_in %= pd->nr_of_steps;
+    me->segment_nr = pulse_in < pd->nr_of_steps - 1 - me->step_nr ? 0 : 1;
+    me->nr_of_reps = pd->nr_of_reps - rep_nr;
+    me->has_next_burst = false;
+    return true;
+}
+
+
+bool PatternIterator_prepareBurst(PatternIterator *me)
+{
+    if (me->has_next_burst) return true;
+
+    Burst *burst = &me->next_burst;
+    if (getNextBurst(me, burst)) {
+        if (burst->pulse_width_¼µs > MAX_PULSE_WIDTH_¼µs) {
+            burst->pulse_width_¼µs = MAX_PULSE_WIDTH_¼µs;
         }
-        // BSP_logf("Pulse width is %hu µs\n", Burst_pulseWidth_µs(&burst));
-        burst.phase = getPhase(burst.elcon);
-        // TODO Set burst.amplitude?
-        return startBurst(&burst);
+        // BSP_logf("Pulse width is %hu µs\n", Burst_pulseWidth_µs(burst));
+        burst->phase = getPhase(burst->elcon);
+        burst->amplitude = 0;
+        burst->flags = 0;
+        me->has_next_burst = true;
+    }
+    return me->has_next_burst;
+}
+
+
+bool PatternIterator_scheduleNextBurst(PatternIterator *me, uint32_t start_µs)
+{
+    if (! PatternIterator_prepareBurst(me)) return false;
+
+    Burst *burst = &me->next_burst;
+    burst->start_time_µs = start_µs;
+    uint8_t const perc = me->burst_voltage_percent;
+    burst->amplitude = (perc != NO_VOLTAGE_CHANGE && perc != me->voltage_percent) ? amplitudeForPercentage(perc) : 0;
+    return scheduleBurst(burst);
+}
+
+
+uint32_t PatternIterator_burstStarted(PatternIterator *me)
+{
+    if (me->next_burst.amplitude != 0) {
+        me->voltage_percent = me->burst_voltage_percent;
     }
+    me->has_next_burst = false;
+    return Burst_duration_µs(&me->next_burst);
+}
 
-    return false;
+
+bool PatternIterator_takeBurst(PatternIterator *me, Burst *burst, uint8_t *intensity_percent)
+{
+    if (! PatternIterator_prepareBurst(me)) return false;
+
+    me->has_next_burst = false;
+    *burst = me->next_burst;
+    uint8_t const perc = me->burst_voltage_percent;
+    *intensity_percent = perc != NO_VOLTAGE_CHANGE ? perc : me->intensity_percent;
+    return true;
+}
+
+
+bool PatternIterator_atRepStart(PatternIterator const *me)
+{
+    return me->elcon_nr == 0 && me->step_nr == 0 && me->segment_nr == 0;
 }
 
 
@@ -0,0 +1,218 @@
+/*
+ * pattern_mux.c -- Merges the bursts of several pattern iterators into one stream of descriptors.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include <string.h>
+
+#include "bsp_dbg.h"
+#include "pulse_train.h"
+
+// This module implements:
+#include "pattern_mux.h"
+
+// The sequencer queues the next descriptor when the previous one starts, which takes a while.
+#ifndef MUX_MIN_START_SPACING_µs
+#define MUX_MIN_START_SPACING_µs    1000
+#endif
+
+
+// Between pulses on different electrodes: the dead time, or the BSP's triac settle time if that is longer.
+static uint16_t switchGap_µs(void)
+{
+    uint16_t const settle_µs = BSP_triacSettleTime();
+    return settle_µs > MIN_DEAD_TIME_¼µs / 4 ? settle_µs : MIN_DEAD_TIME_¼µs / 4;
+}
+
+
+static uint8_t burstElectrodes(Burst const *burst)
+{
+    return burst->elcon[0] | burst->elcon[1];
+}
+
+
+static uint8_t amplitudeForPercentage(uint8_t perc)
+{
+    // The same voltage BSP_setPrimaryVoltagePercent() sets, in units of 40 mV. 0 would mean 'no change'.
+    uint8_t const amplitude = (perc * 85U + 20) / 40;
+    return amplitude == 0 ? 1 : amplitude;
+}
+
+/**
+ * Vcap cannot drop in the gap between two layers' pulses, so all layers share the voltage of the strongest one.
+ * The others get a proportionally narrower pulse.
+ */
+static uint8_t pulseWidthFor(uint8_t perc, uint8_t max_perc)
+{
+    uint16_t const width_µs = (50 + max_perc + max_perc / 2) * perc / max_perc;
+    return width_µs < MIN_PULSE_WIDTH_¼µs / 4 ? MIN_PULSE_WIDTH_¼µs / 4 : width_µs;
+}
+
+// Makes sure the layer has pulses left, unless its pattern has finished.
+static bool fetchBurst(MuxLayer *layer)
+{
+    if (layer->is_done) return false;
+    if (layer->burst.nr_of_pulses != 0) return true;
+
+    uint8_t perc;                               // Ignored: the voltage is common to all layers.
+    if (! PatternIterator_takeBurst(&layer->pi, &layer->burst, &perc)) {
+        layer->is_done = true;
+        return false;
+    }
+    layer->burst.pace_µs = layer->burst.pace_µs / 250 * 250;    // What a descriptor can hold.
+    return true;
+}
+
+
+static MuxLayer *earliestLayer(PatternMux *me, MuxLayer const *except)
+{
+    MuxLayer *earliest = NULL;
+    for (uint8_t i = 0; i < me->nr_of_layers; i++) {
+        MuxLayer *layer = &me->layers[i];
+        if (layer == except || ! fetchBurst(layer)) continue;
+        if (earliest == NULL || (int32_t)(layer->next_µs - earliest->next_µs) < 0) earliest = layer;
+    }
+    return earliest;
+}
+
+/**
+ * The layer whose pulse is due first gets the output, for as many pulses as it can play
+ * before the next layer's pulse is due. A layer that has to wait, for the other layer's pulses
+ * or for the electrodes to switch, slips: the rest of its pattern moves along with it.
+ */
+static bool nextDescriptor(PatternMux *me)
+{
+    MuxLayer *layer = earliestLayer(me, NULL);
+    if (layer == NULL) return false;
+
+    Burst burst = layer->burst;
+    uint32_t earliest_µs = me->busy_until_µs;
+    if (burstElectrodes(&burst) != me->last_electrodes) earliest_µs += switchGap_µs();
+    if (me->last_electrodes != 0 && (int32_t)(earliest_µs - (me->last_start_µs + MUX_MIN_START_SPACING_µs)) < 0) {
+        earliest_µs = me->last_start_µs + MUX_MIN_START_SPACING_µs;
+    }
+    uint32_t const start_µs = (int32_t)(earliest_µs - layer->next_µs) > 0 ? earliest_µs : layer->next_µs;
+
+    MuxLayer const *other = earliestLayer(me, layer);
+    if (other != NULL && (int32_t)(other->next_µs - start_µs) > 0) {
+        uint32_t const nr_due = 1 + (other->next_µs - start_µs - 1) / burst.pace_µs;
+        if (nr_due < burst.nr_of_pulses) burst.nr_of_pulses = nr_due;
+    } else if (other != NULL) {
+        burst.nr_of_pulses = 1;                 // Take turns.
+    }
+
+    PulseTrain *pt = (PulseTrain *)me->pending;
+    PulseTrain_init(pt, me->seq_nr++, start_µs, &burst);
+    PulseTrain_clearDeltas(pt);
+    if (me->last_electrodes == 0) PulseTrain_setAmplitude(pt, me->amplitude);   // Only the first one sets it.
+    me->has_pending = true;
+
+    me->last_start_µs = start_µs;
+    me->last_electrodes = burstElectrodes(&burst);
+    me->busy_until_µs = start_µs + (burst.nr_of_pulses - 1) * burst.pace_µs + Burst_pulseWidth_µs(&burst);
+    layer->next_µs = start_µs + burst.nr_of_pulses * burst.pace_µs;
+    layer->burst.nr_of_pulses -= burst.nr_of_pulses;
+    return true;
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+bool PatternMux_check(LayerSpec const specs[], uint8_t nr_of_layers, MuxErrType *err)
+{
+    uint8_t electrodes_in_use = 0;
+    *err = nr_of_layers == 0 ? ME_NO_LAYERS : nr_of_layers > MUX_MAX_LAYERS ? ME_TOO_MANY : ME_NONE;
+    for (uint8_t i = 0; i < nr_of_layers && *err == ME_NONE; i++) {
+        PatternDescr const *pd = specs[i].pd;
+        uint8_t const electrodes = Patterns_electrodes(pd);
+        if (specs[i].intensity_percent > 100) {
+            *err = ME_BAD_INTENSITY;
+        } else if (! Patterns_isShortFree(pd)) {
+            *err = ME_SHORT;
+        } else if (electrodes & electrodes_in_use) {
+            BSP_logf("Layer '%s' shares electrodes 0x%x\n", Patterns_name(pd), electrodes & electrodes_in_use);
+            *err = ME_OVERLAP;
+        }
+        electrodes_in_use |= electrodes;
+    }
+    return *err == ME_NONE;
+}
+
+
+void PatternMux_init(PatternMux *me)
+{
+    me->nr_of_layers = 0;
+    me->is_active = me->has_more = me->has_pending = false;
+}
+
+
+bool PatternMux_start(PatternMux *me, LayerSpec const specs[], uint8_t nr_of_layers)
+{
+    MuxErrType err;
+    if (! PatternMux_check(specs, nr_of_layers, &err)) return false;
+
+    uint8_t max_perc = 1;
+    for (uint8_t i = 0; i < nr_of_layers; i++) {
+        if (specs[i].intensity_percent > max_perc) max_perc = specs[i].intensity_percent;
+    }
+    memset(me->layers, 0, sizeof me->layers);
+    for (uint8_t i = 0; i < nr_of_layers; i++) {
+        MuxLayer *layer = &me->layers[i];
+        uint8_t const perc = specs[i].intensity_percent;
+        if (! PatternIterator_init(&layer->pi, specs[i].pd)) return false;
+
+        PatternIterator_setIntensity(&layer->pi, max_perc);
+        PatternIterator_setPulseWidth(&layer->pi, pulseWidthFor(perc, max_perc));
+        BSP_logf("Layer %hhu: '%s' at %hhu%%\n", i, Patterns_name(specs[i].pd), perc);
+    }
+    me->amplitude = amplitudeForPercentage(max_perc);
+    me->nr_of_layers = nr_of_layers;
+    me->busy_until_µs = me->last_start_µs = 0;
+    me->last_electrodes = 0;
+    me->seq_nr = 0;
+    me->has_pending = false;
+    me->is_active = me->has_more = true;
+    return true;
+}
+
+
+uint16_t PatternMux_fill(PatternMux *me, PtdQueue *queue)
+{
+    uint16_t nr_queued = 0;
+    while (me->has_more) {
+        if (! me->has_pending && ! nextDescriptor(me)) {
+            me->has_more = false;               // What is queued still gets played.
+            break;
+        }
+        PtdErrType err = PE_NONE;
+        if (! PtdQueue_addDescriptor(queue, (PulseTrain const *)me->pending, PulseTrain_size(), &err)) {
+            if (err == PE_BUFFER_FULL) break;   // Keep it for the next round.
+            BSP_logf("Layered burst rejected, err=%u\n", err);
+        } else {
+            nr_queued++;
+        }
+        me->has_pending = false;
+    }
+    return nr_queued;
+}
+
+
+uint8_t PatternMux_nrOfLayers(PatternMux const *me)
+{
+    return me->is_active ? me->nr_of_layers : 0;
+}
+
+
+void PatternMux_stop(PatternMux *me)
+{
+    if (me->is_active) BSP_logf("Layers stopped\n");
+    me->is_active = me->has_more = me->has_pending = false;
+}
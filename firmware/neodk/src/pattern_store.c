@@ -0,0 +1,357 @@
+/*
+ * pattern_store.c -- A log of pattern records in two flash pages that take turns.
+ *
+ * Records get appended to the active page; a later record replaces an earlier one of the same name.
+ * When the active page is full, the live patterns move to the other page, which then becomes active.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "bsp_dbg.h"
+#include "bsp_app.h"
+#include "convenience.h"
+
+// This module implements:
+#include "pattern_store.h"
+
+#define PATTERN_PAGE_MAGIC      0x5441504eUL    // "NPAT", little endian.
+
+// Written last when a page takes over, so a page with a valid header holds a complete set.
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;                        // The newest page wins.
+} PageHeader;
+
+typedef struct {
+    uint16_t size;                              // Of the whole record, padded to a multiple of 8.
+    uint8_t  name_len;
+    uint8_t  nr_of_elcons;                      // 0 marks the removal of the pattern of this name.
+    uint16_t pace_µs;
+    uint16_t nr_of_reps;
+    uint8_t  nr_of_steps;
+    uint8_t  check;                             // Makes the bytes of the record, padding excluded, add up to 0.
+    char     name[];                            // NUL-terminated, followed by the elcons.
+} PatternRecord;
+
+#define MAX_RECORD_SIZE     ((sizeof(PatternRecord) + PATTERN_NAME_MAX_LEN + 1 + 2 * PATTERN_MAX_ELCONS + 7) & ~7U)
+#define RECORD_END          0xffff              // Erased flash.
+
+typedef struct {
+    uint8_t const *pages[2];
+    uint16_t page_size;
+    uint8_t  active;                            // Index into pages.
+    uint32_t generation;                        // Of the active page.
+    uint16_t write_offset;                      // Into the active page.
+    uint16_t nr_of_changes;
+    PatternDescr slots[MAX_USER_PATTERNS];      // A slot is free if its name is NULL.
+} PatternStore;
+
+
+static PatternStore pattern_store ARENA(pattern_store);
+
+
+static bool isBlank(uint8_t const *bp, uint16_t nb)
+{
+    uint32_t const *wp = (uint32_t const *)bp;
+    for (uint16_t i = 0; i < nb / 4; i++) {
+        if (wp[i] != 0xffffffffUL) return false;
+    }
+    return true;
+}
+
+
+static bool erasePage(PatternStore const *me, uint8_t const *page)
+{
+    return isBlank(page, me->page_size) || BSP_eraseFlashPage(page);
+}
+
+
+static uint16_t dataSize(uint8_t name_len, uint8_t nr_of_elcons)
+{
+    return sizeof(PatternRecord) + name_len + 1 + 2 * nr_of_elcons;
+}
+
+
+static uint8_t checksum(uint8_t const *bp, uint16_t nb)
+{
+    uint8_t sum = 0;
+    while (nb-- != 0) sum += *bp++;
+    return sum;
+}
+
+
+static uint16_t buildRecord(uint64_t *buf, PatternDescr const *pd, uint8_t name_len)
+{
+    PatternRecord *rec = (PatternRecord *)buf;
+    uint16_t const nb = dataSize(name_len, pd->nr_of_elcons);
+    memset(buf, 0xff, MAX_RECORD_SIZE);
+    rec->size = (nb + 7) & ~7U;
+    rec->name_len = name_len;
+    rec->nr_of_elcons = pd->nr_of_elcons;
+    rec->pace_µs = pd->pace_µs;
+    rec->nr_of_reps = pd->nr_of_reps;
+    rec->nr_of_steps = pd->nr_of_steps;
+    rec->check = 0;
+    memcpy(rec->name, pd->name, name_len);
+    rec->name[name_len] = '\0';
+    if (pd->nr_of_elcons != 0) memcpy(rec->name + name_len + 1, pd->pattern, 2 * pd->nr_of_elcons);
+    rec->check = -checksum((uint8_t const *)rec, nb);
+    return rec->size;
+}
+
+
+static void setSlot(PatternDescr *slot, PatternRecord const *rec)
+{
+    slot->name = rec->name;
+    slot->pattern = (uint8_t const (*)[2])(rec->name + rec->name_len + 1);
+    slot->nr_of_elcons = rec->nr_of_elcons;
+    slot->pace_µs = rec->pace_µs;
+    slot->nr_of_reps = rec->nr_of_reps;
+    slot->nr_of_steps = rec->nr_of_steps;
+}
+
+
+static PatternDescr *findSlot(PatternStore *me, char const *name, uint16_t len)
+{
+    for (uint8_t i = 0; i < MAX_USER_PATTERNS; i++) {
+        PatternDescr *slot = &me->slots[i];
+        if (slot->name != NULL && strlen(slot->name) == len && memcmp(slot->name, name, len) == 0) return slot;
+    }
+    return NULL;
+}
+
+
+static PatternDescr *freeSlot(PatternStore *me)
+{
+    for (uint8_t i = 0; i < MAX_USER_PATTERNS; i++) {
+        if (me->slots[i].name == NULL) return &me->slots[i];
+    }
+    return NULL;
+}
+
+
+static void replayRecord(PatternStore *me, PatternRecord const *rec)
+{
+    PatternDescr *slot = findSlot(me, rec->name, rec->name_len);
+    if (rec->nr_of_elcons == 0) {
+        if (slot != NULL) slot->name = NULL;
+    } else if (slot != NULL || (slot = freeSlot(me)) != NULL) {
+        setSlot(slot, rec);
+    } else {
+        BSP_logf("No slot for pattern '%s'\n", rec->name);
+    }
+}
+
+
+static void replayPage(PatternStore *me)
+{
+    uint8_t const *page = me->pages[me->active];
+    uint16_t offset = sizeof(PageHeader);
+    while (offset + sizeof(PatternRecord) <= me->page_size) {
+        PatternRecord const *rec = (PatternRecord const *)(page + offset);
+        if (rec->size == RECORD_END) break;
+
+        if (rec->size < sizeof(PatternRecord) || (rec->size & 7) != 0 || rec->size > me->page_size - offset
+         || rec->size < dataSize(rec->name_len, rec->nr_of_elcons)) {
+            offset = me->page_size;             // Torn. Compact before writing again.
+            break;
+        }
+        if (checksum((uint8_t const *)rec, dataSize(rec->name_len, rec->nr_of_elcons)) == 0) {
+            replayRecord(me, rec);
+        }
+        offset += rec->size;
+    }
+    me->write_offset = offset;
+}
+
+
+static bool takeOverPage(PatternStore *me, uint8_t page_nr, uint32_t generation)
+{
+    PageHeader const header = { .magic = PATTERN_PAGE_MAGIC, .generation = generation };
+    if (! BSP_writeFlash(me->pages[page_nr], &header, sizeof header)) return false;
+
+    uint8_t const old = me->active;
+    me->active = page_nr;
+    me->generation = generation;
+    if (old != page_nr) erasePage(me, me->pages[old]);
+    return true;
+}
+
+
+static bool compact(PatternStore *me)
+{
+    uint8_t const target = me->active ^ 1;
+    uint8_t const *page = me->pages[target];
+    if (! erasePage(me, page)) return false;
+
+    uint64_t buf[MAX_RECORD_SIZE / 8];
+    uint16_t offset = sizeof(PageHeader);
+    for (uint8_t i = 0; i < MAX_USER_PATTERNS; i++) {
+        PatternDescr *slot = &me->slots[i];
+        if (slot->name == NULL) continue;
+
+        uint16_t const size = buildRecord(buf, slot, strlen(slot->name));
+        if (! BSP_writeFlash(page + offset, buf, size)) return false;
+        setSlot(slot, (PatternRecord const *)(page + offset));
+        offset += size;
+    }
+    if (! takeOverPage(me, target, me->generation + 1)) return false;
+
+    me->write_offset = offset;
+    BSP_logf("Pattern store compacted, %hu bytes free\n", me->page_size - offset);
+    return true;
+}
+
+
+static PatternRecord const *appendRecord(PatternStore *me, PatternDescr const *pd, uint8_t name_len, PatStoreErrType *err)
+{
+    uint64_t buf[MAX_RECORD_SIZE / 8];
+    uint16_t const size = buildRecord(buf, pd, name_len);
+    if (me->write_offset + size > me->page_size && ! compact(me)) {
+        *err = PSE_WRITE_FAILED;
+        return NULL;
+    }
+    if (me->write_offset + size > me->page_size) {
+        *err = PSE_STORE_FULL;
+        return NULL;
+    }
+    uint8_t const *dst = me->pages[me->active] + me->write_offset;
+    if (! BSP_writeFlash(dst, buf, size)) {
+        me->write_offset = me->page_size;       // Whatever got written is junk now.
+        *err = PSE_WRITE_FAILED;
+        return NULL;
+    }
+    me->write_offset += size;
+    return (PatternRecord const *)dst;
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+void PatternStore_startService()
+{
+    PatternStore *me = &pattern_store;
+    uint32_t size;
+    uint8_t const *area = BSP_flashArea(FA_PATTERNS, &size);
+    me->page_size = BSP_flashPageSize();
+    me->pages[0] = area;
+    me->pages[1] = area + me->page_size;
+    me->nr_of_changes = 0;
+    for (uint8_t i = 0; i < MAX_USER_PATTERNS; i++) me->slots[i].name = NULL;
+    M_ASSERT(size >= 2UL * me->page_size);
+
+    PageHeader const *hdr[2] = { (PageHeader const *)me->pages[0], (PageHeader const *)me->pages[1] };
+    bool const valid[2] = { hdr[0]->magic == PATTERN_PAGE_MAGIC, hdr[1]->magic == PATTERN_PAGE_MAGIC };
+    if (! valid[0] && ! valid[1]) {
+        me->active = 1;
+        me->generation = 0;
+        erasePage(me, me->pages[0]);
+        takeOverPage(me, 0, 1);                 // Also erases page 1.
+        me->write_offset = sizeof(PageHeader);
+        BSP_logf("Pattern store formatted\n");
+        return;
+    }
+    // Both are valid if a compaction got interrupted before it erased the old page.
+    me->active = (valid[1] && (! valid[0] || (int32_t)(hdr[1]->generation - hdr[0]->generation) > 0)) ? 1 : 0;
+    me->generation = hdr[me->active]->generation;
+    if (valid[me->active ^ 1]) erasePage(me, me->pages[me->active ^ 1]);
+    replayPage(me);
+
+    PatternStoreInfo info;
+    PatternStore_getInfo(&info);
+    BSP_logf("Found %hhu user patterns, %hu bytes free\n", info.nr_of_patterns, info.nr_of_bytes_free);
+}
+
+
+void PatternStore_getInfo(PatternStoreInfo *info)
+{
+    PatternStore const *me = &pattern_store;
+    info->nr_of_patterns = 0;
+    for (uint8_t i = 0; i < MAX_USER_PATTERNS; i++) {
+        if (me->slots[i].name != NULL) info->nr_of_patterns++;
+    }
+    info->max_nr_of_patterns = MAX_USER_PATTERNS;
+    info->nr_of_bytes_free = me->page_size - me->write_offset;
+}
+
+
+uint16_t PatternStore_generation()
+{
+    return pattern_store.nr_of_changes;
+}
+
+
+PatternDescr const *PatternStore_get(uint8_t slot_nr)
+{
+    if (slot_nr >= MAX_USER_PATTERNS) return NULL;
+
+    PatternDescr const *slot = &pattern_store.slots[slot_nr];
+    return slot->name == NULL ? NULL : slot;
+}
+
+
+uint8_t PatternStore_slotNr(PatternDescr const *pd)
+{
+    PatternDescr const *slots = pattern_store.slots;
+    return (pd >= slots && pd < slots + MAX_USER_PATTERNS) ? pd - slots : MAX_USER_PATTERNS;
+}
+
+
+bool PatternStore_put(PatternDescr const *pd, uint8_t name_len, PatStoreErrType *err)
+{
+    PatternStore *me = &pattern_store;
+    *err = PSE_NONE;
+    PatternDescr *slot = findSlot(me, pd->name, name_len);
+    if (slot == NULL && (slot = freeSlot(me)) == NULL) {
+        *err = PSE_TOO_MANY;
+        return false;
+    }
+    PatternRecord const *rec = appendRecord(me, pd, name_len, err);
+    if (rec == NULL) return false;
+
+    setSlot(slot, rec);
+    me->nr_of_changes++;
+    BSP_logf("Stored pattern '%s'\n", slot->name);
+    return true;
+}
+
+
+bool PatternStore_remove(char const *name, uint16_t len)
+{
+    PatternStore *me = &pattern_store;
+    PatternDescr *slot = findSlot(me, name, len);
+    if (slot == NULL) return false;
+
+    // Without a tombstone, the pattern would come back after a reset.
+    PatternDescr const tombstone = { .name = slot->name, .nr_of_elcons = 0 };
+    PatStoreErrType err;
+    slot->name = NULL;
+    me->nr_of_changes++;
+    uint64_t buf[MAX_RECORD_SIZE / 8];
+    if (me->write_offset + buildRecord(buf, &tombstone, len) > me->page_size) return compact(me);
+
+    return appendRecord(me, &tombstone, len, &err) != NULL;
+}
+
+
+void PatternStore_eraseAll()
+{
+    PatternStore *me = &pattern_store;
+    for (uint8_t i = 0; i < MAX_USER_PATTERNS; i++) me->slots[i].name = NULL;
+    me->nr_of_changes++;
+    uint8_t const target = me->active ^ 1;
+    if (erasePage(me, me->pages[target]) && takeOverPage(me, target, me->generation + 1)) {
+        me->write_offset = sizeof(PageHeader);
+    }
+    BSP_logf("Erased all user patterns\n");
+}
@@ -0,0 +1,275 @@
+/*
+ * pattern_vm.c -- A verified bytecode interpreter that runs ahead of the sequencer.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include <string.h>
+
+#include "bsp_dbg.h"
+#include "bsp_app.h"
+#include "convenience.h"
+
+// This module implements:
+#include "pattern_vm.h"
+
+// A program that runs this many instructions without emitting a burst gets stopped.
+#ifndef PVM_INSTRUCTIONS_PER_BURST
+#define PVM_INSTRUCTIONS_PER_BURST  256
+#endif
+
+#define PVM_MAX_WAIT_ms             60000
+
+typedef struct {
+    uint8_t code[PATTERN_PROGRAM_MAX_SIZE];
+    uint8_t size;
+} PatternProgram;
+
+// Operand kinds, per opcode: 'r' variable, 'n' shift count, 'i' immediate, 'j' jump.
+static char const operands[OP_NR_OF_OPCODES][3] = {
+    [OP_END] = "",    [OP_SET] = "rii", [OP_ADDI] = "ri", [OP_ADD] = "rr",  [OP_SUB] = "rr",  [OP_MUL] = "rr",
+    [OP_SHR] = "rn",  [OP_MIN] = "rr",  [OP_MAX] = "rr",  [OP_RAND] = "rr", [OP_SEED] = "r",  [OP_JMP] = "j",
+    [OP_JNZ] = "rj",  [OP_LOOP] = "rj", [OP_EMIT] = "r",  [OP_WAIT] = "r",
+};
+
+
+static PatternProgram program ARENA(pattern_vm);
+
+
+static uint8_t instructionLength(uint8_t opcode)
+{
+    uint8_t len = 1;
+    while (len <= sizeof operands[opcode] && operands[opcode][len - 1] != '\0') len++;
+    return len;
+}
+
+
+static bool verifyOperands(uint8_t const *instr, uint8_t len)
+{
+    for (uint8_t i = 1; i < len; i++) {
+        char const kind = operands[instr[0]][i - 1];
+        if ((kind == 'r' && instr[i] >= PVM_NR_OF_VARS) || (kind == 'n' && instr[i] >= 32)) return false;
+    }
+    return true;
+}
+
+/**
+ * Every instruction must be complete and have valid operands, every jump must land on an instruction,
+ * and the last instruction must not fall through. Loops are bounded at run time, by the instruction budget.
+ */
+static bool verify(uint8_t const *code, uint16_t nb, uint16_t *bad_pc)
+{
+    uint8_t starts[(PATTERN_PROGRAM_MAX_SIZE + 7) / 8] = {0};
+    uint16_t pc = 0, last_pc = 0;
+    while (pc < nb) {
+        *bad_pc = pc;
+        if (code[pc] >= OP_NR_OF_OPCODES) return false;
+
+        uint8_t const len = instructionLength(code[pc]);
+        if (pc + len > nb || ! verifyOperands(code + pc, len)) return false;
+
+        starts[pc / 8] |= 1 << (pc % 8);
+        last_pc = pc;
+        pc += len;
+    }
+    *bad_pc = last_pc;
+    if (nb == 0 || (code[last_pc] != OP_END && code[last_pc] != OP_JMP)) return false;
+
+    for (pc = 0; pc < nb; pc += instructionLength(code[pc])) {
+        uint8_t const len = instructionLength(code[pc]);
+        if (len == 1 || operands[code[pc]][len - 2] != 'j') continue;
+
+        *bad_pc = pc;
+        int16_t const target = pc + len + (int8_t)code[pc + len - 1];
+        if (target < 0 || target >= nb || ! (starts[target / 8] & (1 << (target % 8)))) return false;
+    }
+    return true;
+}
+
+
+static uint32_t nextRandom(PatternVm *me)
+{
+    uint32_t x = me->prng_state;                // Xorshift32.
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return me->prng_state = x;
+}
+
+
+static int32_t clip(int32_t value, int32_t min, int32_t max)
+{
+    return value < min ? min : value > max ? max : value;
+}
+
+
+static bool emitBurst(PatternVm *me, uint8_t elcons)
+{
+    Burst burst;
+    burst.elcon[0] = elcons & 0x0f;
+    burst.elcon[1] = elcons >> 4;
+    if (burst.elcon[0] == 0 || burst.elcon[1] == 0 || (burst.elcon[0] & burst.elcon[1]) != 0) {
+        BSP_logf("Pattern program emits bad elcons 0x%x at pc=%hu\n", elcons, me->pc);
+        return false;
+    }
+    burst.phase = (burst.elcon[0] & 0x5) ? 0 : 1;
+    burst.nr_of_pulses = clip(me->vars[PV_PULSES], 1, UINT16_MAX);
+    burst.pace_µs = clip(me->vars[PV_PACE_µs], MIN_PULSE_PACE_µs, MAX_PULSE_PACE_µs) / 250 * 250;
+    // Clip before scaling, so any variable value gives a valid width.
+    burst.pulse_width_¼µs = clip(me->vars[PV_WIDTH_µs], MIN_PULSE_WIDTH_¼µs / 4, MAX_PULSE_WIDTH_¼µs / 4) * 4;
+    burst.amplitude = 0;
+
+    PulseTrain *pt = (PulseTrain *)me->pending;
+    PulseTrain_init(pt, me->seq_nr++, me->time_µs, &burst);
+    PulseTrain_clearDeltas(pt);
+    me->time_µs += (uint32_t)burst.nr_of_pulses * burst.pace_µs;
+    me->has_pending = true;
+    return true;
+}
+
+
+static bool runUntilBurst(PatternVm *me)
+{
+    int32_t *v = me->vars;
+    for (uint16_t budget = PVM_INSTRUCTIONS_PER_BURST; budget != 0; budget--) {
+        uint8_t const *ip = program.code + me->pc;
+        me->pc += instructionLength(ip[0]);
+        switch (ip[0])
+        {
+            case OP_END:
+                return false;
+            case OP_SET:
+                v[ip[1]] = ip[2] | (ip[3] << 8);
+                break;
+            case OP_ADDI:
+                v[ip[1]] = (int32_t)((uint32_t)v[ip[1]] + (uint32_t)(int8_t)ip[2]);
+                break;
+            case OP_ADD:
+                v[ip[1]] = (int32_t)((uint32_t)v[ip[1]] + (uint32_t)v[ip[2]]);
+                break;
+            case OP_SUB:
+                v[ip[1]] = (int32_t)((uint32_t)v[ip[1]] - (uint32_t)v[ip[2]]);
+                break;
+            case OP_MUL:
+                v[ip[1]] = (int32_t)((uint32_t)v[ip[1]] * (uint32_t)v[ip[2]]);
+                break;
+            case OP_SHR:
+                v[ip[1]] >>= ip[2];
+                break;
+            case OP_MIN:
+                if (v[ip[2]] < v[ip[1]]) v[ip[1]] = v[ip[2]];
+                break;
+            case OP_MAX:
+                if (v[ip[2]] > v[ip[1]]) v[ip[1]] = v[ip[2]];
+                break;
+            case OP_RAND:
+                v[ip[1]] = ((nextRandom(me) >> 16) * (uint32_t)clip(v[ip[2]], 0, UINT16_MAX)) >> 16;
+                break;
+            case OP_SEED:
+                me->prng_state = (uint32_t)v[ip[1]] | 1;    // Xorshift must not start at 0.
+                break;
+            case OP_JMP:
+                me->pc += (int8_t)ip[1];
+                break;
+            case OP_JNZ:
+                if (v[ip[1]] != 0) me->pc += (int8_t)ip[2];
+                break;
+            case OP_LOOP:
+                v[ip[1]] = (int32_t)((uint32_t)v[ip[1]] - 1);
+                if (v[ip[1]] > 0) me->pc += (int8_t)ip[2];
+                break;
+            case OP_EMIT:
+                return emitBurst(me, (uint8_t)v[ip[1]]);
+            case OP_WAIT:
+                me->time_µs += (uint32_t)clip(v[ip[1]], 0, PVM_MAX_WAIT_ms) * 1000;
+                break;
+        }
+    }
+    BSP_logf("Pattern program exceeded its budget at pc=%hu\n", me->pc);
+    return false;
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+bool PatternVm_load(uint8_t const *code, uint16_t nb, uint16_t *bad_pc)
+{
+    if (nb > sizeof program.code || ! verify(code, nb, bad_pc)) return false;
+
+    memcpy(program.code, code, nb);
+    program.size = nb;
+    BSP_logf("Loaded a pattern program of %hu bytes\n", nb);
+    return true;
+}
+
+
+uint16_t PatternVm_programSize()
+{
+    return program.size;
+}
+
+
+void PatternVm_init(PatternVm *me)
+{
+    me->is_active = me->has_more = me->has_pending = false;
+}
+
+
+bool PatternVm_start(PatternVm *me)
+{
+    if (program.size == 0) return false;
+
+    memset(me->vars, 0, sizeof me->vars);
+    me->vars[PV_PULSES] = 1;
+    me->vars[PV_PACE_µs] = MAX_PULSE_PACE_µs;
+    me->vars[PV_WIDTH_µs] = 50;
+    me->prng_state = (uint32_t)BSP_microsecondsSinceBoot() | 1;
+    me->time_µs = 0;
+    me->pc = 0;
+    me->seq_nr = 0;
+    me->has_pending = false;
+    me->is_active = me->has_more = true;
+    BSP_logf("Starting the pattern program\n");
+    return true;
+}
+
+
+uint16_t PatternVm_fill(PatternVm *me, PtdQueue *queue)
+{
+    uint16_t nr_queued = 0;
+    while (me->has_more) {
+        if (! me->has_pending && ! runUntilBurst(me)) {
+            me->has_more = false;               // What is queued still gets played.
+            break;
+        }
+        PtdErrType err = PE_NONE;
+        if (! PtdQueue_addDescriptor(queue, (PulseTrain const *)me->pending, PulseTrain_size(), &err)) {
+            if (err == PE_BUFFER_FULL) break;   // Keep it for the next round.
+            BSP_logf("Pattern program burst rejected, err=%u\n", err);
+        } else {
+            nr_queued++;
+        }
+        me->has_pending = false;
+    }
+    return nr_queued;
+}
+
+
+bool PatternVm_isActive(PatternVm const *me)
+{
+    return me->is_active;
+}
+
+
+void PatternVm_stop(PatternVm *me)
+{
+    if (me->is_active) BSP_logf("Pattern program stopped\n");
+    me->is_active = me->has_more = me->has_pending = false;
+}
@@ -7,18 +7,22 @@
  *
  *  Created on: 11 Jan 2025
  *      Author: mark
- *   Copyright  2025 Neostim™
+ *   Copyright  2025, 2026 Neostim™
  */
 
 #include <string.h>
 
 #include "bsp_dbg.h"
+#include "bsp_app.h"
 #include "convenience.h"
 #include "burst.h"
+#include "pattern_store.h"
 
 // This module implements:
 #include "patterns.h"
 
+#define NAME_INDEX_SIZE             32          // A power of 2, well above the number of patterns.
+
 enum { EL_0, EL_A, EL_B, EL_C = 4, EL_AC = (EL_A | EL_C), EL_D = 8, EL_BD = (EL_B | EL_D) };
 
 __attribute__((unused))
@@ -95,7 +99,7 @@ static uint8_t const pattern_itch[][2] =
     {EL_D, EL_C},
 };
 
-static PatternDescr const pattern_descriptors[] =
+static PatternDescr const pattern_descriptors[NR_OF_BUILT_IN_PATTERNS] =
 {
     {
         .name = "Jackhammer",
@@ -140,6 +144,16 @@ static PatternDescr const pattern_descriptors[] =
 };
 
 
+// Open addressing, on the hash of the name. An entry is a pattern number plus one; 0 is free.
+typedef struct {
+    uint8_t  entries[NAME_INDEX_SIZE];
+    uint16_t store_generation;                  // The index is stale when this differs.
+    bool     is_valid;
+} NameIndex;
+
+static NameIndex name_index ARENA(patterns);
+
+
 static bool checkPattern(uint8_t const pattern[][2], uint16_t nr_of_elcons)
 {
     for (uint16_t i = 0; i < nr_of_elcons; i++) {
@@ -152,13 +166,58 @@ static bool checkPattern(uint8_t const pattern[][2], uint16_t nr_of_elcons)
     return true;
 }
 
+
+static uint32_t hashName(char const *name, uint16_t len)
+{
+    uint32_t hash = 2166136261UL;               // FNV-1a.
+    while (len-- != 0) hash = (hash ^ (uint8_t)*name++) * 16777619UL;
+    return hash;
+}
+
+
+static PatternDescr const *patternByNr(uint8_t nr)
+{
+    if (nr < NR_OF_BUILT_IN_PATTERNS) return &pattern_descriptors[nr];
+    return PatternStore_get(nr - NR_OF_BUILT_IN_PATTERNS);
+}
+
+
+static uint8_t patternNr(PatternDescr const *pd)
+{
+    if (Patterns_isBuiltIn(pd)) return pd - pattern_descriptors;
+    return NR_OF_BUILT_IN_PATTERNS + PatternStore_slotNr(pd);
+}
+
+
+static NameIndex const *nameIndex()
+{
+    NameIndex *ni = &name_index;
+    uint16_t const store_generation = PatternStore_generation();
+    if (ni->is_valid && ni->store_generation == store_generation) return ni;
+
+    memset(ni->entries, 0, sizeof ni->entries);
+    for (uint8_t nr = 0; nr < NR_OF_BUILT_IN_PATTERNS + MAX_USER_PATTERNS; nr++) {
+        PatternDescr const *pd = patternByNr(nr);
+        if (pd == NULL) continue;
+
+        uint32_t hash = hashName(pd->name, strlen(pd->name));
+        while (ni->entries[hash & (NAME_INDEX_SIZE - 1)] != 0) hash++;
+        ni->entries[hash & (NAME_INDEX_SIZE - 1)] = nr + 1;
+    }
+    ni->store_generation = store_generation;
+    ni->is_valid = true;
+    return ni;
+}
+
 /*
  * Below are the functions implementing this module's interface.
  */
 
 uint16_t Patterns_getCount()
 {
-    return M_DIM(pattern_descriptors);
+    PatternStoreInfo info;
+    PatternStore_getInfo(&info);
+    return NR_OF_BUILT_IN_PATTERNS + info.nr_of_patterns;
 }
 
 
@@ -171,27 +230,69 @@ char const *Patterns_name(PatternDescr const *pd)
 
 void Patterns_getNames(char const *names[], uint8_t cnt)
 {
-    if (cnt > M_DIM(pattern_descriptors)) cnt = M_DIM(pattern_descriptors);
-    for (uint8_t i = 0; i < cnt; i++) {
-        names[i] = pattern_descriptors[i].name;
+    uint8_t i = 0;
+    for (uint8_t nr = 0; i < cnt && nr < NR_OF_BUILT_IN_PATTERNS + MAX_USER_PATTERNS; nr++) {
+        PatternDescr const *pd = patternByNr(nr);
+        if (pd != NULL) names[i++] = pd->name;
     }
 }
 
 
 void Patterns_checkAll()
 {
-    for (uint8_t i = 0; i < M_DIM(pattern_descriptors); i++) {
-        PatternDescr const *pd = &pattern_descriptors[i];
-        BSP_logf("Checking '%s'\n", pd->name);
-        checkPattern(pd->pattern, pd->nr_of_elcons);
+    // Only report problems, to keep the boot log short.
+    for (uint8_t nr = 0; nr < NR_OF_BUILT_IN_PATTERNS + MAX_USER_PATTERNS; nr++) {
+        PatternDescr const *pd = patternByNr(nr);
+        if (pd != NULL && ! checkPattern(pd->pattern, pd->nr_of_elcons)) {
+            BSP_logf("Pattern '%s' is invalid\n", pd->name);
+        }
     }
 }
 
 
+bool Patterns_isValid(PatternDescr const *pd, uint16_t name_len)
+{
+    if (name_len == 0 || name_len > PATTERN_NAME_MAX_LEN || memchr(pd->name, '\0', name_len) != NULL) return false;
+    if (pd->nr_of_elcons == 0 || pd->nr_of_elcons > PATTERN_MAX_ELCONS || pd->nr_of_steps < 2 || pd->nr_of_reps == 0) return false;
+    if (pd->pace_µs < MIN_PULSE_PACE_µs || pd->pace_µs > MAX_PULSE_PACE_µs) return false;
+    for (uint16_t i = 0; i < pd->nr_of_elcons; i++) {
+        if (pd->pattern[i][0] == EL_0 || pd->pattern[i][1] == EL_0) return false;
+    }
+    // Built-in patterns cannot be replaced.
+    PatternDescr const *existing = Patterns_findByName(pd->name, name_len);
+    return (existing == NULL || ! Patterns_isBuiltIn(existing)) && checkPattern(pd->pattern, pd->nr_of_elcons);
+}
+
+
+bool Patterns_isShortFree(PatternDescr const *pd)
+{
+    return checkPattern(pd->pattern, pd->nr_of_elcons);
+}
+
+
+uint8_t Patterns_electrodes(PatternDescr const *pd)
+{
+    uint8_t electrodes = 0;
+    for (uint16_t i = 0; i < pd->nr_of_elcons; i++) {
+        electrodes |= pd->pattern[i][0] | pd->pattern[i][1];
+    }
+    return electrodes;
+}
+
+
+bool Patterns_isBuiltIn(PatternDescr const *pd)
+{
+    return pd >= pattern_descriptors && pd < pattern_descriptors + NR_OF_BUILT_IN_PATTERNS;
+}
+
+
 PatternDescr const *Patterns_findByName(char const *name, uint16_t len)
 {
-    for (uint16_t i = 0; i < M_DIM(pattern_descriptors); i++) {
-        PatternDescr const *pd = &pattern_descriptors[i];
+    NameIndex const *ni = nameIndex();
+    uint32_t hash = hashName(name, len);
+    uint8_t entry;
+    while ((entry = ni->entries[hash++ & (NAME_INDEX_SIZE - 1)]) != 0) {
+        PatternDescr const *pd = patternByNr(entry - 1);
         if (len == strlen(pd->name) && memcmp(name, pd->name, len) == 0) {
             return pd;
         }
@@ -202,10 +303,11 @@ PatternDescr const *Patterns_findByName(char const *name, uint16_t len)
 
 PatternDescr const *Patterns_getNext(PatternDescr const *pd)
 {
-    uint16_t index = 0;
-    if (pd != NULL) {
-        index = pd - pattern_descriptors;
-        if (++index == M_DIM(pattern_descriptors)) index = 0;
-    }
-    return &pattern_descriptors[index];
+    uint8_t const nr_of_nrs = NR_OF_BUILT_IN_PATTERNS + MAX_USER_PATTERNS;
+    uint8_t nr = (pd == NULL) ? nr_of_nrs - 1 : patternNr(pd);
+    // Skip the free slots of the store. The built-in patterns guarantee an end to this.
+    do {
+        if (++nr >= nr_of_nrs) nr = 0;
+    } while ((pd = patternByNr(nr)) == NULL);
+    return pd;
 }
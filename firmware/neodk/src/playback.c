@@ -0,0 +1,118 @@
+/*
+ * playback.c -- Decodes recordings incrementally, just ahead of the sequencer.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include "bsp_dbg.h"
+
+// This module implements:
+#include "playback.h"
+
+// Silence between consecutive recordings, when playing them all.
+#ifndef PLAYBACK_GAP_ms
+#define PLAYBACK_GAP_ms     1000
+#endif
+
+
+static bool nextRecording(Playback *me)
+{
+    if (me->recording_nr == me->last_recording_nr || ! RecStore_seek(&me->cursor, me->recording_nr + 1, 0)) return false;
+
+    me->recording_nr++;
+    me->time_offset_µs = me->end_µs + PLAYBACK_GAP_ms * 1000UL;
+    BSP_logf("Playback continues with recording %hhu\n", me->recording_nr);
+    return true;
+}
+
+
+static bool readPending(Playback *me)
+{
+    PulseTrain *pt = (PulseTrain *)me->pending;
+    while ((me->pending_size = RecStore_read(&me->cursor, (uint8_t *)me->pending)) == 0) {
+        if (! nextRecording(me)) return false;
+    }
+    PulseTrain_setTimestamp(pt, PulseTrain_timestamp(pt) + me->time_offset_µs);
+    PulseTrain_setSequenceNumber(pt, me->seq_nr++);
+    return true;
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+void Playback_init(Playback *me)
+{
+    me->is_active = me->has_more = false;
+    me->pending_size = 0;
+}
+
+
+bool Playback_start(Playback *me, uint8_t recording_nr, uint32_t from_µs)
+{
+    uint8_t const nr_of_recordings = RecStore_nrOfRecordings();
+    bool const all = recording_nr == PLAYBACK_ALL;
+    if (all) recording_nr = 0;
+    if (! RecStore_seek(&me->cursor, recording_nr, from_µs)) return false;
+
+    me->recording_nr = recording_nr;
+    me->last_recording_nr = all ? nr_of_recordings - 1 : recording_nr;
+    me->seq_nr = 0;
+    me->time_offset_µs = 0;
+    me->end_µs = 0;
+    me->pending_size = 0;
+    me->is_active = me->has_more = true;
+    BSP_logf("Playing recording %hhu from %u ms\n", recording_nr, from_µs / 1000);
+    return true;
+}
+
+
+uint16_t Playback_fill(Playback *me, PtdQueue *queue)
+{
+    uint16_t nr_queued = 0;
+    while (me->has_more) {
+        if (me->pending_size == 0 && ! readPending(me)) {
+            me->has_more = false;               // What is queued still gets played.
+            break;
+        }
+        PulseTrain const *pt = (PulseTrain const *)me->pending;
+        PtdErrType err = PE_NONE;
+        if (! PtdQueue_addDescriptor(queue, pt, me->pending_size, &err)) {
+            if (err == PE_BUFFER_FULL) break;   // Keep it for the next round.
+            BSP_logf("Playback skips a descriptor, err=%u\n", err);
+        } else {
+            Burst burst;
+            uint32_t const end_µs = PulseTrain_timestamp(pt) + Burst_duration_µs(PulseTrain_getBurst(pt, &burst));
+            if (end_µs > me->end_µs) me->end_µs = end_µs;
+            nr_queued++;
+        }
+        me->pending_size = 0;
+    }
+    return nr_queued;
+}
+
+
+bool Playback_isActive(Playback const *me)
+{
+    return me->is_active;
+}
+
+
+uint8_t Playback_recordingNr(Playback const *me)
+{
+    return me->recording_nr;
+}
+
+
+void Playback_stop(Playback *me)
+{
+    if (me->is_active) BSP_logf("Playback stopped\n");
+    me->is_active = me->has_more = false;
+    me->pending_size = 0;
+}
@@ -7,7 +7,7 @@
  *
  *  Created on: 29 Dec 2019
  *      Author: mark
- *   Copyright  2019..2025 Neostim™
+ *   Copyright  2019..2026 Neostim™
  */
 
 #include <stddef.h>
@@ -86,6 +86,24 @@ uint32_t PulseTrain_timestamp(PulseTrain const *me)
 }
 
 
+void PulseTrain_setTimestamp(PulseTrain *me, uint32_t timestamp)
+{
+    me->start_time_µs = timestamp;
+}
+
+
+void PulseTrain_setSequenceNumber(PulseTrain *me, uint8_t seq_nr)
+{
+    me->sequence_number = seq_nr;
+}
+
+
+void PulseTrain_setAmplitude(PulseTrain *me, uint8_t amplitude)
+{
+    me->amplitude = amplitude;
+}
+
+
 uint8_t PulseTrain_phase(PulseTrain const *me)
 {
     return me->phase & 0x7;
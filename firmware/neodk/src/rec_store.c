@@ -0,0 +1,509 @@
+/*
+ * rec_store.c -- Keeps pulse train recordings in flash, compressed, in blocks of one page.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "bsp_dbg.h"
+#include "bsp_app.h"
+#include "convenience.h"
+
+// This module implements:
+#include "rec_store.h"
+
+#ifndef REC_MAX_RECORDINGS
+#define REC_MAX_RECORDINGS      32
+#endif
+
+#define REC_BLOCK_MAGIC         0x4345524eUL    // "NREC", little endian.
+#define REC_MAX_CODED_SIZE      18              // Flags, time, channel, width, count, pace, tail.
+
+// Offsets of the members of a descriptor, see pulse_train.c.
+enum { DO_META, DO_SEQ, DO_PHASE, DO_WIDTH, DO_START, DO_ELCON = 8, DO_COUNT = 10, DO_PACE = 12, DO_TAIL = 13 };
+
+// The flags byte in front of each coded descriptor. Fields that are not flagged equal the reference's.
+enum {
+    CF_SLOT_MASK = 0x03,                        // The reference it was coded against.
+    CF_CHANNEL   = 1 << 2,                      // Phase and electrode sets follow.
+    CF_WIDTH     = 1 << 3,                      // Pulse width follows.
+    CF_COUNT     = 1 << 4,                      // Number of pulses follows, as a varint.
+    CF_PACE      = 1 << 5,                      // Pace follows.
+    CF_TAIL      = 1 << 6,                      // Size follows, then the members from amplitude on.
+};
+
+enum { BF_LAST = 1 << 0 };
+
+// Written after the block's data, so a block with a valid header is complete.
+typedef struct {
+    uint32_t magic;
+    uint8_t  recording_nr;
+    uint8_t  flags;
+    uint16_t block_index;                       // Within the recording.
+    uint32_t start_time_µs;                     // Of the block's first descriptor.
+    uint16_t nr_of_descriptors;
+    uint16_t nr_of_bytes;                       // Of coded data, following the header.
+} BlockHeader;
+
+typedef struct {
+    RecCodec codec;
+    uint8_t  staged[8];                         // Flash gets written one double word at a time.
+    uint8_t  nr_staged;
+    bool     is_open;                           // Between begin and end.
+    bool     has_block;
+    uint16_t block_nr;
+    BlockHeader header;
+} RecWriter;
+
+typedef struct {
+    uint8_t const *area;
+    uint16_t block_size;
+    uint16_t nr_of_blocks;
+    uint8_t  nr_of_recordings;
+    uint16_t first_block[REC_MAX_RECORDINGS + 1];   // The one past the last recording is the first free one.
+    RecWriter writer;
+} RecStore;
+
+
+static RecStore rec_store ARENA(rec_store);
+
+
+static uint32_t getLE32(uint8_t const *bp)
+{
+    return bp[0] | (bp[1] << 8) | ((uint32_t)bp[2] << 16) | ((uint32_t)bp[3] << 24);
+}
+
+
+static void putLE32(uint8_t *bp, uint32_t value)
+{
+    for (uint8_t i = 0; i < 4; i++, value >>= 8) bp[i] = (uint8_t)value;
+}
+
+
+static uint8_t putVarint(uint8_t *bp, uint32_t value)
+{
+    uint8_t nb = 0;
+    while (value >= 0x80) {
+        bp[nb++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    bp[nb++] = (uint8_t)value;
+    return nb;
+}
+
+
+static uint32_t getVarint(uint8_t const *bp, uint16_t *offset)
+{
+    uint32_t value = 0;
+    for (uint8_t shift = 0; shift < 32; shift += 7) {
+        uint8_t const b = bp[(*offset)++];
+        value |= (uint32_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) break;
+    }
+    return value;
+}
+
+
+static bool isBlank(uint8_t const *bp, uint16_t nb)
+{
+    uint32_t const *wp = (uint32_t const *)bp;
+    for (uint16_t i = 0; i < nb / 4; i++) {
+        if (wp[i] != 0xffffffffUL) return false;
+    }
+    return true;
+}
+
+
+static uint8_t const *blockAddress(RecStore const *me, uint16_t block_nr)
+{
+    return me->area + (uint32_t)block_nr * me->block_size;
+}
+
+
+static BlockHeader const *validHeader(uint8_t const *block)
+{
+    BlockHeader const *hdr = (BlockHeader const *)block;
+    return hdr->magic == REC_BLOCK_MAGIC ? hdr : NULL;
+}
+
+
+static uint16_t blockCapacity(RecStore const *me)
+{
+    return me->block_size - sizeof(BlockHeader);
+}
+
+
+static void resetCodec(RecCodec *codec, uint32_t time_µs)
+{
+    memset(codec, 0, sizeof *codec);
+    codec->time_µs = time_µs;
+}
+
+
+static bool isSameChannel(uint8_t const *a, uint8_t const *b)
+{
+    return a[DO_PHASE] == b[DO_PHASE] && a[DO_ELCON] == b[DO_ELCON] && a[DO_ELCON + 1] == b[DO_ELCON + 1];
+}
+
+
+static uint8_t chooseReference(RecCodec const *codec, uint8_t const *descr)
+{
+    for (uint8_t i = 0; i < REC_NR_OF_REFERENCES; i++) {
+        if (codec->ref_sizes[i] != 0 && isSameChannel(codec->refs[i], descr)) return i;
+    }
+    for (uint8_t i = 0; i < REC_NR_OF_REFERENCES; i++) {
+        if (codec->ref_sizes[i] == 0) return i;
+    }
+    return codec->next_ref;
+}
+
+
+static void updateReference(RecCodec *codec, uint8_t slot, uint8_t const *descr, uint8_t sz)
+{
+    memcpy(codec->refs[slot], descr, PT_DESCRIPTOR_MAX_SIZE);
+    codec->ref_sizes[slot] = sz;
+    codec->time_µs = getLE32(descr + DO_START);
+    if (slot == codec->next_ref) codec->next_ref = (slot + 1) % REC_NR_OF_REFERENCES;
+}
+
+
+static uint8_t encode(RecCodec const *codec, uint8_t const *descr, uint8_t sz, uint8_t *slot, uint8_t *out)
+{
+    uint8_t const *ref = codec->refs[*slot = chooseReference(codec, descr)];
+    uint8_t flags = *slot;
+    uint8_t nb = 1;
+    nb += putVarint(out + nb, getLE32(descr + DO_START) - codec->time_µs);
+    if (! isSameChannel(ref, descr)) {
+        flags |= CF_CHANNEL;
+        out[nb++] = descr[DO_PHASE];
+        out[nb++] = descr[DO_ELCON];
+        out[nb++] = descr[DO_ELCON + 1];
+    }
+    if (descr[DO_WIDTH] != ref[DO_WIDTH]) {
+        flags |= CF_WIDTH;
+        out[nb++] = descr[DO_WIDTH];
+    }
+    if (memcmp(descr + DO_COUNT, ref + DO_COUNT, 2) != 0) {
+        flags |= CF_COUNT;
+        nb += putVarint(out + nb, descr[DO_COUNT] | (descr[DO_COUNT + 1] << 8));
+    }
+    if (descr[DO_PACE] != ref[DO_PACE]) {
+        flags |= CF_PACE;
+        out[nb++] = descr[DO_PACE];
+    }
+    if (sz != codec->ref_sizes[*slot] || memcmp(descr + DO_TAIL, ref + DO_TAIL, PT_DESCRIPTOR_MAX_SIZE - DO_TAIL) != 0) {
+        flags |= CF_TAIL;
+        out[nb++] = sz;
+        for (uint8_t i = DO_TAIL; i < sz; i++) out[nb++] = descr[i];
+    }
+    out[0] = flags;
+    return nb;
+}
+
+
+static uint8_t decode(RecCodec *codec, uint8_t const *data, uint16_t *offset, uint8_t *descr)
+{
+    uint8_t const flags = data[(*offset)++];
+    uint8_t const slot = flags & CF_SLOT_MASK;
+    memcpy(descr, codec->refs[slot], PT_DESCRIPTOR_MAX_SIZE);
+    uint8_t sz = codec->ref_sizes[slot];
+    putLE32(descr + DO_START, codec->time_µs + getVarint(data, offset));
+    if (flags & CF_CHANNEL) {
+        descr[DO_PHASE] = data[(*offset)++];
+        descr[DO_ELCON] = data[(*offset)++];
+        descr[DO_ELCON + 1] = data[(*offset)++];
+    }
+    if (flags & CF_WIDTH) descr[DO_WIDTH] = data[(*offset)++];
+    if (flags & CF_COUNT) {
+        uint32_t const nr_of_pulses = getVarint(data, offset);
+        descr[DO_COUNT] = (uint8_t)nr_of_pulses;
+        descr[DO_COUNT + 1] = (uint8_t)(nr_of_pulses >> 8);
+    }
+    if (flags & CF_PACE) descr[DO_PACE] = data[(*offset)++];
+    if (flags & CF_TAIL) {
+        sz = data[(*offset)++];
+        memset(descr + DO_TAIL, 0, PT_DESCRIPTOR_MAX_SIZE - DO_TAIL);
+        for (uint8_t i = DO_TAIL; i < sz; i++) descr[i] = data[(*offset)++];
+    }
+    descr[DO_SEQ] = 0;
+    updateReference(codec, slot, descr, sz);
+    return sz;
+}
+
+
+static bool stage(RecStore *me, uint8_t const *bp, uint8_t nb)
+{
+    RecWriter *wr = &me->writer;
+    uint8_t const *block = blockAddress(me, wr->block_nr);
+    for (uint8_t i = 0; i < nb; i++) {
+        wr->staged[wr->nr_staged++] = bp[i];
+        if (wr->nr_staged == sizeof wr->staged) {
+            uint16_t const offset = sizeof(BlockHeader) + wr->header.nr_of_bytes + i + 1 - sizeof wr->staged;
+            if (! BSP_writeFlash(block + offset, wr->staged, sizeof wr->staged)) return false;
+            wr->nr_staged = 0;
+        }
+    }
+    wr->header.nr_of_bytes += nb;
+    return true;
+}
+
+
+static bool openBlock(RecStore *me, uint16_t block_nr, uint16_t block_index, uint32_t start_time_µs, RecErrType *err)
+{
+    RecWriter *wr = &me->writer;
+    if (block_nr >= me->nr_of_blocks) {
+        *err = RE_STORE_FULL;
+        return false;
+    }
+    uint8_t const *block = blockAddress(me, block_nr);
+    if (! isBlank(block, me->block_size) && ! BSP_eraseFlashPage(block)) {
+        *err = RE_WRITE_FAILED;
+        return false;
+    }
+    wr->block_nr = block_nr;
+    wr->nr_staged = 0;
+    wr->header = (BlockHeader){
+        .magic = REC_BLOCK_MAGIC, .recording_nr = me->nr_of_recordings, .flags = 0,
+        .block_index = block_index, .start_time_µs = start_time_µs,
+    };
+    resetCodec(&wr->codec, start_time_µs);
+    wr->has_block = true;
+    return true;
+}
+
+
+static bool closeBlock(RecStore *me, bool is_last)
+{
+    RecWriter *wr = &me->writer;
+    uint8_t const *block = blockAddress(me, wr->block_nr);
+    if (wr->nr_staged != 0) {
+        uint16_t const offset = sizeof(BlockHeader) + wr->header.nr_of_bytes - wr->nr_staged;
+        memset(wr->staged + wr->nr_staged, 0xff, sizeof wr->staged - wr->nr_staged);
+        if (! BSP_writeFlash(block + offset, wr->staged, sizeof wr->staged)) return false;
+        wr->nr_staged = 0;
+    }
+    if (is_last) wr->header.flags |= BF_LAST;
+    wr->has_block = false;
+    return BSP_writeFlash(block, &wr->header, sizeof wr->header);
+}
+
+
+static bool appendDescriptor(RecStore *me, uint8_t const *bp, uint8_t sz, RecErrType *err)
+{
+    RecWriter *wr = &me->writer;
+    uint8_t descr[PT_DESCRIPTOR_MAX_SIZE] = {0};
+    memcpy(descr, bp, sz);
+    descr[DO_SEQ] = 0;                          // Gets renumbered on playback.
+    uint32_t const start_time_µs = getLE32(descr + DO_START);
+    if (sz < DO_ELCON + 2 || descr[DO_META] != 0x00 || (wr->has_block && start_time_µs < wr->codec.time_µs)) {
+        *err = RE_BAD_DESCRIPTOR;
+        return false;
+    }
+
+    if (! wr->has_block && ! openBlock(me, me->first_block[me->nr_of_recordings], 0, start_time_µs, err)) return false;
+
+    uint8_t coded[REC_MAX_CODED_SIZE], slot;
+    uint8_t nb = encode(&wr->codec, descr, sz, &slot, coded);
+    if (wr->header.nr_of_bytes + nb > blockCapacity(me)) {
+        uint16_t const next_index = wr->header.block_index + 1;
+        if (! closeBlock(me, false)) {
+            *err = RE_WRITE_FAILED;
+            return false;
+        }
+        if (! openBlock(me, wr->block_nr + 1, next_index, start_time_µs, err)) return false;
+        nb = encode(&wr->codec, descr, sz, &slot, coded);
+    }
+    if (! stage(me, coded, nb)) {
+        *err = RE_WRITE_FAILED;
+        return false;
+    }
+    updateReference(&wr->codec, slot, descr, sz);
+    wr->header.nr_of_descriptors++;
+    return true;
+}
+
+
+static uint16_t endBlockOf(RecStore const *me, uint8_t recording_nr)
+{
+    return me->first_block[recording_nr + 1];
+}
+
+
+static uint16_t scanRecording(RecStore *me, uint16_t block_nr)
+{
+    // Returns the block past the recording's last, or 0 if the recording is not complete.
+    for (uint16_t index = 0; block_nr < me->nr_of_blocks; index++) {
+        BlockHeader const *hdr = validHeader(blockAddress(me, block_nr++));
+        if (hdr == NULL || hdr->recording_nr != me->nr_of_recordings || hdr->block_index != index) break;
+        if (hdr->flags & BF_LAST) return block_nr;
+    }
+    return 0;
+}
+
+
+static void loadBlock(RecStore const *me, RecCursor *rc, uint8_t const *block)
+{
+    BlockHeader const *hdr = (BlockHeader const *)block;
+    rc->block = block;
+    rc->offset = 0;
+    rc->nr_left = hdr->nr_of_descriptors;
+    resetCodec(&rc->codec, hdr->start_time_µs);
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+void RecStore_startService()
+{
+    RecStore *me = &rec_store;
+    uint32_t size;
+    me->area = BSP_flashArea(FA_RECORDINGS, &size);
+    me->block_size = BSP_flashPageSize();
+    me->nr_of_blocks = size / me->block_size;
+    me->nr_of_recordings = 0;
+    me->first_block[0] = 0;
+    me->writer.is_open = me->writer.has_block = false;
+
+    uint16_t end_block;
+    while (me->nr_of_recordings < REC_MAX_RECORDINGS && (end_block = scanRecording(me, me->first_block[me->nr_of_recordings])) != 0) {
+        me->first_block[++me->nr_of_recordings] = end_block;
+    }
+    BSP_logf("Found %hhu recordings, %hu of %hu blocks free\n", me->nr_of_recordings,
+            me->nr_of_blocks - me->first_block[me->nr_of_recordings], me->nr_of_blocks);
+}
+
+
+void RecStore_getInfo(RecStoreInfo *info)
+{
+    RecStore const *me = &rec_store;
+    RecWriter const *wr = &me->writer;
+    uint16_t const first_free = wr->has_block ? wr->block_nr + 1 : me->first_block[me->nr_of_recordings];
+    info->nr_of_recordings = me->nr_of_recordings;
+    info->nr_of_free_blocks = me->nr_of_blocks - first_free;
+    info->block_size = me->block_size;
+}
+
+
+uint8_t RecStore_nrOfRecordings()
+{
+    return rec_store.nr_of_recordings;
+}
+
+
+bool RecStore_beginRecording()
+{
+    RecStore *me = &rec_store;
+    RecWriter *wr = &me->writer;
+    // Blocks of an abandoned recording get erased again when they are reused.
+    wr->is_open = wr->has_block = false;
+    if (me->nr_of_recordings == REC_MAX_RECORDINGS || me->first_block[me->nr_of_recordings] == me->nr_of_blocks) return false;
+
+    wr->is_open = true;
+    return true;
+}
+
+
+bool RecStore_append(uint8_t const *stream, uint16_t nb, RecErrType *err)
+{
+    RecStore *me = &rec_store;
+    *err = RE_NONE;
+    if (! me->writer.is_open) {
+        *err = RE_NOT_RECORDING;
+        return false;
+    }
+    for (uint16_t i = 0; i < nb; ) {
+        uint8_t const sz = stream[i++];
+        if (sz > PT_DESCRIPTOR_MAX_SIZE || i + sz > nb) *err = RE_BAD_DESCRIPTOR;
+        if (*err != RE_NONE || ! appendDescriptor(me, stream + i, sz, err)) {
+            me->writer.is_open = me->writer.has_block = false;
+            return false;
+        }
+        i += sz;
+    }
+    return true;
+}
+
+
+bool RecStore_endRecording()
+{
+    RecStore *me = &rec_store;
+    RecWriter *wr = &me->writer;
+    if (! wr->is_open) return false;
+
+    RecErrType err;
+    wr->is_open = false;
+    // An empty recording still takes a block, to mark its place.
+    if (! wr->has_block && ! openBlock(me, me->first_block[me->nr_of_recordings], 0, 0, &err)) return false;
+
+    uint16_t const end_block = wr->block_nr + 1;
+    if (! closeBlock(me, true)) return false;
+
+    me->first_block[++me->nr_of_recordings] = end_block;
+    BSP_logf("Stored recording %hhu in %hu blocks\n", me->nr_of_recordings - 1,
+            end_block - me->first_block[me->nr_of_recordings - 1]);
+    return true;
+}
+
+
+void RecStore_eraseAll()
+{
+    RecStore *me = &rec_store;
+    me->writer.is_open = me->writer.has_block = false;
+    for (uint16_t block_nr = 0; block_nr < me->nr_of_blocks; block_nr++) {
+        uint8_t const *block = blockAddress(me, block_nr);
+        if (! isBlank(block, me->block_size)) BSP_eraseFlashPage(block);
+    }
+    me->nr_of_recordings = 0;
+    me->first_block[0] = 0;
+    BSP_logf("Erased all recordings\n");
+}
+
+
+bool RecStore_seek(RecCursor *rc, uint8_t recording_nr, uint32_t from_µs)
+{
+    RecStore const *me = &rec_store;
+    if (recording_nr >= me->nr_of_recordings) return false;
+
+    // Find the last block that starts no later than the requested time.
+    uint16_t lo = me->first_block[recording_nr], hi = endBlockOf(me, recording_nr);
+    while (hi - lo > 1) {
+        uint16_t const mid = lo + (hi - lo) / 2;
+        if (((BlockHeader const *)blockAddress(me, mid))->start_time_µs <= from_µs) lo = mid;
+        else hi = mid;
+    }
+    loadBlock(me, rc, blockAddress(me, lo));
+
+    // Then skip the descriptors that start earlier.
+    uint8_t descr[PT_DESCRIPTOR_MAX_SIZE];
+    RecCursor ahead = *rc;
+    while (RecStore_read(&ahead, descr) != 0 && getLE32(descr + DO_START) < from_µs) *rc = ahead;
+    return true;
+}
+
+
+uint8_t RecStore_read(RecCursor *rc, uint8_t descr[PT_DESCRIPTOR_MAX_SIZE])
+{
+    RecStore const *me = &rec_store;
+    if (rc->block == NULL) return 0;
+
+    BlockHeader const *hdr = (BlockHeader const *)rc->block;
+    if (rc->nr_left == 0) {
+        if (hdr->flags & BF_LAST) return 0;
+        loadBlock(me, rc, rc->block + me->block_size);
+        hdr = (BlockHeader const *)rc->block;
+        if (rc->nr_left == 0) return 0;
+    }
+    if (rc->offset >= hdr->nr_of_bytes) return 0;   // Corrupt block.
+
+    rc->nr_left--;
+    return decode(&rc->codec, rc->block + sizeof(BlockHeader), &rc->offset, descr);
+}
@@ -19,21 +19,52 @@
 #include "attributes.h"
 #include "pattern_iter.h"
 #include "ptd_queue.h"
+#include "buffer_pool.h"
+#include "playback.h"
+#include "pattern_vm.h"
+#include "pattern_mux.h"
 
 // This module implements:
 #include "sequencer.h"
 
 #define DEFAULT_INTENSITY_PERCENT         16
 
+#ifndef SEQUENCER_EVENT_STORAGE_SIZE
+#define SEQUENCER_EVENT_STORAGE_SIZE      200
+#endif
+
+#ifndef DEFAULT_CROSSFADE_ms
+#define DEFAULT_CROSSFADE_ms              0     // Switch patterns at once.
+#endif
+
+#ifndef PTD_QUEUE_LENGTH
+#define PTD_QUEUE_LENGTH                  64
+#endif
+
+#define PATTERN_START_TIME_µs             1000  // Of the first burst, on the sequencer clock.
+
 typedef void *(*StateFunc)(Sequencer *, AOEvent const *);
 
 struct _Sequencer {
     EventQueue event_queue;                     // This MUST be the first member.
-    uint8_t event_storage[200];
+    uint8_t event_storage[SEQUENCER_EVENT_STORAGE_SIZE];
     PtdQueue *ptd_queue;
     StateFunc state;
     PatternDescr const *pattern;
     PatternIterator pi;
+    PatternDescr const *next_pattern;           // Waiting for a burst or rep boundary.
+    PatternIterator next_pi;                    // Ready to go.
+    TransitionSettings transition;
+    uint32_t fade_start_µs;
+    uint16_t fade_ms;                           // 0 if not fading.
+    uint8_t fade_from, fade_to;
+    Playback playback;
+    PatternVm vm;
+    PatternMux mux;
+    uint32_t start_at_ms;                       // Where the next start of the pattern seeks to.
+    uint32_t progress_s;                        // As last reported.
+    uint32_t burst_start_µs;                    // Of the pattern burst to schedule next.
+    uint32_t clock_stopped_µs;                  // Where the sequencer clock resumes.
     uint8_t intensity_percent;
     uint8_t play_state;
     uint8_t stream_busy;
@@ -42,12 +73,16 @@ struct _Sequencer {
 
 static void setVoltagePercent(uint8_t voltage_percent)
 {
-    static uint8_t current_voltage_percent = 0;
-    if (voltage_percent != current_voltage_percent) {
-        uint16_t voltage_mV = BSP_setPrimaryVoltagePercent(voltage_percent);
-        current_voltage_percent = voltage_percent;
-        BSP_logf("Primary voltage set to %hu mV\n", voltage_mV);
-    }
+    // Always set it, because the amplitude LFO may have changed it.
+    uint16_t voltage_mV = BSP_setPrimaryVoltagePercent(voltage_percent);
+    BSP_logf("Primary voltage set to %hu mV\n", voltage_mV);
+}
+
+
+static bool prepareTransition(Sequencer *me, PatternDescr const *pd)
+{
+    me->next_pi = me->pi;                       // Inherit pulse width, intensity and modulation.
+    return PatternIterator_init(&me->next_pi, pd) && PatternIterator_prepareBurst(&me->next_pi);
 }
 
 
@@ -55,10 +90,52 @@ static void setIntensityPercentage(Sequencer *me, uint8_t perc)
 {
     BSP_logf("Setting intensity to %hhu%%\n", perc);
     me->intensity_percent = perc;
-    // TODO Ramp up to the previous intensity?
+    me->fade_ms = 0;                            // The user takes over.
     setVoltagePercent(perc);
+    PatternIterator_setIntensity(&me->pi, perc);
     Sequencer_notifyIntensity(me);
     PatternIterator_setPulseWidth(&me->pi, 50 + perc + perc / 2);
+    if (me->next_pattern != NULL) prepareTransition(me, me->next_pattern);
+}
+
+
+static void applyLevel(Sequencer *me, uint8_t perc)
+{
+    BSP_setPrimaryVoltagePercent(perc);
+    PatternIterator_setIntensity(&me->pi, perc);
+}
+
+
+static void startFade(Sequencer *me, uint8_t from, uint8_t to, uint16_t duration_ms)
+{
+    me->fade_from = from;
+    me->fade_to = to;
+    me->fade_ms = duration_ms;
+    me->fade_start_µs = (uint32_t)BSP_microsecondsSinceBoot();
+}
+
+// Returns true if no fade is in progress (any more).
+static bool updateFade(Sequencer *me)
+{
+    if (me->fade_ms == 0) return true;
+
+    uint32_t const elapsed_ms = ((uint32_t)BSP_microsecondsSinceBoot() - me->fade_start_µs) / 1000;
+    if (elapsed_ms >= me->fade_ms) {
+        applyLevel(me, me->fade_to);
+        me->fade_ms = 0;
+        return true;
+    }
+    applyLevel(me, me->fade_from + ((int32_t)me->fade_to - me->fade_from) * (int32_t)elapsed_ms / me->fade_ms);
+    return false;
+}
+
+
+static void stopFade(Sequencer *me)
+{
+    if (me->fade_ms != 0) {
+        me->fade_ms = 0;
+        applyLevel(me, me->intensity_percent);
+    }
 }
 
 
@@ -66,6 +143,8 @@ static void switchPattern(Sequencer *me, PatternDescr const *pd)
 {
     CLI_logf("Switching to '%s'\n", Patterns_name(pd));
     me->pattern = pd;
+    me->next_pattern = NULL;
+    me->start_at_ms = 0;
     PatternIterator_init(&me->pi, pd);
     if (me->intensity_percent > DEFAULT_INTENSITY_PERCENT) {
         // Lower the intensity to a comfortable level.
@@ -75,6 +154,53 @@ static void switchPattern(Sequencer *me, PatternDescr const *pd)
 }
 
 
+/**
+ * While a pattern plays, the switch waits for the next burst or rep boundary, and the next pattern's first burst
+ * gets computed right away. With a crossfade, the intensity first fades down to a comfortable level.
+ */
+static void queueTransition(Sequencer *me, PatternDescr const *pd)
+{
+    if (! prepareTransition(me, pd)) return;
+
+    me->next_pattern = pd;
+    CLI_logf("Switching to '%s' at the next %s\n", Patterns_name(pd), me->transition.boundary == TB_NEXT_REP ? "rep" : "burst");
+    uint8_t const low = me->intensity_percent < DEFAULT_INTENSITY_PERCENT ? me->intensity_percent : DEFAULT_INTENSITY_PERCENT;
+    if (me->transition.crossfade_ms != 0 && me->fade_ms == 0) {
+        startFade(me, me->pi.intensity_percent, low, me->transition.crossfade_ms / 2);
+    }
+}
+
+
+static void completeTransition(Sequencer *me)
+{
+    PatternDescr const *pd = me->next_pattern;
+    CLI_logf("Switched to '%s'\n", Patterns_name(pd));
+    me->pattern = pd;
+    me->next_pattern = NULL;
+    me->start_at_ms = 0;
+    uint8_t const faded = me->pi.intensity_percent;  // Where the fade-out got to; next_pi has the level from before.
+    me->pi = me->next_pi;
+    if (me->transition.crossfade_ms != 0) {
+        PatternIterator_setIntensity(&me->pi, faded);
+        startFade(me, faded, me->intensity_percent, me->transition.crossfade_ms / 2);
+    } else if (me->intensity_percent > DEFAULT_INTENSITY_PERCENT) {
+        setIntensityPercentage(me, DEFAULT_INTENSITY_PERCENT);
+    }
+    Sequencer_notifyPattern(me);
+    Sequencer_notifyProgress(me);
+}
+
+
+static bool transitionDue(Sequencer *me)
+{
+    if (me->next_pattern == NULL) return false;
+    if (me->transition.boundary == TB_NEXT_REP && ! PatternIterator_atRepStart(&me->pi) && ! PatternIterator_done(&me->pi)) {
+        return false;
+    }
+    return true;
+}
+
+
 static void setPlayState(Sequencer *me, PlayState play_state)
 {
     me->play_state = play_state;
@@ -85,7 +211,7 @@ static void setPlayState(Sequencer *me, PlayState play_state)
 static void handleAdcValues(AdcValues const *vi, TransactionId trans_id)
 {
     CLI_logf("Vbat=%hu mV, Vcap=%hu mV, Iprim=%hu mA\n", vi->Vbat_mV, vi->Vcap_mV, vi->Iprim_mA);
-    Attribute_changed(AI_VOLTAGES, trans_id, EE_BYTES_1LEN, (uint8_t const *)vi, sizeof vi);
+    Attribute_changed(AI_VOLTAGES, trans_id, EE_BYTES_1LEN, (uint8_t const *)vi, sizeof *vi);
 }
 
 
@@ -100,6 +226,7 @@ static void queueDescriptor(Sequencer *me, PulseTrain const *pt, uint16_t sz)
 {
     uint8_t err = PE_NONE;
     if (PtdQueue_addDescriptor(me->ptd_queue, pt, sz, &err)) {
+        BSP_selectClockSpeed(CS_FULL_SPEED);    // Pre-warm, as streaming will likely follow.
         Sequencer_notifyPtQueue(me, NO_TRANS_ID);
     } else {
         BSP_logf("Pt discarded, err=%u:\n  ", err);
@@ -107,11 +234,95 @@ static void queueDescriptor(Sequencer *me, PulseTrain const *pt, uint16_t sz)
     }
 }
 
+
+static bool startPlayback(Sequencer *me, PlaybackRequest const *pr)
+{
+    PtdQueue_clear(me->ptd_queue);
+    if (! Playback_start(&me->playback, pr->recording_nr, pr->from_ms * 1000UL)) return false;
+
+    Playback_fill(&me->playback, me->ptd_queue);
+    if (PtdQueue_isEmpty(me->ptd_queue)) {
+        Playback_stop(&me->playback);
+        return false;
+    }
+    return true;
+}
+
+
+static bool startProgram(Sequencer *me)
+{
+    PtdQueue_clear(me->ptd_queue);
+    if (! PatternVm_start(&me->vm)) return false;
+
+    PatternVm_fill(&me->vm, me->ptd_queue);
+    if (PtdQueue_isEmpty(me->ptd_queue)) {
+        PatternVm_stop(&me->vm);
+        return false;
+    }
+    return true;
+}
+
+
+static bool startLayers(Sequencer *me, LayerSpec const specs[], uint8_t nr_of_layers)
+{
+    PtdQueue_clear(me->ptd_queue);
+    if (! PatternMux_start(&me->mux, specs, nr_of_layers)) return false;
+
+    PatternMux_fill(&me->mux, me->ptd_queue);
+    if (PtdQueue_isEmpty(me->ptd_queue)) {
+        PatternMux_stop(&me->mux);
+        return false;
+    }
+    return true;
+}
+
+
+static void seekPattern(Sequencer *me, uint32_t position_ms)
+{
+    if (me->play_state == PS_PLAYING || me->play_state == PS_PAUSED) {
+        if (! PatternIterator_seek(&me->pi, position_ms)) return;
+        CLI_logf("Continuing '%s' at %u ms\n", PatternIterator_name(&me->pi), position_ms);
+    } else {
+        me->start_at_ms = position_ms;
+    }
+    Sequencer_notifyProgress(me);
+}
+
+// Report once per second at most.
+static void updateProgress(Sequencer *me)
+{
+    uint32_t progress_ms[2];
+    PatternIterator_getProgress(&me->pi, progress_ms);
+    if (progress_ms[0] / 1000 != me->progress_s) Sequencer_notifyProgress(me);
+}
+
 // Forward declarations.
 static void *stateIdle(Sequencer *, AOEvent const *);
 static void *statePulsing(Sequencer *, AOEvent const *);
 
 
+// Patterns play at the idle core clock; only streams ask for full speed.
+static void startPattern(Sequencer *me)
+{
+    me->burst_start_µs = PATTERN_START_TIME_µs;
+    BSP_startSequencerClock(me->burst_start_µs);
+    me->stream_busy = PatternIterator_scheduleNextBurst(&me->pi, me->burst_start_µs);
+}
+
+/**
+ * The sequencer clock carries on where it stopped, so the switches still wait for a burst
+ * that was running at the pause. The next burst starts as scheduled, or a little later.
+ */
+static void resumePattern(Sequencer *me)
+{
+    if ((int32_t)(me->burst_start_µs - me->clock_stopped_µs) < PATTERN_START_TIME_µs) {
+        me->burst_start_µs = me->clock_stopped_µs + PATTERN_START_TIME_µs;
+    }
+    me->stream_busy = PatternIterator_scheduleNextBurst(&me->pi, me->burst_start_µs);
+    BSP_resumeSequencerClock();
+}
+
+
 static void *stateCanopy(Sequencer *me, AOEvent const *evt)
 {
     switch (AOEvent_type(evt))
@@ -129,12 +340,37 @@ static void *stateCanopy(Sequencer *me, AOEvent const *evt)
             if (pd != NULL) switchPattern(me, pd);
             return &stateIdle;                  // Transition.
         }
-        case ET_QUEUE_PULSE_TRAIN:
-            queueDescriptor(me, (PulseTrain const *)AOEvent_data(evt), AOEvent_dataSize(evt));
+        case ET_QUEUE_PULSE_TRAIN: {
+            BufferRef const *br = (BufferRef const *)AOEvent_data(evt);
+            queueDescriptor(me, (PulseTrain const *)br->data, br->size);
+            BufferPool_release(br->buffer_nr);
             break;
+        }
         case ET_SET_INTENSITY:
             setIntensityPercentage(me, *AOEvent_data(evt));
             break;
+        case ET_SET_MODULATION: {
+            uint8_t const *data = AOEvent_data(evt);
+            PatternIterator_setModulation(&me->pi, data[0], (LfoSettings const *)(data + 1));
+            if (me->next_pattern != NULL) prepareTransition(me, me->next_pattern);
+            break;
+        }
+        case ET_SET_TRANSITION:
+            memcpy(&me->transition, AOEvent_data(evt), sizeof me->transition);
+            BSP_logf("Pattern transitions: boundary=%hhu, crossfade=%hu ms\n", me->transition.boundary, me->transition.crossfade_ms);
+            break;
+        case ET_SEEK_PATTERN: {
+            uint32_t position_ms;
+            memcpy(&position_ms, AOEvent_data(evt), sizeof position_ms);
+            seekPattern(me, position_ms);
+            break;
+        }
+        case ET_START_PLAYBACK:
+        case ET_START_PROGRAM:
+        case ET_START_LAYERS:
+            // Stop whatever is playing, then let the idle state start the playback, program or layers.
+            EventQueue_repostEvent(&me->event_queue, evt);
+            return &stateIdle;                  // Transition.
         case ET_UNKNOWN_COMMAND:
             BSP_logf("Unknown command\n");
             break;
@@ -153,8 +389,8 @@ static bool scheduleFirstBurst(Sequencer *me)
     Burst burst;
     bool ok = PtdQueue_getNextBurst(me->ptd_queue, &burst);
     if (ok) {
-        BSP_setElectrodeConfiguration(burst.elcon);
-        BSP_startSequencerClock(burst.start_time_µs - 40);
+        // The BSP starts the clock early enough to let the triacs settle.
+        BSP_startSequencerClock(burst.start_time_µs);
         ok = BSP_scheduleBurst(&burst);
     }
     return ok;
@@ -197,12 +433,16 @@ static void *stateStreaming(Sequencer *me, AOEvent const *evt)
         case ET_AO_ENTRY:
             me->pi.pattern_descr = &stream_pd;
             BSP_logf("Sequencer_%s ENTRY\n", __func__);
+            BSP_selectClockSpeed(CS_FULL_SPEED);
             setPlayState(me, PS_PLAYING);
             me->stream_busy = scheduleFirstBurst(me);
             break;
         case ET_AO_EXIT:
             BSP_stopSequencerClock();
             PtdQueue_clear(me->ptd_queue);
+            Playback_stop(&me->playback);
+            PatternVm_stop(&me->vm);
+            PatternMux_stop(&me->mux);
             BSP_logf("Sequencer_%s EXIT\n", __func__);
             break;
         case ET_START_STREAM:
@@ -225,6 +465,9 @@ static void *stateStreaming(Sequencer *me, AOEvent const *evt)
             return &stateIdle;                  // Transition.
         case ET_BURST_STARTED:
             me->stream_busy = scheduleNextBurst(me);
+            Playback_fill(&me->playback, me->ptd_queue);   // Top up, if a recording is playing,
+            PatternVm_fill(&me->vm, me->ptd_queue);        // or a program is running,
+            PatternMux_fill(&me->mux, me->ptd_queue);      // or layers are playing.
             break;
         case ET_BURST_COMPLETED:
             if (me->stream_busy) break;
@@ -246,6 +489,9 @@ static void *stateIdle(Sequencer *me, AOEvent const *evt)
         case ET_AO_ENTRY:
             BSP_logf("Sequencer_%s ENTRY\n", __func__);
             setPlayState(me, PS_IDLE);
+            if (me->next_pattern != NULL) switchPattern(me, me->next_pattern);
+            // Stay fast if a stream may be about to start.
+            if (PtdQueue_isEmpty(me->ptd_queue)) BSP_selectClockSpeed(CS_LOW_POWER);
             break;
         case ET_AO_EXIT:
             BSP_logf("Sequencer_%s EXIT\n", __func__);
@@ -253,6 +499,8 @@ static void *stateIdle(Sequencer *me, AOEvent const *evt)
         case ET_TOGGLE_PLAY_PAUSE:
         case ET_PLAY:
             if (PatternIterator_init(&me->pi, me->pattern)) {
+                if (me->start_at_ms != 0) PatternIterator_seek(&me->pi, me->start_at_ms);
+                me->start_at_ms = 0;
                 CLI_logf("Starting '%s'\n", PatternIterator_name(&me->pi));
                 return &statePulsing;           // Transition.
             }
@@ -266,12 +514,24 @@ static void *stateIdle(Sequencer *me, AOEvent const *evt)
         case ET_START_STREAM:
             if (PtdQueue_isEmpty(me->ptd_queue)) break;
             return &stateStreaming;             // Transition.
+        case ET_START_PLAYBACK:
+            if (! startPlayback(me, (PlaybackRequest const *)AOEvent_data(evt))) break;
+            return &stateStreaming;             // Transition.
+        case ET_START_PROGRAM:
+            if (! startProgram(me)) break;
+            return &stateStreaming;             // Transition.
+        case ET_START_LAYERS:
+            if (! startLayers(me, (LayerSpec const *)AOEvent_data(evt), AOEvent_dataSize(evt) / sizeof(LayerSpec))) break;
+            return &stateStreaming;             // Transition.
         case ET_STOP_STREAM:
             // Superfluous, ignore.
             break;
         case ET_BURST_EXPIRED:
             CLI_logf("Finished '%s'\n", PatternIterator_name(&me->pi));
             break;
+        case ET_BAD_BURST:
+            // Of a pattern that has stopped already.
+            break;
         default:
             return stateCanopy(me, evt);        // Forward the event.
     }
@@ -298,8 +558,15 @@ static void *statePaused(Sequencer *me, AOEvent const *evt)
         case ET_START_STREAM:
             if (PtdQueue_isEmpty(me->ptd_queue)) break;
             return &stateStreaming;             // Transition.
+        case ET_BURST_STARTED:
+            // It was scheduled before the pause.
+            me->burst_start_µs += PatternIterator_burstStarted(&me->pi);
+            break;
+        case ET_BAD_BURST:
+            Burst_print((Burst const*)AOEvent_data(evt));
+            break;                              // Resuming schedules it again.
         case ET_BURST_EXPIRED:
-            if (PatternIterator_done(&me->pi)) {
+            if (! PatternIterator_prepareBurst(&me->pi)) {
                 CLI_logf("Finished '%s'\n", PatternIterator_name(&me->pi));
                 return &stateIdle;              // Transition.
             }
@@ -316,38 +583,59 @@ static void *statePulsing(Sequencer *me, AOEvent const *evt)
 {
     switch (AOEvent_type(evt))
     {
-        case ET_AO_ENTRY:
+        case ET_AO_ENTRY: {
             BSP_logf("Sequencer_%s ENTRY\n", __func__);
+            bool const is_resuming = me->play_state == PS_PAUSED;
             Sequencer_notifyPattern(me);
             setPlayState(me, PS_PLAYING);
-            PatternIterator_scheduleNextBurst(&me->pi);
+            Sequencer_notifyProgress(me);
+            // Pattern bursts go through the BSP like stream bursts, so the triacs switch ahead of them.
+            if (is_resuming) resumePattern(me);
+            else startPattern(me);
             break;
+        }
         case ET_AO_EXIT:
+            me->clock_stopped_µs = BSP_stopSequencerClock();
+            stopFade(me);
+            PatternIterator_restoreIntensity(&me->pi);
             BSP_logf("Sequencer_%s EXIT\n", __func__);
             break;
         case ET_SELECT_NEXT_PATTERN:
-            switchPattern(me, Patterns_getNext(me->pattern));
+            queueTransition(me, Patterns_getNext(me->next_pattern != NULL ? me->next_pattern : me->pattern));
             break;
         case ET_SELECT_PATTERN_BY_NAME: {
             PatternDescr const *pd = Patterns_findByName((char const *)AOEvent_data(evt), AOEvent_dataSize(evt));
-            if (pd != NULL) switchPattern(me, pd);
+            if (pd != NULL) queueTransition(me, pd);
             break;
         }
         case ET_TOGGLE_PLAY_PAUSE:
         case ET_PAUSE:
             return &statePaused;                // Transition.
-        case ET_BURST_STARTED:
-            // BSP_logf("Burst started\n");
+        case ET_BURST_STARTED: {
+            // Schedule the next burst while this one runs, so it can start right after it.
+            me->burst_start_µs += PatternIterator_burstStarted(&me->pi);
+            bool const faded = updateFade(me);
+            if (transitionDue(me) && (faded || PatternIterator_done(&me->pi))) completeTransition(me);
+            updateProgress(me);
+            me->stream_busy = PatternIterator_scheduleNextBurst(&me->pi, me->burst_start_µs);
             break;
+        }
         case ET_BURST_COMPLETED:
             // Not used here.
             break;
+        case ET_BAD_BURST:
+            Burst_print((Burst const*)AOEvent_data(evt));
+            CLI_logf("Stopping '%s', a burst was late\n", PatternIterator_name(&me->pi));
+            return &stateIdle;                  // Transition.
         case ET_BURST_EXPIRED:
-            if (! PatternIterator_scheduleNextBurst(&me->pi)) {
+            if (me->stream_busy) break;         // The next burst is on its way.
+            if (PatternIterator_prepareBurst(&me->pi)) {
+                CLI_logf("Stopping '%s', a burst did not get scheduled\n", PatternIterator_name(&me->pi));
+            } else {
                 CLI_logf("Finished '%s'\n", PatternIterator_name(&me->pi));
-                return &stateIdle;              // Transition.
             }
-            break;
+            Sequencer_notifyProgress(me);
+            return &stateIdle;                  // Transition.
         default:
             return stateCanopy(me, evt);        // Forward the event.
     }
@@ -375,9 +663,10 @@ static void dispatchEvent(Sequencer *me, AOEvent const *evt)
 
 Sequencer *Sequencer_new()
 {
-    Sequencer *me = (Sequencer *)malloc(sizeof(Sequencer));
+    static Sequencer sequencer ARENA(sequencer);   // There is only one.
+    Sequencer *me = &sequencer;
     EventQueue_init(&me->event_queue, me->event_storage, sizeof me->event_storage);
-    me->ptd_queue = PtdQueue_new(20);
+    me->ptd_queue = PtdQueue_new(PTD_QUEUE_LENGTH);
     return me;
 }
 
@@ -390,6 +679,15 @@ Sequencer *Sequencer_init(Sequencer *me)
     me->pattern = Patterns_findByName(default_pattern_name, strlen(default_pattern_name));
     me->intensity_percent = 0;
     me->play_state = PS_UNKNOWN;
+    me->start_at_ms = 0;
+    me->progress_s = 0;
+    me->next_pattern = NULL;
+    me->transition.boundary = TB_NEXT_BURST;
+    me->transition.crossfade_ms = DEFAULT_CROSSFADE_ms;
+    me->fade_ms = 0;
+    Playback_init(&me->playback);
+    PatternVm_init(&me->vm);
+    PatternMux_init(&me->mux);
     BSP_registerPulseDelegate(&me->event_queue);
     return me;
 }
@@ -418,6 +716,58 @@ uint8_t Sequencer_getIntensityPercentage(Sequencer const *me)
 }
 
 
+char const *Sequencer_getPatternName(Sequencer const *me)
+{
+    return Patterns_name(me->pattern);
+}
+
+
+PlayState Sequencer_getPlayState(Sequencer const *me)
+{
+    return me->play_state;
+}
+
+
+bool Sequencer_getPlayback(Sequencer const *me, uint8_t *recording_nr)
+{
+    *recording_nr = Playback_recordingNr(&me->playback);
+    return Playback_isActive(&me->playback);
+}
+
+
+void Sequencer_getModulation(Sequencer const *me, LfoSettings settings[MT_NR_OF_TARGETS])
+{
+    PatternIterator_getModulation(&me->pi, settings);
+}
+
+
+uint8_t Sequencer_getNrOfLayers(Sequencer const *me)
+{
+    return PatternMux_nrOfLayers(&me->mux);
+}
+
+
+void Sequencer_getProgress(Sequencer const *me, uint32_t progress_ms[2])
+{
+    PatternIterator_getProgress(&me->pi, progress_ms);
+    if (me->play_state == PS_IDLE && me->start_at_ms != 0) {
+        progress_ms[0] = me->start_at_ms < progress_ms[1] ? me->start_at_ms : progress_ms[1];
+    }
+}
+
+
+void Sequencer_getTransition(Sequencer const *me, TransitionSettings *ts)
+{
+    *ts = me->transition;
+}
+
+
+void Sequencer_getPtQueueBytesFree(Sequencer const *me, uint16_t nqbf[2])
+{
+    PtdQueue_nrOfBytesFree(me->ptd_queue, nqbf);    // We have one queue per phase.
+}
+
+
 void Sequencer_notifyIntensity(Sequencer const *me)
 {
     Attribute_changed(AI_INTENSITY_PERCENT, NO_TRANS_ID, EE_UNSIGNED_INT_1, &me->intensity_percent, sizeof me->intensity_percent);
@@ -437,10 +787,19 @@ void Sequencer_notifyPlayState(Sequencer const *me)
 }
 
 
+void Sequencer_notifyProgress(Sequencer *me)
+{
+    uint32_t progress_ms[2];
+    Sequencer_getProgress(me, progress_ms);
+    me->progress_s = progress_ms[0] / 1000;
+    Attribute_changed(AI_PATTERN_PROGRESS, NO_TRANS_ID, EE_BYTES_1LEN, (uint8_t const *)progress_ms, sizeof progress_ms);
+}
+
+
 void Sequencer_notifyPtQueue(Sequencer const *me, TransactionId trans_id)
 {
-    uint16_t nqbf[2];                           // We have one queue per phase.
-    PtdQueue_nrOfBytesFree(me->ptd_queue, nqbf);
+    uint16_t nqbf[2];
+    Sequencer_getPtQueueBytesFree(me, nqbf);
     Attribute_changed(AI_PT_DESCRIPTOR_QUEUE, trans_id, EE_BYTES_1LEN, (uint8_t const *)nqbf, sizeof nqbf);
 }
 
@@ -456,5 +815,4 @@ void Sequencer_stop(Sequencer *me)
 void Sequencer_delete(Sequencer *me)
 {
     PtdQueue_delete(me->ptd_queue);
-    free(me);
 }
@@ -43,6 +43,9 @@ defined in linker script */
 .word _sbss
 /* end address for the .bss section. defined in linker script */
 .word _ebss
+/* start and end address of the vector table copy in SRAM. defined in linker script */
+.word _sram_vector
+.word _eram_vector
 
 /**
  * @brief  This is the code that gets called when the processor first
@@ -63,7 +66,7 @@ Reset_Handler:
 /* Call the clock system initialization function.*/
   bl  SystemInit
 
-/* Copy the data segment initializers from flash to SRAM */
+/* Copy the data segment initializers from flash to SRAM, including the .ramfunc code */
   ldr r0, =_sdata
   ldr r1, =_edata
   ldr r2, =_sidata
@@ -94,6 +97,28 @@ LoopFillZerobss:
   cmp r2, r4
   bcc FillZerobss
 
+/* Copy the vector table to SRAM and have the core use that copy */
+  ldr r0, =_sram_vector
+  ldr r1, =_eram_vector
+  ldr r2, =g_pfnVectors
+  movs r3, #0
+  b LoopCopyVectors
+
+CopyVectors:
+  ldr r4, [r2, r3]
+  str r4, [r0, r3]
+  adds r3, r3, #4
+
+LoopCopyVectors:
+  adds r4, r0, r3
+  cmp r4, r1
+  bcc CopyVectors
+
+  ldr r1, =0xE000ED08   /* SCB->VTOR */
+  str r0, [r1]
+  dsb
+  isb
+
 /* Call static constructors */
   bl __libc_init_array
 /* Call the application s entry point.*/
@@ -0,0 +1,211 @@
+/*
+ * telemetry.c -- Samples the ADC at a set rate, and reports the samples and any captured pulses in batches.
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include <stddef.h>
+
+#include "bsp_dbg.h"
+#include "bsp_app.h"
+#include "attributes.h"
+
+// This module implements:
+#include "telemetry.h"
+
+// A report goes out when it is full, or when its oldest sample is this old.
+#ifndef TELEMETRY_REPORT_INTERVAL_ms
+#define TELEMETRY_REPORT_INTERVAL_ms    100
+#endif
+
+#ifndef TELEMETRY_MAX_SAMPLES
+#define TELEMETRY_MAX_SAMPLES   16
+#endif
+
+// The BSP's pulse recorder gets drained this often, into reports of at most so many records.
+#ifndef PULSE_RECORDER_DRAIN_INTERVAL_ms
+#define PULSE_RECORDER_DRAIN_INTERVAL_ms    50
+#endif
+#define PULSE_RECORDS_PER_REPORT    (255 / sizeof(PulseRecord))
+
+typedef struct {
+    uint16_t  dt_ms;                            // Since the report's time stamp.
+    AdcValues av;
+} TelemetrySample;
+
+// The value of AI_ADC_STREAM, as it goes out. All fields are little endian.
+typedef struct {
+    uint32_t time_ms;                           // Of the first sample, since boot.
+    TelemetrySample samples[TELEMETRY_MAX_SAMPLES];
+} TelemetryReport;
+
+typedef struct {
+    AppTimer sample_timer;
+    AppTimer drain_timer;
+    EventQueue *event_queue;
+    TelemetryReport report;
+    uint8_t  nr_of_samples;
+    uint8_t  rate_Hz;
+    bool     capturing_pulses;
+    bool     recording_pulses;
+    uint16_t nr_of_records_dropped;
+} Telemetry;
+
+
+static Telemetry telemetry ARENA(telemetry);
+
+
+static void sendReport(Telemetry *me)
+{
+    uint16_t const size = offsetof(TelemetryReport, samples) + me->nr_of_samples * sizeof(TelemetrySample);
+    // Too big to be cached, so the engine passes it on right away.
+    Attribute_changed(AI_ADC_STREAM, NO_TRANS_ID, EE_BYTES_2LEN, (uint8_t const *)&me->report, size);
+    me->nr_of_samples = 0;
+}
+
+
+static void takeSample(Telemetry *me)
+{
+    uint32_t const now_ms = (uint32_t)(BSP_microsecondsSinceBoot() / 1000);
+    if (me->nr_of_samples == 0) me->report.time_ms = now_ms;
+    TelemetrySample *ts = &me->report.samples[me->nr_of_samples++];
+    ts->dt_ms = (uint16_t)(now_ms - me->report.time_ms);
+    BSP_sampleADC();                            // Nothing triggers the ADC between bursts.
+    BSP_getAdcValues(&ts->av);
+    if (me->nr_of_samples == TELEMETRY_MAX_SAMPLES || ts->dt_ms + 1000U / me->rate_Hz > TELEMETRY_REPORT_INTERVAL_ms) {
+        sendReport(me);
+    }
+}
+
+
+static void drainPulseRecorder(Telemetry *me)
+{
+    PulseRecord records[PULSE_RECORDS_PER_REPORT];
+    uint16_t const nr_of_records = BSP_takePulseRecords(records, M_DIM(records));
+    if (nr_of_records != 0 && Attribute_isSubscribed(AI_PULSE_RECORDS)) {
+        Attribute_changed(AI_PULSE_RECORDS, NO_TRANS_ID, EE_BYTES_1LEN, (uint8_t const *)records, nr_of_records * sizeof records[0]);
+    }
+    uint16_t const nr_dropped = BSP_nrOfPulseRecordsDropped();
+    if (nr_dropped != me->nr_of_records_dropped) {
+        BSP_logf("Pulse recorder dropped %hu records\n", nr_dropped - me->nr_of_records_dropped);
+        me->nr_of_records_dropped = nr_dropped;
+    }
+}
+
+/*
+ * Below are the functions implementing this module's interface.
+ */
+
+void Telemetry_startService(EventQueue *eq, uint8_t timer_event_type)
+{
+    AppTimer_init(&telemetry.sample_timer, eq, timer_event_type);
+    AppTimer_init(&telemetry.drain_timer, eq, timer_event_type);
+    telemetry.event_queue = eq;
+    telemetry.nr_of_samples = 0;
+    telemetry.rate_Hz = 0;
+    telemetry.capturing_pulses = false;
+    telemetry.recording_pulses = false;
+}
+
+
+void Telemetry_stopService()
+{
+    Telemetry_setRate(0);
+    Telemetry_capturePulses(false);
+    Telemetry_recordPulses(false);
+}
+
+
+void Telemetry_handleTimerEvent(AppTimer *timer)
+{
+    Telemetry *me = &telemetry;
+    if (timer == &me->drain_timer) {
+        if (me->recording_pulses) drainPulseRecorder(me);
+        return;
+    }
+    // Ignore expiries that were already posted when the stream stopped.
+    if (timer != &me->sample_timer || me->rate_Hz == 0) return;
+
+    if (Attribute_isSubscribed(AI_ADC_STREAM)) {
+        takeSample(me);
+    } else {
+        me->nr_of_samples = 0;
+    }
+}
+
+
+void Telemetry_handlePulseMetrics(PulseMetrics const *pm, uint16_t size)
+{
+    // A whole batch, so it cannot be cached either.
+    Attribute_changed(AI_PULSE_METRICS, NO_TRANS_ID, EE_BYTES_1LEN, (uint8_t const *)pm, size);
+}
+
+
+uint8_t Telemetry_setRate(uint8_t rate_Hz)
+{
+    Telemetry *me = &telemetry;
+    if (rate_Hz > TELEMETRY_MAX_RATE_Hz) rate_Hz = TELEMETRY_MAX_RATE_Hz;
+    if (me->nr_of_samples != 0) sendReport(me);
+    if ((me->rate_Hz = rate_Hz) == 0) {
+        AppTimer_cancel(&me->sample_timer);
+    } else {
+        uint32_t const period_ms = 1000U / rate_Hz;
+        AppTimer_arm(&me->sample_timer, period_ms, period_ms);
+    }
+    BSP_logf("Telemetry rate set to %hhu Hz\n", rate_Hz);
+    return rate_Hz;
+}
+
+
+uint8_t Telemetry_getRate()
+{
+    return telemetry.rate_Hz;
+}
+
+
+bool Telemetry_capturePulses(bool on)
+{
+    Telemetry *me = &telemetry;
+    if (on == me->capturing_pulses) return true;
+
+    if (! BSP_enablePulseCapture(on ? me->event_queue : NULL)) return false;
+
+    me->capturing_pulses = on;
+    BSP_logf("Pulse capture %s\n", on ? "on" : "off");
+    return true;
+}
+
+
+bool Telemetry_isCapturingPulses()
+{
+    return telemetry.capturing_pulses;
+}
+
+
+void Telemetry_recordPulses(bool on)
+{
+    Telemetry *me = &telemetry;
+    if (on == me->recording_pulses) return;
+
+    BSP_recordPulses(on);
+    if ((me->recording_pulses = on)) {
+        me->nr_of_records_dropped = 0;
+        AppTimer_arm(&me->drain_timer, PULSE_RECORDER_DRAIN_INTERVAL_ms, PULSE_RECORDER_DRAIN_INTERVAL_ms);
+    } else {
+        AppTimer_cancel(&me->drain_timer);
+        drainPulseRecorder(me);                 // Whatever came in last.
+    }
+    BSP_logf("Pulse recorder %s\n", on ? "on" : "off");
+}
+
+
+bool Telemetry_isRecordingPulses()
+{
+    return telemetry.recording_pulses;
+}
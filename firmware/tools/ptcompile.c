@@ -0,0 +1,592 @@
+/*
+ * ptcompile.c -- Compiles pulse recordings in the patterns312 CSV schema to a stream of pulse train descriptors.
+ *
+ *  Consecutive pulses of the same stage and polarity are fitted, greedily, into descriptors with
+ *  as many pulses as the timing and width tolerances allow. See PulseTrainDescr.md for the format.
+ *  The output stream is a sequence of descriptors, each preceded by its size in bytes.
+ *
+ *  Build with: make -C firmware/tools
+ *  Usage:      ptcompile [-t timing_tolerance_µs] [-w width_tolerance_µs] [-f] [-m] [-e S=x:y] [-r] recording.csv...
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#define _POSIX_C_SOURCE 200809L             // For getopt() and mmap().
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// From burst.h, so the fitted trains behave the way the firmware will play them.
+#define MIN_PULSE_WIDTH_¼µs     (  2 * 4)
+#define MAX_PULSE_WIDTH_¼µs     (200 * 4)
+#define MAX_PULSE_PACE_µs     62500
+
+#define MAX_PULSES_PER_TRAIN    UINT16_MAX
+#define PACE_UNIT_µs            250
+#define NR_OF_STAGES            4
+#define PEAK_WINDOW_µs          1000000
+
+typedef struct {
+    uint64_t time_µs;
+    uint16_t width_µs;
+    uint8_t  stage;                             // 0 for stage A, etc.
+    uint8_t  polarity;
+} Pulse;
+
+// The members of a pulse train descriptor, in host order.
+typedef struct {
+    uint32_t start_time_µs;
+    uint16_t nr_of_pulses;
+    uint8_t  phase;
+    uint8_t  pulse_width_µs;
+    uint8_t  electrode_set[2];
+    uint8_t  pace_¼ms;
+    int8_t   delta_pulse_width_¼µs;
+    int8_t   delta_pace_µs;
+} Descriptor;
+
+// One (pace, delta) hypothesis for the start times of a run of pulses.
+typedef struct {
+    int64_t model_µs;                           // Predicted start of the latest pulse, relative to the first.
+    int32_t pace_µs;                            // Until the next pulse.
+    int32_t rmin_µs, rmax_µs;                   // Range of the residuals so far.
+    uint8_t pace_¼ms;
+    int8_t  delta_µs;
+} TimingFit;
+
+// One (width, delta) hypothesis for the widths of a run of pulses.
+typedef struct {
+    int32_t width_¼µs;                          // Of the latest pulse, before clamping.
+    int32_t max_err_¼µs;
+    uint8_t width_µs;
+    int8_t  delta_¼µs;
+} WidthFit;
+
+typedef struct {
+    uint16_t timing_tolerance_µs;
+    uint16_t width_tolerance_µs;
+    bool     fixed;                             // No deltas, for firmware that does not apply them.
+    bool     multi_stage;                       // Stage in phase bits 2..1, instead of one stage and electrode sets.
+    bool     report_only;
+    uint8_t  electrode_sets[NR_OF_STAGES][2];
+} Options;
+
+typedef struct {
+    TimingFit *timing, *timing_next;
+    WidthFit  *width, *width_next;
+    size_t max_timing, max_width;
+} Fitter;
+
+typedef struct {
+    size_t   nr_of_pulses;
+    size_t   nr_of_descriptors;
+    size_t   stream_bytes;
+    size_t   nr_clipped;                        // Pulses too wide or too narrow for the firmware.
+    uint64_t duration_µs;
+    uint32_t max_timing_err_µs;
+    uint32_t max_width_err_¼µs;
+} Statistics;
+
+
+static int32_t clampWidth(int32_t width_¼µs)
+{
+    if (width_¼µs < MIN_PULSE_WIDTH_¼µs) return MIN_PULSE_WIDTH_¼µs;
+    if (width_¼µs > MAX_PULSE_WIDTH_¼µs) return MAX_PULSE_WIDTH_¼µs;
+    return width_¼µs;
+}
+
+
+static uint64_t parseUnsigned(char const **pp, char const *end)
+{
+    uint64_t value = 0;
+    char const *p = *pp;
+    while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    *pp = p;
+    return value;
+}
+
+
+static bool skipComma(char const **pp, char const *end)
+{
+    if (*pp == end || **pp != ',') return false;
+    (*pp)++;
+    return true;
+}
+
+/**
+ * Parses one line of "Stage","SeqNr","Timestamp","Phase","Width","Vprim". False for anything else.
+ */
+static bool parseLine(char const *p, char const *end, Pulse *pulse)
+{
+    if (p == end || *p < 'A' || *p >= 'A' + NR_OF_STAGES) return false;
+    pulse->stage = *p++ - 'A';
+    if (! skipComma(&p, end)) return false;
+    (void)parseUnsigned(&p, end);               // The sequence number; gaps do not matter here.
+    if (! skipComma(&p, end)) return false;
+    pulse->time_µs = parseUnsigned(&p, end);
+    if (! skipComma(&p, end)) return false;
+    pulse->polarity = parseUnsigned(&p, end) & 1;
+    if (! skipComma(&p, end)) return false;
+    uint64_t const width_µs = parseUnsigned(&p, end);
+    pulse->width_µs = width_µs > UINT16_MAX / 4 ? UINT16_MAX / 4 : width_µs;
+    return true;
+}
+
+/**
+ * Reads the recording from the memory-mapped file. Returns the number of pulses.
+ */
+static size_t parseRecording(char const *text, size_t nb, Pulse **pulses)
+{
+    size_t max_nr_of_pulses = 1;
+    for (char const *p = text; (p = memchr(p, '\n', text + nb - p)) != NULL; p++) max_nr_of_pulses++;
+    if ((*pulses = malloc(max_nr_of_pulses * sizeof(Pulse))) == NULL) return 0;
+
+    size_t n = 0;
+    uint64_t epoch_µs = 0;
+    uint32_t prev_µs = 0;
+    char const *end = text + nb;
+    for (char const *line = text; line < end; ) {
+        char const *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) eol = end;
+        Pulse *pulse = &(*pulses)[n];
+        if (parseLine(line, eol, pulse)) {
+            uint32_t const t = (uint32_t)pulse->time_µs;
+            if (n != 0 && t < prev_µs && prev_µs - t > UINT32_MAX / 2) epoch_µs += 1ULL << 32;
+            prev_µs = t;
+            pulse->time_µs = epoch_µs + t;      // The recorder's clock may have wrapped.
+            n++;
+        }
+        line = eol + 1;
+    }
+    return n;
+}
+
+
+static int compareByTime(void const *a, void const *b)
+{
+    Pulse const *pa = *(Pulse const **)a, *pb = *(Pulse const **)b;
+    if (pa->time_µs != pb->time_µs) return pa->time_µs < pb->time_µs ? -1 : 1;
+    return pa < pb ? -1 : pa > pb;              // Keep the file order of simultaneous pulses.
+}
+
+
+static bool initFitter(Fitter *f, Options const *opt)
+{
+    f->max_timing = ((4UL * opt->timing_tolerance_µs) / PACE_UNIT_µs + 2) * 256;
+    f->max_width = (2UL * opt->width_tolerance_µs + 1) * 256;
+    f->timing = malloc(f->max_timing * sizeof(TimingFit));
+    f->timing_next = malloc(f->max_timing * sizeof(TimingFit));
+    f->width = malloc(f->max_width * sizeof(WidthFit));
+    f->width_next = malloc(f->max_width * sizeof(WidthFit));
+    return f->timing != NULL && f->timing_next != NULL && f->width != NULL && f->width_next != NULL;
+}
+
+
+static void freeFitter(Fitter *f)
+{
+    free(f->timing);
+    free(f->timing_next);
+    free(f->width);
+    free(f->width_next);
+}
+
+/**
+ * Every pace that puts the second pulse within the tolerance band, combined with every delta.
+ */
+static size_t seedTimingFits(Fitter *f, Options const *opt, uint64_t gap_µs)
+{
+    size_t n = 0;
+    int const max_delta = opt->fixed ? 0 : INT8_MAX;
+    for (uint32_t p = 1; p * PACE_UNIT_µs <= MAX_PULSE_PACE_µs; p++) {
+        int64_t const r = (int64_t)gap_µs - p * PACE_UNIT_µs;
+        if (r < -2 * opt->timing_tolerance_µs || r > 2 * opt->timing_tolerance_µs) continue;
+        for (int d = -max_delta - (max_delta != 0); d <= max_delta && n < f->max_timing; d++) {
+            TimingFit *tf = &f->timing[n++];
+            tf->model_µs = 0;
+            tf->pace_µs = p * PACE_UNIT_µs;
+            tf->rmin_µs = tf->rmax_µs = 0;
+            tf->pace_¼ms = p;
+            tf->delta_µs = d;
+        }
+    }
+    return n;
+}
+
+
+static size_t seedWidthFits(Fitter *f, Options const *opt, uint16_t width_µs)
+{
+    size_t n = 0;
+    int const max_delta = opt->fixed ? 0 : INT8_MAX;
+    for (int w = width_µs - opt->width_tolerance_µs; w <= width_µs + opt->width_tolerance_µs; w++) {
+        if (w * 4 < MIN_PULSE_WIDTH_¼µs || w * 4 > MAX_PULSE_WIDTH_¼µs) continue;
+        for (int d = -max_delta - (max_delta != 0); d <= max_delta && n < f->max_width; d++) {
+            WidthFit *wf = &f->width[n++];
+            wf->width_¼µs = w * 4;
+            wf->max_err_¼µs = abs(width_µs - w) * 4;
+            wf->width_µs = w;
+            wf->delta_¼µs = d;
+        }
+    }
+    return n;
+}
+
+/**
+ * Keeps the timing hypotheses that also explain the next pulse. Returns how many there are.
+ */
+static size_t extendTimingFits(Fitter *f, size_t n, int64_t offset_µs, uint16_t tolerance_µs)
+{
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        TimingFit tf = f->timing[i];
+        if (tf.pace_µs <= 0) continue;          // The firmware cannot play this.
+        tf.model_µs += tf.pace_µs;
+        int64_t const r = offset_µs - tf.model_µs;
+        if (r < tf.rmin_µs) tf.rmin_µs = r;
+        if (r > tf.rmax_µs) tf.rmax_µs = r;
+        if (tf.rmax_µs - tf.rmin_µs > 2 * tolerance_µs) continue;
+        tf.pace_µs += tf.delta_µs;              // Like Burst_applyDeltas().
+        if (tf.pace_µs > MAX_PULSE_PACE_µs) tf.pace_µs = MAX_PULSE_PACE_µs;
+        f->timing_next[m++] = tf;
+    }
+    return m;
+}
+
+
+static size_t extendWidthFits(Fitter *f, size_t n, uint16_t width_µs, uint16_t tolerance_µs)
+{
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        WidthFit wf = f->width[i];
+        wf.width_¼µs += wf.delta_¼µs;
+        int32_t const err = abs(width_µs * 4 - clampWidth(wf.width_¼µs));
+        if (err > tolerance_µs * 4) continue;
+        if (err > wf.max_err_¼µs) wf.max_err_¼µs = err;
+        f->width_next[m++] = wf;
+    }
+    return m;
+}
+
+
+static TimingFit const *bestTimingFit(TimingFit const tfs[], size_t n)
+{
+    TimingFit const *best = &tfs[0];
+    for (size_t i = 1; i < n; i++) {
+        int32_t const spread = tfs[i].rmax_µs - tfs[i].rmin_µs, best_spread = best->rmax_µs - best->rmin_µs;
+        if (spread < best_spread || (spread == best_spread && abs(tfs[i].delta_µs) < abs(best->delta_µs))) best = &tfs[i];
+    }
+    return best;
+}
+
+
+static WidthFit const *bestWidthFit(WidthFit const wfs[], size_t n)
+{
+    WidthFit const *best = &wfs[0];
+    for (size_t i = 1; i < n; i++) {
+        if (wfs[i].max_err_¼µs < best->max_err_¼µs
+         || (wfs[i].max_err_¼µs == best->max_err_¼µs && abs(wfs[i].delta_¼µs) < abs(best->delta_¼µs))) best = &wfs[i];
+    }
+    return best;
+}
+
+/**
+ * Fits as many of the given pulses as possible into one descriptor. Returns the number of pulses used.
+ */
+static size_t fitTrain(Fitter *f, Options const *opt, Pulse const *const pulses[], size_t avail,
+                       uint64_t origin_µs, Descriptor *d, Statistics *stats)
+{
+    Pulse const *first = pulses[0];
+    size_t nt = avail > 1 ? seedTimingFits(f, opt, pulses[1]->time_µs - first->time_µs) : 0;
+    size_t nw = seedWidthFits(f, opt, first->width_µs);
+    size_t used = 1;
+    if (nt != 0 && nw != 0) {
+        while (used < avail && used < MAX_PULSES_PER_TRAIN) {
+            Pulse const *next = pulses[used];
+            size_t const mt = extendTimingFits(f, nt, next->time_µs - first->time_µs, opt->timing_tolerance_µs);
+            size_t const mw = extendWidthFits(f, nw, next->width_µs, opt->width_tolerance_µs);
+            if (mt == 0 || mw == 0) break;
+            TimingFit *tt = f->timing; f->timing = f->timing_next; f->timing_next = tt;
+            WidthFit *tw = f->width; f->width = f->width_next; f->width_next = tw;
+            nt = mt;
+            nw = mw;
+            used++;
+        }
+    }
+
+    int32_t shift_µs = 0, timing_err_µs = 0;
+    WidthFit const *wf = nw != 0 ? bestWidthFit(f->width, nw) : NULL;
+    d->pulse_width_µs = wf != NULL ? wf->width_µs : first->width_µs;
+    d->delta_pulse_width_¼µs = used > 1 ? wf->delta_¼µs : 0;
+    if (used > 1) {
+        TimingFit const *tf = bestTimingFit(f->timing, nt);
+        shift_µs = tf->rmin_µs + (tf->rmax_µs - tf->rmin_µs) / 2;
+        timing_err_µs = shift_µs - tf->rmin_µs > tf->rmax_µs - shift_µs ? shift_µs - tf->rmin_µs : tf->rmax_µs - shift_µs;
+        d->pace_¼ms = tf->pace_¼ms;
+        d->delta_pace_µs = tf->delta_µs;
+    } else {
+        d->pace_¼ms = 0;
+        d->delta_pace_µs = 0;
+    }
+    d->start_time_µs = (uint32_t)(first->time_µs - origin_µs + shift_µs);
+    d->nr_of_pulses = used;
+    if (opt->multi_stage) {
+        d->phase = (first->stage << 1) | first->polarity;
+    } else {
+        d->phase = first->polarity;
+    }
+    d->electrode_set[0] = opt->electrode_sets[first->stage][0];
+    d->electrode_set[1] = opt->electrode_sets[first->stage][1];
+
+    if ((uint32_t)timing_err_µs > stats->max_timing_err_µs) stats->max_timing_err_µs = timing_err_µs;
+    if (wf != NULL && (uint32_t)wf->max_err_¼µs > stats->max_width_err_¼µs) stats->max_width_err_¼µs = wf->max_err_¼µs;
+    return used;
+}
+
+/**
+ * The shortest encoding PulseTrainDescr.md allows. The electrode set is always included.
+ */
+static uint8_t encodeDescriptor(Descriptor const *d, uint8_t seq_nr, uint8_t buf[16])
+{
+    buf[0]  = 0x00;                             // Meta.
+    buf[1]  = seq_nr;
+    buf[2]  = d->phase;
+    buf[3]  = d->pulse_width_µs;
+    buf[4]  = d->start_time_µs;
+    buf[5]  = d->start_time_µs >> 8;
+    buf[6]  = d->start_time_µs >> 16;
+    buf[7]  = d->start_time_µs >> 24;
+    buf[8]  = d->electrode_set[0];
+    buf[9]  = d->electrode_set[1];
+    buf[10] = d->nr_of_pulses;
+    buf[11] = d->nr_of_pulses >> 8;
+    buf[12] = d->pace_¼ms;
+    buf[13] = 0;                                // Amplitude: unchanged.
+    buf[14] = d->delta_pulse_width_¼µs;
+    buf[15] = d->delta_pace_µs;
+    if (d->delta_pace_µs != 0) return 16;
+    if (d->delta_pulse_width_¼µs != 0) return 15;
+    return d->nr_of_pulses == 1 ? 10 : 13;
+}
+
+
+static int compareDescriptors(void const *a, void const *b)
+{
+    Descriptor const *da = a, *db = b;
+    if (da->start_time_µs != db->start_time_µs) return da->start_time_µs < db->start_time_µs ? -1 : 1;
+    return da->phase - db->phase;
+}
+
+/**
+ * The highest number of descriptors starting within any one window, which the link must keep up with.
+ */
+static size_t peakDescriptorsPerWindow(Descriptor const ds[], size_t n, uint32_t window_µs)
+{
+    size_t peak = 0;
+    for (size_t lo = 0, hi = 0; hi < n; hi++) {
+        while (ds[hi].start_time_µs - ds[lo].start_time_µs >= window_µs) lo++;
+        if (hi - lo + 1 > peak) peak = hi - lo + 1;
+    }
+    return peak;
+}
+
+
+static size_t compileStreams(Pulse *pulses, size_t n, Options const *opt, Descriptor ds[], Statistics *stats)
+{
+    Pulse const **stream = malloc(n * sizeof *stream);
+    Fitter fitter;
+    if (stream == NULL || ! initFitter(&fitter, opt)) {
+        free(stream);
+        return 0;
+    }
+
+    uint64_t origin_µs = UINT64_MAX, last_µs = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (pulses[i].time_µs < origin_µs) origin_µs = pulses[i].time_µs;
+        if (pulses[i].time_µs > last_µs) last_µs = pulses[i].time_µs;
+    }
+    stats->duration_µs = n != 0 ? last_µs - origin_µs : 0;
+    // Leave room for the first train to start a little early.
+    origin_µs = origin_µs > opt->timing_tolerance_µs ? origin_µs - opt->timing_tolerance_µs : 0;
+
+    size_t nd = 0;
+    for (uint8_t sp = 0; sp < NR_OF_STAGES * 2; sp++) {
+        size_t ns = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (pulses[i].stage * 2 + pulses[i].polarity == sp) stream[ns++] = &pulses[i];
+        }
+        qsort(stream, ns, sizeof *stream, &compareByTime);
+        for (size_t i = 0; i < ns; ) {
+            i += fitTrain(&fitter, opt, stream + i, ns - i, origin_µs, &ds[nd++], stats);
+        }
+    }
+    qsort(ds, nd, sizeof ds[0], &compareDescriptors);
+    freeFitter(&fitter);
+    free(stream);
+    return nd;
+}
+
+
+static bool writeStream(char const *out_name, Descriptor const ds[], size_t nd, Statistics *stats)
+{
+    FILE *out = NULL;
+    if (out_name != NULL && (out = fopen(out_name, "wb")) == NULL) {
+        perror(out_name);
+        return false;
+    }
+    for (size_t i = 0; i < nd; i++) {
+        uint8_t buf[1 + 16];
+        buf[0] = encodeDescriptor(&ds[i], (uint8_t)i, buf + 1);
+        stats->stream_bytes += 1 + buf[0];
+        if (out != NULL) fwrite(buf, 1, 1 + buf[0], out);
+    }
+    return out == NULL || fclose(out) == 0;
+}
+
+
+static void printStatistics(char const *name, Statistics const *stats, size_t peak_per_s, size_t csv_bytes)
+{
+    double const secs = stats->duration_µs / 1e6;
+    // Without fitting, every pulse needs its own descriptor of at least 10 bytes, plus its size.
+    size_t const naive_bytes = stats->nr_of_pulses * (1 + 10);
+    printf("%s: %zu pulses in %.1f s -> %zu descriptors (%.1f pulses each), %zu bytes\n", name,
+            stats->nr_of_pulses, secs, stats->nr_of_descriptors,
+            (double)stats->nr_of_pulses / stats->nr_of_descriptors, stats->stream_bytes);
+    printf("  compression: %.1f x vs one descriptor per pulse, %.1f x vs the CSV\n",
+            (double)naive_bytes / stats->stream_bytes, (double)csv_bytes / stats->stream_bytes);
+    printf("  max error: timing %u µs, width %.2f µs\n", stats->max_timing_err_µs, stats->max_width_err_¼µs / 4.0);
+    if (stats->nr_clipped != 0) printf("  %zu pulse widths clipped to the firmware's range\n", stats->nr_clipped);
+    printf("  link: %.1f descriptors/s average, %zu descriptors/s peak\n",
+            secs > 0 ? stats->nr_of_descriptors / secs : 0.0, peak_per_s);
+}
+
+
+static char *outputName(char const *in_name)
+{
+    size_t len = strlen(in_name);
+    if (len > 4 && strcmp(in_name + len - 4, ".csv") == 0) len -= 4;
+    char *out_name = malloc(len + 5);
+    if (out_name != NULL) {
+        memcpy(out_name, in_name, len);
+        strcpy(out_name + len, ".ptd");
+    }
+    return out_name;
+}
+
+
+static bool compileRecording(char const *in_name, Options const *opt)
+{
+    int const fd = open(in_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(in_name);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "%s: empty\n", in_name);
+        close(fd);
+        return false;
+    }
+    char const *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        perror(in_name);
+        return false;
+    }
+
+    Pulse *pulses = NULL;
+    Statistics stats = {0};
+    stats.nr_of_pulses = parseRecording(text, st.st_size, &pulses);
+    munmap((void *)text, st.st_size);
+    for (size_t i = 0; i < stats.nr_of_pulses; i++) {
+        uint16_t const width_µs = clampWidth(pulses[i].width_µs * 4) / 4;
+        if (width_µs != pulses[i].width_µs) {
+            pulses[i].width_µs = width_µs;
+            stats.nr_clipped++;
+        }
+    }
+    Descriptor *ds = stats.nr_of_pulses != 0 ? malloc(stats.nr_of_pulses * sizeof(Descriptor)) : NULL;
+    if (ds == NULL) {
+        fprintf(stderr, "%s: no pulses\n", in_name);
+        free(pulses);
+        return false;
+    }
+
+    bool ok = false;
+    if ((stats.nr_of_descriptors = compileStreams(pulses, stats.nr_of_pulses, opt, ds, &stats)) != 0) {
+        char *out_name = opt->report_only ? NULL : outputName(in_name);
+        if ((ok = writeStream(out_name, ds, stats.nr_of_descriptors, &stats))) {
+            printStatistics(in_name, &stats, peakDescriptorsPerWindow(ds, stats.nr_of_descriptors, PEAK_WINDOW_µs), st.st_size);
+        }
+        free(out_name);
+    }
+    free(ds);
+    free(pulses);
+    return ok;
+}
+
+
+static bool parseElectrodeSets(char const *arg, Options *opt)
+{
+    unsigned int set0, set1;
+    char stage;
+    if (sscanf(arg, "%c=%x:%x", &stage, &set0, &set1) != 3) return false;
+    if (stage < 'A' || stage >= 'A' + NR_OF_STAGES || set0 > 0xff || set1 > 0xff) return false;
+    opt->electrode_sets[stage - 'A'][0] = set0;
+    opt->electrode_sets[stage - 'A'][1] = set1;
+    return true;
+}
+
+
+static int usage(char const *prog_name)
+{
+    fprintf(stderr, "Usage: %s [options] recording.csv...\n"
+            "  -t µs       timing tolerance (default 125)\n"
+            "  -w µs       pulse width tolerance (default 3)\n"
+            "  -f          fixed pace and width, for firmware that does not apply deltas\n"
+            "  -m          multi-stage box: stage in phase bits 2..1\n"
+            "  -e S=x:y    electrode sets of stage S, in hex (default A=1:2 B=4:8 C=1:4 D=2:8)\n"
+            "  -r          report only; do not write the .ptd files\n", prog_name);
+    return EXIT_FAILURE;
+}
+
+
+int main(int argc, char *argv[])
+{
+    Options opt = {
+        .timing_tolerance_µs = 125,
+        .width_tolerance_µs = 3,
+        .electrode_sets = {{0x1, 0x2}, {0x4, 0x8}, {0x1, 0x4}, {0x2, 0x8}},
+    };
+    int c;
+    while ((c = getopt(argc, argv, "t:w:fme:r")) != -1) {
+        switch (c) {
+            case 't': opt.timing_tolerance_µs = atoi(optarg); break;
+            case 'w': opt.width_tolerance_µs = atoi(optarg); break;
+            case 'f': opt.fixed = true; break;
+            case 'm': opt.multi_stage = true; break;
+            case 'e': if (! parseElectrodeSets(optarg, &opt)) return usage(argv[0]); break;
+            case 'r': opt.report_only = true; break;
+            default: return usage(argv[0]);
+        }
+    }
+    if (optind == argc || opt.timing_tolerance_µs > 10000 || opt.width_tolerance_µs > 50) return usage(argv[0]);
+
+    int status = EXIT_SUCCESS;
+    for (int i = optind; i < argc; i++) {
+        if (! compileRecording(argv[i], &opt)) status = EXIT_FAILURE;
+    }
+    return status;
+}
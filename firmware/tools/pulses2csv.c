@@ -0,0 +1,136 @@
+/*
+ * pulses2csv.c -- Converts NeoDK pulse recordings to the CSV schema of the patterns312 recordings.
+ *
+ *  The input is the concatenated data of AI_PULSE_RECORDS reports, as saved by the UI.
+ *  Build with: make -C firmware/tools
+ *  Usage:      pulses2csv [-s stage] [recording.bin] > recording.csv
+ *
+ *  NOTICE (do not remove):
+ *      This file is part of project NeoDK (https://github.com/Onwrikbaar/NeoDK).
+ *      See https://github.com/Onwrikbaar/NeoDK/blob/main/LICENSE.txt for full license details.
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: mark
+ *   Copyright  2026 Neostim™
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Matches PulseRecord in bsp_app.h. All fields are little endian.
+#define RECORD_SIZE     12
+
+typedef struct {
+    uint32_t start_µs;
+    uint16_t seqnr;
+    uint16_t width_¼µs;
+    uint16_t Vcap_mV;
+    uint8_t  phase;
+    uint8_t  elcon;
+} PulseRecord;
+
+// The device counters wrap; these extend them.
+typedef struct {
+    uint64_t time_µs;
+    uint64_t seqnr;
+    uint32_t prev_start_µs;
+    uint16_t prev_seqnr;
+    unsigned long nr_of_records;
+    unsigned long nr_missing;
+} Unwrapper;
+
+
+static uint16_t le16(uint8_t const *b)
+{
+    return b[0] | (b[1] << 8);
+}
+
+
+static uint32_t le32(uint8_t const *b)
+{
+    return le16(b) | ((uint32_t)le16(b + 2) << 16);
+}
+
+
+static void decodeRecord(PulseRecord *pr, uint8_t const *b)
+{
+    pr->start_µs  = le32(b);
+    pr->seqnr     = le16(b + 4);
+    pr->width_¼µs = le16(b + 6);
+    pr->Vcap_mV   = le16(b + 8);
+    pr->phase     = b[10];
+    pr->elcon     = b[11];
+}
+
+
+static void unwrap(Unwrapper *uw, PulseRecord const *pr)
+{
+    if (uw->nr_of_records++ == 0) {
+        uw->time_µs = pr->start_µs;
+        uw->seqnr = pr->seqnr;
+    } else {
+        uint16_t const seq_step = pr->seqnr - uw->prev_seqnr;
+        if (seq_step != 1) uw->nr_missing += (uint16_t)(seq_step - 1);
+        uw->time_µs += (uint32_t)(pr->start_µs - uw->prev_start_µs);
+        uw->seqnr += seq_step;
+    }
+    uw->prev_start_µs = pr->start_µs;
+    uw->prev_seqnr = pr->seqnr;
+}
+
+
+static void printRecord(FILE *out, char const *stage, Unwrapper const *uw, PulseRecord const *pr)
+{
+    fprintf(out, "%s,%llu,%llu,%u,%u,%u\n", stage, (unsigned long long)uw->seqnr, (unsigned long long)uw->time_µs,
+            pr->phase, (pr->width_¼µs + 2) / 4, pr->Vcap_mV);
+}
+
+
+static int usage(char const *prog_name)
+{
+    fprintf(stderr, "Usage: %s [-s stage] [recording.bin]\n", prog_name);
+    return EXIT_FAILURE;
+}
+
+
+int main(int argc, char *argv[])
+{
+    char const *stage = "A";
+    char const *in_name = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            stage = argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            return usage(argv[0]);
+        } else if (in_name == NULL) {
+            in_name = argv[i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    FILE *in = stdin;
+    if (in_name != NULL && strcmp(in_name, "-") != 0 && (in = fopen(in_name, "rb")) == NULL) {
+        perror(in_name);
+        return EXIT_FAILURE;
+    }
+
+    printf("\"Stage\",\"SeqNr\",\"Timestamp [µs]\",\"Phase\",\"Width [µs]\",\"Vprim [mV]\"\n");
+    Unwrapper uw = {0};
+    uint8_t buf[RECORD_SIZE];
+    size_t nb;
+    while ((nb = fread(buf, 1, sizeof buf, in)) == sizeof buf) {
+        PulseRecord pr;
+        decodeRecord(&pr, buf);
+        unwrap(&uw, &pr);
+        printRecord(stdout, stage, &uw, &pr);
+    }
+    if (nb != 0) fprintf(stderr, "Ignoring %zu trailing bytes\n", nb);
+    if (uw.nr_missing != 0) {
+        fprintf(stderr, "%lu of %lu pulses missing from the recording\n", uw.nr_missing, uw.nr_missing + uw.nr_of_records);
+    }
+    if (in != stdin) fclose(in);
+    return EXIT_SUCCESS;
+}